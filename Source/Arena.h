@@ -0,0 +1,219 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_ARENA_H_INCLUDED
+#define TINYRNN_ARENA_H_INCLUDED
+
+#include "Common.h"
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+
+namespace TinyRNN
+{
+    // A bump allocator for the neurons and connections of one network:
+    // the objects are laid out one after another in large blocks, along with
+    // their shared_ptr control blocks, and nothing is freed until the arena itself is gone.
+    //
+    // Each object allocated here keeps the arena alive through its allocator,
+    // so the arena is released with the last neuron or connection, one block at a time;
+    // the objects' destructors still run, since the neurons own their own containers.
+    //
+    // Not thread-safe, the networks are built on a single thread.
+    class Arena final
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<Arena>;
+        
+        explicit Arena(size_t blockSize = 256 * 1024) noexcept;
+        ~Arena();
+        
+        void *allocate(size_t numBytes, size_t alignment);
+        
+        size_t getNumBlocks() const noexcept;
+        
+        // Allocates a T along with its control block from the arena, or from the heap if there is no arena
+        template<typename T, typename... Args>
+        static std::shared_ptr<T> makeShared(const Arena::Ptr &arena, Args &&... args);
+        
+        // The arena that Layer and Neuron constructors allocate from on the current thread, may be nullptr
+        static Arena::Ptr getCurrent();
+        
+        // Sets the current arena until it goes out of scope
+        class Scope final
+        {
+        public:
+            
+            explicit Scope(Arena::Ptr arena);
+            ~Scope();
+        
+        private:
+            
+            Arena::Ptr previousArena;
+            
+            TINYRNN_DISALLOW_COPY_AND_ASSIGN(Scope);
+        };
+        
+        template<typename T>
+        class Allocator final
+        {
+        public:
+            
+            using value_type = T;
+            
+            explicit Allocator(Arena::Ptr targetArena) noexcept : arena(std::move(targetArena)) {}
+            
+            template<typename U>
+            Allocator(const Allocator<U> &other) noexcept : arena(other.arena) {}
+            
+            T *allocate(size_t numElements)
+            {
+                return static_cast<T *>(this->arena->allocate(numElements * sizeof(T), alignof(T)));
+            }
+            
+            void deallocate(T *, size_t) noexcept
+            {
+                // freed along with the whole arena
+            }
+            
+            template<typename U>
+            bool operator ==(const Allocator<U> &other) const noexcept { return this->arena == other.arena; }
+            
+            template<typename U>
+            bool operator !=(const Allocator<U> &other) const noexcept { return this->arena != other.arena; }
+        
+        private:
+            
+            Arena::Ptr arena;
+            
+            template<typename U> friend class Allocator;
+        };
+    
+    private:
+        
+        std::vector<char *> blocks;
+        size_t blockSize;
+        size_t blockOffset;
+        
+        static Arena::Ptr &getCurrentReference();
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(Arena);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // Arena implementation
+    //===------------------------------------------------------------------===//
+    
+    inline Arena::Arena(size_t targetBlockSize) noexcept :
+    blockSize(targetBlockSize),
+    blockOffset(targetBlockSize)
+    {
+    }
+    
+    inline Arena::~Arena()
+    {
+        for (char *block : this->blocks)
+        {
+            std::free(block);
+        }
+    }
+    
+    inline void *Arena::allocate(size_t numBytes, size_t alignment)
+    {
+        // the blocks are malloc'ed, so they are aligned for any type
+        size_t offset = (this->blockOffset + alignment - 1) & ~(alignment - 1);
+        
+        if (this->blocks.empty() || offset + numBytes > this->blockSize)
+        {
+            if (numBytes > this->blockSize)
+            {
+                // too large to share a block with anything else, but still owned by the arena;
+                // insert it before the current block so that the current one keeps filling up
+                char *largeBlock = static_cast<char *>(std::malloc(numBytes));
+                
+                if (largeBlock == nullptr)
+                {
+                    throw std::bad_alloc();
+                }
+                
+                this->blocks.insert(this->blocks.empty() ? this->blocks.end() : this->blocks.end() - 1, largeBlock);
+                return largeBlock;
+            }
+            
+            char *newBlock = static_cast<char *>(std::malloc(this->blockSize));
+            
+            if (newBlock == nullptr)
+            {
+                throw std::bad_alloc();
+            }
+            
+            this->blocks.push_back(newBlock);
+            offset = 0;
+        }
+        
+        this->blockOffset = offset + numBytes;
+        return this->blocks.back() + offset;
+    }
+    
+    inline size_t Arena::getNumBlocks() const noexcept
+    {
+        return this->blocks.size();
+    }
+    
+    template<typename T, typename... Args>
+    inline std::shared_ptr<T> Arena::makeShared(const Arena::Ptr &arena, Args &&... args)
+    {
+        if (arena == nullptr)
+        {
+            return std::make_shared<T>(std::forward<Args>(args)...);
+        }
+        
+        return std::allocate_shared<T>(Allocator<T>(arena), std::forward<Args>(args)...);
+    }
+    
+    // A function-level static rather than a static variable,
+    // so that all translation units share the same arena
+    inline Arena::Ptr &Arena::getCurrentReference()
+    {
+        static thread_local Arena::Ptr currentArena;
+        return currentArena;
+    }
+    
+    inline Arena::Ptr Arena::getCurrent()
+    {
+        return Arena::getCurrentReference();
+    }
+    
+    inline Arena::Scope::Scope(Arena::Ptr arena) :
+    previousArena(Arena::getCurrentReference())
+    {
+        Arena::getCurrentReference() = std::move(arena);
+    }
+    
+    inline Arena::Scope::~Scope()
+    {
+        Arena::getCurrentReference() = std::move(this->previousArena);
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_ARENA_H_INCLUDED
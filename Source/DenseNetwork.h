@@ -0,0 +1,613 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_DENSENETWORK_H_INCLUDED
+#define TINYRNN_DENSENETWORK_H_INCLUDED
+
+#include "Common.h"
+#include "Neuron.h"
+
+#include <algorithm>
+
+// Vector extensions are supported by gcc and clang, and make the dot products
+// use simd registers regardless of the optimization level and the autovectorizer's mood;
+// other compilers get plain loops that sum up in exactly the same order.
+#if defined(__GNUC__) && ! defined(TINYRNN_NO_VECTOR_EXTENSIONS)
+#define TINYRNN_USES_VECTOR_EXTENSIONS 1
+#else
+#define TINYRNN_USES_VECTOR_EXTENSIONS 0
+#endif
+
+namespace TinyRNN
+{
+    // One fully connected layer of a feed-forward network,
+    // with all its incoming weights in a row-major matrix, one row per neuron.
+    class DenseLayer final
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<DenseLayer>;
+        using Vector = std::vector<DenseLayer::Ptr>;
+        using Values = std::vector<Value>;
+    
+    public:
+        
+        // Returns nullptr, unless every input neuron is connected to every output neuron,
+        // and there are no self-connections, gates or any other connections to these neurons
+        static DenseLayer::Ptr buildFrom(const Neuron::Vector &inputNeurons,
+                                         const Neuron::Vector &outputNeurons,
+                                         bool inputsAreFed, bool outputsAreLast);
+        
+        // Writes the weights, biases and activations back to the neurons,
+        // expects the input neurons to be restored already
+        void restore(const Neuron::Vector &inputNeurons,
+                     const Neuron::Vector &outputNeurons) const;
+        
+        Index getNumInputs() const noexcept;
+        Index getNumOutputs() const noexcept;
+        const Values &getActivations() const noexcept;
+        
+        const Values &feed(const Values &inputs);
+        
+        // Inputs are laid out as [lane][input], outputs as [lane][output];
+        // the state of the layer is left untouched
+        void feedBatch(const Value *inputs, Value *outputs, Index numLanes) const;
+        
+        // Error responsibilities of the output layer, Eq. 10
+        void setTargets(const Values &targets);
+        
+        // Error responsibilities of a hidden layer, Eq. 21, from the accumulated projected errors
+        void setProjectedErrors(const Values &errorAccumulator);
+        
+        // Adjusts the weights and biases, Eq. 24; if errorAccumulator is not null,
+        // sums up the errors projected to the inputs with the weights already adjusted,
+        // the same way Neuron::backPropagate sees them after the upper layer has learned
+        void learn(Value rate, const Values &inputs, Values *errorAccumulator);
+        
+        // The dot product all the dense kernels share, see the summation order below
+        static Value dot(const Value *a, const Value *b, Index size);
+    
+    private:
+        
+        DenseLayer(Index numInputs, Index numOutputs, Neuron::ActivationType activationType);
+        
+        Index numInputs;
+        Index numOutputs;
+        Neuron::ActivationType activationType;
+        
+        Values weights;             // numOutputs rows of numInputs
+        Values biases;
+        
+        Values states;
+        Values activations;
+        Values derivatives;
+        Values errors;
+        
+        static void dot4(const Value *row, const Value *inputs, size_t stride, Index size, Value *results);
+        void activate(Value state, Value &activation, Value &derivative) const;
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(DenseLayer);
+    };
+    
+    // A feed-forward network compiled into dense layers, see Network::toDense
+    class DenseNetwork final
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<DenseNetwork>;
+        using Values = DenseLayer::Values;
+    
+    public:
+        
+        DenseNetwork(Index numInputs, const DenseLayer::Vector &layers);
+        
+        Index getNumInputs() const noexcept;
+        Index getNumOutputs() const noexcept;
+        const DenseLayer::Vector &getLayers() const noexcept;
+        const Values &getInputs() const noexcept;
+        
+        Values feed(const Values &inputs);
+        void train(Value rate, const Values &targets);
+        
+        // Inputs are laid out as [lane][input], outputs as [lane][output];
+        // feeding a batch doesn't change the state that the next train call uses
+        Values feedBatch(const Values &inputs);
+    
+    private:
+        
+        Values inputs;
+        DenseLayer::Vector layers;
+        
+        Values errorAccumulator;
+        Values batchInputs;
+        Values batchOutputs;
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(DenseNetwork);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // DenseLayer implementation
+    //===------------------------------------------------------------------===//
+    
+    inline DenseLayer::DenseLayer(Index numInputs, Index numOutputs, Neuron::ActivationType activationType) :
+    numInputs(numInputs),
+    numOutputs(numOutputs),
+    activationType(activationType),
+    weights(size_t(numInputs) * numOutputs, 0.0),
+    biases(numOutputs, 0.0),
+    states(numOutputs, 0.0),
+    activations(numOutputs, 0.0),
+    derivatives(numOutputs, 0.0),
+    errors(numOutputs, 0.0)
+    {
+    }
+    
+    inline DenseLayer::Ptr DenseLayer::buildFrom(const Neuron::Vector &inputNeurons,
+                                                 const Neuron::Vector &outputNeurons,
+                                                 bool inputsAreFed, bool outputsAreLast)
+    {
+        if (inputNeurons.empty() || outputNeurons.empty())
+        {
+            return nullptr;
+        }
+        
+        std::unordered_map<Id, Index> columns;
+        
+        for (size_t i = 0; i < inputNeurons.size(); ++i)
+        {
+            const Neuron::Ptr &neuron = inputNeurons[i];
+            
+            if (neuron->isSelfConnected() || neuron->isGate() ||
+                neuron->outgoingConnections.size() != outputNeurons.size() ||
+                (inputsAreFed && !neuron->incomingConnections.empty()))
+            {
+                return nullptr;
+            }
+            
+            columns[neuron->getUuid()] = Index(i);
+        }
+        
+        const Neuron::ActivationType activationType = outputNeurons.front()->activationType;
+        DenseLayer::Ptr layer(new DenseLayer(Index(inputNeurons.size()), Index(outputNeurons.size()), activationType));
+        
+        for (size_t j = 0; j < outputNeurons.size(); ++j)
+        {
+            const Neuron::Ptr &neuron = outputNeurons[j];
+            
+            if (neuron->activationType != activationType ||
+                neuron->isSelfConnected() || neuron->isGate() ||
+                neuron->incomingConnections.size() != inputNeurons.size() ||
+                (outputsAreLast && !neuron->outgoingConnections.empty()))
+            {
+                return nullptr;
+            }
+            
+            Value *row = layer->weights.data() + j * layer->numInputs;
+            
+            for (const auto &i : neuron->incomingConnections)
+            {
+                const Neuron::Connection::Ptr connection = i.second;
+                const auto column = columns.find(connection->getInputNeuron()->getUuid());
+                
+                if (column == columns.end() || connection->hasGate())
+                {
+                    return nullptr;
+                }
+                
+                row[column->second] = connection->weight;
+            }
+            
+            layer->biases[j] = neuron->bias;
+            layer->states[j] = neuron->state;
+            layer->activations[j] = neuron->activation;
+            layer->derivatives[j] = neuron->derivative;
+            layer->errors[j] = neuron->errorResponsibility;
+        }
+        
+        return layer;
+    }
+    
+    inline void DenseLayer::restore(const Neuron::Vector &inputNeurons,
+                                    const Neuron::Vector &outputNeurons) const
+    {
+        std::unordered_map<Id, Index> columns;
+        
+        for (size_t i = 0; i < inputNeurons.size(); ++i)
+        {
+            columns[inputNeurons[i]->getUuid()] = Index(i);
+        }
+        
+        for (size_t j = 0; j < outputNeurons.size(); ++j)
+        {
+            const Neuron::Ptr &neuron = outputNeurons[j];
+            const Value *row = this->weights.data() + j * this->numInputs;
+            
+            for (size_t slot = 0; slot < neuron->incomingLinks.size(); ++slot)
+            {
+                Neuron::Connection *connection = neuron->incomingLinks[slot].connection;
+                const Neuron *inputNeuron = neuron->incomingLinks[slot].neuron;
+                connection->weight = row[columns[inputNeuron->getUuid()]];
+                neuron->eligibility[slot] = connection->gain * inputNeuron->activation;
+            }
+            
+            neuron->bias = this->biases[j];
+            neuron->state = this->states[j];
+            neuron->activation = this->activations[j];
+            neuron->derivative = this->derivatives[j];
+            neuron->errorResponsibility = this->errors[j];
+            neuron->projectedActivity = this->errors[j];
+            neuron->gatingActivity = 0.0;
+        }
+    }
+    
+    inline Index DenseLayer::getNumInputs() const noexcept
+    {
+        return this->numInputs;
+    }
+    
+    inline Index DenseLayer::getNumOutputs() const noexcept
+    {
+        return this->numOutputs;
+    }
+    
+    inline const DenseLayer::Values &DenseLayer::getActivations() const noexcept
+    {
+        return this->activations;
+    }
+    
+    // Eight partial sums, each one added up sequentially, then summed pairwise;
+    // all the dot products of the dense layers use this very order, so that the results never depend on the code path
+
+#if TINYRNN_USES_VECTOR_EXTENSIONS
+    
+    // 16-byte vectors map onto sse and neon registers without any extra target flags
+    typedef Value DenseVector __attribute__((vector_size(16)));
+
+#else
+    
+    struct DenseVector final
+    {
+        Value v[16 / sizeof(Value)];
+        Value operator[](int i) const { return this->v[i]; }
+        
+        DenseVector &operator+=(const DenseVector &other)
+        {
+            for (size_t k = 0; k < (16 / sizeof(Value)); ++k) { this->v[k] += other.v[k]; }
+            return *this;
+        }
+        
+        DenseVector operator*(const DenseVector &other) const
+        {
+            DenseVector result;
+            for (size_t k = 0; k < (16 / sizeof(Value)); ++k) { result.v[k] = this->v[k] * other.v[k]; }
+            return result;
+        }
+    };
+
+#endif
+    
+    // The eight partial sums of a dot product, in as many vectors as it takes
+    struct DenseBlock final
+    {
+        static const int VectorSize = (16 / sizeof(Value));
+        static const int NumVectors = (8 / VectorSize);
+        
+        DenseVector vectors[NumVectors];
+        
+        DenseBlock() : vectors() {}
+        
+        inline void multiplyAdd(const Value *a, const Value *b)
+        {
+            for (int i = 0; i < NumVectors; ++i)
+            {
+                DenseVector x, y;
+                std::memcpy(&x, a + i * VectorSize, sizeof(DenseVector));
+                std::memcpy(&y, b + i * VectorSize, sizeof(DenseVector));
+                this->vectors[i] += x * y;
+            }
+        }
+        
+        inline Value get(int k) const
+        {
+            return this->vectors[k / VectorSize][k % VectorSize];
+        }
+        
+        inline Value sum() const
+        {
+            return ((this->get(0) + this->get(1)) + (this->get(2) + this->get(3))) +
+                   ((this->get(4) + this->get(5)) + (this->get(6) + this->get(7)));
+        }
+    };
+    
+    inline Value DenseLayer::dot(const Value *a, const Value *b, Index size)
+    {
+        DenseBlock sums;
+        const size_t blocksEnd = (size & ~Index(7));
+        
+        for (size_t i = 0; i < blocksEnd; i += 8)
+        {
+            sums.multiplyAdd(a + i, b + i);
+        }
+        
+        Value result = sums.sum();
+        
+        for (size_t i = blocksEnd; i < size; ++i)
+        {
+            result += a[i] * b[i];
+        }
+        
+        return result;
+    }
+    
+    // The same as dot for four vectors at once, so that they share the loads of a row
+    inline void DenseLayer::dot4(const Value *row, const Value *inputs, size_t stride, Index size, Value *results)
+    {
+        DenseBlock sums[4];
+        const size_t blocksEnd = (size & ~Index(7));
+        const Value *x[4] = { inputs, inputs + stride, inputs + stride * 2, inputs + stride * 3 };
+        
+        for (size_t i = 0; i < blocksEnd; i += 8)
+        {
+            sums[0].multiplyAdd(row + i, x[0] + i);
+            sums[1].multiplyAdd(row + i, x[1] + i);
+            sums[2].multiplyAdd(row + i, x[2] + i);
+            sums[3].multiplyAdd(row + i, x[3] + i);
+        }
+        
+        for (int l = 0; l < 4; ++l)
+        {
+            results[l] = sums[l].sum();
+            
+            for (size_t i = blocksEnd; i < size; ++i)
+            {
+                results[l] += row[i] * x[l][i];
+            }
+        }
+    }
+    
+    inline void DenseLayer::activate(Value state, Value &activation, Value &derivative) const
+    {
+        switch (this->activationType)
+        {
+            case Neuron::Sigmoid:
+                activation = Neuron::activationSigmoid(state);
+                derivative = Neuron::derivativeSigmoid(state);
+                break;
+            case Neuron::Tanh:
+                activation = Neuron::activationTanh(state);
+                derivative = Neuron::derivativeTanh(state);
+                break;
+            case Neuron::LeakyReLU:
+                activation = Neuron::activationReLU(state);
+                derivative = Neuron::derivativeReLU(state);
+                break;
+        }
+    }
+    
+    inline const DenseLayer::Values &DenseLayer::feed(const Values &inputs)
+    {
+        const Value *row = this->weights.data();
+        
+        for (Index j = 0; j < this->numOutputs; ++j, row += this->numInputs)
+        {
+            this->states[j] = this->biases[j] + DenseLayer::dot(row, inputs.data(), this->numInputs);
+            this->activate(this->states[j], this->activations[j], this->derivatives[j]);
+        }
+        
+        return this->activations;
+    }
+    
+    inline void DenseLayer::feedBatch(const Value *inputs, Value *outputs, Index numLanes) const
+    {
+        // the rows are processed in blocks small enough to stay in cache while all the lanes go through them
+        const Index blockSize = std::max<Index>(1, Index(8192 / std::max<Index>(1, this->numInputs)));
+        Value derivative = 0.0;
+        
+        for (Index blockStart = 0; blockStart < this->numOutputs; blockStart += blockSize)
+        {
+            const Index blockEnd = std::min(this->numOutputs, blockStart + blockSize);
+            
+            Index lane = 0;
+            
+            // four lanes share each row load
+            for (; lane + 4 <= numLanes; lane += 4)
+            {
+                const Value *laneInputs = inputs + size_t(lane) * this->numInputs;
+                Value *laneOutputs = outputs + size_t(lane) * this->numOutputs;
+                Value states[4];
+                
+                for (Index j = blockStart; j < blockEnd; ++j)
+                {
+                    const Value *row = this->weights.data() + size_t(j) * this->numInputs;
+                    DenseLayer::dot4(row, laneInputs, this->numInputs, this->numInputs, states);
+                    
+                    for (int k = 0; k < 4; ++k)
+                    {
+                        this->activate(this->biases[j] + states[k], laneOutputs[k * this->numOutputs + j], derivative);
+                    }
+                }
+            }
+            
+            for (; lane < numLanes; ++lane)
+            {
+                const Value *laneInputs = inputs + size_t(lane) * this->numInputs;
+                Value *laneOutputs = outputs + size_t(lane) * this->numOutputs;
+                
+                for (Index j = blockStart; j < blockEnd; ++j)
+                {
+                    const Value *row = this->weights.data() + size_t(j) * this->numInputs;
+                    const Value state = this->biases[j] + DenseLayer::dot(row, laneInputs, this->numInputs);
+                    this->activate(state, laneOutputs[j], derivative);
+                }
+            }
+        }
+    }
+    
+    inline void DenseLayer::setTargets(const Values &targets)
+    {
+        for (Index j = 0; j < this->numOutputs; ++j)
+        {
+            this->errors[j] = targets[j] - this->activations[j];
+        }
+    }
+    
+    inline void DenseLayer::setProjectedErrors(const Values &errorAccumulator)
+    {
+        for (Index j = 0; j < this->numOutputs; ++j)
+        {
+            this->errors[j] = this->derivatives[j] * errorAccumulator[j];
+        }
+    }
+    
+    inline void DenseLayer::learn(Value rate, const Values &inputs, Values *errorAccumulator)
+    {
+        const Value threshold = TINYRNN_GRADIENT_CLIPPING_THRESHOLD;
+        const Value *in = inputs.data();
+        Value *accumulator = nullptr;
+        
+        if (errorAccumulator != nullptr)
+        {
+            errorAccumulator->assign(this->numInputs, 0.0);
+            accumulator = errorAccumulator->data();
+        }
+        
+        const size_t numInputs = this->numInputs;
+        Value *row = this->weights.data();
+        
+        for (Index j = 0; j < this->numOutputs; ++j, row += numInputs)
+        {
+            const Value error = this->errors[j];
+            
+            _Pragma("GCC ivdep")
+            for (size_t i = 0; i < numInputs; ++i)
+            {
+                const Value gradient = error * in[i];
+                row[i] += rate * std::max(-threshold, std::min(gradient, threshold));
+            }
+            
+            if (accumulator != nullptr)
+            {
+                _Pragma("GCC ivdep")
+                for (size_t i = 0; i < numInputs; ++i)
+                {
+                    accumulator[i] += error * row[i];
+                }
+            }
+            
+            this->biases[j] += rate * error;
+        }
+    }
+    
+    //===------------------------------------------------------------------===//
+    // DenseNetwork implementation
+    //===------------------------------------------------------------------===//
+    
+    inline DenseNetwork::DenseNetwork(Index numInputs, const DenseLayer::Vector &targetLayers) :
+    inputs(numInputs, 0.0),
+    layers(targetLayers)
+    {
+    }
+    
+    inline Index DenseNetwork::getNumInputs() const noexcept
+    {
+        return Index(this->inputs.size());
+    }
+    
+    inline Index DenseNetwork::getNumOutputs() const noexcept
+    {
+        return this->layers.back()->getNumOutputs();
+    }
+    
+    inline const DenseLayer::Vector &DenseNetwork::getLayers() const noexcept
+    {
+        return this->layers;
+    }
+    
+    inline const DenseNetwork::Values &DenseNetwork::getInputs() const noexcept
+    {
+        return this->inputs;
+    }
+    
+    inline DenseNetwork::Values DenseNetwork::feed(const Values &values)
+    {
+        if (values.size() != this->inputs.size())
+        {
+            return Values();
+        }
+        
+        this->inputs = values;
+        const Values *layerInputs = &this->inputs;
+        
+        for (auto &layer : this->layers)
+        {
+            layerInputs = &layer->feed(*layerInputs);
+        }
+        
+        return *layerInputs;
+    }
+    
+    inline void DenseNetwork::train(Value rate, const Values &targets)
+    {
+        if (targets.size() != this->getNumOutputs())
+        {
+            return;
+        }
+        
+        this->layers.back()->setTargets(targets);
+        
+        for (size_t i = this->layers.size(); i --> 0 ;)
+        {
+            const Values &layerInputs = (i == 0) ? this->inputs : this->layers[i - 1]->getActivations();
+            
+            // the input layer doesn't learn, so nothing gets projected into it
+            this->layers[i]->learn(rate, layerInputs, (i == 0) ? nullptr : &this->errorAccumulator);
+            
+            if (i > 0)
+            {
+                this->layers[i - 1]->setProjectedErrors(this->errorAccumulator);
+            }
+        }
+    }
+    
+    inline DenseNetwork::Values DenseNetwork::feedBatch(const Values &values)
+    {
+        const Index numLanes = Index(values.size() / this->inputs.size());
+        
+        if (values.size() != size_t(numLanes) * this->inputs.size())
+        {
+            return Values();
+        }
+        
+        this->batchInputs = values;
+        
+        for (auto &layer : this->layers)
+        {
+            this->batchOutputs.resize(size_t(numLanes) * layer->getNumOutputs());
+            layer->feedBatch(this->batchInputs.data(), this->batchOutputs.data(), numLanes);
+            this->batchInputs.swap(this->batchOutputs);
+        }
+        
+        return this->batchInputs;
+    }
+}  // namespace TinyRNN
+
+#endif  // TINYRNN_DENSENETWORK_H_INCLUDED
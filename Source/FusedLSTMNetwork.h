@@ -0,0 +1,1079 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_FUSEDLSTMNETWORK_H_INCLUDED
+#define TINYRNN_FUSEDLSTMNETWORK_H_INCLUDED
+
+#include "Common.h"
+#include "Neuron.h"
+#include "DenseNetwork.h"
+
+#include <algorithm>
+
+namespace TinyRNN
+{
+    // Runs the topology built by Network::Prefabs::longShortTermMemory block by block, instead of neuron by neuron.
+    //
+    // Each block is four layers of the same size: input gates, forget gates, memory cells and output gates.
+    // All four see the same inputs (the input layer and the cells of the previous block),
+    // so their weights are kept in one row-major matrix [Wi; Wf; Wc; Wo] and computed with one fused gemv;
+    // the gates also see the cells of their own block, through a separate [Ui; Uf; Uo] matrix.
+    //
+    // The eligibility and extended traces of Monner and Reggia are kept as matrices of the same shapes,
+    // and follow Neuron::process and Neuron::backPropagate exactly, including all the quirks of the prefab:
+    // the input gates see the cells of the previous step, and their own errors of the previous step;
+    // the forget gates gate nothing (gateOneToOne looks for self-connections among the outgoing ones),
+    // so, just like in the original network, they are computed but never learn.
+    class FusedLSTMNetwork final
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<FusedLSTMNetwork>;
+        using Values = std::vector<Value>;
+        using NeuronLayers = std::vector<Neuron::Vector>;
+    
+    public:
+        
+        // Hidden layers go in fours, as the prefab creates them;
+        // returns nullptr if the network has any other connections or gates
+        static FusedLSTMNetwork::Ptr buildFrom(const Neuron::Vector &inputNeurons,
+                                               const NeuronLayers &hiddenNeurons,
+                                               const Neuron::Vector &outputNeurons);
+        
+        // Writes the weights, activations and all the traces back to the neurons
+        void restore(const Neuron::Vector &inputNeurons,
+                     const NeuronLayers &hiddenNeurons,
+                     const Neuron::Vector &outputNeurons) const;
+        
+        Index getNumInputs() const noexcept;
+        Index getNumOutputs() const noexcept;
+        
+        Values feed(const Values &inputs);
+        void train(Value rate, const Values &targets);
+    
+    private:
+        
+        class Block final
+        {
+        public:
+            
+            using Ptr = std::shared_ptr<Block>;
+            
+            enum Kind
+            {
+                InputGate = 0,
+                ForgetGate = 1,
+                Cell = 2,
+                OutputGate = 3
+            };
+            
+            Block(Index size, Index numInputs, Index numPreviousCells);
+            
+            void feed(const Value *inputs, const Value *previousCells);
+            
+            // Output errors are the sums of the output layer errors times the weights of the connections from each cell,
+            // before and after the output layer has learned; cellErrors are projected from the next block,
+            // and previousCellErrors are accumulated for the previous block
+            void train(Value rate,
+                       const Value *oldOutputErrors, const Value *newOutputErrors,
+                       const Value *cellErrors, Value *previousCellErrors);
+            
+            const Value *getCells() const noexcept;
+            const Value *getOutputGates() const noexcept;
+            
+            Index size;
+            Index numInputs;                    // the size of the network input layer
+            Index numColumns;                   // numInputs + the size of the previous block
+            Neuron::ActivationType activationTypes[4];
+            
+            Values inputWeights;                // 4 * size rows of numColumns: input gates, forget gates, cells, output gates
+            Values recurrentWeights;            // 3 * size rows of size: input, forget and output gates
+            Values selfWeights;                 // cell self-connections, never learn
+            
+            Values biases;                      // all these are 4 * size, in the same order as the rows
+            Values states;
+            Values oldStates;
+            Values activations;
+            Values derivatives;
+            Values errors;
+            
+            Values inputs;                      // the input layer and the previous block cells
+            Values previousCells;               // the cells of the previous step
+            Values sums;                        // the fused gemv result
+            Values influences;                  // the input of each cell, before it is gated
+            
+            Values inputGateTraces;             // size rows of numColumns, extended traces, Eq. 18
+            Values inputGateRecurrentTraces;    // size rows of size
+            Values cellTraces;                  // size rows of numColumns, eligibility traces, Eq. 17
+            Values cellAccumulator;
+            
+            TINYRNN_DISALLOW_COPY_AND_ASSIGN(Block);
+        };
+        
+        FusedLSTMNetwork();
+        
+        Index numInputs;
+        Index numCells;                         // in all blocks
+        std::vector<Block::Ptr> blocks;
+        
+        Neuron::ActivationType outputActivationType;
+        Values outputWeights;                   // one row per output neuron, numInputs + numCells columns
+        Values outputBiases;
+        Values outputStates;
+        Values outputOldStates;
+        Values outputActivations;
+        Values outputDerivatives;
+        Values outputErrors;
+        Values outputInputs;                    // inputs, then all cells times their output gates
+        
+        Values oldOutputErrors;
+        Values newOutputErrors;
+        Values cellErrors;
+        Values previousCellErrors;
+        
+        using Columns = std::unordered_map<Id, Index>;
+        
+        template<typename Callback>
+        static bool forEachInputConnection(const Neuron::Ptr &neuron, const Columns &columns,
+                                           Index numColumns, Callback callback);
+        
+        static bool hasActivationType(const Neuron::Vector &layer, Neuron::ActivationType &type);
+        
+        static void activate(Neuron::ActivationType type, const Value *states,
+                             Value *activations, Value *derivatives, Index size);
+        
+        static Value clip(Value gradient);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(FusedLSTMNetwork);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // Helpers
+    //===------------------------------------------------------------------===//
+    
+    // Visits all incoming connections of a neuron, which must come one by one from the first numColumns of the columns;
+    // the callback also gets the connection's slot in the neuron's traces
+    template<typename Callback>
+    inline bool FusedLSTMNetwork::forEachInputConnection(const Neuron::Ptr &neuron, const Columns &columns,
+                                                         Index numColumns, Callback callback)
+    {
+        if (neuron->incomingLinks.size() != numColumns)
+        {
+            return false;
+        }
+        
+        for (size_t slot = 0; slot < neuron->incomingLinks.size(); ++slot)
+        {
+            const Neuron::Link &link = neuron->incomingLinks[slot];
+            const auto column = columns.find(link.neuron->getUuid());
+            
+            if (column == columns.end() || column->second >= numColumns ||
+                ! callback(column->second, Index(slot), link.connection))
+            {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    inline bool FusedLSTMNetwork::hasActivationType(const Neuron::Vector &layer, Neuron::ActivationType &type)
+    {
+        if (layer.empty())
+        {
+            return false;
+        }
+        
+        type = layer.front()->activationType;
+        
+        for (const auto &neuron : layer)
+        {
+            if (neuron->activationType != type)
+            {
+                return false;
+            }
+        }
+        
+        return true;
+    }
+    
+    inline void FusedLSTMNetwork::activate(Neuron::ActivationType type, const Value *states,
+                                           Value *activations, Value *derivatives, Index size)
+    {
+        switch (type)
+        {
+            case Neuron::Sigmoid:
+                for (Index i = 0; i < size; ++i)
+                {
+                    activations[i] = Neuron::activationSigmoid(states[i]);
+                    derivatives[i] = Neuron::derivativeSigmoid(states[i]);
+                }
+                break;
+            case Neuron::Tanh:
+                for (Index i = 0; i < size; ++i)
+                {
+                    activations[i] = Neuron::activationTanh(states[i]);
+                    derivatives[i] = Neuron::derivativeTanh(states[i]);
+                }
+                break;
+            case Neuron::LeakyReLU:
+                for (Index i = 0; i < size; ++i)
+                {
+                    activations[i] = Neuron::activationReLU(states[i]);
+                    derivatives[i] = Neuron::derivativeReLU(states[i]);
+                }
+                break;
+        }
+    }
+    
+    inline Value FusedLSTMNetwork::clip(Value gradient)
+    {
+        const Value threshold = TINYRNN_GRADIENT_CLIPPING_THRESHOLD;
+        return std::max(-threshold, std::min(gradient, threshold));
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Block implementation
+    //===------------------------------------------------------------------===//
+    
+    inline FusedLSTMNetwork::Block::Block(Index size, Index numInputs, Index numPreviousCells) :
+    size(size),
+    numInputs(numInputs),
+    numColumns(numInputs + numPreviousCells),
+    activationTypes{ Neuron::Sigmoid, Neuron::Sigmoid, Neuron::Tanh, Neuron::Sigmoid },
+    inputWeights(size_t(4) * size * (numInputs + numPreviousCells), 0.0),
+    recurrentWeights(size_t(3) * size * size, 0.0),
+    selfWeights(size, 0.0),
+    biases(4 * size, 0.0),
+    states(4 * size, 0.0),
+    oldStates(4 * size, 0.0),
+    activations(4 * size, 0.0),
+    derivatives(4 * size, 0.0),
+    errors(4 * size, 0.0),
+    inputs(numInputs + numPreviousCells, 0.0),
+    previousCells(size, 0.0),
+    sums(4 * size, 0.0),
+    influences(size, 0.0),
+    inputGateTraces(size_t(size) * (numInputs + numPreviousCells), 0.0),
+    inputGateRecurrentTraces(size_t(size) * size, 0.0),
+    cellTraces(size_t(size) * (numInputs + numPreviousCells), 0.0),
+    cellAccumulator(size, 0.0)
+    {
+    }
+    
+    inline const Value *FusedLSTMNetwork::Block::getCells() const noexcept
+    {
+        return this->activations.data() + Cell * this->size;
+    }
+    
+    inline const Value *FusedLSTMNetwork::Block::getOutputGates() const noexcept
+    {
+        return this->activations.data() + OutputGate * this->size;
+    }
+    
+    inline void FusedLSTMNetwork::Block::feed(const Value *networkInputs, const Value *previousBlockCells)
+    {
+        const Index n = this->size;
+        const Index numColumns = this->numColumns;
+        
+        std::copy(networkInputs, networkInputs + this->numInputs, this->inputs.begin());
+        std::copy(previousBlockCells, previousBlockCells + (numColumns - this->numInputs),
+                  this->inputs.begin() + this->numInputs);
+        
+        std::copy(this->getCells(), this->getCells() + n, this->previousCells.begin());
+        
+        const Value *x = this->inputs.data();
+        const Value *hOld = this->previousCells.data();
+        
+        // one gemv for all four layers, as they all see the same inputs
+        for (Index r = 0; r < 4 * n; ++r)
+        {
+            this->sums[r] = DenseLayer::dot(this->inputWeights.data() + size_t(r) * numColumns, x, numColumns);
+        }
+        
+        // input and forget gates are processed before the cells, so they see the cells of the previous step
+        for (Index r = 0; r < 2 * n; ++r)
+        {
+            this->oldStates[r] = this->states[r];
+            this->states[r] = this->biases[r] + this->sums[r] +
+            DenseLayer::dot(this->recurrentWeights.data() + size_t(r) * n, hOld, n);
+        }
+        
+        FusedLSTMNetwork::activate(this->activationTypes[InputGate], &this->states[InputGate * n],
+                                   &this->activations[InputGate * n], &this->derivatives[InputGate * n], n);
+        
+        FusedLSTMNetwork::activate(this->activationTypes[ForgetGate], &this->states[ForgetGate * n],
+                                   &this->activations[ForgetGate * n], &this->derivatives[ForgetGate * n], n);
+        
+        // extended traces of the input gates, Eq. 18; the influence on a cell is its ungated input,
+        // and the cell's self-connection is never gated, so the decay is just its weight
+        for (Index i = 0; i < n; ++i)
+        {
+            const Value scale = this->derivatives[InputGate * n + i] * this->sums[Cell * n + i];
+            const Value decay = this->selfWeights[i];
+            
+            Value *trace = this->inputGateTraces.data() + size_t(i) * numColumns;
+            
+            for (Index c = 0; c < numColumns; ++c)
+            {
+                trace[c] = scale * x[c] + decay * trace[c];
+            }
+            
+            Value *recurrentTrace = this->inputGateRecurrentTraces.data() + size_t(i) * n;
+            
+            for (Index m = 0; m < n; ++m)
+            {
+                recurrentTrace[m] = scale * hOld[m] + decay * recurrentTrace[m];
+            }
+        }
+        
+        // cells, Eq. 15, with the inputs gated by the input gates
+        for (Index i = 0; i < n; ++i)
+        {
+            const Index r = Cell * n + i;
+            this->influences[i] = this->sums[r];
+            this->oldStates[r] = this->states[r];
+            this->states[r] = this->selfWeights[i] * this->states[r] + this->biases[r] +
+            this->activations[InputGate * n + i] * this->sums[r];
+        }
+        
+        FusedLSTMNetwork::activate(this->activationTypes[Cell], &this->states[Cell * n],
+                                   &this->activations[Cell * n], &this->derivatives[Cell * n], n);
+        
+        // eligibility traces of the cells, Eq. 17
+        for (Index i = 0; i < n; ++i)
+        {
+            const Value gain = this->activations[InputGate * n + i];
+            const Value decay = this->selfWeights[i];
+            Value *trace = this->cellTraces.data() + size_t(i) * numColumns;
+            
+            for (Index c = 0; c < numColumns; ++c)
+            {
+                trace[c] = gain * x[c] + decay * trace[c];
+            }
+        }
+        
+        // output gates are processed after the cells, and see their new activations
+        const Value *h = this->getCells();
+        
+        for (Index i = 0; i < n; ++i)
+        {
+            const Index r = OutputGate * n + i;
+            this->oldStates[r] = this->states[r];
+            this->states[r] = this->biases[r] + this->sums[r] +
+            DenseLayer::dot(this->recurrentWeights.data() + size_t(2 * n + i) * n, h, n);
+        }
+        
+        FusedLSTMNetwork::activate(this->activationTypes[OutputGate], &this->states[OutputGate * n],
+                                   &this->activations[OutputGate * n], &this->derivatives[OutputGate * n], n);
+    }
+    
+    inline void FusedLSTMNetwork::Block::train(Value rate,
+                                               const Value *oldOutputErrors, const Value *newOutputErrors,
+                                               const Value *nextBlockErrors, Value *previousCellErrors)
+    {
+        const Index n = this->size;
+        const Index numColumns = this->numColumns;
+        const Index numInputs = this->numInputs;
+        const Index numPreviousCells = numColumns - numInputs;
+        
+        const Value *x = this->inputs.data();
+        const Value *h = this->getCells();
+        const Value *inputGates = &this->activations[InputGate * n];
+        const Value *outputGates = &this->activations[OutputGate * n];
+        
+        Value *accumulator = this->cellAccumulator.data();
+        
+        for (Index m = 0; m < n; ++m)
+        {
+            accumulator[m] = nextBlockErrors[m] + outputGates[m] * newOutputErrors[m];
+        }
+        
+        std::fill(previousCellErrors, previousCellErrors + numPreviousCells, 0.0);
+        
+        // output gates backpropagate first; they project nothing, and all their error comes from gating, Eq. 22,
+        // while the gradient uses the extended traces computed with the weights before the output layer has learned
+        for (Index i = 0; i < n; ++i)
+        {
+            const Index r = OutputGate * n + i;
+            const Value error = this->derivatives[r] * newOutputErrors[i] * h[i];
+            const Value scale = this->derivatives[r] * oldOutputErrors[i] * h[i];
+            this->errors[r] = error;
+            
+            Value *row = this->inputWeights.data() + size_t(r) * numColumns;
+            
+            for (Index c = 0; c < numColumns; ++c)
+            {
+                row[c] += rate * FusedLSTMNetwork::clip(scale * x[c]);
+            }
+            
+            for (Index q = 0; q < numPreviousCells; ++q)
+            {
+                previousCellErrors[q] += error * row[numInputs + q];
+            }
+            
+            Value *recurrentRow = this->recurrentWeights.data() + size_t(2 * n + i) * n;
+            
+            for (Index m = 0; m < n; ++m)
+            {
+                recurrentRow[m] += rate * FusedLSTMNetwork::clip(scale * h[m]);
+                accumulator[m] += error * recurrentRow[m];
+            }
+            
+            this->biases[r] += rate * error;
+        }
+        
+        // forget and input gates haven't learned yet, so the cells see their errors of the previous step;
+        // forget gates never learn, so they contribute to the previous block here as well
+        for (Index k = InputGate; k <= ForgetGate; ++k)
+        {
+            for (Index i = 0; i < n; ++i)
+            {
+                const Value error = this->errors[k * n + i];
+                
+                if (error == 0.0)
+                {
+                    continue;
+                }
+                
+                const Value *recurrentRow = this->recurrentWeights.data() + size_t(k * n + i) * n;
+                
+                for (Index m = 0; m < n; ++m)
+                {
+                    accumulator[m] += error * recurrentRow[m];
+                }
+                
+                if (k == ForgetGate)
+                {
+                    const Value *row = this->inputWeights.data() + size_t(k * n + i) * numColumns;
+                    
+                    for (Index q = 0; q < numPreviousCells; ++q)
+                    {
+                        previousCellErrors[q] += error * row[numInputs + q];
+                    }
+                }
+            }
+        }
+        
+        // cells, Eq. 21 and 24
+        for (Index i = 0; i < n; ++i)
+        {
+            const Index r = Cell * n + i;
+            const Value error = this->derivatives[r] * accumulator[i];
+            this->errors[r] = error;
+            
+            Value *row = this->inputWeights.data() + size_t(r) * numColumns;
+            const Value *trace = this->cellTraces.data() + size_t(i) * numColumns;
+            
+            for (Index c = 0; c < numColumns; ++c)
+            {
+                row[c] += rate * FusedLSTMNetwork::clip(error * trace[c]);
+            }
+            
+            for (Index q = 0; q < numPreviousCells; ++q)
+            {
+                previousCellErrors[q] += error * inputGates[i] * row[numInputs + q];
+            }
+            
+            // the input gate will see the influence with the weights already adjusted
+            this->influences[i] = DenseLayer::dot(row, x, numColumns);
+            this->biases[r] += rate * error;
+        }
+        
+        // input gates, Eq. 22 and 24
+        for (Index i = 0; i < n; ++i)
+        {
+            const Index r = InputGate * n + i;
+            const Value cellError = this->errors[Cell * n + i];
+            const Value error = this->derivatives[r] * cellError * this->influences[i];
+            this->errors[r] = error;
+            
+            Value *row = this->inputWeights.data() + size_t(r) * numColumns;
+            const Value *trace = this->inputGateTraces.data() + size_t(i) * numColumns;
+            
+            for (Index c = 0; c < numColumns; ++c)
+            {
+                row[c] += rate * FusedLSTMNetwork::clip(cellError * trace[c]);
+            }
+            
+            for (Index q = 0; q < numPreviousCells; ++q)
+            {
+                previousCellErrors[q] += error * row[numInputs + q];
+            }
+            
+            Value *recurrentRow = this->recurrentWeights.data() + size_t(i) * n;
+            const Value *recurrentTrace = this->inputGateRecurrentTraces.data() + size_t(i) * n;
+            
+            for (Index m = 0; m < n; ++m)
+            {
+                recurrentRow[m] += rate * FusedLSTMNetwork::clip(cellError * recurrentTrace[m]);
+            }
+            
+            this->biases[r] += rate * error;
+        }
+    }
+    
+    //===------------------------------------------------------------------===//
+    // FusedLSTMNetwork implementation
+    //===------------------------------------------------------------------===//
+    
+    inline FusedLSTMNetwork::FusedLSTMNetwork() :
+    numInputs(0),
+    numCells(0),
+    outputActivationType(Neuron::Tanh)
+    {
+    }
+    
+    inline Index FusedLSTMNetwork::getNumInputs() const noexcept
+    {
+        return this->numInputs;
+    }
+    
+    inline Index FusedLSTMNetwork::getNumOutputs() const noexcept
+    {
+        return Index(this->outputActivations.size());
+    }
+    
+    inline FusedLSTMNetwork::Values FusedLSTMNetwork::feed(const Values &values)
+    {
+        if (values.size() != this->numInputs)
+        {
+            return Values();
+        }
+        
+        const Value *previousCells = nullptr;
+        
+        for (auto &block : this->blocks)
+        {
+            block->feed(values.data(), previousCells);
+            previousCells = block->getCells();
+        }
+        
+        // the output layer sees the cells through the connections gated by the output gates
+        std::copy(values.begin(), values.end(), this->outputInputs.begin());
+        Value *gatedCells = this->outputInputs.data() + this->numInputs;
+        
+        for (auto &block : this->blocks)
+        {
+            for (Index m = 0; m < block->size; ++m)
+            {
+                gatedCells[m] = block->getOutputGates()[m] * block->getCells()[m];
+            }
+            
+            gatedCells += block->size;
+        }
+        
+        const Index numColumns = this->numInputs + this->numCells;
+        
+        for (Index k = 0; k < this->getNumOutputs(); ++k)
+        {
+            this->outputOldStates[k] = this->outputStates[k];
+            this->outputStates[k] = this->outputBiases[k] +
+            DenseLayer::dot(this->outputWeights.data() + size_t(k) * numColumns, this->outputInputs.data(), numColumns);
+        }
+        
+        FusedLSTMNetwork::activate(this->outputActivationType, this->outputStates.data(),
+                                   this->outputActivations.data(), this->outputDerivatives.data(),
+                                   this->getNumOutputs());
+        
+        return this->outputActivations;
+    }
+    
+    inline void FusedLSTMNetwork::train(Value rate, const Values &targets)
+    {
+        if (targets.size() != this->getNumOutputs())
+        {
+            return;
+        }
+        
+        const Index numColumns = this->numInputs + this->numCells;
+        
+        this->oldOutputErrors.assign(this->numCells, 0.0);
+        this->newOutputErrors.assign(this->numCells, 0.0);
+        
+        Value *oldErrors = this->oldOutputErrors.data();
+        Value *newErrors = this->newOutputErrors.data();
+        
+        // the output layer learns first, Eq. 10 and 24; the output gates need the errors
+        // projected through the weights both before and after that
+        for (Index k = 0; k < this->getNumOutputs(); ++k)
+        {
+            const Value error = targets[k] - this->outputActivations[k];
+            this->outputErrors[k] = error;
+            
+            Value *row = this->outputWeights.data() + size_t(k) * numColumns;
+            Value *cellsRow = row + this->numInputs;
+            
+            for (Index c = 0; c < this->numCells; ++c)
+            {
+                oldErrors[c] += error * cellsRow[c];
+            }
+            
+            for (Index c = 0; c < numColumns; ++c)
+            {
+                row[c] += rate * FusedLSTMNetwork::clip(error * this->outputInputs[c]);
+            }
+            
+            for (Index c = 0; c < this->numCells; ++c)
+            {
+                newErrors[c] += error * cellsRow[c];
+            }
+            
+            this->outputBiases[k] += rate * error;
+        }
+        
+        // then the blocks, the last one first
+        Index offset = this->numCells;
+        this->cellErrors.assign(this->blocks.back()->size, 0.0);
+        
+        for (size_t b = this->blocks.size(); b --> 0 ;)
+        {
+            Block &block = *this->blocks[b];
+            offset -= block.size;
+            
+            this->previousCellErrors.resize(block.numColumns - block.numInputs);
+            
+            block.train(rate, oldErrors + offset, newErrors + offset,
+                        this->cellErrors.data(), this->previousCellErrors.data());
+            
+            this->cellErrors.swap(this->previousCellErrors);
+        }
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Building from and restoring to the neurons
+    //===------------------------------------------------------------------===//
+    
+    inline FusedLSTMNetwork::Ptr FusedLSTMNetwork::buildFrom(const Neuron::Vector &inputNeurons,
+                                                             const NeuronLayers &hiddenNeurons,
+                                                             const Neuron::Vector &outputNeurons)
+    {
+        if (inputNeurons.empty() || outputNeurons.empty() ||
+            hiddenNeurons.empty() || (hiddenNeurons.size() % 4) != 0)
+        {
+            return nullptr;
+        }
+        
+        const Index numInputs = Index(inputNeurons.size());
+        const Index numOutputs = Index(outputNeurons.size());
+        
+        for (const auto &neuron : inputNeurons)
+        {
+            if (! neuron->incomingConnections.empty() || neuron->isSelfConnected() || neuron->isGate())
+            {
+                return nullptr;
+            }
+        }
+        
+        FusedLSTMNetwork::Ptr network(new FusedLSTMNetwork());
+        network->numInputs = numInputs;
+        
+        Columns outputColumns;
+        std::vector<Neuron *> outputGaters;     // which neuron gates each of the output layer columns
+        
+        for (Index j = 0; j < numInputs; ++j)
+        {
+            outputColumns[inputNeurons[j]->getUuid()] = j;
+            outputGaters.push_back(nullptr);
+        }
+        
+        const Neuron::Vector *previousCells = nullptr;
+        
+        for (size_t b = 0; b < hiddenNeurons.size(); b += 4)
+        {
+            const Neuron::Vector *layers[4] = { &hiddenNeurons[b], &hiddenNeurons[b + 1],
+                                                &hiddenNeurons[b + 2], &hiddenNeurons[b + 3] };
+            
+            const Neuron::Vector &inputGates = *layers[Block::InputGate];
+            const Neuron::Vector &cells = *layers[Block::Cell];
+            const Neuron::Vector &outputGates = *layers[Block::OutputGate];
+            
+            const Index n = Index(cells.size());
+            const Index numPreviousCells = (previousCells != nullptr) ? Index(previousCells->size()) : 0;
+            const Index numNextCells = (b + 4 < hiddenNeurons.size()) ? Index(hiddenNeurons[b + 6].size()) : 0;
+            
+            Block::Ptr block(new Block(n, numInputs, numPreviousCells));
+            const Index numColumns = block->numColumns;
+            
+            Columns columns;
+            
+            for (Index j = 0; j < numInputs; ++j)
+            {
+                columns[inputNeurons[j]->getUuid()] = j;
+            }
+            
+            for (Index q = 0; q < numPreviousCells; ++q)
+            {
+                columns[(*previousCells)[q]->getUuid()] = numInputs + q;
+            }
+            
+            for (Index m = 0; m < n; ++m)
+            {
+                columns[cells[m]->getUuid()] = numColumns + m;
+            }
+            
+            for (int k = Block::InputGate; k <= Block::OutputGate; ++k)
+            {
+                if (layers[k]->size() != n ||
+                    ! FusedLSTMNetwork::hasActivationType(*layers[k], block->activationTypes[k]))
+                {
+                    return nullptr;
+                }
+            }
+            
+            for (Index i = 0; i < n; ++i)
+            {
+                const Neuron::Ptr &cell = cells[i];
+                const Neuron::Ptr &inputGate = inputGates[i];
+                
+                // cells are self-connected, gate nothing, and get all their inputs gated by the input gates
+                if (! cell->isSelfConnected() || cell->getSelfConnection()->hasGate() || cell->isGate() ||
+                    cell->outgoingConnections.size() != (numOutputs + 3 * n + 4 * numNextCells))
+                {
+                    return nullptr;
+                }
+                
+                block->selfWeights[i] = cell->getSelfConnection()->weight;
+                
+                const bool cellInputsMatch =
+                FusedLSTMNetwork::forEachInputConnection(cell, columns, numColumns,
+                    [&](Index c, Index slot, Neuron::Connection *connection)
+                    {
+                        block->inputWeights[size_t(Block::Cell * n + i) * numColumns + c] = connection->weight;
+                        block->cellTraces[size_t(i) * numColumns + c] = cell->eligibility[slot];
+                        return (connection->getGateNeuron() == inputGate);
+                    });
+                
+                if (! cellInputsMatch)
+                {
+                    return nullptr;
+                }
+                
+                // gates see the inputs, the previous block and their own block, all connections ungated
+                const int gateKinds[3] = { Block::InputGate, Block::ForgetGate, Block::OutputGate };
+                const size_t expectedGatedConnections[3] = { numColumns, 0, numOutputs };
+                
+                for (int g = 0; g < 3; ++g)
+                {
+                    const int k = gateKinds[g];
+                    const Neuron::Ptr &gate = (*layers[k])[i];
+                    const auto *gatedCell = gate->findGatedNeighbour(cell.get());
+                    
+                    if (gate->isSelfConnected() || ! gate->outgoingConnections.empty() ||
+                        gate->gatedConnections.size() != expectedGatedConnections[g] ||
+                        (k == Block::InputGate && gatedCell == nullptr))
+                    {
+                        return nullptr;
+                    }
+                    
+                    const bool gateInputsMatch =
+                    FusedLSTMNetwork::forEachInputConnection(gate, columns, numColumns + n,
+                        [&](Index c, Index slot, Neuron::Connection *connection)
+                        {
+                            const bool isRecurrent = (c >= numColumns);
+                            
+                            if (isRecurrent)
+                            {
+                                block->recurrentWeights[size_t(g * n + i) * n + (c - numColumns)] = connection->weight;
+                            }
+                            else
+                            {
+                                block->inputWeights[size_t(k * n + i) * numColumns + c] = connection->weight;
+                            }
+                            
+                            if (k == Block::InputGate)
+                            {
+                                Value &trace = isRecurrent ?
+                                block->inputGateRecurrentTraces[size_t(i) * n + (c - numColumns)] :
+                                block->inputGateTraces[size_t(i) * numColumns + c];
+                                
+                                trace = gatedCell->extended[slot];
+                            }
+                            
+                            return ! connection->hasGate();
+                        });
+                    
+                    if (! gateInputsMatch)
+                    {
+                        return nullptr;
+                    }
+                }
+                
+                for (int k = Block::InputGate; k <= Block::OutputGate; ++k)
+                {
+                    const Neuron::Ptr &neuron = (*layers[k])[i];
+                    const Index r = k * n + i;
+                    block->biases[r] = neuron->bias;
+                    block->states[r] = neuron->state;
+                    block->oldStates[r] = neuron->oldState;
+                    block->activations[r] = neuron->activation;
+                    block->derivatives[r] = neuron->derivative;
+                    block->errors[r] = neuron->errorResponsibility;
+                }
+            }
+            
+            for (Index m = 0; m < n; ++m)
+            {
+                outputColumns[cells[m]->getUuid()] = numInputs + network->numCells + m;
+                outputGaters.push_back(outputGates[m].get());
+            }
+            
+            network->numCells += n;
+            network->blocks.push_back(block);
+            previousCells = &cells;
+        }
+        
+        const Index numColumns = numInputs + network->numCells;
+        
+        if (! FusedLSTMNetwork::hasActivationType(outputNeurons, network->outputActivationType))
+        {
+            return nullptr;
+        }
+        
+        network->outputWeights.assign(size_t(numOutputs) * numColumns, 0.0);
+        network->outputBiases.resize(numOutputs);
+        network->outputStates.resize(numOutputs);
+        network->outputOldStates.resize(numOutputs);
+        network->outputActivations.resize(numOutputs);
+        network->outputDerivatives.resize(numOutputs);
+        network->outputErrors.resize(numOutputs);
+        network->outputInputs.assign(numColumns, 0.0);
+        
+        for (Index k = 0; k < numOutputs; ++k)
+        {
+            const Neuron::Ptr &neuron = outputNeurons[k];
+            
+            if (neuron->isSelfConnected() || neuron->isGate() || ! neuron->outgoingConnections.empty())
+            {
+                return nullptr;
+            }
+            
+            const bool outputInputsMatch =
+            FusedLSTMNetwork::forEachInputConnection(neuron, outputColumns, numColumns,
+                [&](Index c, Index /*slot*/, Neuron::Connection *connection)
+                {
+                    network->outputWeights[size_t(k) * numColumns + c] = connection->weight;
+                    return (connection->getGateNeuron().get() == outputGaters[c]);
+                });
+            
+            if (! outputInputsMatch)
+            {
+                return nullptr;
+            }
+            
+            network->outputBiases[k] = neuron->bias;
+            network->outputStates[k] = neuron->state;
+            network->outputOldStates[k] = neuron->oldState;
+            network->outputActivations[k] = neuron->activation;
+            network->outputDerivatives[k] = neuron->derivative;
+            network->outputErrors[k] = neuron->errorResponsibility;
+        }
+        
+        // the previous step cells are the current ones at this point
+        for (auto &block : network->blocks)
+        {
+            std::copy(block->getCells(), block->getCells() + block->size, block->previousCells.begin());
+        }
+        
+        return network;
+    }
+    
+    inline void FusedLSTMNetwork::restore(const Neuron::Vector &inputNeurons,
+                                          const NeuronLayers &hiddenNeurons,
+                                          const Neuron::Vector &outputNeurons) const
+    {
+        const Index numInputs = this->numInputs;
+        Columns outputColumns;
+        Values outputGains(numInputs, 1.0);
+        
+        for (Index j = 0; j < numInputs; ++j)
+        {
+            inputNeurons[j]->activation = this->outputInputs[j];
+            outputColumns[inputNeurons[j]->getUuid()] = j;
+        }
+        
+        const Neuron::Vector *previousCells = nullptr;
+        Index cellsOffset = 0;
+        
+        for (size_t b = 0; b < this->blocks.size(); ++b)
+        {
+            const Block &block = *this->blocks[b];
+            const Neuron::Vector *layers[4] = { &hiddenNeurons[b * 4], &hiddenNeurons[b * 4 + 1],
+                                                &hiddenNeurons[b * 4 + 2], &hiddenNeurons[b * 4 + 3] };
+            
+            const Neuron::Vector &cells = *layers[Block::Cell];
+            const Index n = block.size;
+            const Index numColumns = block.numColumns;
+            const Index numPreviousCells = numColumns - numInputs;
+            
+            Columns columns;
+            
+            for (Index j = 0; j < numInputs; ++j)
+            {
+                columns[inputNeurons[j]->getUuid()] = j;
+            }
+            
+            for (Index q = 0; q < numPreviousCells; ++q)
+            {
+                columns[(*previousCells)[q]->getUuid()] = numInputs + q;
+            }
+            
+            for (Index m = 0; m < n; ++m)
+            {
+                columns[cells[m]->getUuid()] = numColumns + m;
+            }
+            
+            for (Index i = 0; i < n; ++i)
+            {
+                const Neuron::Ptr &cell = cells[i];
+                const Value inputGate = block.activations[Block::InputGate * n + i];
+                
+                FusedLSTMNetwork::forEachInputConnection(cell, columns, numColumns,
+                    [&](Index c, Index slot, Neuron::Connection *connection)
+                    {
+                        connection->weight = block.inputWeights[size_t(Block::Cell * n + i) * numColumns + c];
+                        connection->gain = inputGate;
+                        cell->eligibility[slot] = block.cellTraces[size_t(i) * numColumns + c];
+                        return true;
+                    });
+                
+                const int gateKinds[3] = { Block::InputGate, Block::ForgetGate, Block::OutputGate };
+                
+                for (int g = 0; g < 3; ++g)
+                {
+                    const int k = gateKinds[g];
+                    const Neuron::Ptr &gate = (*layers[k])[i];
+                    
+                    // input and forget gates saw the cells of the previous step, output gates saw the new ones
+                    const Value *h = (k == Block::OutputGate) ? block.getCells() : block.previousCells.data();
+                    
+                    auto *gatedCell = gate->findGatedNeighbour(cell.get());
+                    std::vector<Values *> outputTraces;
+                    
+                    if (k == Block::OutputGate)
+                    {
+                        for (const auto &outputNeuron : outputNeurons)
+                        {
+                            auto *gatedOutput = gate->findGatedNeighbour(outputNeuron.get());
+                            outputTraces.push_back(gatedOutput != nullptr ? &gatedOutput->extended : nullptr);
+                        }
+                    }
+                    
+                    FusedLSTMNetwork::forEachInputConnection(gate, columns, numColumns + n,
+                        [&](Index c, Index slot, Neuron::Connection *connection)
+                        {
+                            const bool isRecurrent = (c >= numColumns);
+                            const Value input = isRecurrent ? h[c - numColumns] : block.inputs[c];
+                            
+                            if (isRecurrent)
+                            {
+                                connection->weight = block.recurrentWeights[size_t(g * n + i) * n + (c - numColumns)];
+                            }
+                            else
+                            {
+                                connection->weight = block.inputWeights[size_t(k * n + i) * numColumns + c];
+                            }
+                            
+                            gate->eligibility[slot] = input;
+                            
+                            if (k == Block::InputGate && gatedCell != nullptr)
+                            {
+                                gatedCell->extended[slot] = isRecurrent ?
+                                block.inputGateRecurrentTraces[size_t(i) * n + (c - numColumns)] :
+                                block.inputGateTraces[size_t(i) * numColumns + c];
+                            }
+                            else if (k == Block::OutputGate)
+                            {
+                                // the influence on each output neuron is the gated connection's weight times the cell,
+                                // restored with the current weights, as the ones of the last feed are gone
+                                const Value scale = block.derivatives[Block::OutputGate * n + i] * input * block.getCells()[i];
+                                const Index cellColumn = numInputs + cellsOffset + i;
+                                
+                                for (size_t o = 0; o < outputNeurons.size(); ++o)
+                                {
+                                    if (outputTraces[o] == nullptr)
+                                    {
+                                        continue;
+                                    }
+                                    
+                                    (*outputTraces[o])[slot] =
+                                    scale * this->outputWeights[o * (numInputs + this->numCells) + cellColumn];
+                                }
+                            }
+                            
+                            return true;
+                        });
+                }
+                
+                for (int k = Block::InputGate; k <= Block::OutputGate; ++k)
+                {
+                    const Neuron::Ptr &neuron = (*layers[k])[i];
+                    const Index r = k * n + i;
+                    const bool isGate = (k != Block::Cell && k != Block::ForgetGate);
+                    neuron->bias = block.biases[r];
+                    neuron->state = block.states[r];
+                    neuron->oldState = block.oldStates[r];
+                    neuron->activation = block.activations[r];
+                    neuron->derivative = block.derivatives[r];
+                    neuron->errorResponsibility = block.errors[r];
+                    neuron->projectedActivity = isGate ? 0.0 : block.errors[r];
+                    neuron->gatingActivity = isGate ? block.errors[r] : 0.0;
+                }
+            }
+            
+            for (Index m = 0; m < n; ++m)
+            {
+                outputColumns[cells[m]->getUuid()] = numInputs + cellsOffset + m;
+                outputGains.push_back(block.getOutputGates()[m]);
+            }
+            
+            cellsOffset += n;
+            previousCells = &cells;
+        }
+        
+        const Index numColumns = numInputs + this->numCells;
+        
+        for (size_t k = 0; k < outputNeurons.size(); ++k)
+        {
+            const Neuron::Ptr &neuron = outputNeurons[k];
+            
+            FusedLSTMNetwork::forEachInputConnection(neuron, outputColumns, numColumns,
+                [&](Index c, Index slot, Neuron::Connection *connection)
+                {
+                    connection->weight = this->outputWeights[k * numColumns + c];
+                    connection->gain = outputGains[c];
+                    neuron->eligibility[slot] = this->outputInputs[c];
+                    return true;
+                });
+            
+            neuron->bias = this->outputBiases[k];
+            neuron->state = this->outputStates[k];
+            neuron->oldState = this->outputOldStates[k];
+            neuron->activation = this->outputActivations[k];
+            neuron->derivative = this->outputDerivatives[k];
+            neuron->errorResponsibility = this->outputErrors[k];
+            neuron->projectedActivity = this->outputErrors[k];
+        }
+    }
+}  // namespace TinyRNN
+
+#endif  // TINYRNN_FUSEDLSTMNETWORK_H_INCLUDED
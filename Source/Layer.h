@@ -29,6 +29,7 @@
 #include "Id.h"
 #include "SerializationKeys.h"
 #include "UnrolledNeuron.h"
+#include "DenseNetwork.h"
 
 namespace TinyRNN
 {
@@ -40,6 +41,12 @@ namespace TinyRNN
         using HashMap = std::unordered_map<Id, Layer::Ptr>;
         using Vector = std::vector<Layer::Ptr>;
         
+        enum WeightInitialization
+        {
+            SmallUniform,   // +/- 0.001, the same as the new connections get
+            Glorot          // scaled by the number of inputs of each neuron and the size of the layer
+        };
+        
     public:
         
         Layer(int numNeurons, Neuron::ActivationType activation = Neuron::Sigmoid);
@@ -50,6 +57,7 @@ namespace TinyRNN
         size_t getSize() const noexcept;
         
         Neuron::Ptr getNeuron(size_t index) const;
+        const Neuron::Vector &getNeurons() const noexcept;
         Neuron::Ptr getNeuronWithId(const Id &uuid) const;
         Neuron::Connection::HashMap findAllOutgoingConnections() const;
         
@@ -72,9 +80,35 @@ namespace TinyRNN
         // Used for the output layer
         bool train(Value rate, const Neuron::Values &target);
         
+        // Normalizes the activations into probabilities; only for the output layer, where
+        // the training then minimizes the cross-entropy instead of the squared error, with the same gradient.
+        // The other layers of a network ignore it, as their gradients would need the whole softmax Jacobian,
+        // and not just each neuron's own derivative.
+        void setUsesSoftmax(bool shouldUseSoftmax) noexcept;
+        bool usesSoftmax() const noexcept;
+        
+        // Meant for the input layer fed with one-hot or other mostly-zero vectors: the unrolled networks
+        // then feed and train the links from it only through the non-zero inputs, see UnrolledNetwork::feedSparse
+        void setUsesSparseInputs(bool shouldUseSparseInputs) noexcept;
+        bool usesSparseInputs() const noexcept;
+        
+        // The same, without the checks and the allocations, the buffers being getSize() long;
+        // the result of process() is only written if there is a buffer for it,
+        // and the hidden layers are processed not as outputs, i.e. without softmax
+        void feed(const Value *values);
+        void process(Value *result, bool asOutput = true);
+        void train(Value rate, const Value *targets);
+        
         // Back-propagation magic
         void backPropagate(Value rate);
         
+        // Mini-batch mode: the neurons sum their updates up until applyGradients() is called
+        void setAccumulatesGradients(bool shouldAccumulate);
+        void applyGradients();
+        
+        // Redraws the weights of all the neurons' incoming connections and self-connections
+        void initializeWeights(Random &random, WeightInitialization initialization);
+        
     public:
         
         virtual void deserialize(SerializationContext::Ptr context) override;
@@ -82,9 +116,15 @@ namespace TinyRNN
         
         UnrolledNeuron::Vector toVM(UnrolledTrainingContext::Ptr context,
                               bool asInput, bool asOutput,
-                              bool asConst) const;
+                              bool asConst,
+                              const Neuron::Vector *sparseInputs = nullptr) const;
 
         void restore(UnrolledTrainingContext::Ptr context);
+        
+        // Returns nullptr if this layer is not fully connected to the input layer and nothing else,
+        // or if it is the last one, and uses softmax
+        DenseLayer::Ptr toDense(Layer::Ptr inputLayer, bool inputsAreFed, bool outputsAreLast) const;
+        void restore(Layer::Ptr inputLayer, DenseLayer::Ptr denseLayer);
 
     private:
         
@@ -93,6 +133,9 @@ namespace TinyRNN
         
         Neuron::Vector neurons;
         
+        bool softmax = false;
+        bool sparseInputs = false;
+        
     private:
         
         TINYRNN_DISALLOW_COPY_AND_ASSIGN(Layer);
@@ -105,10 +148,11 @@ namespace TinyRNN
     inline Layer::Layer(int numNeurons, Neuron::ActivationType activation) :
     uuid(Uuid::generateId())
     {
+        const Arena::Ptr arena = Arena::getCurrent();
         this->neurons.reserve(numNeurons);
         for (int i = 0; i < numNeurons; ++i)
         {
-            Neuron::Ptr neuron(new Neuron(activation));
+            Neuron::Ptr neuron(Arena::makeShared<Neuron>(arena, activation));
             this->neurons.push_back(neuron);
         }
     }
@@ -116,10 +160,11 @@ namespace TinyRNN
     inline Layer::Layer(int numNeurons, Value bias, Neuron::ActivationType activation) :
     uuid(Uuid::generateId())
     {
+        const Arena::Ptr arena = Arena::getCurrent();
         this->neurons.reserve(numNeurons);
         for (int i = 0; i < numNeurons; ++i)
         {
-            Neuron::Ptr neuron(new Neuron(bias, activation));
+            Neuron::Ptr neuron(Arena::makeShared<Neuron>(arena, bias, activation));
             this->neurons.push_back(neuron);
         }
     }
@@ -139,6 +184,31 @@ namespace TinyRNN
         return this->neurons.size();
     }
     
+    inline const Neuron::Vector &Layer::getNeurons() const noexcept
+    {
+        return this->neurons;
+    }
+    
+    inline void Layer::setUsesSoftmax(bool shouldUseSoftmax) noexcept
+    {
+        this->softmax = shouldUseSoftmax;
+    }
+    
+    inline bool Layer::usesSoftmax() const noexcept
+    {
+        return this->softmax;
+    }
+    
+    inline void Layer::setUsesSparseInputs(bool shouldUseSparseInputs) noexcept
+    {
+        this->sparseInputs = shouldUseSparseInputs;
+    }
+    
+    inline bool Layer::usesSparseInputs() const noexcept
+    {
+        return this->sparseInputs;
+    }
+    
     //===------------------------------------------------------------------===//
     // Batch connections
     //===------------------------------------------------------------------===//
@@ -171,20 +241,54 @@ namespace TinyRNN
         return selfConnections;
     }
     
+    // Instead of letting connectWith() scan all the outgoing connections for each new one,
+    // which is quadratic in the layer size, each source neuron marks the targets it is connected to already
     inline Neuron::Connection::HashMap Layer::connectAllToAll(Layer::Ptr other)
     {
         Neuron::Connection::HashMap connections;
+        connections.reserve(this->neurons.size() * other->neurons.size());
+        
+        std::unordered_map<const Neuron *, size_t> targetIndices;
+        for (size_t i = 0; i < other->neurons.size(); ++i)
+        {
+            targetIndices[other->neurons[i].get()] = i;
+        }
+        
+        for (Neuron::Ptr &neuronTo : other->neurons)
+        {
+            neuronTo->reserveIncomingConnections(this->neurons.size());
+        }
+        
+        std::vector<bool> isConnectedAlready(other->neurons.size());
         
         for (Neuron::Ptr &neuronFrom : this->neurons)
         {
-            for (Neuron::Ptr &neuronTo : other->neurons)
+            std::fill(isConnectedAlready.begin(), isConnectedAlready.end(), false);
+            
+            for (const auto &link : neuronFrom->outgoingLinks)
+            {
+                const auto found = targetIndices.find(link.neuron);
+                if (found != targetIndices.end())
+                {
+                    isConnectedAlready[found->second] = true;
+                }
+            }
+            
+            neuronFrom->reserveOutgoingConnections(other->neurons.size());
+            
+            for (size_t i = 0; i < other->neurons.size(); ++i)
             {
+                Neuron::Ptr &neuronTo = other->neurons[i];
+                
                 if (neuronFrom == neuronTo)
                 {
                     continue;
                 }
                 
-                Neuron::Connection::Ptr connection = neuronFrom->connectWith(neuronTo);
+                Neuron::Connection::Ptr connection = isConnectedAlready[i] ?
+                    neuronFrom->findOutgoingConnectionTo(neuronTo) :
+                    neuronFrom->connectWithUnchecked(neuronTo);
+                
                 connections[connection->getUuid()] = connection;
             }
         }
@@ -309,24 +413,14 @@ namespace TinyRNN
             return false;
         }
         
-        for (size_t i = 0; i < this->neurons.size(); ++i)
-        {
-            this->neurons[i]->feed(values[i]);
-        }
-        
+        this->feed(values.data());
         return true;
     }
     
     inline Neuron::Values Layer::process()
     {
-        Neuron::Values result;
-        
-        for (auto &neuron : this->neurons)
-        {
-            const Value activation = neuron->process();
-            result.push_back(activation);
-        }
-        
+        Neuron::Values result(this->neurons.size());
+        this->process(result.data());
         return result;
     }
     
@@ -337,13 +431,67 @@ namespace TinyRNN
             return false;
         }
         
+        this->train(rate, target.data());
+        return true;
+    }
+    
+    inline void Layer::feed(const Value *values)
+    {
+        for (size_t i = 0; i < this->neurons.size(); ++i)
+        {
+            this->neurons[i]->feed(values[i]);
+        }
+    }
+    
+    inline void Layer::process(Value *result, bool asOutput)
+    {
+        for (size_t i = 0; i < this->neurons.size(); ++i)
+        {
+            const Value activation = this->neurons[i]->process();
+            
+            if (result != nullptr)
+            {
+                result[i] = activation;
+            }
+        }
+        
+        if (! this->softmax || ! asOutput)
+        {
+            return;
+        }
+        
+        // The same steps as VMProgram::softmax, so that the unrolled copies give the same results
+        Value maximum = -std::numeric_limits<Value>::max();
+        for (const auto &neuron : this->neurons)
+        {
+            maximum = std::max(maximum, neuron->state);
+        }
+        
+        Value sum = 0;
+        for (const auto &neuron : this->neurons)
+        {
+            neuron->activation = exp(neuron->state - maximum);
+            sum += neuron->activation;
+        }
+        
+        for (size_t i = 0; i < this->neurons.size(); ++i)
+        {
+            this->neurons[i]->activation = this->neurons[i]->activation / sum;
+            
+            if (result != nullptr)
+            {
+                result[i] = this->neurons[i]->activation;
+            }
+        }
+    }
+    
+    inline void Layer::train(Value rate, const Value *targets)
+    {
         // Unsigned backwards iteration from (this->neurons.size() - 1) to 0
         for (size_t i = this->neurons.size(); i --> 0 ;)
         {
-            this->neurons[i]->train(rate, target[i]);
+            this->neurons[i]->train(rate, targets[i]);
         }
-        
-        return true;
     }
     
     inline void Layer::backPropagate(Value rate)
@@ -354,6 +502,52 @@ namespace TinyRNN
         }
     }
     
+    inline void Layer::setAccumulatesGradients(bool shouldAccumulate)
+    {
+        for (auto &neuron : this->neurons)
+        {
+            neuron->accumulatesGradients = shouldAccumulate;
+        }
+    }
+    
+    inline void Layer::applyGradients()
+    {
+        for (auto &neuron : this->neurons)
+        {
+            neuron->applyGradients();
+        }
+    }
+    
+    inline void Layer::initializeWeights(Random &random, WeightInitialization initialization)
+    {
+        Neuron::Values weights;
+        
+        for (auto &neuron : this->neurons)
+        {
+            const size_t numIncoming = neuron->incomingLinks.size();
+            weights.resize(numIncoming + (neuron->isSelfConnected() ? 1 : 0));
+            
+            if (initialization == Glorot)
+            {
+                random.fillGlorot(weights.data(), weights.size(), Index(weights.size()), Index(this->neurons.size()));
+            }
+            else
+            {
+                random.fillUniform(weights.data(), weights.size(), -0.001, 0.001);
+            }
+            
+            for (size_t slot = 0; slot < numIncoming; ++slot)
+            {
+                neuron->incomingLinks[slot].connection->weight = weights[slot];
+            }
+            
+            if (neuron->isSelfConnected())
+            {
+                neuron->selfConnection->weight = weights.back();
+            }
+        }
+    }
+    
     //===------------------------------------------------------------------===//
     // Collecting data
     //===------------------------------------------------------------------===//
@@ -400,6 +594,8 @@ namespace TinyRNN
     {
         this->uuid = context->getNumberProperty(Keys::Core::Uuid);
         this->name = context->getStringProperty(Keys::Core::Name);
+        this->softmax = (context->getNumberProperty(Keys::Core::Softmax) != 0);
+        this->sparseInputs = (context->getNumberProperty(Keys::Core::SparseInputs) != 0);
         
         this->neurons.clear();
         SerializationContext::Ptr neuronsNode(context->getChildContext(Keys::Core::Neurons));
@@ -407,7 +603,7 @@ namespace TinyRNN
         for (size_t i = 0; i < neuronsNode->getNumChildrenContexts(); ++i)
         {
             SerializationContext::Ptr neuronNode(neuronsNode->getChildContext(i));
-            Neuron::Ptr neuron(new Neuron());
+            Neuron::Ptr neuron(Arena::makeShared<Neuron>(Arena::getCurrent()));
             neuron->deserialize(neuronNode);
             this->neurons.push_back(neuron);
         }
@@ -417,6 +613,8 @@ namespace TinyRNN
     {
         context->setNumberProperty(this->uuid, Keys::Core::Uuid);
         context->setStringProperty(this->name, Keys::Core::Name);
+        context->setNumberProperty(this->softmax ? 1 : 0, Keys::Core::Softmax);
+        context->setNumberProperty(this->sparseInputs ? 1 : 0, Keys::Core::SparseInputs);
         
         SerializationContext::Ptr allNeuronsNode(context->addChildContext(Keys::Core::Neurons));
         for (const auto &neuron : this->neurons)
@@ -432,13 +630,30 @@ namespace TinyRNN
     
     inline UnrolledNeuron::Vector Layer::toVM(UnrolledTrainingContext::Ptr context,
                                         bool asInput, bool asOutput,
-                                        bool asConst) const
+                                        bool asConst,
+                                        const Neuron::Vector *sparseInputs) const
     {
         UnrolledNeuron::Vector result;
         
+        // Same as process(), which ignores softmax anywhere but in the output layer
+        const bool inSoftmaxLayer = (this->softmax && asOutput);
+        
         for (auto &neuron : this->neurons)
         {
-            result.push_back(UnrolledNeuron::buildFrom(context, neuron, asInput, asOutput, asConst));
+            result.push_back(UnrolledNeuron::buildFrom(context, neuron, asInput, asOutput, asConst,
+                                                       inSoftmaxLayer, sparseInputs));
+        }
+        
+        // Goes before all the other layers' neurons, as they read the active inputs it finds
+        if (this->sparseInputs && asInput)
+        {
+            result.push_back(UnrolledNeuron::buildSparseInputsFrom(context, this->neurons));
+        }
+        
+        // Goes last, so that it runs after all the neurons in the feed kernel, and before them in the train kernel
+        if (inSoftmaxLayer)
+        {
+            result.push_back(UnrolledNeuron::buildSoftmaxFrom(context, this->uuid, this->neurons, asOutput, asConst));
         }
         
         return result;
@@ -452,6 +667,21 @@ namespace TinyRNN
         }
     }
     
+    inline DenseLayer::Ptr Layer::toDense(Layer::Ptr inputLayer, bool inputsAreFed, bool outputsAreLast) const
+    {
+        if (this->softmax && outputsAreLast)
+        {
+            return nullptr;
+        }
+        
+        return DenseLayer::buildFrom(inputLayer->neurons, this->neurons, inputsAreFed, outputsAreLast);
+    }
+    
+    inline void Layer::restore(Layer::Ptr inputLayer, DenseLayer::Ptr denseLayer)
+    {
+        denseLayer->restore(inputLayer->neurons, this->neurons);
+    }
+    
 } // namespace TinyRNN
 
 #endif // TINYRNN_LAYER_H_INCLUDED
@@ -30,7 +30,11 @@
 #include "ScopedTimer.h"
 #include "SerializedObject.h"
 #include "UnrolledNetwork.h"
+#include "UnrolledHogwildTrainer.h"
+#include "UnrolledBeamSearch.h"
 #include "UnrolledTrainingContext.h"
+#include "DenseNetwork.h"
+#include "FusedLSTMNetwork.h"
 
 namespace TinyRNN
 {
@@ -53,12 +57,38 @@ namespace TinyRNN
         std::string getName() const noexcept;
         Id getUuid() const noexcept;
         
+        // E.g. for making the inputs of a prefab sparse before unrolling it
+        Layer::Ptr getInputLayer() const noexcept;
+        
         // Feed the input layer, process the rest and get result values from the output
         Neuron::Values feed(const Neuron::Values &input);
         
         // Back-propagation magic
         void train(Value rate, const Neuron::Values &target);
         
+        // Run the whole sequence of numSteps in one call, with no allocations per step;
+        // all the buffers are laid out as [step][neuron], and outputs may be nullptr when training
+        void feedSequence(const Value *inputs, size_t numSteps, Value *outputs);
+        void trainSequence(Value rate, const Value *inputs, const Value *targets,
+                           size_t numSteps, Value *outputs = nullptr);
+        
+        // Single steps with the caller's buffers, outputs may be nullptr
+        void feed(const Value *inputs, Value *outputs);
+        void train(Value rate, const Value *targets);
+        
+        // Mini-batch training: the updates are summed up in a separate gradient buffer,
+        // and applied to the weights and biases once per numSamples calls to train();
+        // one is the default, online training, where each sample updates the weights right away
+        void setMiniBatchSize(Index numSamples);
+        Index getMiniBatchSize() const noexcept;
+        
+        // Applies the updates of an incomplete mini-batch, e.g. at the end of an epoch
+        void applyGradients();
+        
+        // Redraws all the weights, layer by layer, from a stream with the given seed,
+        // so that the same seed always gives the same network; the biases are kept as is
+        void initializeWeights(uint64_t seed, Layer::WeightInitialization initialization = Layer::SmallUniform);
+        
         // Connections
         Neuron::Connection::HashMap connectAllToAll(Network::Ptr other);
         Neuron::Connection::HashMap connectOneToOne(Network::Ptr other);
@@ -88,10 +118,20 @@ namespace TinyRNN
         virtual void deserialize(SerializationContext::Ptr context) override;
         virtual void serialize(SerializationContext::Ptr context) const override;
         
-        UnrolledNetwork::Ptr toVM() const;
-        UnrolledNetwork::Ptr toStaticVM() const;
+        UnrolledNetwork::Ptr toVM(bool shouldOptimize = true) const;
+        UnrolledNetwork::Ptr toStaticVM(bool shouldOptimize = true) const;
         void restore(UnrolledTrainingContext::Ptr context);
         
+        // Compiles a feed-forward network, where each layer is connected all-to-all to the next one,
+        // into dense weight matrices; returns nullptr for any other topology, or for a softmax output layer
+        DenseNetwork::Ptr toDense() const;
+        void restore(DenseNetwork::Ptr denseNetwork);
+        
+        // Compiles a network built by Prefabs::longShortTermMemory into blocks of fused gate matrices;
+        // returns nullptr for any other topology, or for a softmax output layer
+        FusedLSTMNetwork::Ptr toFusedLSTM() const;
+        void restore(FusedLSTMNetwork::Ptr fusedNetwork);
+        
     private:
         
         std::string name;
@@ -101,8 +141,14 @@ namespace TinyRNN
         Layer::Vector hiddenLayers;
         Layer::Ptr outputLayer;
         
+        Index miniBatchSize;
+        Index numAccumulatedSamples;
+    
     private:
         
+        void feedStep(const Value *inputs, Value *outputs);
+        void backPropagate(Value rate); // all the hidden layers, after the output one has been trained
+        
         Neuron::Connection::SortedMap findAllConnections() const;
         Neuron::Ptr findNeuronWithId(const Id &uuid);
         
@@ -116,7 +162,9 @@ namespace TinyRNN
     //===------------------------------------------------------------------===//
     
     inline Network::Network() :
-    uuid(Uuid::generateId())
+    uuid(Uuid::generateId()),
+    miniBatchSize(1),
+    numAccumulatedSamples(0)
     {
     }
     
@@ -128,7 +176,9 @@ namespace TinyRNN
     uuid(Uuid::generateId()),
     inputLayer(targetInputLayer),
     hiddenLayers(targetHiddenLayers),
-    outputLayer(targetOutputLayer)
+    outputLayer(targetOutputLayer),
+    miniBatchSize(1),
+    numAccumulatedSamples(0)
     {
     }
     
@@ -142,6 +192,11 @@ namespace TinyRNN
         return this->uuid;
     }
     
+    inline Layer::Ptr Network::getInputLayer() const noexcept
+    {
+        return this->inputLayer;
+    }
+    
     //===------------------------------------------------------------------===//
     // Core
     //===------------------------------------------------------------------===//
@@ -152,7 +207,7 @@ namespace TinyRNN
         
         for (auto &hiddenLayer : this->hiddenLayers)
         {
-            hiddenLayer->process();
+            hiddenLayer->process(nullptr, false);
         }
         
         const Neuron::Values &result = this->outputLayer->process();
@@ -162,11 +217,114 @@ namespace TinyRNN
     inline void Network::train(Value rate, const Neuron::Values &target)
     {
         this->outputLayer->train(rate, target);
+        this->backPropagate(rate);
+    }
+    
+    inline void Network::feed(const Value *inputs, Value *outputs)
+    {
+        this->feedStep(inputs, outputs);
+    }
+    
+    inline void Network::train(Value rate, const Value *targets)
+    {
+        this->outputLayer->train(rate, targets);
+        this->backPropagate(rate);
+    }
+    
+    inline void Network::feedSequence(const Value *inputs, size_t numSteps, Value *outputs)
+    {
+        const size_t numInputs = this->inputLayer->getSize();
+        const size_t numOutputs = this->outputLayer->getSize();
+        
+        for (size_t t = 0; t < numSteps; ++t)
+        {
+            this->feedStep(inputs + t * numInputs, outputs + t * numOutputs);
+        }
+    }
+    
+    inline void Network::trainSequence(Value rate, const Value *inputs, const Value *targets,
+                                       size_t numSteps, Value *outputs)
+    {
+        const size_t numInputs = this->inputLayer->getSize();
+        const size_t numOutputs = this->outputLayer->getSize();
+        
+        for (size_t t = 0; t < numSteps; ++t)
+        {
+            this->feedStep(inputs + t * numInputs, (outputs != nullptr) ? (outputs + t * numOutputs) : nullptr);
+            this->outputLayer->train(rate, targets + t * numOutputs);
+            this->backPropagate(rate);
+        }
+    }
+    
+    inline void Network::feedStep(const Value *inputs, Value *outputs)
+    {
+        this->inputLayer->feed(inputs);
+        
+        for (auto &hiddenLayer : this->hiddenLayers)
+        {
+            hiddenLayer->process(nullptr, false);
+        }
         
+        this->outputLayer->process(outputs);
+    }
+    
+    inline void Network::backPropagate(Value rate)
+    {
         for (size_t i = this->hiddenLayers.size(); i --> 0 ;)
         {
             this->hiddenLayers[i]->backPropagate(rate);
         }
+        
+        if (this->miniBatchSize > 1 &&
+            ++this->numAccumulatedSamples == this->miniBatchSize)
+        {
+            this->applyGradients();
+        }
+    }
+    
+    inline void Network::setMiniBatchSize(Index numSamples)
+    {
+        this->applyGradients();
+        this->miniBatchSize = std::max(numSamples, Index(1));
+        
+        const bool shouldAccumulate = (this->miniBatchSize > 1);
+        this->outputLayer->setAccumulatesGradients(shouldAccumulate);
+        
+        for (auto &hiddenLayer : this->hiddenLayers)
+        {
+            hiddenLayer->setAccumulatesGradients(shouldAccumulate);
+        }
+    }
+    
+    inline Index Network::getMiniBatchSize() const noexcept
+    {
+        return this->miniBatchSize;
+    }
+    
+    inline void Network::applyGradients()
+    {
+        this->outputLayer->applyGradients();
+        
+        for (auto &hiddenLayer : this->hiddenLayers)
+        {
+            hiddenLayer->applyGradients();
+        }
+        
+        this->numAccumulatedSamples = 0;
+    }
+    
+    inline void Network::initializeWeights(uint64_t seed, Layer::WeightInitialization initialization)
+    {
+        Random random(seed);
+        
+        this->inputLayer->initializeWeights(random, initialization);
+        
+        for (auto &hiddenLayer : this->hiddenLayers)
+        {
+            hiddenLayer->initializeWeights(random, initialization);
+        }
+        
+        this->outputLayer->initializeWeights(random, initialization);
     }
     
     //===------------------------------------------------------------------===//
@@ -207,6 +365,13 @@ namespace TinyRNN
         this->uuid = context->getNumberProperty(Keys::Core::Uuid);
         this->name = context->getStringProperty(Keys::Core::Name);
         
+        // the new neurons learn online
+        this->miniBatchSize = 1;
+        this->numAccumulatedSamples = 0;
+        
+        // all the neurons and connections are laid out together
+        const Arena::Scope arenaScope(Arena::Ptr(new Arena()));
+        
         this->inputLayer.reset();
         SerializationContext::Ptr inputLayerNode(context->getChildContext(Keys::Core::InputLayer));
         this->inputLayer = Layer::Ptr(new Layer(0));
@@ -234,7 +399,7 @@ namespace TinyRNN
         {
             SerializationContext::Ptr connectionNode(connectionsNode->getChildContext(i));
             
-            Neuron::Connection::Ptr connection(new Neuron::Connection());
+            Neuron::Connection::Ptr connection(Arena::makeShared<Neuron::Connection>(Arena::getCurrent()));
             connection->deserialize(connectionNode);
             
             const Id inputNeuronUuid = connectionNode->getNumberProperty(Keys::Core::InputNeuronUuid);
@@ -330,7 +495,7 @@ namespace TinyRNN
     // Unrolled networks
     //===------------------------------------------------------------------===//
     
-    inline UnrolledNetwork::Ptr Network::toVM() const
+    inline UnrolledNetwork::Ptr Network::toVM(bool shouldOptimize) const
     {
         UnrolledTrainingContext::Ptr context(new UnrolledTrainingContext());
         UnrolledNetwork::VMLayers vmLayers;
@@ -339,21 +504,24 @@ namespace TinyRNN
             const ScopedTimer timer("Network::toVM");
             vmLayers.push_back(this->inputLayer->toVM(context, true, false, false));
             
+            const Neuron::Vector *sparseInputs =
+            this->inputLayer->usesSparseInputs() ? &this->inputLayer->getNeurons() : nullptr;
+            
             for (auto &hiddenLayer : this->hiddenLayers)
             {
-                vmLayers.push_back(hiddenLayer->toVM(context, false, false, false));
+                vmLayers.push_back(hiddenLayer->toVM(context, false, false, false, sparseInputs));
             }
             
-            vmLayers.push_back(this->outputLayer->toVM(context, false, true, false));
+            vmLayers.push_back(this->outputLayer->toVM(context, false, true, false, sparseInputs));
         }
         
-        UnrolledNetwork::Ptr vmNetwork(new UnrolledNetwork(context, vmLayers));
+        UnrolledNetwork::Ptr vmNetwork(new UnrolledNetwork(context, vmLayers, shouldOptimize));
         
         std::cout << "Hardcoded context memory size: " << context->getMemory().size() << std::endl;
         return vmNetwork;
     }
     
-    inline UnrolledNetwork::Ptr Network::toStaticVM() const
+    inline UnrolledNetwork::Ptr Network::toStaticVM(bool shouldOptimize) const
     {
         UnrolledTrainingContext::Ptr context(new UnrolledTrainingContext());
         UnrolledNetwork::VMLayers vmLayers;
@@ -362,15 +530,18 @@ namespace TinyRNN
             const ScopedTimer timer("Network::toFeedOnlyVM");
             vmLayers.push_back(this->inputLayer->toVM(context, true, false, true));
             
+            const Neuron::Vector *sparseInputs =
+            this->inputLayer->usesSparseInputs() ? &this->inputLayer->getNeurons() : nullptr;
+            
             for (auto &hiddenLayer : this->hiddenLayers)
             {
-                vmLayers.push_back(hiddenLayer->toVM(context, false, false, true));
+                vmLayers.push_back(hiddenLayer->toVM(context, false, false, true, sparseInputs));
             }
             
-            vmLayers.push_back(this->outputLayer->toVM(context, false, true, true));
+            vmLayers.push_back(this->outputLayer->toVM(context, false, true, true, sparseInputs));
         }
         
-        UnrolledNetwork::Ptr vmNetwork(new UnrolledNetwork(context, vmLayers));
+        UnrolledNetwork::Ptr vmNetwork(new UnrolledNetwork(context, vmLayers, shouldOptimize));
         
         std::cout << "Hardcoded context memory size: " << context->getMemory().size() << std::endl;
         return vmNetwork;
@@ -390,6 +561,87 @@ namespace TinyRNN
         this->outputLayer->restore(context);
     }
     
+    inline DenseNetwork::Ptr Network::toDense() const
+    {
+        const ScopedTimer timer("Network::toDense");
+        
+        DenseLayer::Vector denseLayers;
+        Layer::Ptr previousLayer = this->inputLayer;
+        
+        Layer::Vector layers(this->hiddenLayers);
+        layers.push_back(this->outputLayer);
+        
+        for (size_t i = 0; i < layers.size(); ++i)
+        {
+            DenseLayer::Ptr denseLayer =
+            layers[i]->toDense(previousLayer, (i == 0), (i == layers.size() - 1));
+            
+            if (denseLayer == nullptr)
+            {
+                return nullptr;
+            }
+            
+            denseLayers.push_back(denseLayer);
+            previousLayer = layers[i];
+        }
+        
+        return DenseNetwork::Ptr(new DenseNetwork(Index(this->inputLayer->getSize()), denseLayers));
+    }
+    
+    inline void Network::restore(DenseNetwork::Ptr denseNetwork)
+    {
+        const ScopedTimer timer("Network::restore");
+        
+        this->inputLayer->feed(denseNetwork->getInputs());
+        
+        Layer::Ptr previousLayer = this->inputLayer;
+        
+        for (size_t i = 0; i < this->hiddenLayers.size(); ++i)
+        {
+            this->hiddenLayers[i]->restore(previousLayer, denseNetwork->getLayers()[i]);
+            previousLayer = this->hiddenLayers[i];
+        }
+        
+        this->outputLayer->restore(previousLayer, denseNetwork->getLayers().back());
+    }
+    
+    inline FusedLSTMNetwork::Ptr Network::toFusedLSTM() const
+    {
+        const ScopedTimer timer("Network::toFusedLSTM");
+        
+        FusedLSTMNetwork::NeuronLayers hiddenNeurons;
+        
+        for (const auto &hiddenLayer : this->hiddenLayers)
+        {
+            hiddenNeurons.push_back(hiddenLayer->getNeurons());
+        }
+        
+        if (this->outputLayer->usesSoftmax())
+        {
+            return nullptr;
+        }
+        
+        return FusedLSTMNetwork::buildFrom(this->inputLayer->getNeurons(),
+                                           hiddenNeurons,
+                                           this->outputLayer->getNeurons());
+    }
+    
+    inline void Network::restore(FusedLSTMNetwork::Ptr fusedNetwork)
+    {
+        const ScopedTimer timer("Network::restore");
+        
+        FusedLSTMNetwork::NeuronLayers hiddenNeurons;
+        
+        for (const auto &hiddenLayer : this->hiddenLayers)
+        {
+            hiddenNeurons.push_back(hiddenLayer->getNeurons());
+        }
+        
+        fusedNetwork->restore(this->inputLayer->getNeurons(),
+                              hiddenNeurons,
+                              this->outputLayer->getNeurons());
+    }
+    
     //===------------------------------------------------------------------===//
     // Network prefabs
     //===------------------------------------------------------------------===//
@@ -399,6 +651,8 @@ namespace TinyRNN
                                                       const std::vector<int> &hiddenLayersSizes,
                                                       int outputLayerSize)
     {
+        const Arena::Scope arenaScope(Arena::Ptr(new Arena()));
+        
         Layer::Ptr inputLayer = Layer::Ptr(new Layer(inputLayerSize));
         
         std::vector<Layer::Ptr> hiddenLayers;
@@ -433,6 +687,8 @@ namespace TinyRNN
                                                               const std::vector<int> &hiddenLayersSizes,
                                                               int outputLayerSize)
     {
+        const Arena::Scope arenaScope(Arena::Ptr(new Arena()));
+        
         Layer::Ptr inputLayer(new Layer(inputLayerSize, Neuron::Sigmoid));
         Layer::Ptr outputLayer(new Layer(outputLayerSize, Neuron::Tanh));
         
@@ -26,6 +26,8 @@
 #include "SerializedObject.h"
 #include "Id.h"
 #include "SerializationKeys.h"
+#include "Random.h"
+#include "Arena.h"
 
 namespace TinyRNN
 {
@@ -82,6 +84,8 @@ namespace TinyRNN
             Value weight;
             Value gain;
             
+            Value batchGradient;    // the sum of the updates within a mini-batch, never serialized
+            
             void setRandomWeight();
             
             Neuron::WeakPtr inputNeuron;
@@ -89,8 +93,11 @@ namespace TinyRNN
             Neuron::WeakPtr outputNeuron;
             
             friend class Neuron;
+            friend class Layer;
             friend class UnrolledNeuron;
             friend class UnrolledTrainingContext;
+            friend class DenseLayer;
+            friend class FusedLSTMNetwork;
             
         private:
             
@@ -161,7 +168,10 @@ namespace TinyRNN
         
         bool isGatingAnyConnection;
         
-        void feedWithRandomBias(Value signal);
+        // In the mini-batch mode, learn() sums the updates up instead of applying them
+        bool accumulatesGradients;
+        Value batchBiasGradient;
+        
         void setRandomBias();
         
         static Value activationSigmoid(Value x);
@@ -176,27 +186,62 @@ namespace TinyRNN
         Connection::HashMap gatedConnections;
         Connection::Ptr selfConnection;
         
+        // The flat copies of the connection maps, walked by the hot loops instead of the maps;
+        // the connections keep the weights and gains, and own everything, these are just raw pointers.
+        // The links are appended in the order of connecting, so that the link's slot never changes,
+        // and all the traces of the incoming connections are indexed by the incoming link slot
+        struct Link final
+        {
+            Neuron *neuron;         // the input neuron for the incoming links, the output one for the outgoing
+            Connection *connection;
+        };
+        
+        using Links = std::vector<Link>;
+        
+        Links incomingLinks;
+        Links outgoingLinks;
+        std::vector<Connection *> gatedLinks;
+        
+        void addIncomingLink(Neuron *inputNeuron, Connection *connection);
+        
+        // The same as connectWith(), but without the check for an existing connection,
+        // for the bulk connecting of the layers, which does that check once for all the neurons
+        Connection::Ptr connectWithUnchecked(Neuron::Ptr other);
+        
+        // Sizes all the containers that grow with each new connection in one go
+        void reserveIncomingConnections(size_t numNewConnections);
+        void reserveOutgoingConnections(size_t numNewConnections);
+        
         bool isOutput() const;
         void learn(Value rate = 0.1);
+        void applyGradients();
         
         friend class Layer;
         friend class UnrolledNeuron;
         friend class UnrolledTrainingContext;
+        friend class DenseLayer;
+        friend class FusedLSTMNetwork;
         
     private:
         
-        // The cache maps, never serialized
-        // Consume A LOT of memory
-        using EligibilityMap = std::unordered_map<Id, Value>;
-        using ExtendedEligibilityMap = std::unordered_map<Id, EligibilityMap>;
-        using Influences = std::unordered_map<Id, Connection::Ptr>;
-        using InfluencesMap = std::unordered_map<Id, Influences>;
+        // The traces, never serialized
+        
+        // A neuron that has any of its connections gated by this one
+        struct GatedNeighbour final
+        {
+            Neuron::Ptr neuron;
+            Links influences;                       // the connections to it, gated by this neuron
+            Values extended;                        // extended eligibility traces, by the incoming link slot
+            Value influence;                        // computed in process() for the extended traces
+            bool gatesSelfConnection;               // the neighbour's self-connection is one of the influences
+        };
         
-        mutable InfluencesMap influences;
-        mutable EligibilityMap eligibility;
-        mutable ExtendedEligibilityMap extended;
+        Values eligibility;                         // eligibility traces, by the incoming link slot
+        std::vector<GatedNeighbour> gatedNeighbours;
+        std::unordered_map<const Neuron *, size_t> gatedNeighbourIndices;
         
-        mutable Neuron::HashMap neighbours;
+        GatedNeighbour *findGatedNeighbour(const Neuron *neighbour);
+        Value computeInfluence(const GatedNeighbour &gatedNeighbour) const;
         
     private:
         
@@ -218,7 +263,9 @@ namespace TinyRNN
     errorResponsibility(0.0),
     projectedActivity(0.0),
     gatingActivity(0.0),
-    isGatingAnyConnection(false)
+    isGatingAnyConnection(false),
+    accumulatesGradients(false),
+    batchBiasGradient(0.0)
     {
         this->setRandomBias();
     }
@@ -234,23 +281,15 @@ namespace TinyRNN
     errorResponsibility(0.0),
     projectedActivity(0.0),
     gatingActivity(0.0),
-    isGatingAnyConnection(false)
+    isGatingAnyConnection(false),
+    accumulatesGradients(false),
+    batchBiasGradient(0.0)
     {
     }
     
-    inline void Neuron::feedWithRandomBias(Value signal)
-    {
-        this->activation = signal;
-        this->derivative = 0.0;
-        this->setRandomBias();
-    }
-    
     inline void Neuron::setRandomBias()
     {
-        std::random_device randomDevice;
-        std::mt19937 mt19937(randomDevice());
-        std::uniform_real_distribution<Value> distribution(-0.001, 0.001);
-        this->bias = distribution(mt19937);
+        this->bias = Random::getDefault().nextUniform(-0.001, 0.001);
     }
     
     inline Id Neuron::getUuid() const noexcept
@@ -279,8 +318,9 @@ namespace TinyRNN
     {
         if (other.get() == this)
         {
-            this->selfConnection = Connection::Ptr(new Connection(this->shared_from_this(),
-                                                                  this->shared_from_this()));
+            this->selfConnection = Arena::makeShared<Connection>(Arena::getCurrent(),
+                                                                 this->shared_from_this(),
+                                                                 this->shared_from_this());
             return this->selfConnection;
         }
         
@@ -289,21 +329,19 @@ namespace TinyRNN
             return existingOutgoingConnection;
         }
         
-        Connection::Ptr newConnection(new Connection(this->shared_from_this(), other));
+        return this->connectWithUnchecked(other);
+    }
+    
+    inline Neuron::Connection::Ptr Neuron::connectWithUnchecked(Neuron::Ptr other)
+    {
+        Connection::Ptr newConnection(Arena::makeShared<Connection>(Arena::getCurrent(), this->shared_from_this(), other));
         const Id newConnectionId = newConnection->getUuid();
         
-        // reference all the connections
+        // reference all the connections and traces
         this->outgoingConnections[newConnectionId] = newConnection;
+        this->outgoingLinks.push_back({ other.get(), newConnection.get() });
         other->incomingConnections[newConnectionId] = newConnection;
-        
-        // reference traces
-        this->neighbours[other->getUuid()] = other;
-        other->eligibility[newConnectionId] = 0.0;
-        
-        for (auto &extendedTrace : other->extended)
-        {
-            extendedTrace.second[newConnectionId] = 0.0;
-        }
+        other->addIncomingLink(this, newConnection.get());
         
         return newConnection;
     }
@@ -311,37 +349,79 @@ namespace TinyRNN
     inline void Neuron::gate(Connection::Ptr connection)
     {
         const Id connectionId = connection->getUuid();
+        const bool isGatedAlready = (this->gatedConnections.find(connectionId) != this->gatedConnections.end());
         
         // add connection to gated list
         this->gatedConnections[connectionId] = connection;
         
-        Neuron::Ptr targetNeuron = connection->getOutputNeuron();
-        
-        // update traces
-        const bool targetNeuronNotFoundInExtendedTrace = (this->extended.find(targetNeuron->getUuid()) == this->extended.end());
-        if (targetNeuronNotFoundInExtendedTrace)
+        if (! isGatedAlready)
         {
-            // extended trace
-            this->neighbours[targetNeuron->getUuid()] = targetNeuron;
+            this->gatedLinks.push_back(connection.get());
             
-            EligibilityMap &xtrace = this->extended[targetNeuron->getUuid()];
-            xtrace.clear();
+            Neuron::Ptr targetNeuron = connection->getOutputNeuron();
+            GatedNeighbour *gatedNeighbour = this->findGatedNeighbour(targetNeuron.get());
             
-            for (auto &i : this->incomingConnections)
+            // update traces
+            if (gatedNeighbour == nullptr)
             {
-                Connection::Ptr input = i.second;
-                xtrace[input->getUuid()] = 0.0;
+                this->gatedNeighbourIndices[targetNeuron.get()] = this->gatedNeighbours.size();
+                this->gatedNeighbours.push_back({ targetNeuron, {}, Values(this->incomingLinks.size(), 0.0), 0.0, false });
+                gatedNeighbour = &this->gatedNeighbours.back();
             }
+            
+            gatedNeighbour->influences.push_back({ connection->getInputNeuron().get(), connection.get() });
+            gatedNeighbour->gatesSelfConnection |= (connection == targetNeuron->selfConnection);
         }
         
-        this->influences[targetNeuron->getUuid()][connection->getUuid()] = connection;
-        
         this->isGatingAnyConnection = true;
         
         // set gater
         connection->setGate(this->shared_from_this());
     }
     
+    inline void Neuron::addIncomingLink(Neuron *inputNeuron, Connection *connection)
+    {
+        this->incomingLinks.push_back({ inputNeuron, connection });
+        this->eligibility.push_back(0.0);
+        
+        for (auto &gatedNeighbour : this->gatedNeighbours)
+        {
+            gatedNeighbour.extended.push_back(0.0);
+        }
+    }
+    
+    inline void Neuron::reserveIncomingConnections(size_t numNewConnections)
+    {
+        const size_t numConnections = this->incomingLinks.size() + numNewConnections;
+        this->incomingConnections.reserve(numConnections);
+        this->incomingLinks.reserve(numConnections);
+        this->eligibility.reserve(numConnections);
+        
+        for (auto &gatedNeighbour : this->gatedNeighbours)
+        {
+            gatedNeighbour.extended.reserve(numConnections);
+        }
+    }
+    
+    inline void Neuron::reserveOutgoingConnections(size_t numNewConnections)
+    {
+        const size_t numConnections = this->outgoingLinks.size() + numNewConnections;
+        this->outgoingConnections.reserve(numConnections);
+        this->outgoingLinks.reserve(numConnections);
+    }
+    
+    inline Neuron::GatedNeighbour *Neuron::findGatedNeighbour(const Neuron *neighbour)
+    {
+        const auto found = this->gatedNeighbourIndices.find(neighbour);
+        
+        if (found == this->gatedNeighbourIndices.end())
+        {
+            return nullptr;
+        }
+        
+        return &this->gatedNeighbours[found->second];
+    }
+    
     //===------------------------------------------------------------------===//
     // Core
     //===------------------------------------------------------------------===//
@@ -352,9 +432,11 @@ namespace TinyRNN
         const bool hasOutputConnections = !this->outgoingConnections.empty();
         const bool isInputNeuron = (noInputConnections && hasOutputConnections);
         
+        // the input neurons' bias is never used, so it is left as is
         if (isInputNeuron)
         {
-            this->feedWithRandomBias(signalValue);
+            this->activation = signalValue;
+            this->derivative = 0.0;
         }
     }
     
@@ -372,10 +454,9 @@ namespace TinyRNN
             this->state = this->bias;
         }
         
-        for (auto &i : this->incomingConnections)
+        for (const auto &link : this->incomingLinks)
         {
-            const Connection::Ptr inputConnection = i.second;
-            this->state += inputConnection->getInputNeuron()->activation * inputConnection->weight * inputConnection->gain;
+            this->state += link.neuron->activation * link.connection->weight * link.connection->gain;
         }
         
         switch (this->activationType)
@@ -395,75 +476,69 @@ namespace TinyRNN
         }
         
         // update traces
-        EligibilityMap influences;
-        for (auto &id : this->extended)
+        for (auto &gatedNeighbour : this->gatedNeighbours)
         {
-            // extended elegibility trace
-            Neuron::Ptr neighbour = this->neighbours[id.first];
-            
-            Value influence = 0.0;
-            
-            // if gated neuron's selfconnection is gated by this unit, the influence keeps track of the neuron's old state
-            if (Connection::Ptr neighbourSelfconnection = neighbour->getSelfConnection())
-            {
-                if (neighbourSelfconnection->getGateNeuron().get() == this)
-                {
-                    influence = neighbour->oldState;
-                }
-            }
-            
-            // index runs over all the incoming connections to the gated neuron that are gated by this unit
-            for (auto &incoming : this->influences[neighbour->getUuid()])
-            { // captures the effect that has an input connection to this unit, on a neuron that is gated by this unit
-                const Connection::Ptr inputConnection = incoming.second;
-                influence += inputConnection->weight * inputConnection->getInputNeuron()->activation;
-            }
-            
-            influences[neighbour->getUuid()] = influence;
+            gatedNeighbour.influence = this->computeInfluence(gatedNeighbour);
         }
         
-        for (auto &i : this->incomingConnections)
+        const Connection *selfConnection = this->selfConnection.get();
+        
+        for (size_t slot = 0; slot < this->incomingLinks.size(); ++slot)
         {
-            const Connection::Ptr inputConnection = i.second;
+            const Link &link = this->incomingLinks[slot];
             
             // elegibility trace - Eq. 17
-            const Value oldElegibility = this->eligibility[inputConnection->getUuid()];
-            this->eligibility[inputConnection->getUuid()] = inputConnection->gain * inputConnection->getInputNeuron()->activation;
+            const Value oldElegibility = this->eligibility[slot];
+            this->eligibility[slot] = link.connection->gain * link.neuron->activation;
             
-            if (this->isSelfConnected())
+            if (selfConnection != nullptr)
             {
-                this->eligibility[inputConnection->getUuid()] += this->selfConnection->gain * this->selfConnection->weight * oldElegibility;
+                this->eligibility[slot] += selfConnection->gain * selfConnection->weight * oldElegibility;
             }
             
-            for (auto &i : this->extended)
+            for (auto &gatedNeighbour : this->gatedNeighbours)
             {
-                // extended elegibility trace
-                const Id neuronId = i.first;
-                const Value influence = influences[neuronId];
-                EligibilityMap &xtrace = i.second;
-                Neuron::Ptr neighbour = this->neighbours[neuronId];
-                
-                // eq. 18
-                const Value oldXTrace = xtrace[inputConnection->getUuid()];
-                xtrace[inputConnection->getUuid()] = this->derivative * this->eligibility[inputConnection->getUuid()] * influence;
+                // extended elegibility trace - eq. 18
+                Value &xtrace = gatedNeighbour.extended[slot];
+                const Value oldXTrace = xtrace;
+                xtrace = this->derivative * this->eligibility[slot] * gatedNeighbour.influence;
                 
-                if (Connection::Ptr neighbourSelfConnection = neighbour->getSelfConnection())
+                if (const Connection *neighbourSelfConnection = gatedNeighbour.neuron->selfConnection.get())
                 {
-                    xtrace[inputConnection->getUuid()] += neighbourSelfConnection->gain * neighbourSelfConnection->weight * oldXTrace;
+                    xtrace += neighbourSelfConnection->gain * neighbourSelfConnection->weight * oldXTrace;
                 }
             }
         }
         
         // update gated connection's gains
-        for (auto &i : this->gatedConnections)
+        for (auto *connection : this->gatedLinks)
         {
-            const Connection::Ptr connection = i.second;
             connection->gain = this->activation;
         }
         
         return this->activation;
     }
     
+    // The effect of this neuron's activation on the state of a neuron it gates
+    inline Value Neuron::computeInfluence(const GatedNeighbour &gatedNeighbour) const
+    {
+        Value influence = 0.0;
+        
+        // if gated neuron's selfconnection is gated by this unit, the influence keeps track of the neuron's old state
+        if (gatedNeighbour.gatesSelfConnection)
+        {
+            influence = gatedNeighbour.neuron->oldState;
+        }
+        
+        // index runs over all the incoming connections to the gated neuron that are gated by this unit
+        for (const auto &link : gatedNeighbour.influences)
+        { // captures the effect that has an input connection to this unit, on a neuron that is gated by this unit
+            influence += link.connection->weight * link.neuron->activation;
+        }
+        
+        return influence;
+    }
+    
     inline bool Neuron::isOutput() const
     {
         const bool noProjections = this->outgoingConnections.empty();
@@ -490,11 +565,10 @@ namespace TinyRNN
         if (! this->isOutput())
         {
             // error responsibilities from all the connections projected from this neuron
-            for (auto &i : this->outgoingConnections)
+            for (const auto &link : this->outgoingLinks)
             {
-                const Connection::Ptr outputConnection = i.second;
                 // Eq. 21
-                errorAccumulator += outputConnection->getOutputNeuron()->errorResponsibility * outputConnection->gain * outputConnection->weight;
+                errorAccumulator += link.neuron->errorResponsibility * link.connection->gain * link.connection->weight;
             }
             
             // projected error responsibility
@@ -502,32 +576,13 @@ namespace TinyRNN
             
             errorAccumulator = 0.0;
             
-            // error responsibilities from all the connections gated by this neuron
-            for (auto &i : this->extended)
+            // error responsibilities from all the connections gated by this neuron;
+            // the influences are computed again, as the gated neurons' inputs and the weights
+            // may have changed since process(), and the unrolled and fused networks do the same
+            for (const auto &gatedNeighbour : this->gatedNeighbours)
             {
-                const Id gatedNeuronId = i.first;
-                const Neuron::Ptr gatedNeuron = this->neighbours[gatedNeuronId];
-                
-                Value influence = 0.0;
-                
-                // if gated neuron's selfconnection is gated by this neuron
-                if (Connection::Ptr gatedNeuronSelfConnection = gatedNeuron->getSelfConnection())
-                {
-                    if (gatedNeuronSelfConnection->getGateNeuron().get() == this)
-                    {
-                        influence = gatedNeuron->oldState;
-                    }
-                }
-                
-                // index runs over all the connections to the gated neuron that are gated by this neuron
-                for (auto &i : this->influences[gatedNeuronId])
-                { // captures the effect that the input connection of this neuron have, on a neuron which its input/s is/are gated by this neuron
-                    const Connection::Ptr inputConnection = i.second;
-                    influence += inputConnection->weight * inputConnection->getInputNeuron()->activation;
-                }
-                
                 // eq. 22
-                errorAccumulator += gatedNeuron->errorResponsibility * influence;
+                errorAccumulator += gatedNeighbour.neuron->errorResponsibility * this->computeInfluence(gatedNeighbour);
             }
             
             // gated error responsibility
@@ -548,26 +603,38 @@ namespace TinyRNN
     inline void Neuron::learn(Value rate)
     {
         // adjust all the neuron's incoming connections
-        for (auto &i : this->incomingConnections)
+        for (size_t slot = 0; slot < this->incomingLinks.size(); ++slot)
         {
-            const Id inputConnectionUuid = i.first;
-            const Connection::Ptr inputConnection = i.second;
+            Connection *inputConnection = this->incomingLinks[slot].connection;
             
             // Eq. 24
-            Value gradient = this->projectedActivity * this->eligibility[inputConnectionUuid];
-            for (auto &ext : this->extended)
+            Value gradient = this->projectedActivity * this->eligibility[slot];
+            for (const auto &gatedNeighbour : this->gatedNeighbours)
             {
-                const Id neighbourUuid = ext.first;
-                const Neuron::Ptr neighbour = this->neighbours[neighbourUuid];
-                gradient += neighbour->errorResponsibility * this->extended[neighbourUuid][inputConnectionUuid];
+                gradient += gatedNeighbour.neuron->errorResponsibility * gatedNeighbour.extended[slot];
             }
             
             const auto clippedGradient = clip(gradient, -TINYRNN_GRADIENT_CLIPPING_THRESHOLD, TINYRNN_GRADIENT_CLIPPING_THRESHOLD);
-            inputConnection->weight += rate * clippedGradient; // adjust weights - aka learn
+            Value &target = this->accumulatesGradients ? inputConnection->batchGradient : inputConnection->weight;
+            target += rate * clippedGradient; // adjust weights - aka learn
         }
         
         // adjust bias
-        this->bias += rate * this->errorResponsibility;
+        Value &targetBias = this->accumulatesGradients ? this->batchBiasGradient : this->bias;
+        targetBias += rate * this->errorResponsibility;
+    }
+    
+    inline void Neuron::applyGradients()
+    {
+        for (const auto &link : this->incomingLinks)
+        {
+            Connection *inputConnection = link.connection;
+            inputConnection->weight += inputConnection->batchGradient;
+            inputConnection->batchGradient = 0.0;
+        }
+        
+        this->bias += this->batchBiasGradient;
+        this->batchBiasGradient = 0.0;
     }
     
     inline Value Neuron::activationSigmoid(Value x)
@@ -671,15 +738,14 @@ namespace TinyRNN
         return nullptr;
     }
     
+    // Both scan the flat links rather than locking the weak pointers of all the connections in the map
     inline Neuron::Connection::Ptr Neuron::findOutgoingConnectionTo(Neuron::Ptr other) const
     {
-        for (const auto &i : this->outgoingConnections)
+        for (const auto &link : this->outgoingLinks)
         {
-            const Neuron::Connection::Ptr connection = i.second;
-            
-            if (connection->getOutputNeuron() == other)
+            if (link.neuron == other.get())
             {
-                return connection;
+                return this->outgoingConnections.at(link.connection->getUuid());
             }
         }
         
@@ -688,13 +754,11 @@ namespace TinyRNN
     
     inline Neuron::Connection::Ptr Neuron::findIncomingConnectionFrom(Neuron::Ptr other) const
     {
-        for (const auto &i : this->incomingConnections)
+        for (const auto &link : this->incomingLinks)
         {
-            const Neuron::Connection::Ptr connection = i.second;
-            
-            if (connection->getInputNeuron() == other)
+            if (link.neuron == other.get())
             {
-                return connection;
+                return this->incomingConnections.at(link.connection->getUuid());
             }
         }
         
@@ -741,7 +805,8 @@ namespace TinyRNN
     inline Neuron::Connection::Connection() :
     uuid(Uuid::generateId()),
     weight(0.0),
-    gain(1.0)
+    gain(1.0),
+    batchGradient(0.0)
     {
         this->setRandomWeight();
     }
@@ -751,6 +816,7 @@ namespace TinyRNN
     uuid(Uuid::generateId()),
     weight(0.0),
     gain(1.0),
+    batchGradient(0.0),
     inputNeuron(input),
     outputNeuron(output)
     {
@@ -759,10 +825,7 @@ namespace TinyRNN
     
     inline void Neuron::Connection::setRandomWeight()
     {
-        std::random_device randomDevice;
-        std::mt19937 mt19937(randomDevice());
-        std::uniform_real_distribution<Value> distribution(-0.001, 0.001);
-        this->weight = distribution(mt19937);
+        this->weight = Random::getDefault().nextUniform(-0.001, 0.001);
     }
     
     inline Id Neuron::Connection::getUuid() const noexcept
@@ -809,18 +872,11 @@ namespace TinyRNN
             return;
         }
 
-        // reference all the connections
+        // reference all the connections and traces
         strongInput->outgoingConnections[this->getUuid()] = this->shared_from_this();
+        strongInput->outgoingLinks.push_back({ strongOutput.get(), this });
         strongOutput->incomingConnections[this->getUuid()] = this->shared_from_this();
-
-        // reference all the traces
-        strongInput->neighbours[strongOutput->getUuid()] = strongOutput;
-        strongOutput->eligibility[this->getUuid()] = 0.0;
-        
-        for (auto &extendedTrace : strongOutput->extended)
-        {
-            extendedTrace.second[this->getUuid()] = 0.0;
-        }
+        strongOutput->addIncomingLink(strongInput.get(), this);
     }
     
     //===------------------------------------------------------------------===//
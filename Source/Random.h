@@ -0,0 +1,153 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_RANDOM_H_INCLUDED
+#define TINYRNN_RANDOM_H_INCLUDED
+
+#include "Common.h"
+#include <algorithm>
+#include <random>
+
+namespace TinyRNN
+{
+    // The xoshiro128** generator of Blackman and Vigna, 2018:
+    // small, fast, and gives the same stream for the same seed on any platform,
+    // which is not guaranteed for std::random_device and the std distributions
+    class Random final
+    {
+    public:
+        
+        explicit Random(uint64_t seed) noexcept;
+        
+        void setSeed(uint64_t seed) noexcept;
+        
+        uint32_t next() noexcept;
+        bool nextBool() noexcept;
+        
+        // Uniformly distributed in [min, max)
+        Value nextUniform(Value min, Value max) noexcept;
+        
+        // Bulk initialization: the raw numbers are generated in one pass,
+        // and scaled in another one, which the compiler is free to vectorize
+        void fillUniform(Value *values, size_t numValues, Value min, Value max) noexcept;
+        
+        // Glorot and Bengio, 2010: uniform in +/- sqrt(6 / (fanIn + fanOut))
+        void fillGlorot(Value *values, size_t numValues, Index fanIn, Index fanOut) noexcept;
+        
+        // The stream for the initial weights and biases of all the new neurons and connections,
+        // seeded from std::random_device once; seed it to make the new networks reproducible
+        static Random &getDefault();
+    
+    private:
+        
+        uint32_t state[4];
+        
+        static uint32_t rotateLeft(uint32_t x, int k) noexcept;
+    };
+    
+    //===------------------------------------------------------------------===//
+    // Random implementation
+    //===------------------------------------------------------------------===//
+    
+    inline Random::Random(uint64_t seed) noexcept
+    {
+        this->setSeed(seed);
+    }
+    
+    // The state is expanded from the seed with splitmix64, so that it is never all zeros
+    inline void Random::setSeed(uint64_t seed) noexcept
+    {
+        for (int i = 0; i < 4; i += 2)
+        {
+            seed += 0x9e3779b97f4a7c15ull;
+            uint64_t z = seed;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            z = z ^ (z >> 31);
+            this->state[i] = uint32_t(z);
+            this->state[i + 1] = uint32_t(z >> 32);
+        }
+    }
+    
+    inline uint32_t Random::rotateLeft(uint32_t x, int k) noexcept
+    {
+        return (x << k) | (x >> (32 - k));
+    }
+    
+    inline uint32_t Random::next() noexcept
+    {
+        const uint32_t result = Random::rotateLeft(this->state[1] * 5, 7) * 9;
+        const uint32_t t = this->state[1] << 9;
+        
+        this->state[2] ^= this->state[0];
+        this->state[3] ^= this->state[1];
+        this->state[1] ^= this->state[2];
+        this->state[0] ^= this->state[3];
+        this->state[2] ^= t;
+        this->state[3] = Random::rotateLeft(this->state[3], 11);
+        
+        return result;
+    }
+    
+    inline bool Random::nextBool() noexcept
+    {
+        return (this->next() >> 31) != 0;
+    }
+    
+    inline Value Random::nextUniform(Value min, Value max) noexcept
+    {
+        // the upper 24 bits fit the float's mantissa exactly
+        const Value unit = Value(this->next() >> 8) * Value(1.0 / 16777216.0);
+        return min + unit * (max - min);
+    }
+    
+    inline void Random::fillUniform(Value *values, size_t numValues, Value min, Value max) noexcept
+    {
+        for (size_t i = 0; i < numValues; ++i)
+        {
+            values[i] = Value(this->next() >> 8);
+        }
+        
+        const Value scale = (max - min) * Value(1.0 / 16777216.0);
+        
+        for (size_t i = 0; i < numValues; ++i)
+        {
+            values[i] = min + values[i] * scale;
+        }
+    }
+    
+    inline void Random::fillGlorot(Value *values, size_t numValues, Index fanIn, Index fanOut) noexcept
+    {
+        const Value limit = Value(sqrt(6.0 / std::max(double(fanIn) + double(fanOut), 1.0)));
+        this->fillUniform(values, numValues, -limit, limit);
+    }
+    
+    // A function-level static rather than a static variable,
+    // so that all translation units share the same stream
+    inline Random &Random::getDefault()
+    {
+        static Random defaultRandom((uint64_t(std::random_device()()) << 32) | std::random_device()());
+        return defaultRandom;
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_RANDOM_H_INCLUDED
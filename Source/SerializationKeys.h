@@ -59,7 +59,7 @@ namespace TinyRNN
             static const std::string Derivative = "Derivative";
             static const std::string State = "State";
             static const std::string OldState = "OldState";
-
+            
             static const std::string ErrorResponsibility = "ErrorResponsibility";
             static const std::string ProjectedActivity = "ProjectedActivity";
             static const std::string GatingActivity = "GatingActivity";
@@ -72,6 +72,9 @@ namespace TinyRNN
             
             static const std::string ErrorAccumulator = "ErrorAccumulator";
             static const std::string Gradient = "Gradient";
+            
+            static const std::string Softmax = "Softmax";
+            static const std::string SparseInputs = "SparseInputs";
         } // namespace Core
         
         namespace Mapping
@@ -121,6 +124,14 @@ namespace TinyRNN
             
             static const Id ErrorAccumulator = 38;
             static const Id Gradient = 39;
+            static const Id BatchGradient = 40;
+            
+            static const Id Loss = 41;
+            
+            static const Id ActiveInputs = 42;
+            static const Id ActiveInput = 43;
+            static const Id PreviousActiveInputs = 44;
+            static const Id PreviousActiveInput = 45;
         } // namespace Mapping
         
         namespace Unrolled
@@ -144,6 +155,8 @@ namespace TinyRNN
             
             static const std::string RawMemory = "RawMemory";
             static const std::string MemorySize = "MemorySize";
+            static const std::string RawMapping = "RawMapping";
+            static const std::string MappingSize = "MappingSize";
             static const std::string Variable = "Variable";
             static const std::string Key = "Key";
             static const std::string Index = "Index";
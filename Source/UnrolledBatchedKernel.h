@@ -0,0 +1,491 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDBATCHEDKERNEL_H_INCLUDED
+#define TINYRNN_UNROLLEDBATCHEDKERNEL_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledNeuron.h"
+
+namespace TinyRNN
+{
+    // Runs the kernel over many independent sequences at once.
+    // The per-lane memory is laid out as [variable][lane], so every instruction
+    // is decoded once and then applied to all the lanes with a tight loop,
+    // which the compiler turns into SIMD for the fixed batch widths.
+    //
+    // The variables from numLaneVariables on are shared by all the lanes, and live in the scalar
+    // memory at their index minus numLaneVariables, e.g. the weights and biases kept in the context;
+    // the kernel only ever reads those, see UnrolledNetwork::setBatchSize().
+    class UnrolledBatchedKernel final
+    {
+    public:
+        
+        static void run(const std::vector<char> &commands,
+                        const std::vector<Index> &indices,
+                        Value *memory,
+                        const Value *sharedMemory,
+                        Index numLaneVariables,
+                        Index numLanes,
+                        Value dropout);
+    
+    private:
+        
+        // A variable as the lanes see it: either a run of its own values, one per lane, or a single shared one
+        struct Operand final
+        {
+            Value *data;
+            Index stride; // 1 for the per-lane variables, 0 for the shared ones
+            
+            Value &operator[](Index lane) const noexcept { return this->data[lane * this->stride]; }
+        };
+        
+        // Lanes == 0 means the number of lanes is only known at runtime
+        template<Index Lanes>
+        static void process(const char *commands,
+                            const Index *indices,
+                            Value *memory,
+                            const Value *sharedMemory,
+                            Index numLaneVariables,
+                            Index numLanes,
+                            Value dropout);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledBatchedKernel);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledBatchedKernel implementation
+    //===------------------------------------------------------------------===//
+    
+    inline void UnrolledBatchedKernel::run(const std::vector<char> &commands,
+                                           const std::vector<Index> &indices,
+                                           Value *memory,
+                                           const Value *sharedMemory,
+                                           Index numLaneVariables,
+                                           Index numLanes,
+                                           Value dropout)
+    {
+        switch (numLanes)
+        {
+            case 4:
+                process<4>(commands.data(), indices.data(), memory, sharedMemory, numLaneVariables, numLanes, dropout);
+                break;
+            case 8:
+                process<8>(commands.data(), indices.data(), memory, sharedMemory, numLaneVariables, numLanes, dropout);
+                break;
+            case 16:
+                process<16>(commands.data(), indices.data(), memory, sharedMemory, numLaneVariables, numLanes, dropout);
+                break;
+            default:
+                process<0>(commands.data(), indices.data(), memory, sharedMemory, numLaneVariables, numLanes, dropout);
+                break;
+        }
+    }
+    
+    template<Index Lanes>
+    inline void UnrolledBatchedKernel::process(const char *commands,
+                                               const Index *indices,
+                                               Value *memory,
+                                               const Value *sharedMemory,
+                                               Index numLaneVariables,
+                                               Index numLanes,
+                                               Value dropout)
+    {
+        const Index lanes = (Lanes != 0) ? Lanes : numLanes;
+        
+        const auto operand = [=](Index variable) -> Operand
+        {
+            if (variable < numLaneVariables)
+            {
+                return { memory + size_t(variable) * lanes, 1 };
+            }
+            
+            // never written to, so the constness is only cast away to keep a single Operand type
+            return { const_cast<Value *>(sharedMemory) + (variable - numLaneVariables), 0 };
+        };
+        
+        uint32_t c = 0; // command number
+        uint32_t i = 0; // index number
+        char command = 0;
+        
+        // Variables are either the same or don't overlap at all,
+        // and every lane only writes to its own slot, so it's safe to vectorize
+#define I(INDEX) (indices[i + INDEX])
+#define X(INDEX) (operand(indices[i + INDEX]))
+#define FOR_EACH_LANE _Pragma("GCC ivdep") for (Index l = 0; l < lanes; ++l)
+        
+        while (command != VMProgram::End)
+        {
+            switch (command = commands[c++])
+            {
+                case VMProgram::Zero:
+                {
+                    const Operand x0 = X(0);
+                    FOR_EACH_LANE { x0[l] = 0; }
+                    i += 1;
+                    break;
+                }
+                case VMProgram::Clip:
+                {
+                    const Operand x0 = X(0);
+                    FOR_EACH_LANE
+                    {
+                        x0[l] = std::max(Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD),
+                                         std::min(x0[l], Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD)));
+                    }
+                    i += 1;
+                    break;
+                }
+                
+                case VMProgram::ActivationSigmoid:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    for (Index l = 0; l < lanes; ++l) { x0[l] = (1.0 / (1.0 + exp(-x1[l]))); }
+                    i += 2;
+                    break;
+                }
+                case VMProgram::DropoutActivationSigmoid:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    for (Index l = 0; l < lanes; ++l) { x0[l] = Value(dropout) * (1.0 / (1.0 + exp(-x1[l]))); }
+                    i += 2;
+                    break;
+                }
+                case VMProgram::DerivativeSigmoid:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    FOR_EACH_LANE { x0[l] = x1[l] * (1.0 - x1[l]); }
+                    i += 2;
+                    break;
+                }
+                
+                case VMProgram::ActivationTanh:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    for (Index l = 0; l < lanes; ++l)
+                    {
+                        const Value eP = exp(x1[l]);
+                        const Value eN = 1.0 / eP;
+                        x0[l] = (eP - eN) / (eP + eN);
+                    }
+                    i += 2;
+                    break;
+                }
+                case VMProgram::DropoutActivationTanh:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    for (Index l = 0; l < lanes; ++l)
+                    {
+                        const Value eP = exp(x1[l]);
+                        const Value eN = 1.0 / eP;
+                        x0[l] = Value(dropout) * ((eP - eN) / (eP + eN));
+                    }
+                    i += 2;
+                    break;
+                }
+                case VMProgram::DerivativeTanh:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    FOR_EACH_LANE { x0[l] = 1.0 - (x1[l] * x1[l]); }
+                    i += 2;
+                    break;
+                }
+                
+                case VMProgram::ActivationLeakyReLU:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    FOR_EACH_LANE { x0[l] = x1[l] > 0.0 ? x1[l] : (0.01 * x1[l]); }
+                    i += 2;
+                    break;
+                }
+                case VMProgram::DropoutActivationLeakyReLU:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    FOR_EACH_LANE { x0[l] = Value(dropout) * (x1[l] > 0.0 ? x1[l] : (0.01 * x1[l])); }
+                    i += 2;
+                    break;
+                }
+                case VMProgram::DerivativeLeakyReLU:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    FOR_EACH_LANE { x0[l] = x1[l] > 0.0 ? 1.0 : 0.01; }
+                    i += 2;
+                    break;
+                }
+                
+                case VMProgram::AAP:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    FOR_EACH_LANE { x0[l] = x0[l] + x1[l] * x2[l]; }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::AAPP:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2), x3 = X(3);
+                    FOR_EACH_LANE { x0[l] = x0[l] + x1[l] * x2[l] * x3[l]; }
+                    i += 4;
+                    break;
+                }
+                case VMProgram::A:
+                {
+                    const Operand x0 = X(0), x1 = X(1);
+                    FOR_EACH_LANE { x0[l] = x1[l]; }
+                    i += 2;
+                    break;
+                }
+                case VMProgram::AS:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    FOR_EACH_LANE { x0[l] = x1[l] + x2[l]; }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::AD:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    FOR_EACH_LANE { x0[l] = x1[l] - x2[l]; }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::AP:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    FOR_EACH_LANE { x0[l] = x1[l] * x2[l]; }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::APP:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2), x3 = X(3);
+                    FOR_EACH_LANE { x0[l] = x1[l] * x2[l] * x3[l]; }
+                    i += 4;
+                    break;
+                }
+                case VMProgram::APS:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2), x3 = X(3);
+                    FOR_EACH_LANE { x0[l] = x1[l] * x2[l] + x3[l]; }
+                    i += 4;
+                    break;
+                }
+                case VMProgram::APSP:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2), x3 = X(3), x4 = X(4);
+                    FOR_EACH_LANE { x0[l] = x1[l] * x2[l] + x3[l] * x4[l]; }
+                    i += 5;
+                    break;
+                }
+                case VMProgram::APPS:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2), x3 = X(3), x4 = X(4);
+                    FOR_EACH_LANE { x0[l] = x1[l] * x2[l] * x3[l] + x4[l]; }
+                    i += 5;
+                    break;
+                }
+                case VMProgram::APPSP:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2), x3 = X(3), x4 = X(4), x5 = X(5);
+                    FOR_EACH_LANE { x0[l] = x1[l] * x2[l] * x3[l] + x4[l] * x5[l]; }
+                    i += 6;
+                    break;
+                }
+                case VMProgram::APPSPP:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2), x3 = X(3), x4 = X(4), x5 = X(5), x6 = X(6);
+                    FOR_EACH_LANE { x0[l] = x1[l] * x2[l] * x3[l] + x4[l] * x5[l] * x6[l]; }
+                    i += 7;
+                    break;
+                }
+                
+                case VMProgram::FeedState:
+                {
+                    const auto loopCount = I(0);
+                    const Operand state = X(1);
+                    i += 2;
+                    
+                    for (Index loop = 0; loop < loopCount; ++loop)
+                    {
+                        const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                        FOR_EACH_LANE { state[l] = state[l] + x0[l] * x1[l] * x2[l]; }
+                        i += 3;
+                    }
+                    
+                    break;
+                }
+                
+                case VMProgram::ActivationDerivativeSigmoid:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    for (Index l = 0; l < lanes; ++l)
+                    {
+                        x0[l] = (1.0 / (1.0 + exp(-x2[l])));
+                        x1[l] = x0[l] * (1.0 - x0[l]);
+                    }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::DropoutActivationDerivativeSigmoid:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    for (Index l = 0; l < lanes; ++l)
+                    {
+                        x0[l] = Value(dropout) * (1.0 / (1.0 + exp(-x2[l])));
+                        x1[l] = x0[l] * (1.0 - x0[l]);
+                    }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::ActivationDerivativeTanh:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    for (Index l = 0; l < lanes; ++l)
+                    {
+                        const Value eP = exp(x2[l]);
+                        const Value eN = 1.0 / eP;
+                        x0[l] = (eP - eN) / (eP + eN);
+                        x1[l] = 1.0 - (x0[l] * x0[l]);
+                    }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::DropoutActivationDerivativeTanh:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    for (Index l = 0; l < lanes; ++l)
+                    {
+                        const Value eP = exp(x2[l]);
+                        const Value eN = 1.0 / eP;
+                        x0[l] = Value(dropout) * ((eP - eN) / (eP + eN));
+                        x1[l] = 1.0 - (x0[l] * x0[l]);
+                    }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::ActivationDerivativeLeakyReLU:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    FOR_EACH_LANE
+                    {
+                        x0[l] = x2[l] > 0.0 ? x2[l] : (0.01 * x2[l]);
+                        x1[l] = x2[l] > 0.0 ? 1.0 : 0.01;
+                    }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::DropoutActivationDerivativeLeakyReLU:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    FOR_EACH_LANE
+                    {
+                        x0[l] = Value(dropout) * (x2[l] > 0.0 ? x2[l] : (0.01 * x2[l]));
+                        x1[l] = x2[l] > 0.0 ? 1.0 : 0.01;
+                    }
+                    i += 3;
+                    break;
+                }
+                case VMProgram::ClipAAP:
+                {
+                    const Operand x0 = X(0), x1 = X(1), x2 = X(2);
+                    FOR_EACH_LANE
+                    {
+                        x2[l] = std::max(Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD),
+                                         std::min(x2[l], Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD)));
+                        x0[l] = x0[l] + x1[l] * x2[l];
+                    }
+                    i += 3;
+                    break;
+                }
+                
+                // The lanes can't share a normalizer, so these just walk them one by one
+                case VMProgram::Softmax:
+                {
+                    for (Index l = 0; l < lanes; ++l) { VMProgram::softmax(memory + l, &I(0), lanes); }
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                }
+                case VMProgram::SoftmaxCrossEntropy:
+                {
+                    for (Index l = 0; l < lanes; ++l) { VMProgram::softmaxCrossEntropy(memory + l, &I(0), lanes); }
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                }
+                
+                // Every lane has its own active inputs; these only touch the per-lane variables,
+                // but the sparse feed also reads the shared weights, so it can't go through the single-stride helper
+                case VMProgram::GatherActiveInputs:
+                {
+                    for (Index l = 0; l < lanes; ++l) { VMProgram::gatherActiveInputs(memory + l, &I(0), lanes); }
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                }
+                case VMProgram::FeedStateSparse:
+                {
+                    const Index numInputs = I(0);
+                    const Operand count = X(1), state = X(2);
+                    const Index *inputs = &I(3);
+                    
+                    for (Index l = 0; l < lanes; ++l)
+                    {
+                        const Index numActive = std::min(Index(count[l]), numInputs);
+                        
+                        for (Index k = 0; k < numActive; ++k)
+                        {
+                            const Index input = Index(operand(inputs[k * 4])[l]);
+                            state[l] = state[l] +
+                                operand(inputs[input * 4 + 1])[l] *
+                                operand(inputs[input * 4 + 2])[l] *
+                                operand(inputs[input * 4 + 3])[l];
+                        }
+                    }
+                    
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                }
+                case VMProgram::TraceSparse:
+                {
+                    for (Index l = 0; l < lanes; ++l) { VMProgram::traceSparse(memory + l, &I(0), lanes); }
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                }
+                case VMProgram::TrainSparse:
+                case VMProgram::TrainSparseClipped:
+                {
+                    // the weights it adds to are the per-lane gradients here, see UnrolledKernelOptimizer::redirectAccumulations()
+                    const bool clipsGradients = (command == VMProgram::TrainSparseClipped);
+                    for (Index l = 0; l < lanes; ++l) { VMProgram::trainSparse(memory + l, &I(0), clipsGradients, lanes); }
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                }
+                
+                default:
+                    break;
+            }
+        }
+
+#undef I
+#undef X
+#undef FOR_EACH_LANE
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDBATCHEDKERNEL_H_INCLUDED
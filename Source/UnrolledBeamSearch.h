@@ -0,0 +1,181 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDBEAMSEARCH_H_INCLUDED
+#define TINYRNN_UNROLLEDBEAMSEARCH_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledNetwork.h"
+#include "UnrolledStateSnapshot.h"
+
+#include <cmath>
+
+namespace TinyRNN
+{
+    // Keeps the K most likely continuations of a sequence of symbols, for a network that takes
+    // the one-hot encoded symbols as inputs, and outputs the scores of the next symbol.
+    // The scores of each step are normalized to sum up to one, and taken as the probabilities.
+    //
+    // Each hypothesis keeps a snapshot of the network's state after its last symbol;
+    // the continuations of one hypothesis all share its snapshot, so a step costs
+    // one restore, one feed and one save per survivor, and never copies the weights.
+    class UnrolledBeamSearch final
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<UnrolledBeamSearch>;
+        using RawData = UnrolledTrainingContext::RawData;
+        
+        struct Hypothesis final
+        {
+            std::vector<Index> symbols;
+            double logProbability;
+            UnrolledStateSnapshot::Ptr state;   // after the last symbol is fed
+            RawData outputs;                    // the scores of the next symbol
+        };
+        
+        using Hypotheses = std::vector<Hypothesis>;
+    
+    public:
+        
+        UnrolledBeamSearch(UnrolledNetwork::Ptr targetNetwork, Index beamWidth);
+        
+        // Starts from the network's current state, feeds the first symbol, and extends the hypotheses
+        // numSteps times; returns them sorted from the most likely one, and puts the network's state back
+        // as it was. Returns nothing, if the network has different numbers of inputs and outputs.
+        Hypotheses search(Index firstSymbol, Index numSteps);
+    
+    private:
+        
+        struct Candidate final
+        {
+            size_t parent;
+            Index symbol;
+            double logProbability;
+        };
+        
+        UnrolledNetwork::Ptr network;
+        Index beamWidth;
+        
+        std::vector<Candidate> candidates;
+        RawData inputs;
+        
+        void feedSymbol(Index symbol, Hypothesis &hypothesis);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledBeamSearch);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledBeamSearch implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledBeamSearch::UnrolledBeamSearch(UnrolledNetwork::Ptr targetNetwork, Index targetBeamWidth) :
+    network(targetNetwork),
+    beamWidth(std::max(targetBeamWidth, Index(1)))
+    {
+    }
+    
+    inline UnrolledBeamSearch::Hypotheses UnrolledBeamSearch::search(Index firstSymbol, Index numSteps)
+    {
+        const size_t numSymbols = this->network->getContext()->getOutputVariables().size();
+        const size_t numInputs = this->network->getContext()->getInputVariables().size();
+        
+        if (numSymbols != numInputs || firstSymbol >= numSymbols)
+        {
+            return Hypotheses();
+        }
+        
+        this->inputs.assign(numSymbols, Value(0.0));
+        const auto initialState = this->network->saveState();
+        
+        Hypotheses beam(1);
+        beam.front().logProbability = 0.0;
+        this->feedSymbol(firstSymbol, beam.front());
+        
+        for (Index step = 0; step < numSteps; ++step)
+        {
+            this->candidates.clear();
+            
+            for (size_t h = 0; h < beam.size(); ++h)
+            {
+                const RawData &outputs = beam[h].outputs;
+                
+                // the scores are clamped, as the sigmoid outputs can get arbitrarily close to zero
+                const Value minScore = Value(1e-6);
+                double sum = 0.0;
+                for (const auto &score : outputs)
+                {
+                    sum += std::max(score, minScore);
+                }
+                
+                for (Index s = 0; s < numSymbols; ++s)
+                {
+                    const double probability = std::max(outputs[s], minScore) / sum;
+                    this->candidates.push_back({ h, s, beam[h].logProbability + std::log(probability) });
+                }
+            }
+            
+            const size_t numSurvivors = std::min(this->candidates.size(), size_t(this->beamWidth));
+            std::partial_sort(this->candidates.begin(),
+                              this->candidates.begin() + numSurvivors,
+                              this->candidates.end(),
+                              [](const Candidate &a, const Candidate &b)
+                              {
+                                  return a.logProbability > b.logProbability;
+                              });
+            
+            Hypotheses nextBeam(numSurvivors);
+            
+            for (size_t i = 0; i < numSurvivors; ++i)
+            {
+                const Candidate &candidate = this->candidates[i];
+                const Hypothesis &parent = beam[candidate.parent];
+                Hypothesis &child = nextBeam[i];
+                
+                child.symbols = parent.symbols;
+                child.logProbability = candidate.logProbability;
+                
+                this->network->restoreState(*parent.state);
+                this->feedSymbol(candidate.symbol, child);
+            }
+            
+            // the parents' snapshots go back to the pool here, unless the caller holds them
+            beam.swap(nextBeam);
+        }
+        
+        this->network->restoreState(*initialState);
+        return beam;
+    }
+    
+    inline void UnrolledBeamSearch::feedSymbol(Index symbol, Hypothesis &hypothesis)
+    {
+        this->inputs[symbol] = Value(1.0);
+        hypothesis.outputs.resize(this->inputs.size());
+        this->network->feed(this->inputs.data(), hypothesis.outputs.data());
+        this->inputs[symbol] = Value(0.0);
+        
+        hypothesis.symbols.push_back(symbol);
+        hypothesis.state = this->network->saveState();
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDBEAMSEARCH_H_INCLUDED
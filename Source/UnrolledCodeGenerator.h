@@ -0,0 +1,548 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDCODEGENERATOR_H_INCLUDED
+#define TINYRNN_UNROLLEDCODEGENERATOR_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledNeuron.h"
+#include "UnrolledTrainingContext.h"
+
+#include <cmath>
+#include <limits>
+#include <iomanip>
+#include <algorithm>
+#include <cctype>
+
+namespace TinyRNN
+{
+    // Turns the compiled kernels into a standalone C++ header,
+    // with one straight-line function per kernel, where all the operands are constant offsets;
+    // only the sparse input operations go through the tables of their operands, as their loops depend on the inputs.
+    // The expressions are exactly the ones vmProcess evaluates, so the generated code
+    // gives the same results, as long as it is built without floating-point contraction.
+    class UnrolledCodeGenerator final
+    {
+    public:
+        
+        static std::string generate(const std::string &namespaceName,
+                                    UnrolledTrainingContext::Ptr context,
+                                    const std::vector<char> &feedCommands,
+                                    const std::vector<Index> &feedIndices,
+                                    const std::vector<char> &trainCommands,
+                                    const std::vector<Index> &trainIndices);
+    
+    private:
+        
+        static void generateKernel(std::ostream &stream,
+                                   const std::string &functionName,
+                                   const std::vector<char> &commands,
+                                   const std::vector<Index> &indices);
+        
+        static void generateIndices(std::ostream &stream,
+                                    const std::string &name,
+                                    const UnrolledTrainingContext::Indices &indices);
+        
+        static void generateSparseHelpers(std::ostream &stream);
+        
+        static std::string literal(Value value);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledCodeGenerator);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledCodeGenerator implementation
+    //===------------------------------------------------------------------===//
+    
+    inline std::string UnrolledCodeGenerator::generate(const std::string &namespaceName,
+                                                       UnrolledTrainingContext::Ptr context,
+                                                       const std::vector<char> &feedCommands,
+                                                       const std::vector<Index> &feedIndices,
+                                                       const std::vector<char> &trainCommands,
+                                                       const std::vector<Index> &trainIndices)
+    {
+        std::ostringstream stream;
+        std::string guard = namespaceName + "_H_INCLUDED";
+        std::transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+        
+        const auto &memory = context->getMemory();
+        
+        stream << "// Generated by TinyRNN, do not edit" << std::endl;
+        stream << std::endl;
+        stream << "#ifndef " << guard << std::endl;
+        stream << "#define " << guard << std::endl;
+        stream << std::endl;
+        stream << "#include <math.h>" << std::endl;
+        stream << "#include <stddef.h>" << std::endl;
+        stream << "#include <algorithm>" << std::endl;
+        stream << "#include <limits>" << std::endl;
+        stream << std::endl;
+        stream << "namespace " << namespaceName << std::endl;
+        stream << "{" << std::endl;
+        stream << "    using Value = " << ((sizeof(Value) == sizeof(double)) ? "double" : "float") << ";" << std::endl;
+        stream << std::endl;
+        stream << "    constexpr size_t kMemorySize = " << memory.size() << ";" << std::endl;
+        stream << std::endl;
+        
+        generateIndices(stream, "Inputs", context->getInputVariables());
+        generateIndices(stream, "Outputs", context->getOutputVariables());
+        generateIndices(stream, "Targets", context->getTargetVariables());
+        
+        stream << "    constexpr size_t kRate = " << context->getRateVariable() << ";" << std::endl;
+        stream << std::endl;
+        
+        // The state of the network at the moment of export, weights included
+        stream << "    static const Value kInitialMemory[kMemorySize] =" << std::endl;
+        stream << "    {";
+        
+        for (size_t i = 0; i < memory.size(); ++i)
+        {
+            stream << ((i % 8 == 0) ? "\n        " : " ") << literal(memory[i]) << ",";
+        }
+        
+        stream << std::endl << "    };" << std::endl;
+        stream << std::endl;
+        
+        const bool usesSparseInputs =
+        (std::find(feedCommands.begin(), feedCommands.end(), VMProgram::GatherActiveInputs) != feedCommands.end());
+        
+        if (usesSparseInputs)
+        {
+            generateSparseHelpers(stream);
+        }
+        
+        generateKernel(stream, "feedKernel", feedCommands, feedIndices);
+        generateKernel(stream, "trainKernel", trainCommands, trainIndices);
+        
+        stream << "    inline void initialize(Value *x)" << std::endl;
+        stream << "    {" << std::endl;
+        stream << "        std::copy(kInitialMemory, kInitialMemory + kMemorySize, x);" << std::endl;
+        stream << "    }" << std::endl;
+        stream << std::endl;
+        
+        // Dropout factor is 0.5 at test time, and either 0 or 1 while training
+        stream << "    inline void feed(Value *x, const Value *inputs, Value *outputs, Value dropout = 0.5)" << std::endl;
+        stream << "    {" << std::endl;
+        stream << "        for (size_t i = 0; i < kNumInputs; ++i) { x[kInputs[i]] = inputs[i]; }" << std::endl;
+        stream << "        feedKernel(x, dropout);" << std::endl;
+        stream << "        for (size_t i = 0; i < kNumOutputs; ++i) { outputs[i] = x[kOutputs[i]]; }" << std::endl;
+        stream << "    }" << std::endl;
+        stream << std::endl;
+        stream << "    inline void train(Value *x, Value rate, const Value *targets)" << std::endl;
+        stream << "    {" << std::endl;
+        stream << "        for (size_t i = 0; i < kNumTargets; ++i) { x[kTargets[i]] = targets[i]; }" << std::endl;
+        stream << "        x[kRate] = rate;" << std::endl;
+        stream << "        trainKernel(x, 0.5);" << std::endl;
+        stream << "    }" << std::endl;
+        stream << "} // namespace " << namespaceName << std::endl;
+        stream << std::endl;
+        stream << "#endif // " << guard << std::endl;
+        
+        return stream.str();
+    }
+    
+    inline void UnrolledCodeGenerator::generateIndices(std::ostream &stream,
+                                                       const std::string &name,
+                                                       const UnrolledTrainingContext::Indices &indices)
+    {
+        stream << "    constexpr size_t kNum" << name << " = " << indices.size() << ";" << std::endl;
+        stream << "    constexpr size_t k" << name << "[] = {";
+        
+        for (size_t i = 0; i < indices.size(); ++i)
+        {
+            stream << ((i == 0) ? " " : ", ") << indices[i];
+        }
+        
+        // Zero-sized arrays are not allowed
+        stream << (indices.empty() ? " 0 };" : " };") << std::endl;
+        stream << std::endl;
+    }
+    
+    // The same loops as the VMProgram's ones, over the same operands
+    inline void UnrolledCodeGenerator::generateSparseHelpers(std::ostream &stream)
+    {
+        const std::string clipMin = literal(Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD));
+        const std::string clipMax = literal(Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD));
+        
+        stream << "    inline void gatherActiveInputs(Value *x, const size_t *o)" << std::endl;
+        stream << "    {" << std::endl;
+        stream << "        const size_t numPreviouslyActive = std::min(size_t(x[o[1]]), o[0]);" << std::endl;
+        stream << "        for (size_t k = 0; k < numPreviouslyActive; ++k) { x[o[3 + k * 3 + 2]] = x[o[3 + k * 3 + 1]]; }" << std::endl;
+        stream << "        x[o[2]] = Value(numPreviouslyActive);" << std::endl;
+        stream << "        size_t numActive = 0;" << std::endl;
+        stream << "        for (size_t i = 0; i < o[0]; ++i) { if (x[o[3 + i * 3]] != 0) { x[o[3 + (numActive++) * 3 + 1]] = Value(i); } }" << std::endl;
+        stream << "        x[o[1]] = Value(numActive);" << std::endl;
+        stream << "    }" << std::endl;
+        stream << std::endl;
+        
+        stream << "    inline void feedStateSparse(Value *x, const size_t *o)" << std::endl;
+        stream << "    {" << std::endl;
+        stream << "        const size_t numActive = std::min(size_t(x[o[1]]), o[0]);" << std::endl;
+        stream << "        const size_t *p = o + 3;" << std::endl;
+        stream << "        for (size_t k = 0; k < numActive; ++k)" << std::endl;
+        stream << "        {" << std::endl;
+        stream << "            const size_t i = size_t(x[p[k * 4]]);" << std::endl;
+        stream << "            x[o[2]] = x[o[2]] + x[p[i * 4 + 1]] * x[p[i * 4 + 2]] * x[p[i * 4 + 3]];" << std::endl;
+        stream << "        }" << std::endl;
+        stream << "    }" << std::endl;
+        stream << std::endl;
+        
+        stream << "    inline void traceSparse(Value *x, const size_t *o)" << std::endl;
+        stream << "    {" << std::endl;
+        stream << "        const size_t numActive = std::min(size_t(x[o[1]]), o[0]);" << std::endl;
+        stream << "        const size_t numPreviouslyActive = std::min(size_t(x[o[2]]), o[0]);" << std::endl;
+        stream << "        const size_t *p = o + 3;" << std::endl;
+        stream << "        for (size_t k = 0; k < numPreviouslyActive; ++k)" << std::endl;
+        stream << "        {" << std::endl;
+        stream << "            const size_t i = size_t(x[p[k * 5 + 1]]);" << std::endl;
+        stream << "            x[p[i * 5 + 2]] = x[p[i * 5 + 3]] * x[p[i * 5 + 4]];" << std::endl;
+        stream << "        }" << std::endl;
+        stream << "        for (size_t k = 0; k < numActive; ++k)" << std::endl;
+        stream << "        {" << std::endl;
+        stream << "            const size_t i = size_t(x[p[k * 5]]);" << std::endl;
+        stream << "            x[p[i * 5 + 2]] = x[p[i * 5 + 3]] * x[p[i * 5 + 4]];" << std::endl;
+        stream << "        }" << std::endl;
+        stream << "    }" << std::endl;
+        stream << std::endl;
+        
+        stream << "    inline void trainSparse(Value *x, const size_t *o, bool clipsGradients)" << std::endl;
+        stream << "    {" << std::endl;
+        stream << "        const size_t numActive = std::min(size_t(x[o[1]]), o[0]);" << std::endl;
+        stream << "        const Value rate = x[o[2]];" << std::endl;
+        stream << "        const Value responsibility = x[o[3]];" << std::endl;
+        stream << "        const size_t *p = o + 4;" << std::endl;
+        stream << "        for (size_t k = 0; k < numActive; ++k)" << std::endl;
+        stream << "        {" << std::endl;
+        stream << "            const size_t i = size_t(x[p[k * 3]]);" << std::endl;
+        stream << "            if (clipsGradients)" << std::endl;
+        stream << "            {" << std::endl;
+        stream << "                const Value gradient = std::max(Value(" << clipMin << "), std::min(Value(responsibility * x[p[i * 3 + 2]]), Value("
+               << clipMax << ")));" << std::endl;
+        stream << "                x[p[i * 3 + 1]] = x[p[i * 3 + 1]] + rate * gradient;" << std::endl;
+        stream << "            }" << std::endl;
+        stream << "            else" << std::endl;
+        stream << "            {" << std::endl;
+        stream << "                x[p[i * 3 + 1]] = x[p[i * 3 + 1]] + rate * responsibility * x[p[i * 3 + 2]];" << std::endl;
+        stream << "            }" << std::endl;
+        stream << "        }" << std::endl;
+        stream << "    }" << std::endl;
+        stream << std::endl;
+    }
+    
+    inline std::string UnrolledCodeGenerator::literal(Value value)
+    {
+        if (std::isnan(value))
+        {
+            return "std::numeric_limits<Value>::quiet_NaN()";
+        }
+        else if (std::isinf(value))
+        {
+            return (value > 0) ? "std::numeric_limits<Value>::infinity()" : "-std::numeric_limits<Value>::infinity()";
+        }
+        
+        std::ostringstream stream;
+        stream << std::setprecision(std::numeric_limits<Value>::max_digits10) << value;
+        
+        std::string result = stream.str();
+        
+        // Make sure it's a floating-point literal of the right type
+        if (result.find_first_of(".eE") == std::string::npos)
+        {
+            result += ".0";
+        }
+        
+        return (sizeof(Value) == sizeof(double)) ? result : (result + "f");
+    }
+    
+    inline void UnrolledCodeGenerator::generateKernel(std::ostream &stream,
+                                                      const std::string &functionName,
+                                                      const std::vector<char> &commands,
+                                                      const std::vector<Index> &indices)
+    {
+        stream << "    inline void " << functionName << "(Value *x, Value dropout)" << std::endl;
+        stream << "    {" << std::endl;
+        stream << "        (void)dropout;" << std::endl;
+        
+        const std::string clipMin = literal(Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD));
+        const std::string clipMax = literal(Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD));
+        
+        Index i = 0;
+
+#define X(INDEX) "x[" << indices[i + INDEX] << "]"
+        
+        for (const char command : commands)
+        {
+            if (command == VMProgram::End)
+            {
+                break;
+            }
+            
+            switch (command)
+            {
+                case VMProgram::Zero:
+                    stream << "        " << X(0) << " = 0;" << std::endl;
+                    i += 1;
+                    break;
+                case VMProgram::Clip:
+                    stream << "        " << X(0) << " = std::max(Value(" << clipMin << "), std::min("
+                           << X(0) << ", Value(" << clipMax << ")));" << std::endl;
+                    i += 1;
+                    break;
+                
+                case VMProgram::ActivationSigmoid:
+                    stream << "        " << X(0) << " = (1.0 / (1.0 + exp(-" << X(1) << ")));" << std::endl;
+                    i += 2;
+                    break;
+                case VMProgram::DropoutActivationSigmoid:
+                    stream << "        " << X(0) << " = Value(dropout) * (1.0 / (1.0 + exp(-" << X(1) << ")));" << std::endl;
+                    i += 2;
+                    break;
+                case VMProgram::DerivativeSigmoid:
+                    stream << "        " << X(0) << " = " << X(1) << " * (1.0 - " << X(1) << ");" << std::endl;
+                    i += 2;
+                    break;
+                
+                case VMProgram::ActivationTanh:
+                    stream << "        { const Value eP = exp(" << X(1) << "); const Value eN = 1.0 / eP; "
+                           << X(0) << " = (eP - eN) / (eP + eN); }" << std::endl;
+                    i += 2;
+                    break;
+                case VMProgram::DropoutActivationTanh:
+                    stream << "        { const Value eP = exp(" << X(1) << "); const Value eN = 1.0 / eP; "
+                           << X(0) << " = Value(dropout) * ((eP - eN) / (eP + eN)); }" << std::endl;
+                    i += 2;
+                    break;
+                case VMProgram::DerivativeTanh:
+                    stream << "        " << X(0) << " = 1.0 - (" << X(1) << " * " << X(1) << ");" << std::endl;
+                    i += 2;
+                    break;
+                
+                case VMProgram::ActivationLeakyReLU:
+                    stream << "        " << X(0) << " = " << X(1) << " > 0.0 ? " << X(1)
+                           << " : (0.01 * " << X(1) << ");" << std::endl;
+                    i += 2;
+                    break;
+                case VMProgram::DropoutActivationLeakyReLU:
+                    stream << "        " << X(0) << " = Value(dropout) * (" << X(1) << " > 0.0 ? " << X(1)
+                           << " : (0.01 * " << X(1) << "));" << std::endl;
+                    i += 2;
+                    break;
+                case VMProgram::DerivativeLeakyReLU:
+                    stream << "        " << X(0) << " = " << X(1) << " > 0.0 ? 1.0 : 0.01;" << std::endl;
+                    i += 2;
+                    break;
+                
+                case VMProgram::AAP:
+                    stream << "        " << X(0) << " = " << X(0) << " + " << X(1) << " * " << X(2) << ";" << std::endl;
+                    i += 3;
+                    break;
+                case VMProgram::AAPP:
+                    stream << "        " << X(0) << " = " << X(0) << " + " << X(1) << " * " << X(2)
+                           << " * " << X(3) << ";" << std::endl;
+                    i += 4;
+                    break;
+                case VMProgram::A:
+                    stream << "        " << X(0) << " = " << X(1) << ";" << std::endl;
+                    i += 2;
+                    break;
+                case VMProgram::AS:
+                    stream << "        " << X(0) << " = " << X(1) << " + " << X(2) << ";" << std::endl;
+                    i += 3;
+                    break;
+                case VMProgram::AD:
+                    stream << "        " << X(0) << " = " << X(1) << " - " << X(2) << ";" << std::endl;
+                    i += 3;
+                    break;
+                case VMProgram::AP:
+                    stream << "        " << X(0) << " = " << X(1) << " * " << X(2) << ";" << std::endl;
+                    i += 3;
+                    break;
+                case VMProgram::APP:
+                    stream << "        " << X(0) << " = " << X(1) << " * " << X(2) << " * " << X(3) << ";" << std::endl;
+                    i += 4;
+                    break;
+                case VMProgram::APS:
+                    stream << "        " << X(0) << " = " << X(1) << " * " << X(2) << " + " << X(3) << ";" << std::endl;
+                    i += 4;
+                    break;
+                case VMProgram::APSP:
+                    stream << "        " << X(0) << " = " << X(1) << " * " << X(2) << " + "
+                           << X(3) << " * " << X(4) << ";" << std::endl;
+                    i += 5;
+                    break;
+                case VMProgram::APPS:
+                    stream << "        " << X(0) << " = " << X(1) << " * " << X(2) << " * " << X(3)
+                           << " + " << X(4) << ";" << std::endl;
+                    i += 5;
+                    break;
+                case VMProgram::APPSP:
+                    stream << "        " << X(0) << " = " << X(1) << " * " << X(2) << " * " << X(3) << " + "
+                           << X(4) << " * " << X(5) << ";" << std::endl;
+                    i += 6;
+                    break;
+                case VMProgram::APPSPP:
+                    stream << "        " << X(0) << " = " << X(1) << " * " << X(2) << " * " << X(3) << " + "
+                           << X(4) << " * " << X(5) << " * " << X(6) << ";" << std::endl;
+                    i += 7;
+                    break;
+                
+                case VMProgram::FeedState:
+                {
+                    const Index loopCount = indices[i];
+                    const Index stateIndex = indices[i + 1];
+                    i += 2;
+                    
+                    for (Index loop = 0; loop < loopCount; ++loop)
+                    {
+                        stream << "        x[" << stateIndex << "] = x[" << stateIndex << "] + "
+                               << X(0) << " * " << X(1) << " * " << X(2) << ";" << std::endl;
+                        i += 3;
+                    }
+                    
+                    break;
+                }
+                
+                case VMProgram::ActivationDerivativeSigmoid:
+                case VMProgram::DropoutActivationDerivativeSigmoid:
+                    stream << "        " << X(0) << " = "
+                           << ((command == VMProgram::DropoutActivationDerivativeSigmoid) ? "Value(dropout) * " : "")
+                           << "(1.0 / (1.0 + exp(-" << X(2) << ")));" << std::endl;
+                    stream << "        " << X(1) << " = " << X(0) << " * (1.0 - " << X(0) << ");" << std::endl;
+                    i += 3;
+                    break;
+                case VMProgram::ActivationDerivativeTanh:
+                case VMProgram::DropoutActivationDerivativeTanh:
+                    stream << "        { const Value eP = exp(" << X(2) << "); const Value eN = 1.0 / eP; "
+                           << X(0) << " = "
+                           << ((command == VMProgram::DropoutActivationDerivativeTanh) ? "Value(dropout) * " : "")
+                           << "((eP - eN) / (eP + eN)); }" << std::endl;
+                    stream << "        " << X(1) << " = 1.0 - (" << X(0) << " * " << X(0) << ");" << std::endl;
+                    i += 3;
+                    break;
+                case VMProgram::ActivationDerivativeLeakyReLU:
+                case VMProgram::DropoutActivationDerivativeLeakyReLU:
+                    stream << "        " << X(0) << " = "
+                           << ((command == VMProgram::DropoutActivationDerivativeLeakyReLU) ? "Value(dropout) * " : "")
+                           << "(" << X(2) << " > 0.0 ? " << X(2) << " : (0.01 * " << X(2) << "));" << std::endl;
+                    stream << "        " << X(1) << " = " << X(2) << " > 0.0 ? 1.0 : 0.01;" << std::endl;
+                    i += 3;
+                    break;
+                case VMProgram::ClipAAP:
+                    stream << "        " << X(2) << " = std::max(Value(" << clipMin << "), std::min("
+                           << X(2) << ", Value(" << clipMax << ")));" << std::endl;
+                    stream << "        " << X(0) << " = " << X(0) << " + " << X(1) << " * " << X(2) << ";" << std::endl;
+                    i += 3;
+                    break;
+                
+                // Unrolled the same way as VMProgram::softmax and VMProgram::softmaxCrossEntropy
+                case VMProgram::Softmax:
+                {
+                    const Index numOutputs = indices[i];
+                    i += 1;
+                    
+                    stream << "        {" << std::endl;
+                    stream << "            Value maximum = -std::numeric_limits<Value>::max();" << std::endl;
+                    
+                    for (Index o = 0; o < numOutputs; ++o)
+                    {
+                        stream << "            maximum = std::max(maximum, " << X(o * 2 + 1) << ");" << std::endl;
+                    }
+                    
+                    stream << "            Value sum = 0;" << std::endl;
+                    
+                    for (Index o = 0; o < numOutputs; ++o)
+                    {
+                        stream << "            " << X(o * 2) << " = exp(" << X(o * 2 + 1) << " - maximum); "
+                               << "sum += " << X(o * 2) << ";" << std::endl;
+                    }
+                    
+                    for (Index o = 0; o < numOutputs; ++o)
+                    {
+                        stream << "            " << X(o * 2) << " = " << X(o * 2) << " / sum;" << std::endl;
+                    }
+                    
+                    stream << "        }" << std::endl;
+                    i += numOutputs * 2;
+                    break;
+                }
+                case VMProgram::SoftmaxCrossEntropy:
+                {
+                    const Index numOutputs = indices[i];
+                    const Index lossIndex = indices[i + 1];
+                    i += 2;
+                    
+                    for (Index o = 0; o < numOutputs; ++o)
+                    {
+                        stream << "        " << X(o * 3) << " = " << X(o * 3 + 1) << " - " << X(o * 3 + 2) << ";" << std::endl;
+                        stream << "        x[" << lossIndex << "] -= " << X(o * 3 + 1) << " * log(std::max("
+                               << X(o * 3 + 2) << ", std::numeric_limits<Value>::min()));" << std::endl;
+                    }
+                    
+                    i += numOutputs * 3;
+                    break;
+                }
+                
+                case VMProgram::GatherActiveInputs:
+                case VMProgram::FeedStateSparse:
+                case VMProgram::TraceSparse:
+                case VMProgram::TrainSparse:
+                case VMProgram::TrainSparseClipped:
+                {
+                    const Index numOperands = VMProgram::getNumOperands(command, indices.data() + i);
+                    
+                    stream << "        { static const size_t o[] = {";
+                    
+                    for (Index operand = 0; operand < numOperands; ++operand)
+                    {
+                        stream << ((operand == 0) ? " " : ", ") << indices[i + operand];
+                    }
+                    
+                    stream << " }; ";
+                    
+                    switch (command)
+                    {
+                        case VMProgram::GatherActiveInputs: stream << "gatherActiveInputs(x, o);"; break;
+                        case VMProgram::FeedStateSparse: stream << "feedStateSparse(x, o);"; break;
+                        case VMProgram::TraceSparse: stream << "traceSparse(x, o);"; break;
+                        case VMProgram::TrainSparse: stream << "trainSparse(x, o, false);"; break;
+                        default: stream << "trainSparse(x, o, true);"; break;
+                    }
+                    
+                    stream << " }" << std::endl;
+                    i += numOperands;
+                    break;
+                }
+                
+                default:
+                    break;
+            }
+        }
+
+#undef X
+        
+        stream << "    }" << std::endl;
+        stream << std::endl;
+    }
+
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDCODEGENERATOR_H_INCLUDED
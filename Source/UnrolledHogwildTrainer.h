@@ -0,0 +1,247 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDHOGWILDTRAINER_H_INCLUDED
+#define TINYRNN_UNROLLEDHOGWILDTRAINER_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledNetwork.h"
+#include "UnrolledThreadedKernel.h"
+#include "UnrolledKernelOptimizer.h"
+
+#include <thread>
+
+namespace TinyRNN
+{
+    // Trains one unrolled network on many threads at once, Hogwild-style.
+    //
+    // The memory is laid out as the weights and biases, shared by all the threads,
+    // followed by a private copy of all the other variables for each thread;
+    // each thread gets its own copy of the kernels, renumbered to point to its region.
+    // The shared weights are updated by all the threads without any locking,
+    // which is fine for the sparse enough updates, see Niu et al., 2011.
+    class UnrolledHogwildTrainer final
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<UnrolledHogwildTrainer>;
+        using RawData = UnrolledTrainingContext::RawData;
+        using Indices = UnrolledTrainingContext::Indices;
+        
+        using Step = std::pair<RawData, RawData>; // inputs and targets
+        using Sequence = std::vector<Step>;
+    
+    public:
+        
+        UnrolledHogwildTrainer(UnrolledNetwork::Ptr targetNetwork, Index numThreads);
+        
+        Index getNumThreads() const noexcept;
+        
+        // Thread i runs the sequences i, i + numThreads and so on, keeping its activations,
+        // states and traces between the calls; the weights are taken from the network before
+        // the threads start, and are written back when all of them are done
+        void train(Value rate, const std::vector<Sequence> &sequences);
+    
+    private:
+        
+        struct Worker final
+        {
+            using Ptr = std::shared_ptr<Worker>;
+            
+            Worker() : random(0) {}
+            
+            UnrolledThreadedKernel feedCode;
+            UnrolledThreadedKernel trainCode;
+            
+            Indices inputVariables;
+            Indices targetVariables;
+            Index rateVariable;
+            
+            Random random;
+            
+            TINYRNN_DISALLOW_COPY_AND_ASSIGN(Worker);
+        };
+        
+        UnrolledNetwork::Ptr network;
+        Indices sharedVariables;    // in the network's context memory
+        RawData memory;             // laid out as [shared variables][thread][private variables]
+        
+        std::vector<Worker::Ptr> workers;
+        
+        void run(Worker &worker, Value rate, const std::vector<Sequence> &sequences, size_t firstSequence);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledHogwildTrainer);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledHogwildTrainer implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledHogwildTrainer::UnrolledHogwildTrainer(UnrolledNetwork::Ptr targetNetwork, Index numThreads) :
+    network(targetNetwork)
+    {
+        UnrolledTrainingContext::Ptr context = this->network->getContext();
+        const RawData &contextMemory = context->getMemory();
+        const Index numVariables = Index(contextMemory.size());
+        
+        this->sharedVariables = context->getTrainableVariables();
+        const Index numShared = Index(this->sharedVariables.size());
+        
+        // Private regions are aligned to the cache lines, so that the threads don't write to the same ones
+        std::vector<bool> isShared(numVariables, false);
+        Indices privateVariables;
+        
+        for (const auto &v : this->sharedVariables)
+        {
+            isShared[v] = true;
+        }
+        
+        for (Index v = 0; v < numVariables; ++v)
+        {
+            if (! isShared[v])
+            {
+                privateVariables.push_back(v);
+            }
+        }
+        
+        const Index valuesPerLine = Index(64 / sizeof(Value));
+        const Index privateRegionSize = ((Index(privateVariables.size()) + valuesPerLine - 1) / valuesPerLine) * valuesPerLine;
+        const Index privateRegionsStart = ((numShared + valuesPerLine - 1) / valuesPerLine) * valuesPerLine;
+        
+        numThreads = std::max(numThreads, Index(1));
+        this->memory.assign(privateRegionsStart + size_t(privateRegionSize) * numThreads, 0.0);
+        
+        for (Index s = 0; s < numShared; ++s)
+        {
+            this->memory[s] = contextMemory[this->sharedVariables[s]];
+        }
+        
+        for (Index t = 0; t < numThreads; ++t)
+        {
+            const Index regionStart = privateRegionsStart + privateRegionSize * t;
+            Indices newIndices(numVariables, 0);
+            
+            for (Index s = 0; s < numShared; ++s)
+            {
+                newIndices[this->sharedVariables[s]] = s;
+            }
+            
+            for (Index p = 0; p < privateVariables.size(); ++p)
+            {
+                newIndices[privateVariables[p]] = regionStart + p;
+                this->memory[regionStart + p] = contextMemory[privateVariables[p]];
+            }
+            
+            Worker::Ptr worker(new Worker());
+            
+            std::vector<char> feedCommands = this->network->feedKernel->commands;
+            std::vector<Index> feedIndices = this->network->feedKernel->indices;
+            UnrolledKernelOptimizer::renumber(feedCommands, feedIndices, newIndices);
+            worker->feedCode.decode(feedCommands, feedIndices);
+            
+            std::vector<char> trainCommands = this->network->trainKernel->commands;
+            std::vector<Index> trainIndices = this->network->trainKernel->indices;
+            UnrolledKernelOptimizer::renumber(trainCommands, trainIndices, newIndices);
+            worker->trainCode.decode(trainCommands, trainIndices);
+            
+            for (const auto &v : context->getInputVariables())
+            {
+                worker->inputVariables.push_back(newIndices[v]);
+            }
+            
+            for (const auto &v : context->getTargetVariables())
+            {
+                worker->targetVariables.push_back(newIndices[v]);
+            }
+            
+            worker->rateVariable = newIndices[context->getRateVariable()];
+            worker->random.setSeed(this->network->random.next());
+            
+            this->workers.push_back(worker);
+        }
+    }
+    
+    inline Index UnrolledHogwildTrainer::getNumThreads() const noexcept
+    {
+        return Index(this->workers.size());
+    }
+    
+    inline void UnrolledHogwildTrainer::train(Value rate, const std::vector<Sequence> &sequences)
+    {
+        RawData &contextMemory = this->network->getContext()->getMemory();
+        
+        for (size_t s = 0; s < this->sharedVariables.size(); ++s)
+        {
+            this->memory[s] = contextMemory[this->sharedVariables[s]];
+        }
+        
+        std::vector<std::thread> threads;
+        
+        for (size_t t = 1; t < this->workers.size(); ++t)
+        {
+            threads.push_back(std::thread(&UnrolledHogwildTrainer::run, this,
+                                          std::ref(*this->workers[t]), rate, std::cref(sequences), t));
+        }
+        
+        this->run(*this->workers.front(), rate, sequences, 0);
+        
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        
+        for (size_t s = 0; s < this->sharedVariables.size(); ++s)
+        {
+            contextMemory[this->sharedVariables[s]] = this->memory[s];
+        }
+    }
+    
+    // Same as UnrolledNetwork::feed and train, with a dropout while training
+    inline void UnrolledHogwildTrainer::run(Worker &worker, Value rate,
+                                            const std::vector<Sequence> &sequences, size_t firstSequence)
+    {
+        Value *memory = this->memory.data();
+        
+        for (size_t s = firstSequence; s < sequences.size(); s += this->workers.size())
+        {
+            for (const auto &step : sequences[s])
+            {
+                for (size_t i = 0; i < worker.inputVariables.size(); ++i)
+                {
+                    memory[worker.inputVariables[i]] = step.first[i];
+                }
+                
+                worker.feedCode.run(memory, Value(worker.random.nextBool()));
+                
+                for (size_t i = 0; i < worker.targetVariables.size(); ++i)
+                {
+                    memory[worker.targetVariables[i]] = step.second[i];
+                }
+                
+                memory[worker.rateVariable] = rate;
+                worker.trainCode.run(memory, Value(worker.random.nextBool()));
+            }
+        }
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDHOGWILDTRAINER_H_INCLUDED
@@ -0,0 +1,813 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDJITKERNEL_H_INCLUDED
+#define TINYRNN_UNROLLEDJITKERNEL_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledNeuron.h"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define TINYRNN_HAS_JIT 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define TINYRNN_HAS_JIT 0
+#endif
+
+namespace TinyRNN
+{
+    // Translates the kernel bytecode into native x86-64 code.
+    //
+    // The memory base pointer lives in rbx, and every operand becomes
+    // a displacement off it, so there is no dispatch and no index lookups left.
+    // Arithmetic is emitted as scalar SSE2 in the same evaluation order as vmProcess,
+    // so the results are bit-exact with the interpreter (as long as the interpreter
+    // itself is built without floating-point contraction, which is the default on x86-64).
+    // Activations and derivatives are rare enough to just call the C++ helpers below,
+    // and so are the whole-layer softmax operations and the sparse input operations,
+    // which get their operands as they are.
+    //
+    // With fused ops enabled, and on a cpu with AVX2/FMA, all the multiply-adds are
+    // emitted as vfmadd231, which skips one rounding step per instruction:
+    // each fused result may differ from the interpreter by about one ulp,
+    // and those differences accumulate over training.
+    class UnrolledJitKernel final
+    {
+    public:
+        
+        UnrolledJitKernel();
+        ~UnrolledJitKernel();
+        
+        static bool isAvailable() noexcept;
+        static bool supportsFusedOps() noexcept;
+        
+        bool compile(const std::vector<char> &commands,
+                     const std::vector<Index> &indices,
+                     bool shouldUseFusedOps);
+        
+        bool isCompiled() const noexcept;
+        bool usesFusedOps() const noexcept;
+        
+        // Frees the compiled code, so that the next run compiles the kernel again
+        void release();
+        
+        void run(Value *memory, Value dropout) const;
+    
+    private:
+        
+        using Function = void (*)(Value *memory, Value dropout);
+        using Helper = void (*)(Value *target, const Value *source, Value dropout);
+        using LayerHelper = void (*)(Value *memory, const Index *operands);
+        
+        void *code;
+        size_t codeSize;
+        bool fusedOps;
+        
+        // The layer helpers point into this copy, so it lives as long as the code
+        std::vector<Index> operands;
+    
+    private:
+        
+        class Assembler final
+        {
+        public:
+            
+            explicit Assembler(bool shouldUseFusedOps);
+            
+            std::vector<unsigned char> bytes;
+            
+            void prologue();
+            void epilogue();
+            
+            void zero(Index variable);
+            void load(int xmm, Index variable);
+            void store(int xmm, Index variable);
+            void add(int xmm, Index variable);
+            void subtract(int xmm, Index variable);
+            void multiply(int xmm, Index variable);
+            void addRegister(int xmm, int source);
+            void clip(Index variable);
+            void call(Helper helper, Index target, Index source);
+            void call(LayerHelper helper, const Index *operands);
+            
+            // xmm += source * variable, either fused, or as two rounded ops (clobbers source)
+            void multiplyAdd(int xmm, int source, Index variable);
+        
+        private:
+            
+            // Stack frame layout, relative to rsp after the prologue
+            enum Frame
+            {
+                FrameDropout = 0,
+                FrameClipMax = 8,
+                FrameClipMin = 16,
+                FrameSize = 32
+            };
+            
+            bool fusedOps;
+            
+            void emit(unsigned char byte);
+            void emit32(uint32_t value);
+            void emit64(uint64_t value);
+            void emitMemoryOperand(int reg, Index variable);
+            void emitScalar(unsigned char opcode, int xmm, Index variable);
+            void emitScalarToStack(unsigned char opcode, int xmm, unsigned char offset);
+            
+            TINYRNN_DISALLOW_COPY_AND_ASSIGN(Assembler);
+        };
+    
+    private:
+        
+        static void activationSigmoid(Value *target, const Value *source, Value dropout);
+        static void derivativeSigmoid(Value *target, const Value *source, Value dropout);
+        static void dropoutActivationSigmoid(Value *target, const Value *source, Value dropout);
+        static void activationTanh(Value *target, const Value *source, Value dropout);
+        static void derivativeTanh(Value *target, const Value *source, Value dropout);
+        static void dropoutActivationTanh(Value *target, const Value *source, Value dropout);
+        static void activationLeakyReLU(Value *target, const Value *source, Value dropout);
+        static void derivativeLeakyReLU(Value *target, const Value *source, Value dropout);
+        static void dropoutActivationLeakyReLU(Value *target, const Value *source, Value dropout);
+        static void softmax(Value *memory, const Index *operands);
+        static void softmaxCrossEntropy(Value *memory, const Index *operands);
+        static void gatherActiveInputs(Value *memory, const Index *operands);
+        static void feedStateSparse(Value *memory, const Index *operands);
+        static void traceSparse(Value *memory, const Index *operands);
+        static void trainSparse(Value *memory, const Index *operands);
+        static void trainSparseClipped(Value *memory, const Index *operands);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledJitKernel);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledJitKernel implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledJitKernel::UnrolledJitKernel() :
+    code(nullptr),
+    codeSize(0),
+    fusedOps(false)
+    {
+    }
+    
+    inline UnrolledJitKernel::~UnrolledJitKernel()
+    {
+        this->release();
+    }
+    
+    inline bool UnrolledJitKernel::isAvailable() noexcept
+    {
+        return (TINYRNN_HAS_JIT != 0);
+    }
+    
+    inline bool UnrolledJitKernel::supportsFusedOps() noexcept
+    {
+#if TINYRNN_HAS_JIT
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#else
+        return false;
+#endif
+    }
+    
+    inline bool UnrolledJitKernel::isCompiled() const noexcept
+    {
+        return (this->code != nullptr);
+    }
+    
+    inline bool UnrolledJitKernel::usesFusedOps() const noexcept
+    {
+        return this->fusedOps;
+    }
+    
+    inline void UnrolledJitKernel::run(Value *memory, Value dropout) const
+    {
+        reinterpret_cast<Function>(this->code)(memory, dropout);
+    }
+    
+    inline void UnrolledJitKernel::release()
+    {
+#if TINYRNN_HAS_JIT
+        if (this->code != nullptr)
+        {
+            munmap(this->code, this->codeSize);
+        }
+#endif
+        
+        this->code = nullptr;
+        this->codeSize = 0;
+        this->operands.clear();
+    }
+    
+    inline bool UnrolledJitKernel::compile(const std::vector<char> &commands,
+                                           const std::vector<Index> &indices,
+                                           bool shouldUseFusedOps)
+    {
+        this->release();
+        this->fusedOps = shouldUseFusedOps && UnrolledJitKernel::supportsFusedOps();
+
+#if TINYRNN_HAS_JIT
+        
+        // All displacements are 32-bit
+        for (const Index index : indices)
+        {
+            if (index > (INT32_MAX / sizeof(Value)))
+            {
+                return false;
+            }
+        }
+        
+        this->operands = indices;
+        
+        Assembler assembler(this->fusedOps);
+        assembler.prologue();
+        
+        Index i = 0;
+
+#define I(INDEX) (indices[i + INDEX])
+        
+        for (const char command : commands)
+        {
+            if (command == VMProgram::End)
+            {
+                break;
+            }
+            
+            switch (command)
+            {
+                case VMProgram::Zero:
+                    assembler.zero(I(0));
+                    i += 1;
+                    break;
+                case VMProgram::Clip:
+                    assembler.clip(I(0));
+                    i += 1;
+                    break;
+                
+                case VMProgram::ActivationSigmoid:
+                    assembler.call(&UnrolledJitKernel::activationSigmoid, I(0), I(1));
+                    i += 2;
+                    break;
+                case VMProgram::DerivativeSigmoid:
+                    assembler.call(&UnrolledJitKernel::derivativeSigmoid, I(0), I(1));
+                    i += 2;
+                    break;
+                case VMProgram::DropoutActivationSigmoid:
+                    assembler.call(&UnrolledJitKernel::dropoutActivationSigmoid, I(0), I(1));
+                    i += 2;
+                    break;
+                case VMProgram::ActivationTanh:
+                    assembler.call(&UnrolledJitKernel::activationTanh, I(0), I(1));
+                    i += 2;
+                    break;
+                case VMProgram::DerivativeTanh:
+                    assembler.call(&UnrolledJitKernel::derivativeTanh, I(0), I(1));
+                    i += 2;
+                    break;
+                case VMProgram::DropoutActivationTanh:
+                    assembler.call(&UnrolledJitKernel::dropoutActivationTanh, I(0), I(1));
+                    i += 2;
+                    break;
+                case VMProgram::ActivationLeakyReLU:
+                    assembler.call(&UnrolledJitKernel::activationLeakyReLU, I(0), I(1));
+                    i += 2;
+                    break;
+                case VMProgram::DerivativeLeakyReLU:
+                    assembler.call(&UnrolledJitKernel::derivativeLeakyReLU, I(0), I(1));
+                    i += 2;
+                    break;
+                case VMProgram::DropoutActivationLeakyReLU:
+                    assembler.call(&UnrolledJitKernel::dropoutActivationLeakyReLU, I(0), I(1));
+                    i += 2;
+                    break;
+                
+                case VMProgram::AAP:
+                    assembler.load(0, I(0));
+                    assembler.load(1, I(1));
+                    assembler.multiplyAdd(0, 1, I(2));
+                    assembler.store(0, I(0));
+                    i += 3;
+                    break;
+                case VMProgram::AAPP:
+                    assembler.load(1, I(1));
+                    assembler.multiply(1, I(2));
+                    assembler.load(0, I(0));
+                    assembler.multiplyAdd(0, 1, I(3));
+                    assembler.store(0, I(0));
+                    i += 4;
+                    break;
+                case VMProgram::A:
+                    assembler.load(0, I(1));
+                    assembler.store(0, I(0));
+                    i += 2;
+                    break;
+                case VMProgram::AS:
+                    assembler.load(0, I(1));
+                    assembler.add(0, I(2));
+                    assembler.store(0, I(0));
+                    i += 3;
+                    break;
+                case VMProgram::AD:
+                    assembler.load(0, I(1));
+                    assembler.subtract(0, I(2));
+                    assembler.store(0, I(0));
+                    i += 3;
+                    break;
+                case VMProgram::AP:
+                    assembler.load(0, I(1));
+                    assembler.multiply(0, I(2));
+                    assembler.store(0, I(0));
+                    i += 3;
+                    break;
+                case VMProgram::APP:
+                    assembler.load(0, I(1));
+                    assembler.multiply(0, I(2));
+                    assembler.multiply(0, I(3));
+                    assembler.store(0, I(0));
+                    i += 4;
+                    break;
+                case VMProgram::APS:
+                    assembler.load(0, I(3));
+                    assembler.load(1, I(1));
+                    assembler.multiplyAdd(0, 1, I(2));
+                    assembler.store(0, I(0));
+                    i += 4;
+                    break;
+                case VMProgram::APSP:
+                    assembler.load(0, I(1));
+                    assembler.multiply(0, I(2));
+                    assembler.load(1, I(3));
+                    assembler.multiplyAdd(0, 1, I(4));
+                    assembler.store(0, I(0));
+                    i += 5;
+                    break;
+                case VMProgram::APPS:
+                    assembler.load(1, I(1));
+                    assembler.multiply(1, I(2));
+                    assembler.load(0, I(4));
+                    assembler.multiplyAdd(0, 1, I(3));
+                    assembler.store(0, I(0));
+                    i += 5;
+                    break;
+                case VMProgram::APPSP:
+                    assembler.load(0, I(1));
+                    assembler.multiply(0, I(2));
+                    assembler.multiply(0, I(3));
+                    assembler.load(1, I(4));
+                    assembler.multiplyAdd(0, 1, I(5));
+                    assembler.store(0, I(0));
+                    i += 6;
+                    break;
+                case VMProgram::APPSPP:
+                    assembler.load(0, I(1));
+                    assembler.multiply(0, I(2));
+                    assembler.multiply(0, I(3));
+                    assembler.load(1, I(4));
+                    assembler.multiply(1, I(5));
+                    assembler.multiplyAdd(0, 1, I(6));
+                    assembler.store(0, I(0));
+                    i += 7;
+                    break;
+                
+                case VMProgram::FeedState:
+                {
+                    const Index loopCount = I(0);
+                    const Index stateIndex = I(1);
+                    i += 2;
+                    
+                    // The state stays in xmm0 for the whole loop
+                    assembler.load(0, stateIndex);
+                    
+                    for (Index loop = 0; loop < loopCount; ++loop)
+                    {
+                        assembler.load(1, I(0));
+                        assembler.multiply(1, I(1));
+                        assembler.multiplyAdd(0, 1, I(2));
+                        i += 3;
+                    }
+                    
+                    assembler.store(0, stateIndex);
+                    break;
+                }
+                
+                // Superinstructions only save dispatches in the other modes,
+                // so here they are simply split back into their parts
+                case VMProgram::ActivationDerivativeSigmoid:
+                    assembler.call(&UnrolledJitKernel::activationSigmoid, I(0), I(2));
+                    assembler.call(&UnrolledJitKernel::derivativeSigmoid, I(1), I(0));
+                    i += 3;
+                    break;
+                case VMProgram::DropoutActivationDerivativeSigmoid:
+                    assembler.call(&UnrolledJitKernel::dropoutActivationSigmoid, I(0), I(2));
+                    assembler.call(&UnrolledJitKernel::derivativeSigmoid, I(1), I(0));
+                    i += 3;
+                    break;
+                case VMProgram::ActivationDerivativeTanh:
+                    assembler.call(&UnrolledJitKernel::activationTanh, I(0), I(2));
+                    assembler.call(&UnrolledJitKernel::derivativeTanh, I(1), I(0));
+                    i += 3;
+                    break;
+                case VMProgram::DropoutActivationDerivativeTanh:
+                    assembler.call(&UnrolledJitKernel::dropoutActivationTanh, I(0), I(2));
+                    assembler.call(&UnrolledJitKernel::derivativeTanh, I(1), I(0));
+                    i += 3;
+                    break;
+                case VMProgram::ActivationDerivativeLeakyReLU:
+                    assembler.call(&UnrolledJitKernel::activationLeakyReLU, I(0), I(2));
+                    assembler.call(&UnrolledJitKernel::derivativeLeakyReLU, I(1), I(2));
+                    i += 3;
+                    break;
+                case VMProgram::DropoutActivationDerivativeLeakyReLU:
+                    assembler.call(&UnrolledJitKernel::dropoutActivationLeakyReLU, I(0), I(2));
+                    assembler.call(&UnrolledJitKernel::derivativeLeakyReLU, I(1), I(2));
+                    i += 3;
+                    break;
+                case VMProgram::ClipAAP:
+                    assembler.clip(I(2));
+                    assembler.load(0, I(0));
+                    assembler.load(1, I(1));
+                    assembler.multiplyAdd(0, 1, I(2));
+                    assembler.store(0, I(0));
+                    i += 3;
+                    break;
+                
+                case VMProgram::Softmax:
+                    assembler.call(&UnrolledJitKernel::softmax, this->operands.data() + i);
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                case VMProgram::SoftmaxCrossEntropy:
+                    assembler.call(&UnrolledJitKernel::softmaxCrossEntropy, this->operands.data() + i);
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                
+                case VMProgram::GatherActiveInputs:
+                    assembler.call(&UnrolledJitKernel::gatherActiveInputs, this->operands.data() + i);
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                case VMProgram::FeedStateSparse:
+                    assembler.call(&UnrolledJitKernel::feedStateSparse, this->operands.data() + i);
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                case VMProgram::TraceSparse:
+                    assembler.call(&UnrolledJitKernel::traceSparse, this->operands.data() + i);
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                case VMProgram::TrainSparse:
+                    assembler.call(&UnrolledJitKernel::trainSparse, this->operands.data() + i);
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                case VMProgram::TrainSparseClipped:
+                    assembler.call(&UnrolledJitKernel::trainSparseClipped, this->operands.data() + i);
+                    i += VMProgram::getNumOperands(command, &I(0));
+                    break;
+                
+                default:
+                    break;
+            }
+        }
+
+#undef I
+        
+        assembler.epilogue();
+        
+        const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+        const size_t size = ((assembler.bytes.size() + pageSize - 1) / pageSize) * pageSize;
+        
+        void *buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        
+        if (buffer == MAP_FAILED)
+        {
+            return false;
+        }
+        
+        std::memcpy(buffer, assembler.bytes.data(), assembler.bytes.size());
+        
+        if (mprotect(buffer, size, PROT_READ | PROT_EXEC) != 0)
+        {
+            munmap(buffer, size);
+            return false;
+        }
+        
+        this->code = buffer;
+        this->codeSize = size;
+        return true;
+
+#else
+        (void)commands;
+        (void)indices;
+        return false;
+#endif
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Helpers, these are the same expressions as in vmProcess
+    //===------------------------------------------------------------------===//
+    
+    inline void UnrolledJitKernel::activationSigmoid(Value *target, const Value *source, Value)
+    {
+        *target = (1.0 / (1.0 + exp(-*source)));
+    }
+    
+    inline void UnrolledJitKernel::dropoutActivationSigmoid(Value *target, const Value *source, Value dropout)
+    {
+        *target = Value(dropout) * (1.0 / (1.0 + exp(-*source)));
+    }
+    
+    inline void UnrolledJitKernel::derivativeSigmoid(Value *target, const Value *source, Value)
+    {
+        *target = *source * (1.0 - *source);
+    }
+    
+    inline void UnrolledJitKernel::activationTanh(Value *target, const Value *source, Value)
+    {
+        const Value eP = exp(*source);
+        const Value eN = 1.0 / eP;
+        *target = (eP - eN) / (eP + eN);
+    }
+    
+    inline void UnrolledJitKernel::dropoutActivationTanh(Value *target, const Value *source, Value dropout)
+    {
+        const Value eP = exp(*source);
+        const Value eN = 1.0 / eP;
+        *target = Value(dropout) * ((eP - eN) / (eP + eN));
+    }
+    
+    inline void UnrolledJitKernel::derivativeTanh(Value *target, const Value *source, Value)
+    {
+        *target = 1.0 - (*source * *source);
+    }
+    
+    inline void UnrolledJitKernel::activationLeakyReLU(Value *target, const Value *source, Value)
+    {
+        *target = *source > 0.0 ? *source : (0.01 * *source);
+    }
+    
+    inline void UnrolledJitKernel::dropoutActivationLeakyReLU(Value *target, const Value *source, Value dropout)
+    {
+        *target = Value(dropout) * (*source > 0.0 ? *source : (0.01 * *source));
+    }
+    
+    inline void UnrolledJitKernel::derivativeLeakyReLU(Value *target, const Value *source, Value)
+    {
+        *target = *source > 0.0 ? 1.0 : 0.01;
+    }
+    
+    inline void UnrolledJitKernel::softmax(Value *memory, const Index *operands)
+    {
+        VMProgram::softmax(memory, operands);
+    }
+    
+    inline void UnrolledJitKernel::softmaxCrossEntropy(Value *memory, const Index *operands)
+    {
+        VMProgram::softmaxCrossEntropy(memory, operands);
+    }
+    
+    inline void UnrolledJitKernel::gatherActiveInputs(Value *memory, const Index *operands)
+    {
+        VMProgram::gatherActiveInputs(memory, operands);
+    }
+    
+    inline void UnrolledJitKernel::feedStateSparse(Value *memory, const Index *operands)
+    {
+        VMProgram::feedStateSparse(memory, operands);
+    }
+    
+    inline void UnrolledJitKernel::traceSparse(Value *memory, const Index *operands)
+    {
+        VMProgram::traceSparse(memory, operands);
+    }
+    
+    inline void UnrolledJitKernel::trainSparse(Value *memory, const Index *operands)
+    {
+        VMProgram::trainSparse(memory, operands, false);
+    }
+    
+    inline void UnrolledJitKernel::trainSparseClipped(Value *memory, const Index *operands)
+    {
+        VMProgram::trainSparse(memory, operands, true);
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Assembler
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledJitKernel::Assembler::Assembler(bool shouldUseFusedOps) :
+    fusedOps(shouldUseFusedOps)
+    {
+    }
+    
+    inline void UnrolledJitKernel::Assembler::emit(unsigned char byte)
+    {
+        this->bytes.push_back(byte);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::emit32(uint32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            this->emit(static_cast<unsigned char>(value >> (i * 8)));
+        }
+    }
+    
+    inline void UnrolledJitKernel::Assembler::emit64(uint64_t value)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            this->emit(static_cast<unsigned char>(value >> (i * 8)));
+        }
+    }
+    
+    // ModRM for [rbx + disp], with disp8 whenever it fits
+    inline void UnrolledJitKernel::Assembler::emitMemoryOperand(int reg, Index variable)
+    {
+        const uint32_t displacement = variable * sizeof(Value);
+        
+        if (displacement < 128)
+        {
+            this->emit(0x43 | (reg << 3));
+            this->emit(static_cast<unsigned char>(displacement));
+        }
+        else
+        {
+            this->emit(0x83 | (reg << 3));
+            this->emit32(displacement);
+        }
+    }
+    
+    // movss/addss/etc xmm, [rbx + disp]; F2 prefix selects the double precision versions
+    inline void UnrolledJitKernel::Assembler::emitScalar(unsigned char opcode, int xmm, Index variable)
+    {
+        this->emit((sizeof(Value) == sizeof(double)) ? 0xF2 : 0xF3);
+        this->emit(0x0F);
+        this->emit(opcode);
+        this->emitMemoryOperand(xmm, variable);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::emitScalarToStack(unsigned char opcode, int xmm, unsigned char offset)
+    {
+        this->emit((sizeof(Value) == sizeof(double)) ? 0xF2 : 0xF3);
+        this->emit(0x0F);
+        this->emit(opcode);
+        this->emit(0x44 | (xmm << 3)); // [rsp + disp8]
+        this->emit(0x24);
+        this->emit(offset);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::prologue()
+    {
+        this->emit(0x53);                                       // push rbx
+        this->emit(0x48); this->emit(0x89); this->emit(0xFB);   // mov rbx, rdi
+        this->emit(0x48); this->emit(0x83); this->emit(0xEC);   // sub rsp, FrameSize
+        this->emit(FrameSize);
+        
+        this->emitScalarToStack(0x11, 0, FrameDropout);      // movss [rsp], xmm0
+        
+        const Value clipBounds[] =
+        {
+            Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD),
+            Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD)
+        };
+        
+        const unsigned char clipOffsets[] = { FrameClipMax, FrameClipMin };
+        
+        for (int i = 0; i < 2; ++i)
+        {
+            uint64_t bits = 0;
+            std::memcpy(&bits, &clipBounds[i], sizeof(Value));
+            this->emit(0x48); this->emit(0xB8); this->emit64(bits);                 // mov rax, imm64
+            this->emit(0x48); this->emit(0x89); this->emit(0x44); this->emit(0x24); // mov [rsp + disp8], rax
+            this->emit(clipOffsets[i]);
+        }
+    }
+    
+    inline void UnrolledJitKernel::Assembler::epilogue()
+    {
+        this->emit(0x48); this->emit(0x83); this->emit(0xC4);   // add rsp, FrameSize
+        this->emit(FrameSize);
+        this->emit(0x5B);                                       // pop rbx
+        this->emit(0xC3);                                       // ret
+    }
+    
+    inline void UnrolledJitKernel::Assembler::zero(Index variable)
+    {
+        if (sizeof(Value) == sizeof(double))
+        {
+            this->emit(0x48);
+        }
+        
+        this->emit(0xC7);                                       // mov [rbx + disp], imm32
+        this->emitMemoryOperand(0, variable);
+        this->emit32(0);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::load(int xmm, Index variable)
+    {
+        this->emitScalar(0x10, xmm, variable);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::store(int xmm, Index variable)
+    {
+        this->emitScalar(0x11, xmm, variable);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::add(int xmm, Index variable)
+    {
+        this->emitScalar(0x58, xmm, variable);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::multiply(int xmm, Index variable)
+    {
+        this->emitScalar(0x59, xmm, variable);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::subtract(int xmm, Index variable)
+    {
+        this->emitScalar(0x5C, xmm, variable);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::addRegister(int xmm, int source)
+    {
+        this->emit((sizeof(Value) == sizeof(double)) ? 0xF2 : 0xF3);
+        this->emit(0x0F);
+        this->emit(0x58);
+        this->emit(0xC0 | (xmm << 3) | source);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::multiplyAdd(int xmm, int source, Index variable)
+    {
+        if (this->fusedOps)
+        {
+            // vfmadd231ss/sd xmm, source, [rbx + disp]
+            this->emit(0xC4);
+            this->emit(0xE2);
+            this->emit(((sizeof(Value) == sizeof(double)) ? 0x80 : 0x00) | ((~source & 0x0F) << 3) | 0x01);
+            this->emit(0xB9);
+            this->emitMemoryOperand(xmm, variable);
+            return;
+        }
+        
+        // The product has to be rounded on its own, and then added,
+        // and addition is commutative, so it doesn't matter which side xmm is
+        this->multiply(source, variable);
+        this->addRegister(xmm, source);
+    }
+    
+    // std::max(min, std::min(x, max)) is exactly maxss(minss(max, x), min),
+    // including the NaN cases
+    inline void UnrolledJitKernel::Assembler::clip(Index variable)
+    {
+        this->emitScalarToStack(0x10, 0, FrameClipMax);      // movss xmm0, [rsp + max]
+        this->emitScalar(0x5D, 0, variable);                    // minss xmm0, [rbx + disp]
+        this->emitScalarToStack(0x5F, 0, FrameClipMin);      // maxss xmm0, [rsp + min]
+        this->store(0, variable);
+    }
+    
+    inline void UnrolledJitKernel::Assembler::call(Helper helper, Index target, Index source)
+    {
+        this->emit(0x48); this->emit(0x8D);                     // lea rdi, [rbx + disp]
+        this->emitMemoryOperand(7, target);
+        this->emit(0x48); this->emit(0x8D);                     // lea rsi, [rbx + disp]
+        this->emitMemoryOperand(6, source);
+        this->emitScalarToStack(0x10, 0, FrameDropout);      // movss xmm0, [rsp]
+        
+        uint64_t address = 0;
+        std::memcpy(&address, &helper, sizeof(helper));
+        this->emit(0x48); this->emit(0xB8); this->emit64(address); // mov rax, imm64
+        this->emit(0xFF); this->emit(0xD0);                     // call rax
+    }
+    
+    inline void UnrolledJitKernel::Assembler::call(LayerHelper helper, const Index *operands)
+    {
+        this->emit(0x48); this->emit(0x89); this->emit(0xDF);   // mov rdi, rbx
+        
+        uint64_t operandsAddress = 0;
+        std::memcpy(&operandsAddress, &operands, sizeof(operands));
+        this->emit(0x48); this->emit(0xBE); this->emit64(operandsAddress); // mov rsi, imm64
+        
+        uint64_t address = 0;
+        std::memcpy(&address, &helper, sizeof(helper));
+        this->emit(0x48); this->emit(0xB8); this->emit64(address); // mov rax, imm64
+        this->emit(0xFF); this->emit(0xD0);                     // call rax
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDJITKERNEL_H_INCLUDED
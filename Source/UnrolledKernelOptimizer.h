@@ -0,0 +1,963 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDKERNELOPTIMIZER_H_INCLUDED
+#define TINYRNN_UNROLLEDKERNELOPTIMIZER_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledNeuron.h"
+#include "UnrolledTrainingContext.h"
+
+#include <unordered_set>
+#include <limits>
+
+namespace TinyRNN
+{
+    // Runs a pipeline of passes over the feed and the train kernels,
+    // right after they are compiled from the neurons' chunks.
+    // The kernels are decoded into separate instructions first,
+    // so that the passes can freely remove and rewrite them.
+    class UnrolledKernelOptimizer final
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<UnrolledKernelOptimizer>;
+        using Indices = UnrolledTrainingContext::Indices;
+        
+        struct Instruction final
+        {
+            char operation;
+            Indices operands;   // FeedState and the whole-layer operations keep their counts here as well
+            Index chunk;        // the neuron chunk it came from, fused instructions take the first one's
+        };
+        
+        using Program = std::vector<Instruction>;
+        
+        class Pass
+        {
+        public:
+            
+            using Ptr = std::shared_ptr<Pass>;
+            
+            virtual ~Pass() {}
+            virtual std::string getName() const = 0;
+            
+            // Returns the number of the instructions removed
+            virtual Index run(Program &feedProgram,
+                              Program &trainProgram,
+                              const Indices &outputVariables) const = 0;
+        };
+        
+        // Pass names with the number of the instructions each of them has removed
+        using Report = std::vector<std::pair<std::string, Index>>;
+    
+    public:
+        
+        // Creates the default pipeline
+        UnrolledKernelOptimizer();
+        
+        void clearPasses();
+        void addPass(Pass::Ptr pass);
+        
+        // Chunk sizes are the numbers of instructions each neuron has put into a kernel, in the kernel order;
+        // they are updated along with the kernels, so that UnrolledParallelKernel can still tell the neurons apart
+        Report run(std::vector<char> &feedCommands,
+                   std::vector<Index> &feedIndices,
+                   Indices &feedChunkSizes,
+                   std::vector<char> &trainCommands,
+                   std::vector<Index> &trainIndices,
+                   Indices &trainChunkSizes,
+                   const Indices &outputVariables) const;
+    
+    public:
+        
+        // All the instructions are put into the chunk 0
+        static Program decode(const std::vector<char> &commands,
+                              const std::vector<Index> &indices);
+        
+        static void encode(const Program &program,
+                           std::vector<char> &commands,
+                           std::vector<Index> &indices);
+        
+        // Chunks that don't add up to the program size are ignored
+        static void setChunkSizes(Program &program, const Indices &chunkSizes);
+        static Indices getChunkSizes(const Program &program, size_t numChunks);
+        
+        // Positions of the operands an instruction writes to, and of the operands it reads,
+        // the latter include the destinations of the accumulating operations like AAP
+        static void getOperandRoles(const Instruction &instruction,
+                                    std::vector<size_t> &writes,
+                                    std::vector<size_t> &reads);
+        
+        // Maps each variable to a new index, so that the variables are laid out
+        // in the order the feed and the train kernels first access them;
+        // the variables that are never accessed go last, in their original order
+        static Indices getLocalityOrder(const std::vector<char> &feedCommands,
+                                        const std::vector<Index> &feedIndices,
+                                        const std::vector<char> &trainCommands,
+                                        const std::vector<Index> &trainIndices,
+                                        Index numVariables);
+        
+        static void renumber(std::vector<char> &commands,
+                             std::vector<Index> &indices,
+                             const Indices &newIndices);
+        
+        // Redirects the accumulations (AAP, AAPP, ClipAAP and the sparse updates) into each variable to newIndices[variable],
+        // leaving all the reads of it in place; returns false and leaves the kernel untouched,
+        // if any of the redirected variables is written in some other way
+        static bool redirectAccumulations(std::vector<char> &commands,
+                                          std::vector<Index> &indices,
+                                          const Indices &newIndices);
+    
+    private:
+        
+        std::vector<Pass::Ptr> passes;
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledKernelOptimizer);
+    };
+    
+    // Reads of a variable that was just copied with A are redirected to the original,
+    // and the copies of a variable to itself are removed
+    class CopyPropagationPass final : public UnrolledKernelOptimizer::Pass
+    {
+    public:
+        
+        virtual std::string getName() const override;
+        
+        virtual Index run(UnrolledKernelOptimizer::Program &feedProgram,
+                          UnrolledKernelOptimizer::Program &trainProgram,
+                          const UnrolledKernelOptimizer::Indices &outputVariables) const override;
+    
+    private:
+        
+        static Index propagate(UnrolledKernelOptimizer::Program &program);
+    };
+    
+    // Removes everything that has no way to affect the outputs, at any of the future steps,
+    // including the neurons that have no path to an output;
+    // the memory of such neurons is just never updated after that
+    class DeadCodeEliminationPass final : public UnrolledKernelOptimizer::Pass
+    {
+    public:
+        
+        virtual std::string getName() const override;
+        
+        virtual Index run(UnrolledKernelOptimizer::Program &feedProgram,
+                          UnrolledKernelOptimizer::Program &trainProgram,
+                          const UnrolledKernelOptimizer::Indices &outputVariables) const override;
+    };
+    
+    // Removes the stores that are overwritten later within the same kernel before being read;
+    // all the variables are considered live at the end of a kernel, as the memory persists
+    class DeadStoreEliminationPass final : public UnrolledKernelOptimizer::Pass
+    {
+    public:
+        
+        virtual std::string getName() const override;
+        
+        virtual Index run(UnrolledKernelOptimizer::Program &feedProgram,
+                          UnrolledKernelOptimizer::Program &trainProgram,
+                          const UnrolledKernelOptimizer::Indices &outputVariables) const override;
+    
+    private:
+        
+        static Index eliminate(UnrolledKernelOptimizer::Program &program);
+    };
+    
+    // Merges the adjacent instructions into superinstructions:
+    // Zero + AAP(P) into AP(P), activations with their derivatives, and Clip + AAP
+    class PeepholeFusionPass final : public UnrolledKernelOptimizer::Pass
+    {
+    public:
+        
+        virtual std::string getName() const override;
+        
+        virtual Index run(UnrolledKernelOptimizer::Program &feedProgram,
+                          UnrolledKernelOptimizer::Program &trainProgram,
+                          const UnrolledKernelOptimizer::Indices &outputVariables) const override;
+    
+    private:
+        
+        static Index fuse(UnrolledKernelOptimizer::Program &program);
+        
+        static bool tryFuse(const UnrolledKernelOptimizer::Instruction &first,
+                            const UnrolledKernelOptimizer::Instruction &second,
+                            UnrolledKernelOptimizer::Instruction &result);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledKernelOptimizer implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledKernelOptimizer::UnrolledKernelOptimizer()
+    {
+        // Copy propagation leaves some copies unused, which are then removed as a dead code,
+        // and the fusion goes last, as the other passes are simpler without superinstructions
+        this->addPass(Pass::Ptr(new CopyPropagationPass()));
+        this->addPass(Pass::Ptr(new DeadCodeEliminationPass()));
+        this->addPass(Pass::Ptr(new DeadStoreEliminationPass()));
+        this->addPass(Pass::Ptr(new PeepholeFusionPass()));
+    }
+    
+    inline void UnrolledKernelOptimizer::clearPasses()
+    {
+        this->passes.clear();
+    }
+    
+    inline void UnrolledKernelOptimizer::addPass(Pass::Ptr pass)
+    {
+        this->passes.push_back(pass);
+    }
+    
+    inline UnrolledKernelOptimizer::Report
+    UnrolledKernelOptimizer::run(std::vector<char> &feedCommands,
+                                 std::vector<Index> &feedIndices,
+                                 Indices &feedChunkSizes,
+                                 std::vector<char> &trainCommands,
+                                 std::vector<Index> &trainIndices,
+                                 Indices &trainChunkSizes,
+                                 const Indices &outputVariables) const
+    {
+        Program feedProgram = UnrolledKernelOptimizer::decode(feedCommands, feedIndices);
+        Program trainProgram = UnrolledKernelOptimizer::decode(trainCommands, trainIndices);
+        
+        UnrolledKernelOptimizer::setChunkSizes(feedProgram, feedChunkSizes);
+        UnrolledKernelOptimizer::setChunkSizes(trainProgram, trainChunkSizes);
+        
+        Report report;
+        
+        for (const auto &pass : this->passes)
+        {
+            const Index numRemoved = pass->run(feedProgram, trainProgram, outputVariables);
+            report.push_back(std::make_pair(pass->getName(), numRemoved));
+        }
+        
+        UnrolledKernelOptimizer::encode(feedProgram, feedCommands, feedIndices);
+        UnrolledKernelOptimizer::encode(trainProgram, trainCommands, trainIndices);
+        
+        feedChunkSizes = UnrolledKernelOptimizer::getChunkSizes(feedProgram, feedChunkSizes.size());
+        trainChunkSizes = UnrolledKernelOptimizer::getChunkSizes(trainProgram, trainChunkSizes.size());
+        
+        return report;
+    }
+    
+    inline UnrolledKernelOptimizer::Program
+    UnrolledKernelOptimizer::decode(const std::vector<char> &commands,
+                                    const std::vector<Index> &indices)
+    {
+        Program program;
+        Index i = 0;
+        
+        for (const char command : commands)
+        {
+            if (command == VMProgram::End)
+            {
+                break;
+            }
+            
+            Instruction instruction;
+            instruction.operation = command;
+            instruction.chunk = 0;
+            
+            const Index numOperands = VMProgram::getNumOperands(command, indices.data() + i);
+            
+            instruction.operands.assign(indices.begin() + i, indices.begin() + i + numOperands);
+            program.push_back(instruction);
+            i += numOperands;
+        }
+        
+        return program;
+    }
+    
+    inline void UnrolledKernelOptimizer::encode(const Program &program,
+                                                std::vector<char> &commands,
+                                                std::vector<Index> &indices)
+    {
+        commands.clear();
+        indices.clear();
+        
+        for (const auto &instruction : program)
+        {
+            commands.push_back(instruction.operation);
+            indices.insert(indices.end(), instruction.operands.begin(), instruction.operands.end());
+        }
+        
+        commands.push_back(VMProgram::End);
+    }
+    
+    inline void UnrolledKernelOptimizer::setChunkSizes(Program &program, const Indices &chunkSizes)
+    {
+        size_t totalSize = 0;
+        
+        for (const auto &size : chunkSizes)
+        {
+            totalSize += size;
+        }
+        
+        if (totalSize != program.size())
+        {
+            return;
+        }
+        
+        size_t i = 0;
+        
+        for (Index chunk = 0; chunk < chunkSizes.size(); ++chunk)
+        {
+            for (Index j = 0; j < chunkSizes[chunk]; ++j)
+            {
+                program[i++].chunk = chunk;
+            }
+        }
+    }
+    
+    // The passes never reorder the instructions, so the chunks stay contiguous
+    inline UnrolledKernelOptimizer::Indices
+    UnrolledKernelOptimizer::getChunkSizes(const Program &program, size_t numChunks)
+    {
+        Indices chunkSizes(numChunks, 0);
+        
+        for (const auto &instruction : program)
+        {
+            if (instruction.chunk < numChunks)
+            {
+                chunkSizes[instruction.chunk]++;
+            }
+        }
+        
+        return chunkSizes;
+    }
+    
+    inline void UnrolledKernelOptimizer::getOperandRoles(const Instruction &instruction,
+                                                         std::vector<size_t> &writes,
+                                                         std::vector<size_t> &reads)
+    {
+        writes.clear();
+        reads.clear();
+        
+        const size_t numOperands = instruction.operands.size();
+        
+        switch (instruction.operation)
+        {
+            case VMProgram::Zero:
+                writes.push_back(0);
+                break;
+            
+            case VMProgram::Clip:
+            case VMProgram::AAP:
+            case VMProgram::AAPP:
+                writes.push_back(0);
+                for (size_t i = 0; i < numOperands; ++i) { reads.push_back(i); }
+                break;
+            
+            case VMProgram::FeedState:
+                writes.push_back(1);
+                for (size_t i = 1; i < numOperands; ++i) { reads.push_back(i); }
+                break;
+            
+            case VMProgram::Softmax:
+                for (size_t i = 1; i < numOperands; i += 2)
+                {
+                    writes.push_back(i);
+                    reads.push_back(i + 1);
+                }
+                break;
+            
+            case VMProgram::SoftmaxCrossEntropy:
+                writes.push_back(1);
+                reads.push_back(1);
+                for (size_t i = 2; i < numOperands; i += 3)
+                {
+                    writes.push_back(i);
+                    reads.push_back(i + 1);
+                    reads.push_back(i + 2);
+                }
+                break;
+            
+            // The sparse input operations only write some of their variables, depending on the slots,
+            // so all of those are taken as read as well, like the destinations of the accumulations
+            case VMProgram::GatherActiveInputs:
+                writes.push_back(1);
+                writes.push_back(2);
+                reads.push_back(1);
+                for (size_t i = 3; i < numOperands; i += 3)
+                {
+                    writes.push_back(i + 1);
+                    writes.push_back(i + 2);
+                    reads.push_back(i);
+                    reads.push_back(i + 1);
+                    reads.push_back(i + 2);
+                }
+                break;
+            
+            case VMProgram::FeedStateSparse:
+                writes.push_back(2);
+                for (size_t i = 1; i < numOperands; ++i) { reads.push_back(i); }
+                break;
+            
+            case VMProgram::TraceSparse:
+                for (size_t i = 3; i < numOperands; i += 5) { writes.push_back(i + 2); }
+                for (size_t i = 1; i < numOperands; ++i) { reads.push_back(i); }
+                break;
+            
+            case VMProgram::TrainSparse:
+            case VMProgram::TrainSparseClipped:
+                for (size_t i = 4; i < numOperands; i += 3) { writes.push_back(i + 1); }
+                for (size_t i = 1; i < numOperands; ++i) { reads.push_back(i); }
+                break;
+            
+            case VMProgram::ActivationDerivativeSigmoid:
+            case VMProgram::DropoutActivationDerivativeSigmoid:
+            case VMProgram::ActivationDerivativeTanh:
+            case VMProgram::DropoutActivationDerivativeTanh:
+            case VMProgram::ActivationDerivativeLeakyReLU:
+            case VMProgram::DropoutActivationDerivativeLeakyReLU:
+                writes.push_back(0);
+                writes.push_back(1);
+                reads.push_back(2);
+                break;
+            
+            case VMProgram::ClipAAP:
+                writes.push_back(0);
+                writes.push_back(2);
+                for (size_t i = 0; i < numOperands; ++i) { reads.push_back(i); }
+                break;
+            
+            default:
+                // All the rest are plain assignments to the first operand, if they have any
+                if (numOperands > 0)
+                {
+                    writes.push_back(0);
+                    for (size_t i = 1; i < numOperands; ++i) { reads.push_back(i); }
+                }
+                break;
+        }
+    }
+    
+    inline UnrolledKernelOptimizer::Indices
+    UnrolledKernelOptimizer::getLocalityOrder(const std::vector<char> &feedCommands,
+                                              const std::vector<Index> &feedIndices,
+                                              const std::vector<char> &trainCommands,
+                                              const std::vector<Index> &trainIndices,
+                                              Index numVariables)
+    {
+        const Index unassigned = std::numeric_limits<Index>::max();
+        Indices newIndices(numVariables, unassigned);
+        Index nextIndex = 0;
+        
+        const Program programs[] =
+        {
+            UnrolledKernelOptimizer::decode(feedCommands, feedIndices),
+            UnrolledKernelOptimizer::decode(trainCommands, trainIndices)
+        };
+        
+        std::vector<size_t> writes, reads;
+        
+        for (const auto &program : programs)
+        {
+            for (const auto &instruction : program)
+            {
+                UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+                
+                // Operands are taken in the order they appear in the instruction,
+                // e.g. FeedState's activation, weight and gain triples go together
+                for (size_t position = 0; position < instruction.operands.size(); ++position)
+                {
+                    const bool isVariable =
+                    (std::find(writes.begin(), writes.end(), position) != writes.end()) ||
+                    (std::find(reads.begin(), reads.end(), position) != reads.end());
+                    
+                    const Index variable = instruction.operands[position];
+                    
+                    if (isVariable && newIndices[variable] == unassigned)
+                    {
+                        newIndices[variable] = nextIndex++;
+                    }
+                }
+            }
+        }
+        
+        for (auto &newIndex : newIndices)
+        {
+            if (newIndex == unassigned)
+            {
+                newIndex = nextIndex++;
+            }
+        }
+        
+        return newIndices;
+    }
+    
+    inline void UnrolledKernelOptimizer::renumber(std::vector<char> &commands,
+                                                  std::vector<Index> &indices,
+                                                  const Indices &newIndices)
+    {
+        Program program = UnrolledKernelOptimizer::decode(commands, indices);
+        std::vector<size_t> writes, reads;
+        
+        for (auto &instruction : program)
+        {
+            UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+            const Indices oldOperands = instruction.operands;
+            
+            for (const size_t w : writes)
+            {
+                instruction.operands[w] = newIndices[oldOperands[w]];
+            }
+            
+            for (const size_t r : reads)
+            {
+                instruction.operands[r] = newIndices[oldOperands[r]];
+            }
+        }
+        
+        UnrolledKernelOptimizer::encode(program, commands, indices);
+    }
+    
+    inline bool UnrolledKernelOptimizer::redirectAccumulations(std::vector<char> &commands,
+                                                               std::vector<Index> &indices,
+                                                               const Indices &newIndices)
+    {
+        Program program = UnrolledKernelOptimizer::decode(commands, indices);
+        std::vector<size_t> writes, reads;
+        
+        for (auto &instruction : program)
+        {
+            UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+            
+            for (const size_t w : writes)
+            {
+                const Index variable = instruction.operands[w];
+                
+                if (newIndices[variable] == variable)
+                {
+                    continue;
+                }
+                
+                // the sparse updates only write to the weights, always adding to them
+                const bool isAccumulation = ((w == 0 &&
+                                              (instruction.operation == VMProgram::AAP ||
+                                               instruction.operation == VMProgram::AAPP ||
+                                               instruction.operation == VMProgram::ClipAAP)) ||
+                                             instruction.operation == VMProgram::TrainSparse ||
+                                             instruction.operation == VMProgram::TrainSparseClipped);
+                
+                if (! isAccumulation)
+                {
+                    return false;
+                }
+                
+                instruction.operands[w] = newIndices[variable];
+            }
+        }
+        
+        UnrolledKernelOptimizer::encode(program, commands, indices);
+        return true;
+    }
+    
+    //===------------------------------------------------------------------===//
+    // CopyPropagationPass
+    //===------------------------------------------------------------------===//
+    
+    inline std::string CopyPropagationPass::getName() const
+    {
+        return "copy propagation";
+    }
+    
+    inline Index CopyPropagationPass::run(UnrolledKernelOptimizer::Program &feedProgram,
+                                          UnrolledKernelOptimizer::Program &trainProgram,
+                                          const UnrolledKernelOptimizer::Indices &) const
+    {
+        return CopyPropagationPass::propagate(feedProgram) +
+               CopyPropagationPass::propagate(trainProgram);
+    }
+    
+    inline Index CopyPropagationPass::propagate(UnrolledKernelOptimizer::Program &program)
+    {
+        UnrolledKernelOptimizer::Program result;
+        std::unordered_map<Index, Index> copies;                // copy variable to the original
+        std::unordered_map<Index, std::vector<Index>> originals; // original variable to its copies
+        std::vector<size_t> writes, reads;
+        
+        for (auto instruction : program)
+        {
+            UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+            
+            // Only the pure sources are redirected, not the accumulators,
+            // and never to a variable the same instruction writes to
+            for (const size_t r : reads)
+            {
+                const bool isWritten = (std::find(writes.begin(), writes.end(), r) != writes.end());
+                const auto copy = copies.find(instruction.operands[r]);
+                
+                if (isWritten || copy == copies.end())
+                {
+                    continue;
+                }
+                
+                bool aliasesDestination = false;
+                
+                for (const size_t w : writes)
+                {
+                    aliasesDestination = aliasesDestination || (instruction.operands[w] == copy->second);
+                }
+                
+                if (! aliasesDestination)
+                {
+                    instruction.operands[r] = copy->second;
+                }
+            }
+            
+            if (instruction.operation == VMProgram::A &&
+                instruction.operands[0] == instruction.operands[1])
+            {
+                continue;
+            }
+            
+            // Anything that writes to either a copy or its original invalidates the copy
+            for (const size_t w : writes)
+            {
+                const Index variable = instruction.operands[w];
+                copies.erase(variable);
+                
+                const auto original = originals.find(variable);
+                
+                if (original != originals.end())
+                {
+                    for (const Index copy : original->second)
+                    {
+                        const auto i = copies.find(copy);
+                        
+                        if (i != copies.end() && i->second == variable)
+                        {
+                            copies.erase(i);
+                        }
+                    }
+                    
+                    originals.erase(original);
+                }
+            }
+            
+            if (instruction.operation == VMProgram::A)
+            {
+                copies[instruction.operands[0]] = instruction.operands[1];
+                originals[instruction.operands[1]].push_back(instruction.operands[0]);
+            }
+            
+            result.push_back(instruction);
+        }
+        
+        const Index numRemoved = Index(program.size() - result.size());
+        program.swap(result);
+        return numRemoved;
+    }
+    
+    //===------------------------------------------------------------------===//
+    // DeadCodeEliminationPass
+    //===------------------------------------------------------------------===//
+    
+    inline std::string DeadCodeEliminationPass::getName() const
+    {
+        return "dead code elimination";
+    }
+    
+    inline Index DeadCodeEliminationPass::run(UnrolledKernelOptimizer::Program &feedProgram,
+                                              UnrolledKernelOptimizer::Program &trainProgram,
+                                              const UnrolledKernelOptimizer::Indices &outputVariables) const
+    {
+        // The kernels are run in a loop, so this is a fixed point over both of them,
+        // which doesn't care about the order of instructions
+        UnrolledKernelOptimizer::Program *programs[] = { &feedProgram, &trainProgram };
+        std::vector<size_t> writes, reads;
+        
+        Index numVariables = 0;
+        for (const auto &variable : outputVariables)
+        {
+            numVariables = std::max(numVariables, variable + 1);
+        }
+        
+        for (const auto *program : programs)
+        {
+            for (const auto &instruction : *program)
+            {
+                for (const auto &operand : instruction.operands)
+                {
+                    numVariables = std::max(numVariables, operand + 1);
+                }
+            }
+        }
+        
+        // Instructions writing to each variable, as pairs of program number and instruction number
+        std::vector<std::vector<std::pair<size_t, size_t>>> writers(numVariables);
+        
+        for (size_t p = 0; p < 2; ++p)
+        {
+            for (size_t i = 0; i < programs[p]->size(); ++i)
+            {
+                const auto &instruction = (*programs[p])[i];
+                UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+                
+                for (const size_t w : writes)
+                {
+                    writers[instruction.operands[w]].push_back(std::make_pair(p, i));
+                }
+            }
+        }
+        
+        std::vector<bool> live(numVariables, false);
+        std::vector<Index> worklist;
+        
+        for (const auto &variable : outputVariables)
+        {
+            if (! live[variable])
+            {
+                live[variable] = true;
+                worklist.push_back(variable);
+            }
+        }
+        
+        while (! worklist.empty())
+        {
+            const Index variable = worklist.back();
+            worklist.pop_back();
+            
+            for (const auto &writer : writers[variable])
+            {
+                const auto &instruction = (*programs[writer.first])[writer.second];
+                UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+                
+                for (const size_t r : reads)
+                {
+                    const Index source = instruction.operands[r];
+                    
+                    if (! live[source])
+                    {
+                        live[source] = true;
+                        worklist.push_back(source);
+                    }
+                }
+            }
+            
+            writers[variable].clear();
+        }
+        
+        Index numRemoved = 0;
+        
+        for (auto *program : programs)
+        {
+            UnrolledKernelOptimizer::Program result;
+            
+            for (const auto &instruction : *program)
+            {
+                UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+                
+                bool isLive = writes.empty();
+                
+                for (const size_t w : writes)
+                {
+                    isLive = isLive || live[instruction.operands[w]];
+                }
+                
+                if (isLive)
+                {
+                    result.push_back(instruction);
+                }
+            }
+            
+            numRemoved += Index(program->size() - result.size());
+            program->swap(result);
+        }
+        
+        return numRemoved;
+    }
+    
+    //===------------------------------------------------------------------===//
+    // DeadStoreEliminationPass
+    //===------------------------------------------------------------------===//
+    
+    inline std::string DeadStoreEliminationPass::getName() const
+    {
+        return "dead store elimination";
+    }
+    
+    inline Index DeadStoreEliminationPass::run(UnrolledKernelOptimizer::Program &feedProgram,
+                                               UnrolledKernelOptimizer::Program &trainProgram,
+                                               const UnrolledKernelOptimizer::Indices &) const
+    {
+        return DeadStoreEliminationPass::eliminate(feedProgram) +
+               DeadStoreEliminationPass::eliminate(trainProgram);
+    }
+    
+    inline Index DeadStoreEliminationPass::eliminate(UnrolledKernelOptimizer::Program &program)
+    {
+        // Walking backwards, keeps track of the variables that are overwritten before they are read
+        std::unordered_set<Index> overwritten;
+        std::vector<bool> isDead(program.size(), false);
+        std::vector<size_t> writes, reads;
+        
+        for (size_t i = program.size(); i --> 0 ;)
+        {
+            const auto &instruction = program[i];
+            UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+            
+            bool allWritesAreDead = !writes.empty();
+            
+            for (const size_t w : writes)
+            {
+                allWritesAreDead = allWritesAreDead && (overwritten.count(instruction.operands[w]) > 0);
+            }
+            
+            if (allWritesAreDead)
+            {
+                isDead[i] = true;
+                continue;
+            }
+            
+            for (const size_t w : writes)
+            {
+                overwritten.insert(instruction.operands[w]);
+            }
+            
+            for (const size_t r : reads)
+            {
+                overwritten.erase(instruction.operands[r]);
+            }
+        }
+        
+        UnrolledKernelOptimizer::Program result;
+        
+        for (size_t i = 0; i < program.size(); ++i)
+        {
+            if (! isDead[i])
+            {
+                result.push_back(program[i]);
+            }
+        }
+        
+        const Index numRemoved = Index(program.size() - result.size());
+        program.swap(result);
+        return numRemoved;
+    }
+    
+    //===------------------------------------------------------------------===//
+    // PeepholeFusionPass
+    //===------------------------------------------------------------------===//
+    
+    inline std::string PeepholeFusionPass::getName() const
+    {
+        return "peephole fusion";
+    }
+    
+    inline Index PeepholeFusionPass::run(UnrolledKernelOptimizer::Program &feedProgram,
+                                         UnrolledKernelOptimizer::Program &trainProgram,
+                                         const UnrolledKernelOptimizer::Indices &) const
+    {
+        return PeepholeFusionPass::fuse(feedProgram) +
+               PeepholeFusionPass::fuse(trainProgram);
+    }
+    
+    inline Index PeepholeFusionPass::fuse(UnrolledKernelOptimizer::Program &program)
+    {
+        UnrolledKernelOptimizer::Program result;
+        
+        for (size_t i = 0; i < program.size(); ++i)
+        {
+            UnrolledKernelOptimizer::Instruction fused;
+            
+            if (i + 1 < program.size() &&
+                PeepholeFusionPass::tryFuse(program[i], program[i + 1], fused))
+            {
+                result.push_back(fused);
+                ++i;
+            }
+            else
+            {
+                result.push_back(program[i]);
+            }
+        }
+        
+        const Index numRemoved = Index(program.size() - result.size());
+        program.swap(result);
+        return numRemoved;
+    }
+    
+    inline bool PeepholeFusionPass::tryFuse(const UnrolledKernelOptimizer::Instruction &first,
+                                            const UnrolledKernelOptimizer::Instruction &second,
+                                            UnrolledKernelOptimizer::Instruction &result)
+    {
+        const auto &x = first.operands;
+        const auto &y = second.operands;
+        
+        // x = 0; x += a * b;  ->  x = a * b;
+        if (first.operation == VMProgram::Zero &&
+            (second.operation == VMProgram::AAP || second.operation == VMProgram::AAPP) &&
+            y[0] == x[0] &&
+            std::find(y.begin() + 1, y.end(), x[0]) == y.end())
+        {
+            result.operation = (second.operation == VMProgram::AAP) ? VMProgram::AP : VMProgram::APP;
+            result.operands = y;
+            result.chunk = first.chunk;
+            return true;
+        }
+        
+        // g = clip(g); w += r * g;  ->  ClipAAP w r g
+        if (first.operation == VMProgram::Clip &&
+            second.operation == VMProgram::AAP &&
+            y[2] == x[0] && y[0] != x[0] && y[1] != x[0])
+        {
+            result.operation = VMProgram::ClipAAP;
+            result.operands = y;
+            result.chunk = first.chunk;
+            return true;
+        }
+        
+        // a = activation(s); d = derivative(a or s);  ->  one superinstruction
+        struct Pattern { char activation; char derivative; char fused; bool derivesFromState; };
+        
+        static const Pattern patterns[] =
+        {
+            { VMProgram::ActivationSigmoid, VMProgram::DerivativeSigmoid, VMProgram::ActivationDerivativeSigmoid, false },
+            { VMProgram::DropoutActivationSigmoid, VMProgram::DerivativeSigmoid, VMProgram::DropoutActivationDerivativeSigmoid, false },
+            { VMProgram::ActivationTanh, VMProgram::DerivativeTanh, VMProgram::ActivationDerivativeTanh, false },
+            { VMProgram::DropoutActivationTanh, VMProgram::DerivativeTanh, VMProgram::DropoutActivationDerivativeTanh, false },
+            { VMProgram::ActivationLeakyReLU, VMProgram::DerivativeLeakyReLU, VMProgram::ActivationDerivativeLeakyReLU, true },
+            { VMProgram::DropoutActivationLeakyReLU, VMProgram::DerivativeLeakyReLU, VMProgram::DropoutActivationDerivativeLeakyReLU, true }
+        };
+        
+        for (const auto &pattern : patterns)
+        {
+            if (first.operation == pattern.activation &&
+                second.operation == pattern.derivative &&
+                y[1] == (pattern.derivesFromState ? x[1] : x[0]) &&
+                x[0] != x[1] && y[0] != x[0] && y[0] != x[1])
+            {
+                result.operation = pattern.fused;
+                result.operands = { x[0], y[0], x[1] };
+                result.chunk = first.chunk;
+                return true;
+            }
+        }
+        
+        return false;
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDKERNELOPTIMIZER_H_INCLUDED
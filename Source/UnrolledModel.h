@@ -0,0 +1,301 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDMODEL_H_INCLUDED
+#define TINYRNN_UNROLLEDMODEL_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledTrainingContext.h"
+#include "UnrolledThreadedKernel.h"
+#include "UnrolledKernelOptimizer.h"
+
+#include <atomic>
+
+namespace TinyRNN
+{
+    // An immutable inference-only copy of an unrolled network: the feed kernel,
+    // stripped of everything only the training needs, e.g. the traces, and the weights and biases it reads.
+    //
+    // Any number of sessions can be created from one model, each of them keeping
+    // just the variables the kernel writes to, i.e. the recurrent state of a single stream.
+    // Sessions are independent of each other, so different threads may feed different sessions
+    // at the same time with no locks; a single session is not meant to be fed from two threads at once.
+    //
+    // The kernel is run over a per-thread workspace, which keeps a copy of the weights
+    // for the model that thread has run most recently; so the weights are copied once per thread,
+    // not once per session, and each feed() only moves the session's state in and out of it.
+    class UnrolledModel final : public std::enable_shared_from_this<UnrolledModel>
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<const UnrolledModel>;
+        using RawData = UnrolledTrainingContext::RawData;
+        using Indices = UnrolledTrainingContext::Indices;
+        
+        class Session final
+        {
+        public:
+            
+            using Ptr = std::shared_ptr<Session>;
+            
+            explicit Session(UnrolledModel::Ptr targetModel);
+            
+            // Never allocates, unless this thread has just run another model
+            void feed(const Value *inputs, Value *outputs);
+            RawData feed(const RawData &inputs);
+            
+            UnrolledModel::Ptr getModel() const noexcept;
+        
+        private:
+            
+            UnrolledModel::Ptr model;
+            RawData state;
+            
+            TINYRNN_DISALLOW_COPY_AND_ASSIGN(Session);
+        };
+    
+    public:
+        
+        // Built from a feed kernel and the memory it runs on; the state of the new sessions
+        // is copied from that memory as well, so they start where the network is
+        static UnrolledModel::Ptr buildFrom(const std::vector<char> &feedCommands,
+                                            const std::vector<Index> &feedIndices,
+                                            const RawData &memory,
+                                            const Indices &inputVariables,
+                                            const Indices &outputVariables);
+        
+        Session::Ptr createSession() const;
+        
+        size_t getNumInputs() const noexcept;
+        size_t getNumOutputs() const noexcept;
+        
+        // The number of values each session keeps, and the number of values shared by all of them
+        size_t getStateSize() const noexcept;
+        size_t getNumSharedVariables() const noexcept;
+    
+    private:
+        
+        UnrolledModel() = default;
+        
+        uint64_t uuid;
+        UnrolledThreadedKernel kernel;  // only read by run(), so it is safe to share between threads
+        
+        RawData memory;                 // laid out as [state][weights, biases and the other variables it only reads]
+        Index stateSize;
+        Indices inputVariables;         // all of them are within the state
+        Indices outputVariables;
+        
+        struct Workspace final
+        {
+            uint64_t modelUuid = 0;
+            RawData memory;
+        };
+        
+        static Workspace &getWorkspace();
+        static uint64_t generateUuid();
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledModel);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledModel implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledModel::Ptr UnrolledModel::buildFrom(const std::vector<char> &feedCommands,
+                                                       const std::vector<Index> &feedIndices,
+                                                       const RawData &memory,
+                                                       const Indices &inputVariables,
+                                                       const Indices &outputVariables)
+    {
+        UnrolledKernelOptimizer::Program program = UnrolledKernelOptimizer::decode(feedCommands, feedIndices);
+        
+        // The train kernel is never run, so whatever only it reads is dead here
+        UnrolledKernelOptimizer::Program noTraining;
+        const DeadCodeEliminationPass deadCodeElimination;
+        deadCodeElimination.run(program, noTraining, outputVariables);
+        
+        // The variables the kernel writes to go first, they are what the sessions keep,
+        // followed by the ones it only reads, and all the rest are left out
+        const Index unassigned = std::numeric_limits<Index>::max();
+        Indices newIndices(memory.size(), unassigned);
+        std::vector<size_t> writes, reads;
+        Index nextIndex = 0;
+        
+        const auto assignStateVariable = [&](Index variable)
+        {
+            if (newIndices[variable] == unassigned)
+            {
+                newIndices[variable] = nextIndex++;
+            }
+        };
+        
+        for (const auto &variable : inputVariables) { assignStateVariable(variable); }
+        for (const auto &variable : outputVariables) { assignStateVariable(variable); }
+        
+        for (const auto &instruction : program)
+        {
+            UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+            for (const size_t w : writes) { assignStateVariable(instruction.operands[w]); }
+        }
+        
+        const Index stateSize = nextIndex;
+        
+        for (const auto &instruction : program)
+        {
+            UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+            for (const size_t r : reads) { assignStateVariable(instruction.operands[r]); }
+        }
+        
+        std::shared_ptr<UnrolledModel> model(new UnrolledModel());
+        model->uuid = UnrolledModel::generateUuid();
+        model->stateSize = stateSize;
+        model->memory.resize(nextIndex);
+        
+        for (size_t variable = 0; variable < newIndices.size(); ++variable)
+        {
+            if (newIndices[variable] != unassigned)
+            {
+                model->memory[newIndices[variable]] = memory[variable];
+            }
+        }
+        
+        for (const auto &variable : inputVariables) { model->inputVariables.push_back(newIndices[variable]); }
+        for (const auto &variable : outputVariables) { model->outputVariables.push_back(newIndices[variable]); }
+        
+        for (auto &instruction : program)
+        {
+            UnrolledKernelOptimizer::getOperandRoles(instruction, writes, reads);
+            const Indices oldOperands = instruction.operands;
+            for (const size_t w : writes) { instruction.operands[w] = newIndices[oldOperands[w]]; }
+            for (const size_t r : reads) { instruction.operands[r] = newIndices[oldOperands[r]]; }
+        }
+        
+        std::vector<char> commands;
+        std::vector<Index> indices;
+        UnrolledKernelOptimizer::encode(program, commands, indices);
+        model->kernel.decode(commands, indices);
+        
+        return model;
+    }
+    
+    inline UnrolledModel::Session::Ptr UnrolledModel::createSession() const
+    {
+        return Session::Ptr(new Session(this->shared_from_this()));
+    }
+    
+    inline size_t UnrolledModel::getNumInputs() const noexcept
+    {
+        return this->inputVariables.size();
+    }
+    
+    inline size_t UnrolledModel::getNumOutputs() const noexcept
+    {
+        return this->outputVariables.size();
+    }
+    
+    inline size_t UnrolledModel::getStateSize() const noexcept
+    {
+        return this->stateSize;
+    }
+    
+    inline size_t UnrolledModel::getNumSharedVariables() const noexcept
+    {
+        return this->memory.size() - this->stateSize;
+    }
+    
+    // Function-level statics rather than static variables,
+    // so that all translation units share the same ones
+    inline UnrolledModel::Workspace &UnrolledModel::getWorkspace()
+    {
+        static thread_local Workspace workspace;
+        return workspace;
+    }
+    
+    inline uint64_t UnrolledModel::generateUuid()
+    {
+        static std::atomic<uint64_t> recentUuid(0);
+        return ++recentUuid;
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Session implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledModel::Session::Session(UnrolledModel::Ptr targetModel) :
+    model(targetModel),
+    state(targetModel->memory.begin(), targetModel->memory.begin() + targetModel->stateSize)
+    {
+    }
+    
+    inline UnrolledModel::Ptr UnrolledModel::Session::getModel() const noexcept
+    {
+        return this->model;
+    }
+    
+    inline void UnrolledModel::Session::feed(const Value *inputs, Value *outputs)
+    {
+        Workspace &workspace = UnrolledModel::getWorkspace();
+        
+        if (workspace.modelUuid != this->model->uuid)
+        {
+            workspace.memory = this->model->memory;
+            workspace.modelUuid = this->model->uuid;
+        }
+        
+        Value *memory = workspace.memory.data();
+        std::copy(this->state.begin(), this->state.end(), memory);
+        
+        const Indices &inputVariables = this->model->inputVariables;
+        for (size_t i = 0; i < inputVariables.size(); ++i)
+        {
+            memory[inputVariables[i]] = inputs[i];
+        }
+        
+        // At test time, the activations are just scaled by the probability of dropout
+        this->model->kernel.run(memory, Value(0.5));
+        
+        if (outputs != nullptr)
+        {
+            const Indices &outputVariables = this->model->outputVariables;
+            for (size_t i = 0; i < outputVariables.size(); ++i)
+            {
+                outputs[i] = memory[outputVariables[i]];
+            }
+        }
+        
+        std::copy(memory, memory + this->state.size(), this->state.begin());
+    }
+    
+    inline UnrolledModel::RawData UnrolledModel::Session::feed(const RawData &inputs)
+    {
+        RawData outputs(this->model->getNumOutputs());
+        
+        if (inputs.size() == this->model->getNumInputs())
+        {
+            this->feed(inputs.data(), outputs.data());
+        }
+        
+        return outputs;
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDMODEL_H_INCLUDED
@@ -26,13 +26,20 @@
 #include "Common.h"
 #include "UnrolledNeuron.h"
 #include "UnrolledTrainingContext.h"
+#include "UnrolledThreadedKernel.h"
+#include "UnrolledParallelKernel.h"
+#include "UnrolledBatchedKernel.h"
+#include "UnrolledJitKernel.h"
+#include "UnrolledCodeGenerator.h"
+#include "UnrolledKernelOptimizer.h"
+#include "UnrolledModel.h"
+#include "UnrolledStateSnapshot.h"
 #include "Id.h"
+#include "Random.h"
 #include "ScopedMemoryBlock.h"
 #include "ScopedTimer.h"
 #include "SerializedObject.h"
 
-#include <ctime>
-#include <cstdlib>
 
 namespace TinyRNN
 {
@@ -43,27 +50,184 @@ namespace TinyRNN
         using Ptr = std::shared_ptr<UnrolledNetwork>;
         using VMLayers = std::vector<UnrolledNeuron::Vector>;
         
+        enum ExecutionMode
+        {
+            Interpreted,    // the switch-based vmProcess, kept as a reference implementation
+            Threaded,       // kernels are decoded once and run with direct-threaded dispatch
+            Jit,            // kernels are compiled to native x86-64 code, bit-exact with the interpreter;
+                            // best for small networks, as large kernels make a code too big to stay in cache
+            JitFused,       // same, but uses fma where available, see UnrolledJitKernel for the tolerance
+            Parallel        // the neurons' chunks are scheduled in levels and run across a pool of threads,
+                            // bit-exact with the interpreter; only pays off for the wide layers
+        };
+    
     public:
         
         explicit UnrolledNetwork(UnrolledTrainingContext::Ptr targetContext);
-        UnrolledNetwork(UnrolledTrainingContext::Ptr targetContext, VMLayers targetLayers);
+        UnrolledNetwork(UnrolledTrainingContext::Ptr targetContext, VMLayers targetLayers,
+                        bool shouldOptimize = true);
         
         UnrolledTrainingContext::Ptr getContext() const noexcept;
         
         UnrolledTrainingContext::RawData feed(const UnrolledTrainingContext::RawData &values);
         void train(Value rate, const UnrolledTrainingContext::RawData &target);
         
+        // Run the whole sequence of numSteps in one call, with no allocations per step;
+        // all the buffers are laid out as [step][variable], and outputs may be nullptr when training
+        void feedSequence(const Value *inputs, size_t numSteps, Value *outputs);
+        void trainSequence(Value rate, const Value *inputs, const Value *targets,
+                           size_t numSteps, Value *outputs = nullptr);
+        
+        enum Feedback
+        {
+            Outputs,    // the outputs are fed back as they are
+            Argmax,     // the output with the highest score is fed back as a one-hot input
+            Sample      // same, but the output is drawn with the probability proportional to its score,
+                        // from the same stream the dropout masks are drawn from, see setRandomSeed()
+        };
+        
+        // Closed-loop generation: feeds the inputs once, then numSteps - 1 times feeds back the outputs
+        // of the previous step, writing them straight into the input variables, with no round trips
+        // through the caller's buffers and no allocations. Outputs are laid out as [step][variable],
+        // symbols get the chosen output of each step, not set in the Outputs mode; both may be nullptr.
+        // Returns false, if the network doesn't have as many outputs as it has inputs.
+        bool generate(const Value *inputs, size_t numSteps, Value *outputs,
+                      Feedback feedback = Outputs, Index *symbols = nullptr);
+        
+        // Single steps with the caller's buffers, which never allocate once the kernels are decoded;
+        // outputs may be nullptr, if they are only read through the view below
+        void feed(const Value *inputs, Value *outputs);
+        void train(Value rate, const Value *targets);
+        
+        // The same step for a mostly zero input, e.g. a one-hot symbol, given as the positions of the non-zero inputs
+        // and their values, or all ones, if values is nullptr. Only pays off with an input layer set to use sparse inputs,
+        // see Layer::setUsesSparseInputs(), and works the same as feed() either way.
+        // Returns false, if any of the positions is out of range.
+        bool feedSparse(const Index *activeInputs, const Value *values, size_t numActive, Value *outputs);
+        
+        // Read-only views straight into the memory, for the outputs of the most recent feed,
+        // and for the activations of any neurons; the neurons that are not in this network are skipped.
+        // The first call for a given list of neurons looks up their variables and keeps them in the network,
+        // which allocates; the later calls for the same list, and the reads through the views, don't.
+        // Views stay valid as long as the network does, renumberVariables() included.
+        UnrolledTrainingContext::View getOutputsView() const;
+        UnrolledTrainingContext::View getActivationsView(const std::vector<Id> &neuronUuids) const;
+        
+        void setExecutionMode(ExecutionMode mode) noexcept;
+        ExecutionMode getExecutionMode() const noexcept;
+        
+        // The number of threads for the parallel mode, defaults to the number of cores
+        void setNumThreads(Index numThreads) noexcept;
+        Index getNumThreads() const noexcept;
+        
+        // Batched mode runs both kernels over many independent sequences at once, each lane with its own copy
+        // of the per-sequence variables, and all of them reading the same weights and biases from the context;
+        // like in the mini-batch mode, the lanes sum their updates up instead of applying them,
+        // and trainBatch() then applies the average of all the lanes' updates to the weights.
+        // Setting the batch size takes a snapshot of the context memory, zero turns the batched mode off,
+        // and so does deserializing; returns false, if the train kernel can't be made to sum the updates up.
+        bool setBatchSize(Index numLanes);
+        Index getBatchSize() const noexcept;
+        
+        // Inputs, targets and outputs are laid out as [lane][variable]
+        UnrolledTrainingContext::RawData feedBatch(const UnrolledTrainingContext::RawData &inputs);
+        void trainBatch(Value rate, const UnrolledTrainingContext::RawData &targets);
+        
+        // Mini-batch training: train() runs a copy of the train kernel that sums the updates up
+        // in a separate gradient buffer, and the weights and biases are updated in a single pass
+        // once per numSamples calls; one is the default, online training, with the kernel as is.
+        // The pass is a contiguous loop if the variables are renumbered, and a gather loop otherwise.
+        // Returns false and keeps training online, if the train kernel can't be redirected.
+        bool setMiniBatchSize(Index numSamples);
+        Index getMiniBatchSize() const noexcept;
+        
+        // Applies the updates of an incomplete mini-batch, e.g. at the end of an epoch
+        void applyGradients();
+        
+        // Puts the network back to the start of a sequence, as if it was just built, at the cost of a few fills:
+        // zeroes the activations, the states, the responsibilities and all the traces, and sets the gains back to one,
+        // leaving the weights and biases as they are; in the batched mode, resets all the lanes
+        void resetState();
+        
+        // Copies the same variables that resetState() clears, i.e. the state of the current sequence,
+        // from the network's pool of buffers; weights and biases are never copied.
+        // Snapshots are immutable and can be restored any number of times, e.g. to branch
+        // the sequence into many hypotheses; both calls work on the scalar memory only.
+        UnrolledStateSnapshot::Ptr saveState();
+        
+        // Returns false, if the snapshot doesn't fit, i.e. was taken from a different network,
+        // or before the variables were renumbered or the network was deserialized
+        bool restoreState(const UnrolledStateSnapshot &snapshot);
+        
+        // The cross-entropy of the softmax output layers, summed up by the train kernel itself
+        // since the last resetLoss(), over all the lanes in the batched mode; zero without softmax
+        Value getLoss();
+        void resetLoss();
+        
+        // The dropout masks are drawn from the network's own stream, seeded from Random::getDefault();
+        // two networks with the same seed, fed and trained in the same way, drop out the same neurons
+        void setRandomSeed(uint64_t seed) noexcept;
+        
+        // Lays out the variables in the order the kernels access them, done by default along with the optimizations;
+        // the weights and biases go after all the rest, and their mini-batch gradients after them, in the same order
+        void renumberVariables();
+        
+        // How many instructions each of the optimizer passes has removed from the kernels
+        const UnrolledKernelOptimizer::Report &getOptimizationReport() const noexcept;
+        
+        // Exports both kernels and the current memory as a standalone C++ header
+        std::string generateCode(const std::string &namespaceName) const;
+        
+        // Takes an immutable inference-only snapshot of the feed kernel and the current weights,
+        // for serving many independent streams at once, see UnrolledModel;
+        // training the network afterwards doesn't affect the models taken before
+        UnrolledModel::Ptr createModel() const;
+    
     public:
         
         virtual void deserialize(SerializationContext::Ptr context) override;
         virtual void serialize(SerializationContext::Ptr context) const override;
-        
+    
     private:
         
         UnrolledTrainingContext::Ptr trainingContext;
+        ExecutionMode executionMode;
+        Index numThreads;
+        
+        Index batchSize;
+        UnrolledTrainingContext::RawData batchMemory;   // the per-lane variables only, laid out as [variable][lane]
+        UnrolledTrainingContext::Indices batchIndices;  // where each variable is in there, or past it, if shared
+        Index numLaneVariables;
+        
+        Index miniBatchSize;
+        Index numAccumulatedSamples;
+        // The variables of the activation views, by the neurons' uuids
+        mutable std::map<std::vector<Id>, UnrolledTrainingContext::Indices> activationsViews;
+        
+        UnrolledTrainingContext::Indices trainableVariables;    // weights and biases,
+        UnrolledTrainingContext::Indices gradientVariables;     // and their sums within a mini-batch
+        bool hasGradientRuns;                                   // if both are contiguous runs, see renumberVariables()
+        
+        // The runs of the adjacent per-sequence variables, and the loss accumulators, found on the first use,
+        // and then again after the variables are renumbered
+        using Ranges = UnrolledStatePool::Ranges;
+        Ranges stateRanges;
+        Ranges gainRanges;
+        Ranges snapshotRanges;  // both of the above, merged
+        size_t snapshotSize;
+        UnrolledTrainingContext::Indices lossVariables;
+        bool hasStateRanges;
+        void findStateRanges();
         
+        UnrolledStatePool::Ptr statePool;
+        
+        // Dropout is only applied to the feed right after train(), and feeding turns it off again
+        bool usesDropout;
+        Random random;
+        Value getDropoutFactor() noexcept;
+    
     private:
-      
+        
         class Kernel final : public SerializedObject
         {
         public:
@@ -73,10 +237,18 @@ namespace TinyRNN
             
             std::vector<char> commands;
             std::vector<Index> indices; // Index is the same type as cl_uint
+            std::vector<Index> chunks;  // the number of instructions of each neuron, not serialized
+            
+            UnrolledThreadedKernel threadedCode; // decoded lazily, on the first run
+            UnrolledJitKernel nativeCode;        // the same, and also recompiled when switching Jit modes
+            UnrolledParallelKernel parallelCode; // the same, and also rescheduled when the number of threads changes
+            
+            // Drops all of the above, which have the operands built in, e.g. after the variables are renumbered
+            void clearCode();
             
             virtual void deserialize(SerializationContext::Ptr context) override;
             virtual void serialize(SerializationContext::Ptr context) const override;
-            
+        
         private:
             
             TINYRNN_DISALLOW_COPY_AND_ASSIGN(Kernel);
@@ -84,11 +256,26 @@ namespace TinyRNN
         
         Kernel::Ptr feedKernel;
         Kernel::Ptr trainKernel;
+        Kernel::Ptr accumulatingTrainKernel; // only built in the mini-batch mode
+        Kernel::Ptr batchedFeedKernel;       // only built in the batched mode, renumbered into batchIndices
+        Kernel::Ptr batchedTrainKernel;      // the same, and summing the updates up, like the accumulating one
+        
+        UnrolledKernelOptimizer::Report optimizationReport;
         
         Kernel::Ptr compileFeedKernel(const VMLayers &targetLayers) const;
         Kernel::Ptr compileTrainKernel(const VMLayers &targetLayers) const;
         
-        bool initialize(const VMLayers &targetLayers);
+        void process(Kernel &kernel);
+        
+        using Indices = UnrolledTrainingContext::Indices;
+        void feedStep(const Value *inputs, const Indices &inputIds, Value *outputs, const Indices &outputIds);
+        void trainStep(Value rate, const Value *targets, const Indices &targetIds);
+        
+        bool initialize(const VMLayers &targetLayers, bool shouldOptimize);
+        Kernel::Ptr compileAccumulatingTrainKernel();
+        bool compileBatchedKernels();
+        
+        friend class UnrolledHogwildTrainer;
         
         TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledNetwork);
     };
@@ -98,17 +285,42 @@ namespace TinyRNN
     //===------------------------------------------------------------------===//
     
     inline UnrolledNetwork::UnrolledNetwork(UnrolledTrainingContext::Ptr targetContext) :
-    trainingContext(targetContext)
+    trainingContext(targetContext),
+    executionMode(Threaded),
+    numThreads(std::max(std::thread::hardware_concurrency(), 1u)),
+    batchSize(0),
+    numLaneVariables(0),
+    miniBatchSize(1),
+    numAccumulatedSamples(0),
+    hasGradientRuns(false),
+    snapshotSize(0),
+    hasStateRanges(false),
+    statePool(new UnrolledStatePool()),
+    usesDropout(true),
+    random(Random::getDefault().next())
     {
         VMLayers empty;
-        this->initialize(empty);
+        this->initialize(empty, false);
     }
     
     inline UnrolledNetwork::UnrolledNetwork(UnrolledTrainingContext::Ptr targetContext,
-                                VMLayers targetLayers) :
-    trainingContext(targetContext)
+                                VMLayers targetLayers,
+                                bool shouldOptimize) :
+    trainingContext(targetContext),
+    executionMode(Threaded),
+    numThreads(std::max(std::thread::hardware_concurrency(), 1u)),
+    batchSize(0),
+    numLaneVariables(0),
+    miniBatchSize(1),
+    numAccumulatedSamples(0),
+    hasGradientRuns(false),
+    snapshotSize(0),
+    hasStateRanges(false),
+    statePool(new UnrolledStatePool()),
+    usesDropout(true),
+    random(Random::getDefault().next())
     {
-        this->initialize(targetLayers);
+        this->initialize(targetLayers, shouldOptimize);
     }
     
     inline UnrolledTrainingContext::Ptr UnrolledNetwork::getContext() const noexcept
@@ -116,46 +328,208 @@ namespace TinyRNN
         return this->trainingContext;
     }
     
+    inline void UnrolledNetwork::setExecutionMode(ExecutionMode mode) noexcept
+    {
+        this->executionMode = mode;
+    }
+    
+    inline UnrolledNetwork::ExecutionMode UnrolledNetwork::getExecutionMode() const noexcept
+    {
+        return this->executionMode;
+    }
+    
+    inline void UnrolledNetwork::setNumThreads(Index targetNumThreads) noexcept
+    {
+        this->numThreads = std::max(targetNumThreads, Index(1));
+    }
+    
+    inline Index UnrolledNetwork::getNumThreads() const noexcept
+    {
+        return this->numThreads;
+    }
+    
     //===------------------------------------------------------------------===//
     // Compiling
     //===------------------------------------------------------------------===//
     
-    inline bool UnrolledNetwork::initialize(const VMLayers &targetLayers)
+    inline bool UnrolledNetwork::initialize(const VMLayers &targetLayers, bool shouldOptimize)
     {
         const ScopedTimer timer("UnrolledNetwork::initialize");
         
-        srand(time(0));
-        
         this->feedKernel = this->compileFeedKernel(targetLayers);
         this->trainKernel = this->compileTrainKernel(targetLayers);
+        this->accumulatingTrainKernel = nullptr;
+        this->miniBatchSize = 1;
+        this->numAccumulatedSamples = 0;
+        this->hasStateRanges = false;
+        
+        this->optimizationReport.clear();
+        
+        if (shouldOptimize)
+        {
+            const UnrolledKernelOptimizer optimizer;
+            this->optimizationReport =
+            optimizer.run(this->feedKernel->commands, this->feedKernel->indices, this->feedKernel->chunks,
+                          this->trainKernel->commands, this->trainKernel->indices, this->trainKernel->chunks,
+                          this->trainingContext->getOutputVariables());
+            
+            this->renumberVariables();
+        }
         
         return true;
     }
     
+    // allocateOrReuseVariable assigns indices in the order the neurons are built,
+    // so a single FeedState loop would gather its operands from all over the memory
+    inline void UnrolledNetwork::renumberVariables()
+    {
+        this->applyGradients();
+        
+        const auto &localityOrder =
+        UnrolledKernelOptimizer::getLocalityOrder(this->feedKernel->commands, this->feedKernel->indices,
+                                                  this->trainKernel->commands, this->trainKernel->indices,
+                                                  Index(this->trainingContext->getMemory().size()));
+        
+        // The weights and biases are then moved into one contiguous run, keeping their order,
+        // and the gradients into a parallel run after it, so that applyGradients() is a plain w[i] += g[i] loop;
+        // each variable is ranked by its group, and then by its own place, or by the place of its weight
+        const auto &mapping = this->trainingContext->getMapping();
+        std::vector<std::pair<Index, Index>> ranks(localityOrder.size());
+        
+        for (size_t v = 0; v < localityOrder.size(); ++v)
+        {
+            ranks[v] = {0, localityOrder[v]};
+        }
+        
+        for (const auto &i : mapping)
+        {
+            if (i.first.tag == Keys::Mapping::Weight ||
+                i.first.tag == Keys::Mapping::Bias)
+            {
+                ranks[i.second] = {1, localityOrder[i.second]};
+            }
+            else if (i.first.tag == Keys::Mapping::BatchGradient)
+            {
+                UnrolledTrainingContext::VariableKey trainableKey = i.first;
+                trainableKey.tag = Keys::Mapping::Weight;
+                const Index *trainable = mapping.find(trainableKey);
+                
+                if (trainable == nullptr)
+                {
+                    trainableKey.tag = Keys::Mapping::Bias;
+                    trainable = mapping.find(trainableKey);
+                }
+                
+                ranks[i.second] = {2, localityOrder[(trainable != nullptr) ? *trainable : i.second]};
+            }
+        }
+        
+        UnrolledTrainingContext::Indices order(ranks.size());
+        std::iota(order.begin(), order.end(), Index(0));
+        std::sort(order.begin(), order.end(), [&ranks](Index a, Index b) { return ranks[a] < ranks[b]; });
+        
+        UnrolledTrainingContext::Indices newIndices(order.size());
+        
+        for (size_t k = 0; k < order.size(); ++k)
+        {
+            newIndices[order[k]] = Index(k);
+        }
+        
+        UnrolledKernelOptimizer::renumber(this->feedKernel->commands, this->feedKernel->indices, newIndices);
+        UnrolledKernelOptimizer::renumber(this->trainKernel->commands, this->trainKernel->indices, newIndices);
+        this->feedKernel->clearCode();
+        this->trainKernel->clearCode();
+        this->trainingContext->renumberVariables(newIndices);
+        this->hasStateRanges = false;
+        this->statePool = UnrolledStatePool::Ptr(new UnrolledStatePool());
+        
+        // The batched kernels are built again in the new order, and each variable's run of lanes moves as a whole;
+        // the variables allocated after setBatchSize() take their values from the context
+        if (this->batchSize > 0)
+        {
+            const size_t lanes = this->batchSize;
+            const UnrolledTrainingContext::Indices oldBatchIndices = this->batchIndices;
+            const Index oldNumLaneVariables = this->numLaneVariables;
+            this->compileBatchedKernels();
+            
+            const auto &memory = this->trainingContext->getMemory();
+            UnrolledTrainingContext::RawData batchMemory(size_t(this->numLaneVariables) * lanes);
+            
+            for (size_t v = 0; v < newIndices.size(); ++v)
+            {
+                const Index slot = this->batchIndices[newIndices[v]];
+                
+                if (slot >= this->numLaneVariables)
+                {
+                    continue;
+                }
+                
+                Value *target = batchMemory.data() + size_t(slot) * lanes;
+                
+                if (v < oldBatchIndices.size() && oldBatchIndices[v] < oldNumLaneVariables)
+                {
+                    std::copy_n(this->batchMemory.data() + size_t(oldBatchIndices[v]) * lanes, lanes, target);
+                }
+                else
+                {
+                    std::fill_n(target, lanes, memory[newIndices[v]]);
+                }
+            }
+            
+            this->batchMemory.swap(batchMemory);
+        }
+        
+        // Renumbered in place, as the views point to them
+        for (auto &i : this->activationsViews)
+        {
+            for (auto &variable : i.second)
+            {
+                variable = newIndices[variable];
+            }
+        }
+        
+        if (this->accumulatingTrainKernel != nullptr)
+        {
+            this->accumulatingTrainKernel = this->compileAccumulatingTrainKernel();
+        }
+    }
+    
+    inline const UnrolledKernelOptimizer::Report &UnrolledNetwork::getOptimizationReport() const noexcept
+    {
+        return this->optimizationReport;
+    }
+    
+    inline void UnrolledNetwork::setRandomSeed(uint64_t seed) noexcept
+    {
+        this->random.setSeed(seed);
+    }
+
 #define VALUE_STRING std::string((sizeof(Value) == sizeof(double)) ? "double" : "float")
     
     //===------------------------------------------------------------------===//
     // Compiling all the expressions
     //===------------------------------------------------------------------===//
     
-    static bool kVMUsesDropout = true;
+    inline Value UnrolledNetwork::getDropoutFactor() noexcept
+    {
+        // At test time, do not droupout,
+        // But scale activation by p (the probability of dropout, 0.5 for now)
+        return this->usesDropout ? Value(this->random.nextBool()) : Value(0.5);
+    }
     
     static void vmProcess(const char *commands,
                           const Index *indices,
-                          Value *registers)
+                          Value *registers,
+                          Value dropout)
     {
         uint32_t c = 0; // command number
         uint32_t i = 0; // index number
         char command = 0;
-        
+
 #define I(INDEX) (indices[i + INDEX])
 #define X(INDEX) (registers[indices[i + INDEX]])
 #define SKIP(NUMBER) (i += NUMBER)
         
-        // At test time, do not droupout,
-        // But scale activation by p (the probability of dropout, 0.5 for now)
-        const Value dropout = kVMUsesDropout ? Value(rand() % 2) : Value(0.5);
-        
         while (command != VMProgram::End)
         {
             switch (command = commands[c++])
@@ -169,7 +543,7 @@ namespace TinyRNN
                                     std::min(X(0), Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD)));
                     SKIP(1);
                     break;
-                    
+                
                 case VMProgram::ActivationSigmoid:
                     X(0) = (1.0 / (1.0 + exp(-X(1))));
                     i += 2;
@@ -182,7 +556,7 @@ namespace TinyRNN
                     X(0) = X(1) * (1.0 - X(1));
                     i += 2;
                     break;
-                    
+                
                 case VMProgram::ActivationTanh:
                 {
                     const Value eP = exp(X(1));
@@ -203,7 +577,7 @@ namespace TinyRNN
                     X(0) = 1.0 - (X(1) * X(1));
                     i += 2;
                     break;
-                    
+                
                 case VMProgram::ActivationLeakyReLU:
                     X(0) = X(1) > 0.0 ? X(1) : (0.01 * X(1));
                     SKIP(2);
@@ -216,7 +590,7 @@ namespace TinyRNN
                     X(0) = X(1) > 0.0 ? 1.0 : 0.01;
                     SKIP(2);
                     break;
-                    
+                
                 case VMProgram::AAP:
                     X(0) = X(0) + X(1) * X(2);
                     SKIP(3);
@@ -265,7 +639,7 @@ namespace TinyRNN
                     X(0) = X(1) * X(2) * X(3) + X(4) * X(5) * X(6);
                     SKIP(7);
                     break;
-                    
+                
                 case VMProgram::FeedState:
                 {
                     const auto loopCount = I(0);
@@ -280,7 +654,79 @@ namespace TinyRNN
                     
                     break;
                 }
-                    
+                
+                case VMProgram::ActivationDerivativeSigmoid:
+                    X(0) = (1.0 / (1.0 + exp(-X(2))));
+                    X(1) = X(0) * (1.0 - X(0));
+                    SKIP(3);
+                    break;
+                case VMProgram::DropoutActivationDerivativeSigmoid:
+                    X(0) = Value(dropout) * (1.0 / (1.0 + exp(-X(2))));
+                    X(1) = X(0) * (1.0 - X(0));
+                    SKIP(3);
+                    break;
+                case VMProgram::ActivationDerivativeTanh:
+                {
+                    const Value eP = exp(X(2));
+                    const Value eN = 1.0 / eP;
+                    X(0) = (eP - eN) / (eP + eN);
+                    X(1) = 1.0 - (X(0) * X(0));
+                    SKIP(3);
+                    break;
+                }
+                case VMProgram::DropoutActivationDerivativeTanh:
+                {
+                    const Value eP = exp(X(2));
+                    const Value eN = 1.0 / eP;
+                    X(0) = Value(dropout) * ((eP - eN) / (eP + eN));
+                    X(1) = 1.0 - (X(0) * X(0));
+                    SKIP(3);
+                    break;
+                }
+                case VMProgram::ActivationDerivativeLeakyReLU:
+                    X(0) = X(2) > 0.0 ? X(2) : (0.01 * X(2));
+                    X(1) = X(2) > 0.0 ? 1.0 : 0.01;
+                    SKIP(3);
+                    break;
+                case VMProgram::DropoutActivationDerivativeLeakyReLU:
+                    X(0) = Value(dropout) * (X(2) > 0.0 ? X(2) : (0.01 * X(2)));
+                    X(1) = X(2) > 0.0 ? 1.0 : 0.01;
+                    SKIP(3);
+                    break;
+                case VMProgram::ClipAAP:
+                    X(2) = std::max(Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD),
+                                    std::min(X(2), Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD)));
+                    X(0) = X(0) + X(1) * X(2);
+                    SKIP(3);
+                    break;
+                
+                case VMProgram::Softmax:
+                    VMProgram::softmax(registers, &I(0));
+                    SKIP(VMProgram::getNumOperands(command, &I(0)));
+                    break;
+                case VMProgram::SoftmaxCrossEntropy:
+                    VMProgram::softmaxCrossEntropy(registers, &I(0));
+                    SKIP(VMProgram::getNumOperands(command, &I(0)));
+                    break;
+                
+                case VMProgram::GatherActiveInputs:
+                    VMProgram::gatherActiveInputs(registers, &I(0));
+                    SKIP(VMProgram::getNumOperands(command, &I(0)));
+                    break;
+                case VMProgram::FeedStateSparse:
+                    VMProgram::feedStateSparse(registers, &I(0));
+                    SKIP(VMProgram::getNumOperands(command, &I(0)));
+                    break;
+                case VMProgram::TraceSparse:
+                    VMProgram::traceSparse(registers, &I(0));
+                    SKIP(VMProgram::getNumOperands(command, &I(0)));
+                    break;
+                case VMProgram::TrainSparse:
+                case VMProgram::TrainSparseClipped:
+                    VMProgram::trainSparse(registers, &I(0), (command == VMProgram::TrainSparseClipped));
+                    SKIP(VMProgram::getNumOperands(command, &I(0)));
+                    break;
+                
                 default:
                     break;
             }
@@ -307,6 +753,8 @@ namespace TinyRNN
                 kernel->indices.reserve(kernel->indices.size() + feedIndices.size() + traceIndices.size());
                 kernel->indices.insert(kernel->indices.end(), feedIndices.begin(), feedIndices.end());
                 kernel->indices.insert(kernel->indices.end(), traceIndices.begin(), traceIndices.end());
+                
+                kernel->chunks.push_back(Index(feedCommands.size() + traceCommands.size()));
             }
         }
         
@@ -332,6 +780,8 @@ namespace TinyRNN
                 kernel->commands.insert(kernel->commands.end(), trainCommands.begin(), trainCommands.end());
                 kernel->indices.reserve(kernel->indices.size() + trainIndices.size());
                 kernel->indices.insert(kernel->indices.end(), trainIndices.begin(), trainIndices.end());
+                
+                kernel->chunks.push_back(Index(trainCommands.size()));
             }
         }
         
@@ -343,82 +793,858 @@ namespace TinyRNN
     // Core
     //===------------------------------------------------------------------===//
     
-    inline UnrolledTrainingContext::RawData UnrolledNetwork::feed(const UnrolledTrainingContext::RawData &inputs)
+    inline void UnrolledNetwork::process(Kernel &kernel)
     {
-        std::fill(this->trainingContext->getOutputs().begin(),
-                  this->trainingContext->getOutputs().end(),
-                  0.0);
+        Value *memory = this->trainingContext->getMemory().data();
+        const Value dropout = this->getDropoutFactor();
         
-        const auto &inputIds = this->trainingContext->getInputVariables();
-        for (size_t i = 0; i < inputIds.size(); ++i)
+        if (this->executionMode == Interpreted)
+        {
+            vmProcess(kernel.commands.data(), kernel.indices.data(), memory, dropout);
+            return;
+        }
+        
+        if (this->executionMode == Parallel)
         {
-            this->trainingContext->getMemory()[inputIds[i]] = inputs[i];
+            if (kernel.parallelCode.getNumThreads() != this->numThreads)
+            {
+                kernel.parallelCode.schedule(kernel.commands, kernel.indices, kernel.chunks, this->numThreads);
+            }
+            
+            kernel.parallelCode.run(memory, dropout);
+            return;
         }
         
-        vmProcess(this->feedKernel->commands.data(),
-                  this->feedKernel->indices.data(),
-                  this->trainingContext->getMemory().data());
+        // Where there is no jit, fall back to the threaded code
+        if ((this->executionMode == Jit || this->executionMode == JitFused) &&
+            UnrolledJitKernel::isAvailable())
+        {
+            const bool shouldUseFusedOps =
+                (this->executionMode == JitFused) && UnrolledJitKernel::supportsFusedOps();
+            
+            if (! kernel.nativeCode.isCompiled() ||
+                kernel.nativeCode.usesFusedOps() != shouldUseFusedOps)
+            {
+                kernel.nativeCode.compile(kernel.commands, kernel.indices, shouldUseFusedOps);
+            }
+            
+            if (kernel.nativeCode.isCompiled())
+            {
+                kernel.nativeCode.run(memory, dropout);
+                return;
+            }
+        }
         
-        const auto &outputIds = this->trainingContext->getOutputVariables();
-        for (size_t i = 0; i < outputIds.size(); ++i)
+        if (! kernel.threadedCode.isDecoded())
         {
-            this->trainingContext->getOutputs()[i] = this->trainingContext->getMemory()[outputIds[i]];
+            kernel.threadedCode.decode(kernel.commands, kernel.indices);
         }
         
-        // Set not to use dropout next time we feed forward
-        // Will be reset back to true in train()
-        kVMUsesDropout = false;
+        kernel.threadedCode.run(memory, dropout);
+    }
+    
+    inline UnrolledTrainingContext::RawData UnrolledNetwork::feed(const UnrolledTrainingContext::RawData &inputs)
+    {
+        auto &outputs = this->trainingContext->getOutputs();
+        std::fill(outputs.begin(), outputs.end(), 0.0);
         
-        return this->trainingContext->getOutputs();
+        this->feedStep(inputs.data(), this->trainingContext->getInputVariables(),
+                       outputs.data(), this->trainingContext->getOutputVariables());
+        
+        return outputs;
     }
     
     inline void UnrolledNetwork::train(Value rate, const UnrolledTrainingContext::RawData &targets)
     {
-        kVMUsesDropout = true;
+        this->trainStep(rate, targets.data(), this->trainingContext->getTargetVariables());
+    }
+    
+    inline void UnrolledNetwork::feed(const Value *inputs, Value *outputs)
+    {
+        this->feedStep(inputs, this->trainingContext->getInputVariables(),
+                       outputs, this->trainingContext->getOutputVariables());
+    }
+    
+    inline void UnrolledNetwork::train(Value rate, const Value *targets)
+    {
+        this->trainStep(rate, targets, this->trainingContext->getTargetVariables());
+    }
+    
+    inline bool UnrolledNetwork::feedSparse(const Index *activeInputs, const Value *values,
+                                            size_t numActive, Value *outputs)
+    {
+        const Indices &inputIds = this->trainingContext->getInputVariables();
+        const Indices &outputIds = this->trainingContext->getOutputVariables();
         
-        const auto &targetIds = this->trainingContext->getTargetVariables();
-        for (size_t i = 0; i < targetIds.size(); ++i)
+        for (size_t k = 0; k < numActive; ++k)
         {
-            this->trainingContext->getMemory()[targetIds[i]] = targets[i];
+            if (activeInputs[k] >= inputIds.size())
+            {
+                return false;
+            }
         }
         
-        const auto rateId = this->trainingContext->getRateVariable();
-        this->trainingContext->getMemory()[rateId] = rate;
+        Value *memory = this->trainingContext->getMemory().data();
+        
+        // Anything might have been written to the inputs since the last feed, e.g. by generate(),
+        // and clearing them all is nothing compared to the neurons going through all of them
+        for (const auto &inputId : inputIds)
+        {
+            memory[inputId] = 0.0;
+        }
+        
+        for (size_t k = 0; k < numActive; ++k)
+        {
+            memory[inputIds[activeInputs[k]]] = (values != nullptr) ? values[k] : Value(1.0);
+        }
+        
+        this->process(*this->feedKernel);
+        
+        if (outputs != nullptr)
+        {
+            for (size_t i = 0; i < outputIds.size(); ++i)
+            {
+                outputs[i] = memory[outputIds[i]];
+            }
+        }
         
-        vmProcess(this->trainKernel->commands.data(),
-                  this->trainKernel->indices.data(),
-                  this->trainingContext->getMemory().data());
+        this->usesDropout = false;
+        return true;
     }
     
-    //===------------------------------------------------------------------===//
-    // Serialization
-    //===------------------------------------------------------------------===//
+    inline UnrolledTrainingContext::View UnrolledNetwork::getOutputsView() const
+    {
+        return this->trainingContext->getView(this->trainingContext->getOutputVariables());
+    }
     
-    inline void UnrolledNetwork::deserialize(SerializationContext::Ptr context)
+    inline UnrolledTrainingContext::View UnrolledNetwork::getActivationsView(const std::vector<Id> &neuronUuids) const
     {
-        this->feedKernel = nullptr;
-        this->trainKernel = nullptr;
+        auto cached = this->activationsViews.find(neuronUuids);
         
-        if (auto feedKernelNode = context->getChildContext(Keys::Unrolled::FeedKernel))
+        if (cached == this->activationsViews.end())
         {
-            this->feedKernel = Kernel::Ptr(new Kernel());
-            this->feedKernel->deserialize(feedKernelNode);
+            UnrolledTrainingContext::Indices variables;
+            
+            for (const auto &uuid : neuronUuids)
+            {
+                if (const Index *variable = this->trainingContext->getMapping().find({uuid, Keys::Mapping::Activation}))
+                {
+                    variables.push_back(*variable);
+                }
+            }
+            
+            cached = this->activationsViews.insert({neuronUuids, variables}).first;
         }
         
-        if (auto trainKernelNode = context->getChildContext(Keys::Unrolled::TrainKernel))
+        return this->trainingContext->getView(cached->second);
+    }
+    
+    inline void UnrolledNetwork::feedSequence(const Value *inputs, size_t numSteps, Value *outputs)
+    {
+        const Indices &inputIds = this->trainingContext->getInputVariables();
+        const Indices &outputIds = this->trainingContext->getOutputVariables();
+        
+        for (size_t t = 0; t < numSteps; ++t)
         {
-            this->trainKernel = Kernel::Ptr(new Kernel());
-            this->trainKernel->deserialize(trainKernelNode);
+            this->feedStep(inputs + t * inputIds.size(), inputIds,
+                           outputs + t * outputIds.size(), outputIds);
         }
     }
     
-    inline void UnrolledNetwork::serialize(SerializationContext::Ptr context) const
+    inline void UnrolledNetwork::trainSequence(Value rate, const Value *inputs, const Value *targets,
+                                               size_t numSteps, Value *outputs)
     {
-        SerializationContext::Ptr feedKernelNode(context->addChildContext(Keys::Unrolled::FeedKernel));
-        this->feedKernel->serialize(feedKernelNode);
+        const Indices &inputIds = this->trainingContext->getInputVariables();
+        const Indices &outputIds = this->trainingContext->getOutputVariables();
+        const Indices &targetIds = this->trainingContext->getTargetVariables();
         
-        SerializationContext::Ptr trainKernelNode(context->addChildContext(Keys::Unrolled::TrainKernel));
-        this->trainKernel->serialize(trainKernelNode);
+        for (size_t t = 0; t < numSteps; ++t)
+        {
+            this->feedStep(inputs + t * inputIds.size(), inputIds,
+                           (outputs != nullptr) ? (outputs + t * outputIds.size()) : nullptr, outputIds);
+            
+            this->trainStep(rate, targets + t * targetIds.size(), targetIds);
+        }
+    }
+    
+    inline bool UnrolledNetwork::generate(const Value *inputs, size_t numSteps, Value *outputs,
+                                          Feedback feedback, Index *symbols)
+    {
+        const Indices &inputIds = this->trainingContext->getInputVariables();
+        const Indices &outputIds = this->trainingContext->getOutputVariables();
+        const size_t numOutputs = outputIds.size();
+        
+        if (inputIds.size() != numOutputs || numOutputs == 0)
+        {
+            return false;
+        }
+        
+        Value *memory = this->trainingContext->getMemory().data();
+        
+        for (size_t i = 0; i < numOutputs; ++i)
+        {
+            memory[inputIds[i]] = inputs[i];
+        }
+        
+        for (size_t t = 0; t < numSteps; ++t)
+        {
+            this->process(*this->feedKernel);
+            this->usesDropout = false;
+            
+            size_t symbol = 0;
+            Value sum = 0.0;
+            
+            for (size_t i = 0; i < numOutputs; ++i)
+            {
+                const Value output = memory[outputIds[i]];
+                symbol = (output > memory[outputIds[symbol]]) ? i : symbol;
+                sum += std::max(output, Value(0.0));
+                
+                if (outputs != nullptr)
+                {
+                    outputs[t * numOutputs + i] = output;
+                }
+            }
+            
+            if (feedback == Outputs)
+            {
+                for (size_t i = 0; i < numOutputs; ++i)
+                {
+                    memory[inputIds[i]] = memory[outputIds[i]];
+                }
+                
+                continue;
+            }
+            
+            // negative scores are never drawn, and if all of them are, the argmax is taken
+            if (feedback == Sample && sum > 0.0)
+            {
+                Value threshold = this->random.nextUniform(0.0, sum);
+                
+                for (size_t i = 0; i < numOutputs; ++i)
+                {
+                    threshold -= std::max(memory[outputIds[i]], Value(0.0));
+                    
+                    if (threshold < 0.0)
+                    {
+                        symbol = i;
+                        break;
+                    }
+                }
+            }
+            
+            for (size_t i = 0; i < numOutputs; ++i)
+            {
+                memory[inputIds[i]] = Value(i == symbol);
+            }
+            
+            if (symbols != nullptr)
+            {
+                symbols[t] = Index(symbol);
+            }
+        }
+        
+        return true;
+    }
+    
+    inline void UnrolledNetwork::feedStep(const Value *inputs, const Indices &inputIds,
+                                          Value *outputs, const Indices &outputIds)
+    {
+        Value *memory = this->trainingContext->getMemory().data();
+        
+        for (size_t i = 0; i < inputIds.size(); ++i)
+        {
+            memory[inputIds[i]] = inputs[i];
+        }
+        
+        this->process(*this->feedKernel);
+        
+        if (outputs != nullptr)
+        {
+            for (size_t i = 0; i < outputIds.size(); ++i)
+            {
+                outputs[i] = memory[outputIds[i]];
+            }
+        }
+        
+        // Set not to use dropout next time we feed forward
+        // Will be reset back to true in train()
+        this->usesDropout = false;
+    }
+    
+    inline void UnrolledNetwork::trainStep(Value rate, const Value *targets, const Indices &targetIds)
+    {
+        this->usesDropout = true;
+        
+        Value *memory = this->trainingContext->getMemory().data();
+        
+        for (size_t i = 0; i < targetIds.size(); ++i)
+        {
+            memory[targetIds[i]] = targets[i];
+        }
+        
+        memory[this->trainingContext->getRateVariable()] = rate;
+        
+        if (this->accumulatingTrainKernel == nullptr)
+        {
+            this->process(*this->trainKernel);
+            return;
+        }
+        
+        this->process(*this->accumulatingTrainKernel);
+        
+        if (++this->numAccumulatedSamples == this->miniBatchSize)
+        {
+            this->applyGradients();
+        }
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Mini-batch mode
+    //===------------------------------------------------------------------===//
+    
+    inline bool UnrolledNetwork::setMiniBatchSize(Index numSamples)
+    {
+        this->applyGradients();
+        this->accumulatingTrainKernel = nullptr;
+        this->miniBatchSize = std::max(numSamples, Index(1));
+        
+        if (this->miniBatchSize == 1)
+        {
+            return true;
+        }
+        
+        this->accumulatingTrainKernel = this->compileAccumulatingTrainKernel();
+        
+        if (this->accumulatingTrainKernel == nullptr)
+        {
+            this->miniBatchSize = 1;
+            return false;
+        }
+        
+        return true;
+    }
+    
+    inline Index UnrolledNetwork::getMiniBatchSize() const noexcept
+    {
+        return this->miniBatchSize;
+    }
+    
+    // Each weight and bias gets a gradient variable, all of them allocated together at the end of memory
+    // the first time, in the order of the weights, and the copy of the train kernel accumulates into those instead;
+    // the reads are left in place, so all the samples of a mini-batch see the same weights
+    inline UnrolledNetwork::Kernel::Ptr UnrolledNetwork::compileAccumulatingTrainKernel()
+    {
+        using Key = UnrolledTrainingContext::VariableKey;
+        
+        std::vector<std::pair<Index, Key>> trainableKeys;
+        
+        for (const auto &i : this->trainingContext->getMapping())
+        {
+            if (i.first.tag == Keys::Mapping::Weight ||
+                i.first.tag == Keys::Mapping::Bias)
+            {
+                trainableKeys.push_back({i.second, i.first});
+            }
+        }
+        
+        std::sort(trainableKeys.begin(), trainableKeys.end(),
+                  [](const std::pair<Index, Key> &a, const std::pair<Index, Key> &b) { return a.first < b.first; });
+        
+        this->trainableVariables.clear();
+        this->gradientVariables.clear();
+        
+        for (const auto &i : trainableKeys)
+        {
+            Key gradientKey = i.second;
+            gradientKey.tag = Keys::Mapping::BatchGradient;
+            
+            this->trainableVariables.push_back(i.first);
+            this->gradientVariables.push_back(this->trainingContext->allocateOrReuseVariable(0.0, gradientKey));
+        }
+        
+        this->hasGradientRuns = true;
+        
+        for (size_t i = 0; i < this->trainableVariables.size(); ++i)
+        {
+            this->hasGradientRuns = this->hasGradientRuns &&
+            (this->trainableVariables[i] == this->trainableVariables.front() + i) &&
+            (this->gradientVariables[i] == this->gradientVariables.front() + i);
+        }
+        
+        UnrolledTrainingContext::Indices newIndices(this->trainingContext->getMemory().size());
+        std::iota(newIndices.begin(), newIndices.end(), Index(0));
+        
+        for (size_t i = 0; i < this->trainableVariables.size(); ++i)
+        {
+            newIndices[this->trainableVariables[i]] = this->gradientVariables[i];
+        }
+        
+        Kernel::Ptr kernel(new Kernel());
+        kernel->commands = this->trainKernel->commands;
+        kernel->indices = this->trainKernel->indices;
+        kernel->chunks = this->trainKernel->chunks;
+        
+        if (! UnrolledKernelOptimizer::redirectAccumulations(kernel->commands, kernel->indices, newIndices))
+        {
+            return nullptr;
+        }
+        
+        return kernel;
+    }
+    
+    inline void UnrolledNetwork::applyGradients()
+    {
+        if (this->accumulatingTrainKernel == nullptr)
+        {
+            return;
+        }
+        
+        Value *memory = this->trainingContext->getMemory().data();
+        const size_t numTrainableVariables = this->trainableVariables.size();
+        
+        if (this->hasGradientRuns && numTrainableVariables > 0)
+        {
+            Value *weights = memory + this->trainableVariables.front();
+            Value *gradients = memory + this->gradientVariables.front();
+            
+            for (size_t i = 0; i < numTrainableVariables; ++i)
+            {
+                weights[i] += gradients[i];
+            }
+            
+            std::fill_n(gradients, numTrainableVariables, Value(0.0));
+        }
+        else
+        {
+            for (size_t i = 0; i < numTrainableVariables; ++i)
+            {
+                memory[this->trainableVariables[i]] += memory[this->gradientVariables[i]];
+                memory[this->gradientVariables[i]] = 0.0;
+            }
+        }
+        
+        this->numAccumulatedSamples = 0;
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Batched mode
+    //===------------------------------------------------------------------===//
+    
+    inline bool UnrolledNetwork::setBatchSize(Index numLanes)
+    {
+        this->batchSize = 0;
+        this->batchMemory.clear();
+        this->batchIndices.clear();
+        this->numLaneVariables = 0;
+        this->batchedFeedKernel = nullptr;
+        this->batchedTrainKernel = nullptr;
+        
+        if (numLanes == 0)
+        {
+            return true;
+        }
+        
+        if (! this->compileBatchedKernels())
+        {
+            return false;
+        }
+        
+        this->batchSize = numLanes;
+        
+        const auto &memory = this->trainingContext->getMemory();
+        this->batchMemory.resize(size_t(this->numLaneVariables) * numLanes);
+        
+        for (size_t v = 0; v < memory.size(); ++v)
+        {
+            const Index slot = this->batchIndices[v];
+            
+            if (slot < this->numLaneVariables)
+            {
+                std::fill_n(this->batchMemory.begin() + size_t(slot) * numLanes, numLanes, memory[v]);
+            }
+        }
+        
+        // the context's own gradients, if any, belong to the mini-batch mode
+        for (const auto &v : this->gradientVariables)
+        {
+            std::fill_n(this->batchMemory.begin() + size_t(this->batchIndices[v]) * numLanes, numLanes, Value(0.0));
+        }
+        
+        return true;
+    }
+    
+    // The per-lane variables are numbered in the order they have in the context, skipping the weights and biases,
+    // which are numbered past all of them, keeping their own indices in the context, see UnrolledBatchedKernel;
+    // the train kernel is the accumulating one, so the lanes only ever write to their own gradients
+    inline bool UnrolledNetwork::compileBatchedKernels()
+    {
+        Kernel::Ptr trainKernel = this->compileAccumulatingTrainKernel();
+        
+        if (trainKernel == nullptr)
+        {
+            return false;
+        }
+        
+        const size_t numVariables = this->trainingContext->getMemory().size();
+        std::vector<bool> isShared(numVariables, false);
+        
+        for (const auto &v : this->trainableVariables)
+        {
+            isShared[v] = true;
+        }
+        
+        this->batchIndices.resize(numVariables);
+        this->numLaneVariables = 0;
+        
+        for (size_t v = 0; v < numVariables; ++v)
+        {
+            if (! isShared[v])
+            {
+                this->batchIndices[v] = this->numLaneVariables++;
+            }
+        }
+        
+        for (size_t v = 0; v < numVariables; ++v)
+        {
+            if (isShared[v])
+            {
+                this->batchIndices[v] = this->numLaneVariables + Index(v);
+            }
+        }
+        
+        this->batchedFeedKernel = Kernel::Ptr(new Kernel());
+        this->batchedFeedKernel->commands = this->feedKernel->commands;
+        this->batchedFeedKernel->indices = this->feedKernel->indices;
+        UnrolledKernelOptimizer::renumber(this->batchedFeedKernel->commands, this->batchedFeedKernel->indices, this->batchIndices);
+        
+        UnrolledKernelOptimizer::renumber(trainKernel->commands, trainKernel->indices, this->batchIndices);
+        this->batchedTrainKernel = trainKernel;
+        return true;
+    }
+    
+    inline Index UnrolledNetwork::getBatchSize() const noexcept
+    {
+        return this->batchSize;
+    }
+    
+    inline UnrolledTrainingContext::RawData UnrolledNetwork::feedBatch(const UnrolledTrainingContext::RawData &inputs)
+    {
+        const Index lanes = this->batchSize;
+        Value *memory = this->batchMemory.data();
+        
+        const auto &inputIds = this->trainingContext->getInputVariables();
+        for (Index l = 0; l < lanes; ++l)
+        {
+            for (size_t i = 0; i < inputIds.size(); ++i)
+            {
+                memory[size_t(this->batchIndices[inputIds[i]]) * lanes + l] = inputs[l * inputIds.size() + i];
+            }
+        }
+        
+        UnrolledBatchedKernel::run(this->batchedFeedKernel->commands,
+                                   this->batchedFeedKernel->indices,
+                                   memory, this->trainingContext->getMemory().data(),
+                                   this->numLaneVariables, lanes, this->getDropoutFactor());
+        
+        const auto &outputIds = this->trainingContext->getOutputVariables();
+        UnrolledTrainingContext::RawData outputs(lanes * outputIds.size());
+        for (Index l = 0; l < lanes; ++l)
+        {
+            for (size_t i = 0; i < outputIds.size(); ++i)
+            {
+                outputs[l * outputIds.size() + i] = memory[size_t(this->batchIndices[outputIds[i]]) * lanes + l];
+            }
+        }
+        
+        // The same dropout logic as in feed()
+        this->usesDropout = false;
+        
+        return outputs;
+    }
+    
+    inline void UnrolledNetwork::trainBatch(Value rate, const UnrolledTrainingContext::RawData &targets)
+    {
+        this->usesDropout = true;
+        
+        const Index lanes = this->batchSize;
+        Value *memory = this->batchMemory.data();
+        
+        const auto &targetIds = this->trainingContext->getTargetVariables();
+        for (Index l = 0; l < lanes; ++l)
+        {
+            for (size_t i = 0; i < targetIds.size(); ++i)
+            {
+                memory[size_t(this->batchIndices[targetIds[i]]) * lanes + l] = targets[l * targetIds.size() + i];
+            }
+        }
+        
+        const auto rateId = this->trainingContext->getRateVariable();
+        std::fill_n(memory + size_t(this->batchIndices[rateId]) * lanes, lanes, rate);
+        
+        Value *weights = this->trainingContext->getMemory().data();
+        
+        UnrolledBatchedKernel::run(this->batchedTrainKernel->commands,
+                                   this->batchedTrainKernel->indices,
+                                   memory, weights,
+                                   this->numLaneVariables, lanes, this->getDropoutFactor());
+        
+        // Each lane has summed up its own updates, and the weights get the average of them
+        for (size_t i = 0; i < this->trainableVariables.size(); ++i)
+        {
+            Value *gradients = memory + size_t(this->batchIndices[this->gradientVariables[i]]) * lanes;
+            Value sum = 0;
+            
+            for (Index l = 0; l < lanes; ++l)
+            {
+                sum += gradients[l];
+            }
+            
+            weights[this->trainableVariables[i]] += sum / Value(lanes);
+            std::fill_n(gradients, lanes, Value(0.0));
+        }
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Resetting the state
+    //===------------------------------------------------------------------===//
+    
+    inline void UnrolledNetwork::resetState()
+    {
+        if (! this->hasStateRanges)
+        {
+            this->findStateRanges();
+        }
+        
+        Value *memory = this->trainingContext->getMemory().data();
+        
+        for (const auto &range : this->stateRanges)
+        {
+            std::fill(memory + range.first, memory + range.second, Value(0.0));
+        }
+        
+        for (const auto &range : this->gainRanges)
+        {
+            std::fill(memory + range.first, memory + range.second, Value(1.0));
+        }
+        
+        if (this->batchSize == 0)
+        {
+            return;
+        }
+        
+        // the lanes of a variable are adjacent, and the runs have no weights in them,
+        // so they stay runs in the batch memory, just wider
+        const size_t lanes = this->batchSize;
+        Value *batchMemory = this->batchMemory.data();
+        
+        for (const auto &range : this->stateRanges)
+        {
+            const size_t first = this->batchIndices[range.first];
+            std::fill(batchMemory + first * lanes, batchMemory + (first + range.second - range.first) * lanes, Value(0.0));
+        }
+        
+        for (const auto &range : this->gainRanges)
+        {
+            const size_t first = this->batchIndices[range.first];
+            std::fill(batchMemory + first * lanes, batchMemory + (first + range.second - range.first) * lanes, Value(1.0));
+        }
+    }
+    
+    inline void UnrolledNetwork::findStateRanges()
+    {
+        const auto getRanges = [this](const std::vector<Id> &tags)
+        {
+            Indices variables;
+            for (const auto &tag : tags)
+            {
+                const auto &taggedVariables = this->trainingContext->getVariablesWithTag(tag);
+                variables.insert(variables.end(), taggedVariables.begin(), taggedVariables.end());
+            }
+            
+            std::sort(variables.begin(), variables.end());
+            
+            Ranges ranges;
+            for (const auto &variable : variables)
+            {
+                if (! ranges.empty() && ranges.back().second == variable)
+                {
+                    ranges.back().second++;
+                }
+                else
+                {
+                    ranges.push_back({ variable, variable + 1 });
+                }
+            }
+            
+            return ranges;
+        };
+        
+        this->stateRanges = getRanges({ Keys::Mapping::Activation, Keys::Mapping::Derivative,
+                                        Keys::Mapping::State, Keys::Mapping::OldState,
+                                        Keys::Mapping::ErrorResponsibility, Keys::Mapping::ProjectedActivity,
+                                        Keys::Mapping::GatingActivity, Keys::Mapping::Influence,
+                                        Keys::Mapping::Eligibility, Keys::Mapping::ExtendedTrace,
+                                        Keys::Mapping::ActiveInputs, Keys::Mapping::ActiveInput,
+                                        Keys::Mapping::PreviousActiveInputs, Keys::Mapping::PreviousActiveInput });
+        
+        this->gainRanges = getRanges({ Keys::Mapping::Gain });
+        
+        this->snapshotRanges = this->stateRanges;
+        this->snapshotRanges.insert(this->snapshotRanges.end(), this->gainRanges.begin(), this->gainRanges.end());
+        std::sort(this->snapshotRanges.begin(), this->snapshotRanges.end());
+        
+        this->snapshotSize = 0;
+        for (const auto &range : this->snapshotRanges)
+        {
+            this->snapshotSize += (range.second - range.first);
+        }
+        
+        this->lossVariables = this->trainingContext->getVariablesWithTag(Keys::Mapping::Loss);
+        
+        this->hasStateRanges = true;
+    }
+    
+    inline Value UnrolledNetwork::getLoss()
+    {
+        if (! this->hasStateRanges)
+        {
+            this->findStateRanges();
+        }
+        
+        Value loss = 0;
+        
+        for (const auto &variable : this->lossVariables)
+        {
+            if (this->batchSize == 0)
+            {
+                loss += this->trainingContext->getMemory()[variable];
+            }
+            
+            for (Index l = 0; l < this->batchSize; ++l)
+            {
+                loss += this->batchMemory[size_t(this->batchIndices[variable]) * this->batchSize + l];
+            }
+        }
+        
+        return loss;
+    }
+    
+    inline void UnrolledNetwork::resetLoss()
+    {
+        if (! this->hasStateRanges)
+        {
+            this->findStateRanges();
+        }
+        
+        auto &memory = this->trainingContext->getMemory();
+        
+        for (const auto &variable : this->lossVariables)
+        {
+            memory[variable] = 0;
+            
+            for (Index l = 0; l < this->batchSize; ++l)
+            {
+                this->batchMemory[size_t(this->batchIndices[variable]) * this->batchSize + l] = 0;
+            }
+        }
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Forking the state
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledStateSnapshot::Ptr UnrolledNetwork::saveState()
+    {
+        if (! this->hasStateRanges)
+        {
+            this->findStateRanges();
+        }
+        
+        return this->statePool->save(this->trainingContext->getMemory().data(),
+                                     this->snapshotRanges, this->snapshotSize);
+    }
+    
+    inline bool UnrolledNetwork::restoreState(const UnrolledStateSnapshot &snapshot)
+    {
+        if (! this->hasStateRanges)
+        {
+            this->findStateRanges();
+        }
+        
+        return this->statePool->restore(snapshot, this->trainingContext->getMemory().data(),
+                                        this->snapshotRanges, this->snapshotSize);
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Inference sessions
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledModel::Ptr UnrolledNetwork::createModel() const
+    {
+        return UnrolledModel::buildFrom(this->feedKernel->commands,
+                                        this->feedKernel->indices,
+                                        this->trainingContext->getMemory(),
+                                        this->trainingContext->getInputVariables(),
+                                        this->trainingContext->getOutputVariables());
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Code generation
+    //===------------------------------------------------------------------===//
+    
+    inline std::string UnrolledNetwork::generateCode(const std::string &namespaceName) const
+    {
+        return UnrolledCodeGenerator::generate(namespaceName,
+                                               this->trainingContext,
+                                               this->feedKernel->commands,
+                                               this->feedKernel->indices,
+                                               this->trainKernel->commands,
+                                               this->trainKernel->indices);
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Serialization
+    //===------------------------------------------------------------------===//
+    
+    inline void UnrolledNetwork::deserialize(SerializationContext::Ptr context)
+    {
+        this->feedKernel = nullptr;
+        this->trainKernel = nullptr;
+        this->accumulatingTrainKernel = nullptr;
+        this->miniBatchSize = 1;
+        this->numAccumulatedSamples = 0;
+        this->hasStateRanges = false;
+        this->statePool = UnrolledStatePool::Ptr(new UnrolledStatePool());
+        this->setBatchSize(0);
+        
+        if (auto feedKernelNode = context->getChildContext(Keys::Unrolled::FeedKernel))
+        {
+            this->feedKernel = Kernel::Ptr(new Kernel());
+            this->feedKernel->deserialize(feedKernelNode);
+        }
+        
+        if (auto trainKernelNode = context->getChildContext(Keys::Unrolled::TrainKernel))
+        {
+            this->trainKernel = Kernel::Ptr(new Kernel());
+            this->trainKernel->deserialize(trainKernelNode);
+        }
+    }
+    
+    inline void UnrolledNetwork::serialize(SerializationContext::Ptr context) const
+    {
+        SerializationContext::Ptr feedKernelNode(context->addChildContext(Keys::Unrolled::FeedKernel));
+        this->feedKernel->serialize(feedKernelNode);
+        
+        SerializationContext::Ptr trainKernelNode(context->addChildContext(Keys::Unrolled::TrainKernel));
+        this->trainKernel->serialize(trainKernelNode);
+    }
+    
+    inline void UnrolledNetwork::Kernel::clearCode()
+    {
+        this->threadedCode.clear();
+        this->nativeCode.release();
+        this->parallelCode.clear();
     }
     
     inline void UnrolledNetwork::Kernel::deserialize(SerializationContext::Ptr context)
@@ -454,7 +1680,7 @@ namespace TinyRNN
         context->setStringProperty(indicesEncoded, Keys::Unrolled::Indices);
         context->setNumberProperty(this->indices.size(), Keys::Unrolled::IndicesSize);
     }
-    
+
 } // namespace TinyRNN
 
 #endif // TINYRNN_VMNETWORK_H_INCLUDED
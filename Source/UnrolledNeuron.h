@@ -78,16 +78,71 @@ namespace TinyRNN
                                             //     x[2] += x[6] * x[7] * x[8];
                                             // }
             
+            // Superinstructions, only emitted by UnrolledKernelOptimizer:
+            
+            ActivationDerivativeSigmoid,        // x[1] = activation(x[3]); x[2] = derivative(x[1]);
+            DropoutActivationDerivativeSigmoid, // same, but with 0.5 chance of dropout
+            ActivationDerivativeTanh,           // x[1] = activation(x[3]); x[2] = derivative(x[1]);
+            DropoutActivationDerivativeTanh,    // same, but with 0.5 chance of dropout
+            ActivationDerivativeLeakyReLU,      // x[1] = activation(x[3]); x[2] = derivative(x[3]);
+            DropoutActivationDerivativeLeakyReLU, // same, but with 0.5 chance of dropout
+            ClipAAP,                            // x[3] = clip(x[3], -1.0, 1.0); x[1] += x[2] * x[3];
+            
+            // Whole-layer operations, only emitted for a softmax output layer:
+            
+            Softmax,                        // for (x[1] number of outputs) {
+                                            //     x[2] = exp(x[3] - max) / sum;            where x[3] is state
+                                            // }
+            SoftmaxCrossEntropy,            // for (x[1] number of outputs) {
+                                            //     x[3] = x[4] - x[5];                      where x[3] is responsibility,
+                                            //     x[2] -= x[4] * log(x[5]);                x[4] is target, x[2] is loss
+                                            // }
+            
+            // Operations on the active inputs only, emitted for an input layer that uses sparse inputs;
+            // each of them has a group of operands per input, and the slots hold the active inputs' positions:
+            
+            GatherActiveInputs,             // x[3] = x[2]; the slots are kept as the previous slots;
+                                            // x[2] = 0;
+                                            // for (x[1] number of inputs) {
+                                            //     if (activation != 0) { slot[x[2]++] = input; }
+                                            // }
+            FeedStateSparse,                // for (x[2] active inputs) {
+                                            //     x[3] += activation * weight * gain;      of the input in the slot
+                                            // }
+            TraceSparse,                    // for (x[3] previously active inputs, then x[2] active inputs) {
+                                            //     eligibility = gain * activation;         of the input in the slot
+                                            // }
+            TrainSparse,                    // for (x[2] active inputs) {
+                                            //     weight += x[3] * x[4] * eligibility;     where x[3] is rate,
+                                            // }                                            x[4] is responsibility
+            TrainSparseClipped,             // same, but weight += x[3] * clip(x[4] * eligibility);
+            
             End = 127
         };
         
+        // The whole-layer operations, shared by all the execution modes, so that they give the same results;
+        // the operands start with the number of outputs, and the variable v is at memory[v * stride]
+        static void softmax(Value *memory, const Index *operands, size_t stride = 1) noexcept;
+        static void softmaxCrossEntropy(Value *memory, const Index *operands, size_t stride = 1) noexcept;
+        
+        // The same for the sparse input operations; the operands start with the number of inputs,
+        // followed by the counts and the neuron's own variables, and then by a group per input,
+        // e.g. n, count, state, (slot, activation, weight, gain) * n for FeedStateSparse
+        static void gatherActiveInputs(Value *memory, const Index *operands, size_t stride = 1) noexcept;
+        static void feedStateSparse(Value *memory, const Index *operands, size_t stride = 1) noexcept;
+        static void traceSparse(Value *memory, const Index *operands, size_t stride = 1) noexcept;
+        static void trainSparse(Value *memory, const Index *operands, bool clipsGradients, size_t stride = 1) noexcept;
+        
+        // The number of the operands after the operation, including the loop counts
+        static Index getNumOperands(char operation, const Index *operands) noexcept;
+        
         friend VMProgram &operator << (VMProgram &i, Index index);
         friend VMProgram &operator << (VMProgram &i, size_t index);
         friend VMProgram &operator << (VMProgram &i, Operation operation);
         
         std::vector<char> commands;
         std::vector<Index> indices;
-
+        
         TINYRNN_DISALLOW_COPY_AND_ASSIGN(VMProgram);
     };
     
@@ -97,7 +152,7 @@ namespace TinyRNN
         
         using Ptr = std::shared_ptr<UnrolledNeuron>;
         using Vector = std::vector<UnrolledNeuron::Ptr>;
-        
+    
     public:
         
         UnrolledNeuron() = default;
@@ -106,18 +161,42 @@ namespace TinyRNN
                                        Neuron::Ptr target,
                                        bool asInput,
                                        bool asOutput,
-                                       bool asConst);
+                                       bool asConst,
+                                       bool inSoftmaxLayer = false,
+                                       const Neuron::Vector *sparseInputs = nullptr);
+        
+        // Not a neuron, but the chunks normalizing the whole layer after all its neurons are fed,
+        // and computing the output responsibilities and the loss before they are trained
+        static UnrolledNeuron::Ptr buildSoftmaxFrom(UnrolledTrainingContext::Ptr context,
+                                              Id layerUuid,
+                                              const Neuron::Vector &targets,
+                                              bool asOutput,
+                                              bool asConst);
+        
+        // Not a neuron either, but the chunk finding the non-zero inputs before anything else is fed,
+        // so that the neurons connected to all of the sparse inputs only go through the active ones
+        static UnrolledNeuron::Ptr buildSparseInputsFrom(UnrolledTrainingContext::Ptr context,
+                                                   const Neuron::Vector &targets);
         
         const VMProgram &getFeedChunk() const noexcept;
         const VMProgram &getTraceChunk() const noexcept;
         const VMProgram &getTrainChunk() const noexcept;
-        
+    
     private:
         
         VMProgram feedProgram;
         VMProgram traceProgram;
         VMProgram trainProgram;
         
+        // Emits TrainSparse or TrainSparseClipped over the first numSparseLinks incoming links
+        static void trainSparseLinks(UnrolledTrainingContext::Ptr context,
+                                     Neuron::Ptr target,
+                                     size_t numSparseLinks,
+                                     VMProgram::Operation operation,
+                                     Index rateVar,
+                                     Index responsibilityVar,
+                                     VMProgram &program);
+        
         TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledNeuron);
     };
     
@@ -143,6 +222,248 @@ namespace TinyRNN
         return i;
     }
     
+    inline void VMProgram::softmax(Value *memory, const Index *operands, size_t stride) noexcept
+    {
+        const Index numOutputs = operands[0];
+        const Index *outputs = operands + 1;
+
+#define ACTIVATION(OUTPUT) (memory[size_t(outputs[(OUTPUT) * 2]) * stride])
+#define STATE(OUTPUT) (memory[size_t(outputs[(OUTPUT) * 2 + 1]) * stride])
+        
+        // shifted by the largest state, so that exp never overflows
+        Value maximum = -std::numeric_limits<Value>::max();
+        for (Index o = 0; o < numOutputs; ++o)
+        {
+            maximum = std::max(maximum, STATE(o));
+        }
+        
+        Value sum = 0;
+        for (Index o = 0; o < numOutputs; ++o)
+        {
+            ACTIVATION(o) = exp(STATE(o) - maximum);
+            sum += ACTIVATION(o);
+        }
+        
+        for (Index o = 0; o < numOutputs; ++o)
+        {
+            ACTIVATION(o) = ACTIVATION(o) / sum;
+        }
+
+#undef ACTIVATION
+#undef STATE
+    }
+    
+    inline void VMProgram::softmaxCrossEntropy(Value *memory, const Index *operands, size_t stride) noexcept
+    {
+        const Index numOutputs = operands[0];
+        const Index *outputs = operands + 2;
+        Value &loss = memory[size_t(operands[1]) * stride];
+
+#define RESPONSIBILITY(OUTPUT) (memory[size_t(outputs[(OUTPUT) * 3]) * stride])
+#define TARGET(OUTPUT) (memory[size_t(outputs[(OUTPUT) * 3 + 1]) * stride])
+#define ACTIVATION(OUTPUT) (memory[size_t(outputs[(OUTPUT) * 3 + 2]) * stride])
+        
+        // the gradient of the cross-entropy through the softmax is just the difference,
+        // the same as the error responsibility of any other output neuron
+        for (Index o = 0; o < numOutputs; ++o)
+        {
+            RESPONSIBILITY(o) = TARGET(o) - ACTIVATION(o);
+            loss -= TARGET(o) * log(std::max(ACTIVATION(o), std::numeric_limits<Value>::min()));
+        }
+
+#undef RESPONSIBILITY
+#undef TARGET
+#undef ACTIVATION
+    }
+    
+    inline void VMProgram::gatherActiveInputs(Value *memory, const Index *operands, size_t stride) noexcept
+    {
+        const Index numInputs = operands[0];
+        Value &count = memory[size_t(operands[1]) * stride];
+        Value &previousCount = memory[size_t(operands[2]) * stride];
+        const Index *inputs = operands + 3;
+
+#define ACTIVATION(INPUT) (memory[size_t(inputs[(INPUT) * 3]) * stride])
+#define SLOT(INPUT) (memory[size_t(inputs[(INPUT) * 3 + 1]) * stride])
+#define PREVIOUS_SLOT(INPUT) (memory[size_t(inputs[(INPUT) * 3 + 2]) * stride])
+        
+        // the previous ones are kept, so that their traces can be cleared
+        const Index numPreviouslyActive = std::min(Index(count), numInputs);
+        for (Index k = 0; k < numPreviouslyActive; ++k)
+        {
+            PREVIOUS_SLOT(k) = SLOT(k);
+        }
+        
+        previousCount = Value(numPreviouslyActive);
+        
+        Index numActive = 0;
+        for (Index i = 0; i < numInputs; ++i)
+        {
+            if (ACTIVATION(i) != 0)
+            {
+                SLOT(numActive++) = Value(i);
+            }
+        }
+        
+        count = Value(numActive);
+
+#undef ACTIVATION
+#undef SLOT
+#undef PREVIOUS_SLOT
+    }
+    
+    inline void VMProgram::feedStateSparse(Value *memory, const Index *operands, size_t stride) noexcept
+    {
+        const Index numActive = std::min(Index(memory[size_t(operands[1]) * stride]), operands[0]);
+        Value &state = memory[size_t(operands[2]) * stride];
+        const Index *inputs = operands + 3;
+
+#define SLOT(INPUT) (memory[size_t(inputs[(INPUT) * 4]) * stride])
+#define ACTIVATION(INPUT) (memory[size_t(inputs[(INPUT) * 4 + 1]) * stride])
+#define WEIGHT(INPUT) (memory[size_t(inputs[(INPUT) * 4 + 2]) * stride])
+#define GAIN(INPUT) (memory[size_t(inputs[(INPUT) * 4 + 3]) * stride])
+        
+        // the slots are in the ascending order, so the sum is the same as FeedState's over all the inputs
+        for (Index k = 0; k < numActive; ++k)
+        {
+            const Index i = Index(SLOT(k));
+            state = state + ACTIVATION(i) * WEIGHT(i) * GAIN(i);
+        }
+
+#undef SLOT
+#undef ACTIVATION
+#undef WEIGHT
+#undef GAIN
+    }
+    
+    inline void VMProgram::traceSparse(Value *memory, const Index *operands, size_t stride) noexcept
+    {
+        const Index numActive = std::min(Index(memory[size_t(operands[1]) * stride]), operands[0]);
+        const Index numPreviouslyActive = std::min(Index(memory[size_t(operands[2]) * stride]), operands[0]);
+        const Index *inputs = operands + 3;
+
+#define SLOT(INPUT) (memory[size_t(inputs[(INPUT) * 5]) * stride])
+#define PREVIOUS_SLOT(INPUT) (memory[size_t(inputs[(INPUT) * 5 + 1]) * stride])
+#define ELIGIBILITY(INPUT) (memory[size_t(inputs[(INPUT) * 5 + 2]) * stride])
+#define GAIN(INPUT) (memory[size_t(inputs[(INPUT) * 5 + 3]) * stride])
+#define ACTIVATION(INPUT) (memory[size_t(inputs[(INPUT) * 5 + 4]) * stride])
+        
+        // the inputs that went inactive are cleared, as their activations are zero now,
+        // and all the rest have been zero since the last time they were
+        for (Index k = 0; k < numPreviouslyActive; ++k)
+        {
+            const Index i = Index(PREVIOUS_SLOT(k));
+            ELIGIBILITY(i) = GAIN(i) * ACTIVATION(i);
+        }
+        
+        for (Index k = 0; k < numActive; ++k)
+        {
+            const Index i = Index(SLOT(k));
+            ELIGIBILITY(i) = GAIN(i) * ACTIVATION(i);
+        }
+
+#undef SLOT
+#undef PREVIOUS_SLOT
+#undef ELIGIBILITY
+#undef GAIN
+#undef ACTIVATION
+    }
+    
+    inline void VMProgram::trainSparse(Value *memory, const Index *operands, bool clipsGradients, size_t stride) noexcept
+    {
+        const Index numActive = std::min(Index(memory[size_t(operands[1]) * stride]), operands[0]);
+        const Value rate = memory[size_t(operands[2]) * stride];
+        const Value responsibility = memory[size_t(operands[3]) * stride];
+        const Index *inputs = operands + 4;
+
+#define SLOT(INPUT) (memory[size_t(inputs[(INPUT) * 3]) * stride])
+#define WEIGHT(INPUT) (memory[size_t(inputs[(INPUT) * 3 + 1]) * stride])
+#define ELIGIBILITY(INPUT) (memory[size_t(inputs[(INPUT) * 3 + 2]) * stride])
+        
+        // the eligibilities of the inactive inputs are zero, so their weights would stay the same anyway
+        for (Index k = 0; k < numActive; ++k)
+        {
+            const Index i = Index(SLOT(k));
+            
+            if (clipsGradients)
+            {
+                const Value gradient = std::max(Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD),
+                                                std::min(Value(responsibility * ELIGIBILITY(i)),
+                                                         Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD)));
+                WEIGHT(i) = WEIGHT(i) + rate * gradient;
+            }
+            else
+            {
+                WEIGHT(i) = WEIGHT(i) + rate * responsibility * ELIGIBILITY(i);
+            }
+        }
+
+#undef SLOT
+#undef WEIGHT
+#undef ELIGIBILITY
+    }
+    
+    inline Index VMProgram::getNumOperands(char operation, const Index *operands) noexcept
+    {
+        switch (operation)
+        {
+            case VMProgram::Zero:
+            case VMProgram::Clip:
+                return 1;
+            case VMProgram::ActivationSigmoid:
+            case VMProgram::DerivativeSigmoid:
+            case VMProgram::DropoutActivationSigmoid:
+            case VMProgram::ActivationTanh:
+            case VMProgram::DerivativeTanh:
+            case VMProgram::DropoutActivationTanh:
+            case VMProgram::ActivationLeakyReLU:
+            case VMProgram::DerivativeLeakyReLU:
+            case VMProgram::DropoutActivationLeakyReLU:
+            case VMProgram::A:
+                return 2;
+            case VMProgram::AAP:
+            case VMProgram::AS:
+            case VMProgram::AD:
+            case VMProgram::AP:
+            case VMProgram::ActivationDerivativeSigmoid:
+            case VMProgram::DropoutActivationDerivativeSigmoid:
+            case VMProgram::ActivationDerivativeTanh:
+            case VMProgram::DropoutActivationDerivativeTanh:
+            case VMProgram::ActivationDerivativeLeakyReLU:
+            case VMProgram::DropoutActivationDerivativeLeakyReLU:
+            case VMProgram::ClipAAP:
+                return 3;
+            case VMProgram::AAPP:
+            case VMProgram::APP:
+            case VMProgram::APS:
+                return 4;
+            case VMProgram::APSP:
+            case VMProgram::APPS:
+                return 5;
+            case VMProgram::APPSP:
+                return 6;
+            case VMProgram::APPSPP:
+                return 7;
+            case VMProgram::FeedState:
+                return 2 + operands[0] * 3;
+            case VMProgram::Softmax:
+                return 1 + operands[0] * 2;
+            case VMProgram::SoftmaxCrossEntropy:
+                return 2 + operands[0] * 3;
+            case VMProgram::GatherActiveInputs:
+                return 3 + operands[0] * 3;
+            case VMProgram::FeedStateSparse:
+                return 3 + operands[0] * 4;
+            case VMProgram::TraceSparse:
+                return 3 + operands[0] * 5;
+            case VMProgram::TrainSparse:
+            case VMProgram::TrainSparseClipped:
+                return 4 + operands[0] * 3;
+            default:
+                return 0;
+        }
+    }
+    
     //===------------------------------------------------------------------===//
     // UnrolledNeuron implementation
     //===------------------------------------------------------------------===//
@@ -151,10 +472,35 @@ namespace TinyRNN
                                              Neuron::Ptr target,
                                              bool asInput,
                                              bool asOutput,
-                                             bool asConst)
+                                             bool asConst,
+                                             bool inSoftmaxLayer,
+                                             const Neuron::Vector *sparseInputs)
     {
         UnrolledNeuron::Ptr vm(new UnrolledNeuron());
         
+        // The links from the sparse inputs are only taken through the active ones, if they go first
+        // and in the same order, as connectAllToAll makes them, so that the sums stay the same
+        size_t numSparseLinks = (sparseInputs != nullptr) ? sparseInputs->size() : 0;
+        
+        if (numSparseLinks > target->incomingLinks.size())
+        {
+            numSparseLinks = 0;
+        }
+        
+        for (size_t slot = 0; slot < numSparseLinks; ++slot)
+        {
+            if (target->incomingLinks[slot].neuron != (*sparseInputs)[slot].get())
+            {
+                numSparseLinks = 0;
+            }
+        }
+        
+        // Their traces and weight updates too, unless they depend on the past or on the gated neurons,
+        // i.e. the traces of the inactive inputs are zero, and so are their updates
+        const bool tracesSparseLinks = (numSparseLinks > 0 &&
+                                        ! target->isSelfConnected() &&
+                                        target->gatedNeighbours.empty());
+        
         const Index rateVar =
         context->allocateOrReuseVariable(0, {Keys::Mapping::Rate});
         
@@ -201,7 +547,7 @@ namespace TinyRNN
                     selfConnectionGainVar =
                     context->allocateOrReuseVariable(target->selfConnection->gain,
                                                      {target->selfConnection->getUuid(), Keys::Mapping::Gain});
-                    
+                
                 }
             }
             
@@ -233,12 +579,43 @@ namespace TinyRNN
             }
             
             
-            vm->feedProgram << VMProgram::FeedState << target->incomingConnections.size() << stateVar;
+            if (numSparseLinks > 0)
+            {
+                const Index activeInputsVar =
+                context->allocateOrReuseVariable(Value(numSparseLinks), {Keys::Mapping::ActiveInputs});
+                
+                vm->feedProgram << VMProgram::FeedStateSparse << numSparseLinks << activeInputsVar << stateVar;
+                
+                for (size_t slot = 0; slot < numSparseLinks; ++slot)
+                {
+                    const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
+                    const Neuron *inputNeuron = target->incomingLinks[slot].neuron;
+                    
+                    const Index activeInputVar =
+                    context->allocateOrReuseVariable(Value(slot), {Id(slot), Keys::Mapping::ActiveInput});
+                    
+                    const Index inputActivationVar =
+                    context->allocateOrReuseVariable(inputNeuron->activation,
+                                                     {inputNeuron->getUuid(), Keys::Mapping::Activation});
+                    
+                    const Index inputWeightVar =
+                    context->allocateOrReuseVariable(inputConnection->weight,
+                                                     {inputConnection->getUuid(), Keys::Mapping::Weight});
+                    
+                    const Index inputGainVar =
+                    context->allocateOrReuseVariable(inputConnection->gain,
+                                                     {inputConnection->getUuid(), Keys::Mapping::Gain});
+                    
+                    vm->feedProgram << activeInputVar << inputActivationVar << inputWeightVar << inputGainVar;
+                }
+            }
             
-            for (auto &i : target->incomingConnections)
+            vm->feedProgram << VMProgram::FeedState << (target->incomingLinks.size() - numSparseLinks) << stateVar;
+            
+            for (size_t slot = numSparseLinks; slot < target->incomingLinks.size(); ++slot)
             {
-                const Neuron::Connection::Ptr inputConnection = i.second;
-                const Neuron::Ptr inputNeuron = inputConnection->getInputNeuron();
+                const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
+                const Neuron *inputNeuron = target->incomingLinks[slot].neuron;
                 
                 const Index inputActivationVar =
                 context->allocateOrReuseVariable(inputNeuron->activation,
@@ -286,18 +663,13 @@ namespace TinyRNN
             if (! asConst)
             {
                 // Calculate extended elegibility traces in advance
-                Neuron::EligibilityMap influences;
-                
-                for (auto &i : target->extended)
+                for (const auto &gatedNeighbour : target->gatedNeighbours)
                 {
                     // extended elegibility trace
-                    const Id neuronId = i.first;
-                    const Value influence = influences[neuronId];
-                    
-                    Neuron::Ptr neighbour = target->neighbours[i.first];
+                    const Neuron::Ptr &neighbour = gatedNeighbour.neuron;
                     const Index influenceVar =
-                    context->allocateOrReuseVariable(influence,
-                                                     {neighbour->getUuid(), Keys::Mapping::Influence});
+                    context->allocateOrReuseVariable(gatedNeighbour.influence,
+                                                     {target->getUuid(), neighbour->getUuid(), Keys::Mapping::Influence});
                     
                     const Index neighbourOldStateVar =
                     context->allocateOrReuseVariable(neighbour->oldState,
@@ -306,20 +678,17 @@ namespace TinyRNN
                     bool influenceWasInitialized = false;
                     
                     // if gated neuron's selfconnection is gated by this unit, the influence keeps track of the neuron's old state
-                    if (Neuron::Connection::Ptr neighbourSelfconnection = neighbour->getSelfConnection())
+                    if (gatedNeighbour.gatesSelfConnection)
                     {
-                        if (neighbourSelfconnection->getGateNeuron() == target)
-                        {
-                            vm->traceProgram << VMProgram::A << influenceVar << neighbourOldStateVar;
-                            influenceWasInitialized = true;
-                        }
+                        vm->traceProgram << VMProgram::A << influenceVar << neighbourOldStateVar;
+                        influenceWasInitialized = true;
                     }
                     
                     // index runs over all the incoming connections to the gated neuron that are gated by this unit
-                    for (auto &incoming : target->influences[neighbour->getUuid()])
+                    for (const auto &incoming : gatedNeighbour.influences)
                     { // captures the effect that has an input connection to this unit, on a neuron that is gated by this unit
-                        const Neuron::Connection::Ptr inputConnection = incoming.second;
-                        const Neuron::Ptr inputNeuron = inputConnection->getInputNeuron();
+                        const Neuron::Connection *inputConnection = incoming.connection;
+                        const Neuron *inputNeuron = incoming.neuron;
                         
                         const Index incomingWeightVar =
                         context->allocateOrReuseVariable(inputConnection->weight,
@@ -341,10 +710,48 @@ namespace TinyRNN
                     }
                 }
                 
-                for (auto &i : target->incomingConnections)
+                if (tracesSparseLinks)
                 {
-                    const Neuron::Connection::Ptr inputConnection = i.second;
-                    const Neuron::Ptr inputNeuron = inputConnection->getInputNeuron();
+                    const Index activeInputsVar =
+                    context->allocateOrReuseVariable(Value(numSparseLinks), {Keys::Mapping::ActiveInputs});
+                    
+                    const Index previousActiveInputsVar =
+                    context->allocateOrReuseVariable(0, {Keys::Mapping::PreviousActiveInputs});
+                    
+                    vm->traceProgram << VMProgram::TraceSparse << numSparseLinks << activeInputsVar << previousActiveInputsVar;
+                    
+                    for (size_t slot = 0; slot < numSparseLinks; ++slot)
+                    {
+                        const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
+                        const Neuron *inputNeuron = target->incomingLinks[slot].neuron;
+                        
+                        const Index activeInputVar =
+                        context->allocateOrReuseVariable(Value(slot), {Id(slot), Keys::Mapping::ActiveInput});
+                        
+                        const Index previousActiveInputVar =
+                        context->allocateOrReuseVariable(0, {Id(slot), Keys::Mapping::PreviousActiveInput});
+                        
+                        const Index eligibilityVar =
+                        context->allocateOrReuseVariable(target->eligibility[slot],
+                                                         {target->getUuid(), inputConnection->getUuid(), Keys::Mapping::Eligibility});
+                        
+                        // the gain of a connection with no gate stays one, so this is the same as A
+                        const Index inputGainVar =
+                        context->allocateOrReuseVariable(inputConnection->gain,
+                                                         {inputConnection->getUuid(), Keys::Mapping::Gain});
+                        
+                        const Index inputActivationVar =
+                        context->allocateOrReuseVariable(inputNeuron->activation,
+                                                         {inputNeuron->getUuid(), Keys::Mapping::Activation});
+                        
+                        vm->traceProgram << activeInputVar << previousActiveInputVar << eligibilityVar << inputGainVar << inputActivationVar;
+                    }
+                }
+                
+                for (size_t slot = (tracesSparseLinks ? numSparseLinks : 0); slot < target->incomingLinks.size(); ++slot)
+                {
+                    const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
+                    const Neuron *inputNeuron = target->incomingLinks[slot].neuron;
                     const bool inputConnectionHasGate = (inputConnection->getGateNeuron() != nullptr);
                     
                     // elegibility trace - Eq. 17
@@ -361,7 +768,7 @@ namespace TinyRNN
                                                      {inputNeuron->getUuid(), Keys::Mapping::Activation});
                     
                     const Index eligibilityVar =
-                    context->allocateOrReuseVariable(target->eligibility[inputConnection->getUuid()],
+                    context->allocateOrReuseVariable(target->eligibility[slot],
                                                      {target->getUuid(), inputConnection->getUuid(), Keys::Mapping::Eligibility});
                     
                     if (target->isSelfConnected())
@@ -383,7 +790,7 @@ namespace TinyRNN
                             if (inputConnectionHasGate)
                             {
                                 vm->traceProgram << VMProgram::APSP << eligibilityVar << selfConnectionWeightVar << eligibilityVar << inputGainVar << inputActivationVar;
-                                
+                            
                             }
                             else
                             {
@@ -403,25 +810,22 @@ namespace TinyRNN
                         }
                     }
                     
-                    for (auto &i : target->extended)
+                    for (const auto &gatedNeighbour : target->gatedNeighbours)
                     {
                         // extended elegibility trace
-                        const Id neighbourNeuronUuid = i.first;
-                        const Value influence = influences[neighbourNeuronUuid];
-                        
-                        Neuron::EligibilityMap &xtrace = i.second;
-                        Neuron::Ptr neighbour = target->neighbours[neighbourNeuronUuid];
+                        const Neuron::Ptr &neighbour = gatedNeighbour.neuron;
+                        const Id neighbourNeuronUuid = neighbour->getUuid();
                         
                         const Index influenceVar =
-                        context->allocateOrReuseVariable(influence,
-                                                         {neighbour->getUuid(), Keys::Mapping::Influence});
+                        context->allocateOrReuseVariable(gatedNeighbour.influence,
+                                                         {target->getUuid(), neighbour->getUuid(), Keys::Mapping::Influence});
                         
                         const Index eligibilityVar =
-                        context->allocateOrReuseVariable(target->eligibility[inputConnection->getUuid()],
+                        context->allocateOrReuseVariable(target->eligibility[slot],
                                                          {target->getUuid(), inputConnection->getUuid(), Keys::Mapping::Eligibility});
                         
                         const Index extendedTraceVar =
-                        context->allocateOrReuseVariable(xtrace[inputConnection->getUuid()],
+                        context->allocateOrReuseVariable(gatedNeighbour.extended[slot],
                                                          {target->getUuid(), neighbourNeuronUuid, inputConnection->getUuid(), Keys::Mapping::ExtendedTrace});
                         
                         if (Neuron::Connection::Ptr neighbourSelfConnection = neighbour->getSelfConnection())
@@ -482,14 +886,24 @@ namespace TinyRNN
                 context->registerTargetVariable(myTargetVar);
                 context->registerOutputVariable(activationVar);
                 
-                vm->trainProgram << VMProgram::AD << responsibilityVar << myTargetVar << activationVar;
+                // with softmax, the layer's SoftmaxCrossEntropy has already done it
+                if (! inSoftmaxLayer)
+                {
+                    vm->trainProgram << VMProgram::AD << responsibilityVar << myTargetVar << activationVar;
+                }
+                
+                if (tracesSparseLinks)
+                {
+                    UnrolledNeuron::trainSparseLinks(context, target, numSparseLinks, VMProgram::TrainSparse,
+                                                     rateVar, responsibilityVar, vm->trainProgram);
+                }
                 
-                for (auto &i : target->incomingConnections)
+                for (size_t slot = (tracesSparseLinks ? numSparseLinks : 0); slot < target->incomingLinks.size(); ++slot)
                 {
-                    const Neuron::Connection::Ptr inputConnection = i.second;
+                    const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
                     
                     const Index eligibilityVar =
-                    context->allocateOrReuseVariable(target->eligibility[inputConnection->getUuid()],
+                    context->allocateOrReuseVariable(target->eligibility[slot],
                                                      {target->getUuid(), inputConnection->getUuid(), Keys::Mapping::Eligibility});
                     
                     const Index inputWeightVar =
@@ -505,13 +919,15 @@ namespace TinyRNN
                 {
                     const Index errorAccumulatorVar =
                     context->allocateOrReuseVariable(0.0,
-                                                     {Keys::Mapping::ErrorAccumulator});
+                                                     {target->getUuid(), Keys::Mapping::ErrorAccumulator});
+                    
+                    vm->trainProgram << VMProgram::Zero << errorAccumulatorVar;
                     
                     // error responsibilities from all the connections projected from this neuron
-                    for (auto &i : target->outgoingConnections)
+                    for (const auto &link : target->outgoingLinks)
                     {
-                        const Neuron::Connection::Ptr outputConnection = i.second;
-                        const Neuron::Ptr outputNeuron = outputConnection->getOutputNeuron();
+                        const Neuron::Connection *outputConnection = link.connection;
+                        const Neuron *outputNeuron = link.neuron;
                         
                         const Index outputWeightVar =
                         context->allocateOrReuseVariable(outputConnection->weight,
@@ -544,39 +960,36 @@ namespace TinyRNN
                     vm->trainProgram << VMProgram::Zero << errorAccumulatorVar;
                     
                     // error responsibilities from all the connections gated by this neuron
-                    for (auto &i : target->extended)
+                    for (const auto &gatedNeighbour : target->gatedNeighbours)
                     {
-                        const Id gatedNeuronId = i.first;
-                        const Neuron::Ptr gatedNeuron = target->neighbours[gatedNeuronId];
+                        const Neuron::Ptr &gatedNeuron = gatedNeighbour.neuron;
+                        const Id gatedNeuronId = gatedNeuron->getUuid();
                         
                         const Index influenceTempVar =
                         context->allocateOrReuseVariable(0.0,
-                                                         {Keys::Mapping::Influence});
+                                                         {target->getUuid(), gatedNeuronId, Keys::Mapping::Influence});
                         
                         const Index gatedNeuronOldStateVar =
                         context->allocateOrReuseVariable(gatedNeuron->oldState,
                                                          {gatedNeuron->getUuid(), Keys::Mapping::OldState});
                         
                         // if gated neuron's selfconnection is gated by this neuron
-                        if (auto gatedNeuronSelfConnection = gatedNeuron->getSelfConnection())
+                        if (gatedNeighbour.gatesSelfConnection)
                         {
-                            if (gatedNeuronSelfConnection->getGateNeuron() == target)
-                            {
-                                vm->trainProgram << VMProgram::A << influenceTempVar << gatedNeuronOldStateVar;
-                            }
-                            else
-                            {
-                                vm->trainProgram << VMProgram::Zero << influenceTempVar;
-                            }
+                            vm->trainProgram << VMProgram::A << influenceTempVar << gatedNeuronOldStateVar;
+                        }
+                        else
+                        {
+                            vm->trainProgram << VMProgram::Zero << influenceTempVar;
                         }
                         
                         if (! asConst)
                         {
                             // index runs over all the connections to the gated neuron that are gated by this neuron
-                            for (auto &i : target->influences[gatedNeuronId])
+                            for (const auto &incoming : gatedNeighbour.influences)
                             { // captures the effect that the input connection of this neuron have, on a neuron which its input/s is/are gated by this neuron
-                                const Neuron::Connection::Ptr inputConnection = i.second;
-                                const Neuron::Ptr inputNeuron = inputConnection->getInputNeuron();
+                                const Neuron::Connection *inputConnection = incoming.connection;
+                                const Neuron *inputNeuron = incoming.neuron;
                                 
                                 const Index inputActivationVar =
                                 context->allocateOrReuseVariable(inputNeuron->activation,
@@ -609,35 +1022,34 @@ namespace TinyRNN
                     vm->trainProgram << VMProgram::AS << responsibilityVar << projectedErrorVar << gatedErrorVar;
                     
                     // adjust all the neuron's incoming connections
-                    for (auto &i : target->incomingConnections)
+                    for (size_t slot = 0; slot < target->incomingLinks.size(); ++slot)
                     {
-                        const Id inputConnectionUuid = i.first;
-                        const Neuron::Connection::Ptr inputConnection = i.second;
+                        const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
+                        const Id inputConnectionUuid = inputConnection->getUuid();
                         
                         const Index gradientTempVar =
                         context->allocateOrReuseVariable(0.0,
-                                                         {Keys::Mapping::Gradient});
+                                                         {target->getUuid(), Keys::Mapping::Gradient});
                         
                         const Index eligibilityVar =
-                        context->allocateOrReuseVariable(target->eligibility[inputConnection->getUuid()],
+                        context->allocateOrReuseVariable(target->eligibility[slot],
                                                          {target->getUuid(), inputConnection->getUuid(), Keys::Mapping::Eligibility});
                         
                         // Eq. 24
                         vm->trainProgram << VMProgram::AP << gradientTempVar << projectedErrorVar << eligibilityVar;
                         
-                        for (auto &ext : target->extended)
+                        for (const auto &gatedNeighbour : target->gatedNeighbours)
                         {
                             // extended elegibility trace
-                            const Id neighbourNeuronId = ext.first;
-                            Neuron::EligibilityMap &xtrace = ext.second;
-                            Neuron::Ptr neighbour = target->neighbours[neighbourNeuronId];
+                            const Id neighbourNeuronId = gatedNeighbour.neuron->getUuid();
+                            const Neuron::Ptr &neighbour = gatedNeighbour.neuron;
                             
                             const Index neighbourResponsibilityVar =
                             context->allocateOrReuseVariable(neighbour->errorResponsibility,
                                                              {neighbourNeuronId, Keys::Mapping::ErrorResponsibility});
                             
                             const Index extendedTraceVar =
-                            context->allocateOrReuseVariable(xtrace[inputConnection->getUuid()],
+                            context->allocateOrReuseVariable(gatedNeighbour.extended[slot],
                                                              {target->getUuid(), neighbourNeuronId, inputConnectionUuid, Keys::Mapping::ExtendedTrace});
                             
                             vm->trainProgram << VMProgram::AAP << gradientTempVar << neighbourResponsibilityVar << extendedTraceVar;
@@ -657,10 +1069,10 @@ namespace TinyRNN
                     vm->trainProgram << VMProgram::Zero << responsibilityVar;
                     
                     // error responsibilities from all the connections projected from this neuron
-                    for (auto &i : target->outgoingConnections)
+                    for (const auto &link : target->outgoingLinks)
                     {
-                        const Neuron::Connection::Ptr outputConnection = i.second;
-                        const Neuron::Ptr outputNeuron = outputConnection->getOutputNeuron();
+                        const Neuron::Connection *outputConnection = link.connection;
+                        const Neuron *outputNeuron = link.neuron;
                         
                         const Index outputWeightVar =
                         context->allocateOrReuseVariable(outputConnection->weight,
@@ -686,12 +1098,18 @@ namespace TinyRNN
                     
                     vm->trainProgram << VMProgram::AP << responsibilityVar << responsibilityVar << derivativeVar;
                     
-                    for (auto &i : target->incomingConnections)
+                    if (tracesSparseLinks)
                     {
-                        const Neuron::Connection::Ptr inputConnection = i.second;
+                        UnrolledNeuron::trainSparseLinks(context, target, numSparseLinks, VMProgram::TrainSparseClipped,
+                                                         rateVar, responsibilityVar, vm->trainProgram);
+                    }
+                    
+                    for (size_t slot = (tracesSparseLinks ? numSparseLinks : 0); slot < target->incomingLinks.size(); ++slot)
+                    {
+                        const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
                         
                         const Index eligibilityVar =
-                        context->allocateOrReuseVariable(target->eligibility[inputConnection->getUuid()],
+                        context->allocateOrReuseVariable(target->eligibility[slot],
                                                          {target->getUuid(), inputConnection->getUuid(), Keys::Mapping::Eligibility});
                         
                         const Index inputWeightVar =
@@ -700,9 +1118,9 @@ namespace TinyRNN
                         
                         // learn
                         const Index gradientTempVar =
-                        context->allocateOrReuseVariable(0.0, {Keys::Mapping::Gradient});
+                        context->allocateOrReuseVariable(0.0, {target->getUuid(), Keys::Mapping::Gradient});
                         vm->trainProgram << VMProgram::AP << gradientTempVar << responsibilityVar << eligibilityVar;
-
+                        
                         vm->trainProgram << VMProgram::Clip << gradientTempVar;
                         vm->trainProgram << VMProgram::AAP << inputWeightVar << rateVar << gradientTempVar;
                     }
@@ -712,37 +1130,34 @@ namespace TinyRNN
                     vm->trainProgram << VMProgram::Zero << responsibilityVar;
                     
                     // error responsibilities from all the connections gated by this neuron
-                    for (auto &i : target->extended)
+                    for (const auto &gatedNeighbour : target->gatedNeighbours)
                     {
-                        const Id gatedNeuronId = i.first;
-                        const Neuron::Ptr gatedNeuron = target->neighbours[gatedNeuronId];
+                        const Neuron::Ptr &gatedNeuron = gatedNeighbour.neuron;
+                        const Id gatedNeuronId = gatedNeuron->getUuid();
                         
                         const Index influenceTempVar =
                         context->allocateOrReuseVariable(0.0,
-                                                         {Keys::Mapping::Influence});
+                                                         {target->getUuid(), gatedNeuronId, Keys::Mapping::Influence});
                         
                         const Index gatedNeuronOldStateVar =
                         context->allocateOrReuseVariable(gatedNeuron->oldState,
                                                          {gatedNeuron->getUuid(), Keys::Mapping::OldState});
                         
                         // if gated neuron's selfconnection is gated by this neuron
-                        if (auto gatedNeuronSelfConnection = gatedNeuron->getSelfConnection())
+                        if (gatedNeighbour.gatesSelfConnection)
                         {
-                            if (gatedNeuronSelfConnection->getGateNeuron() == target)
-                            {
-                                vm->trainProgram << VMProgram::A << influenceTempVar << gatedNeuronOldStateVar;
-                            }
-                            else
-                            {
-                                vm->trainProgram << VMProgram::Zero << influenceTempVar;
-                            }
+                            vm->trainProgram << VMProgram::A << influenceTempVar << gatedNeuronOldStateVar;
+                        }
+                        else
+                        {
+                            vm->trainProgram << VMProgram::Zero << influenceTempVar;
                         }
                         
                         // index runs over all the connections to the gated neuron that are gated by this neuron
-                        for (auto &i : target->influences[gatedNeuronId])
+                        for (const auto &incoming : gatedNeighbour.influences)
                         { // captures the effect that the input connection of this neuron have, on a neuron which its input/s is/are gated by this neuron
-                            const Neuron::Connection::Ptr inputConnection = i.second;
-                            const Neuron::Ptr inputNeuron = inputConnection->getInputNeuron();
+                            const Neuron::Connection *inputConnection = incoming.connection;
+                            const Neuron *inputNeuron = incoming.neuron;
                             
                             const Index inputActivationVar =
                             context->allocateOrReuseVariable(inputNeuron->activation,
@@ -766,30 +1181,29 @@ namespace TinyRNN
                     vm->trainProgram << VMProgram::AP << responsibilityVar << responsibilityVar << derivativeVar;
                     
                     // adjust all the neuron's incoming connections
-                    for (auto &i : target->incomingConnections)
+                    for (size_t slot = 0; slot < target->incomingLinks.size(); ++slot)
                     {
-                        const Id inputConnectionUuid = i.first;
-                        const Neuron::Connection::Ptr inputConnection = i.second;
+                        const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
+                        const Id inputConnectionUuid = inputConnection->getUuid();
                         
                         const Index gradientTempVar =
                         context->allocateOrReuseVariable(0.0,
-                                                         {Keys::Mapping::Gradient});
+                                                         {target->getUuid(), Keys::Mapping::Gradient});
                         
                         vm->trainProgram << VMProgram::Zero << gradientTempVar;
                         
-                        for (auto &ext : target->extended)
+                        for (const auto &gatedNeighbour : target->gatedNeighbours)
                         {
                             // extended elegibility trace
-                            const Id neighbourNeuronId = ext.first;
-                            Neuron::EligibilityMap &xtrace = ext.second;
-                            Neuron::Ptr neighbour = target->neighbours[neighbourNeuronId];
+                            const Id neighbourNeuronId = gatedNeighbour.neuron->getUuid();
+                            const Neuron::Ptr &neighbour = gatedNeighbour.neuron;
                             
                             const Index neighbourResponsibilityVar =
                             context->allocateOrReuseVariable(neighbour->errorResponsibility,
                                                              {neighbourNeuronId, Keys::Mapping::ErrorResponsibility});
                             
                             const Index extendedTraceVar =
-                            context->allocateOrReuseVariable(xtrace[inputConnection->getUuid()],
+                            context->allocateOrReuseVariable(gatedNeighbour.extended[slot],
                                                              {target->getUuid(), neighbourNeuronId, inputConnectionUuid, Keys::Mapping::ExtendedTrace});
                             
                             vm->trainProgram << VMProgram::AAP << gradientTempVar << neighbourResponsibilityVar << extendedTraceVar;
@@ -817,6 +1231,123 @@ namespace TinyRNN
         return vm;
     }
     
+    inline UnrolledNeuron::Ptr UnrolledNeuron::buildSoftmaxFrom(UnrolledTrainingContext::Ptr context,
+                                                    Id layerUuid,
+                                                    const Neuron::Vector &targets,
+                                                    bool asOutput,
+                                                    bool asConst)
+    {
+        UnrolledNeuron::Ptr vm(new UnrolledNeuron());
+        
+        vm->feedProgram << VMProgram::Softmax << targets.size();
+        
+        for (const auto &target : targets)
+        {
+            const Index activationVar =
+            context->allocateOrReuseVariable(target->activation,
+                                             {target->getUuid(), Keys::Mapping::Activation});
+            
+            const Index stateVar =
+            context->allocateOrReuseVariable(target->state,
+                                             {target->getUuid(), Keys::Mapping::State});
+            
+            vm->feedProgram << activationVar << stateVar;
+        }
+        
+        if (asOutput && !asConst)
+        {
+            // Accumulates over the train calls, until UnrolledNetwork::resetLoss()
+            const Index lossVar =
+            context->allocateOrReuseVariable(0.0, {layerUuid, Keys::Mapping::Loss});
+            
+            vm->trainProgram << VMProgram::SoftmaxCrossEntropy << targets.size() << lossVar;
+            
+            for (const auto &target : targets)
+            {
+                const Index responsibilityVar =
+                context->allocateOrReuseVariable(target->errorResponsibility,
+                                                 {target->getUuid(), Keys::Mapping::ErrorResponsibility});
+                
+                const Index targetVar =
+                context->allocateOrReuseVariable(0.0,
+                                                 {target->getUuid(), Keys::Mapping::Target});
+                
+                const Index activationVar =
+                context->allocateOrReuseVariable(target->activation,
+                                                 {target->getUuid(), Keys::Mapping::Activation});
+                
+                vm->trainProgram << responsibilityVar << targetVar << activationVar;
+            }
+        }
+        
+        return vm;
+    }
+    
+    inline UnrolledNeuron::Ptr UnrolledNeuron::buildSparseInputsFrom(UnrolledTrainingContext::Ptr context,
+                                                         const Neuron::Vector &targets)
+    {
+        UnrolledNeuron::Ptr vm(new UnrolledNeuron());
+        
+        // All the inputs start as active, so that the first feed clears whatever traces
+        // the network had, and from then on only the inactive inputs' traces are zero
+        const Index activeInputsVar =
+        context->allocateOrReuseVariable(Value(targets.size()), {Keys::Mapping::ActiveInputs});
+        
+        const Index previousActiveInputsVar =
+        context->allocateOrReuseVariable(0, {Keys::Mapping::PreviousActiveInputs});
+        
+        vm->feedProgram << VMProgram::GatherActiveInputs << targets.size() << activeInputsVar << previousActiveInputsVar;
+        
+        for (size_t slot = 0; slot < targets.size(); ++slot)
+        {
+            const Index activationVar =
+            context->allocateOrReuseVariable(targets[slot]->activation,
+                                             {targets[slot]->getUuid(), Keys::Mapping::Activation});
+            
+            const Index activeInputVar =
+            context->allocateOrReuseVariable(Value(slot), {Id(slot), Keys::Mapping::ActiveInput});
+            
+            const Index previousActiveInputVar =
+            context->allocateOrReuseVariable(0, {Id(slot), Keys::Mapping::PreviousActiveInput});
+            
+            vm->feedProgram << activationVar << activeInputVar << previousActiveInputVar;
+        }
+        
+        return vm;
+    }
+    
+    inline void UnrolledNeuron::trainSparseLinks(UnrolledTrainingContext::Ptr context,
+                                                 Neuron::Ptr target,
+                                                 size_t numSparseLinks,
+                                                 VMProgram::Operation operation,
+                                                 Index rateVar,
+                                                 Index responsibilityVar,
+                                                 VMProgram &program)
+    {
+        const Index activeInputsVar =
+        context->allocateOrReuseVariable(Value(numSparseLinks), {Keys::Mapping::ActiveInputs});
+        
+        program << operation << numSparseLinks << activeInputsVar << rateVar << responsibilityVar;
+        
+        for (size_t slot = 0; slot < numSparseLinks; ++slot)
+        {
+            const Neuron::Connection *inputConnection = target->incomingLinks[slot].connection;
+            
+            const Index activeInputVar =
+            context->allocateOrReuseVariable(Value(slot), {Id(slot), Keys::Mapping::ActiveInput});
+            
+            const Index inputWeightVar =
+            context->allocateOrReuseVariable(inputConnection->weight,
+                                             {inputConnection->getUuid(), Keys::Mapping::Weight});
+            
+            const Index eligibilityVar =
+            context->allocateOrReuseVariable(target->eligibility[slot],
+                                             {target->getUuid(), inputConnection->getUuid(), Keys::Mapping::Eligibility});
+            
+            program << activeInputVar << inputWeightVar << eligibilityVar;
+        }
+    }
+    
     inline const VMProgram &UnrolledNeuron::getFeedChunk() const noexcept
     {
         return this->feedProgram;
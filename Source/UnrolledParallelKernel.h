@@ -0,0 +1,386 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDPARALLELKERNEL_H_INCLUDED
+#define TINYRNN_UNROLLEDPARALLELKERNEL_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledThreadedKernel.h"
+#include "UnrolledKernelOptimizer.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace TinyRNN
+{
+    // Runs a kernel across a pool of persistent threads.
+    //
+    // The neurons' chunks are put into levels: each chunk goes to the first level after
+    // all the chunks it reads from, and all the chunks that read or write what it writes.
+    // So the chunks of one level never touch each other's variables, and each level is split
+    // between the threads by the instruction counts, with a barrier after it.
+    // The instructions of each chunk are the same as in the sequential kernel,
+    // so the results are bit-exact with all the other execution modes.
+    class UnrolledParallelKernel final
+    {
+    public:
+        
+        UnrolledParallelKernel();
+        ~UnrolledParallelKernel();
+        
+        // If the chunk sizes don't add up to the kernel size, it is run as a single chunk
+        void schedule(const std::vector<char> &commands,
+                      const std::vector<Index> &indices,
+                      const std::vector<Index> &chunkSizes,
+                      Index numThreads);
+        
+        bool isScheduled() const noexcept;
+        void clear();
+        
+        Index getNumThreads() const noexcept;
+        Index getNumLevels() const noexcept;
+        
+        void run(Value *memory, Value dropout);
+    
+    private:
+        
+        class Barrier final
+        {
+        public:
+            
+            Barrier();
+            
+            void reset(Index numThreads);
+            void wait();
+        
+        private:
+            
+            Index numThreads;
+            std::atomic<Index> numWaiting;
+            std::atomic<Index> generation;
+            
+            std::mutex mutex;
+            std::condition_variable condition;
+            
+            TINYRNN_DISALLOW_COPY_AND_ASSIGN(Barrier);
+        };
+        
+        using Slice = std::shared_ptr<UnrolledThreadedKernel>;
+        using Level = std::vector<Slice>; // one slice per thread, some may be empty
+        
+        std::vector<Level> levels;
+        Index numThreads;
+        
+        std::vector<std::thread> workers;
+        Barrier barrier;
+        
+        Value *memory;
+        Value dropout;
+        bool shouldStop;
+        
+        void runLevels(Index threadIndex);
+        void runWorker(Index threadIndex);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledParallelKernel);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // Barrier implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledParallelKernel::Barrier::Barrier() :
+    numThreads(1),
+    numWaiting(0),
+    generation(0)
+    {
+    }
+    
+    inline void UnrolledParallelKernel::Barrier::reset(Index targetNumThreads)
+    {
+        this->numThreads = targetNumThreads;
+        this->numWaiting = 0;
+    }
+    
+    // Spins for a while, as the levels are usually short, and then falls asleep
+    inline void UnrolledParallelKernel::Barrier::wait()
+    {
+        const Index currentGeneration = this->generation.load(std::memory_order_acquire);
+        
+        if (this->numWaiting.fetch_add(1, std::memory_order_acq_rel) + 1 == this->numThreads)
+        {
+            // nobody can enter the next generation before the increment below, so the reset is safe
+            this->numWaiting.store(0, std::memory_order_relaxed);
+            
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->generation.store(currentGeneration + 1, std::memory_order_release);
+            }
+            
+            this->condition.notify_all();
+            return;
+        }
+        
+        for (int spin = 0; spin < 4096; ++spin)
+        {
+            if (this->generation.load(std::memory_order_acquire) != currentGeneration)
+            {
+                return;
+            }
+        }
+        
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->condition.wait(lock, [this, currentGeneration]()
+        {
+            return this->generation.load(std::memory_order_acquire) != currentGeneration;
+        });
+    }
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledParallelKernel implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledParallelKernel::UnrolledParallelKernel() :
+    numThreads(0),
+    memory(nullptr),
+    dropout(0),
+    shouldStop(false)
+    {
+    }
+    
+    inline UnrolledParallelKernel::~UnrolledParallelKernel()
+    {
+        this->clear();
+    }
+    
+    inline bool UnrolledParallelKernel::isScheduled() const noexcept
+    {
+        return (this->numThreads > 0);
+    }
+    
+    inline Index UnrolledParallelKernel::getNumThreads() const noexcept
+    {
+        return this->numThreads;
+    }
+    
+    inline Index UnrolledParallelKernel::getNumLevels() const noexcept
+    {
+        return Index(this->levels.size());
+    }
+    
+    inline void UnrolledParallelKernel::clear()
+    {
+        if (! this->workers.empty())
+        {
+            this->shouldStop = true;
+            this->barrier.wait();
+            
+            for (auto &worker : this->workers)
+            {
+                worker.join();
+            }
+            
+            this->workers.clear();
+            this->shouldStop = false;
+        }
+        
+        this->levels.clear();
+        this->numThreads = 0;
+    }
+    
+    inline void UnrolledParallelKernel::schedule(const std::vector<char> &commands,
+                                                 const std::vector<Index> &indices,
+                                                 const std::vector<Index> &chunkSizes,
+                                                 Index targetNumThreads)
+    {
+        using Optimizer = UnrolledKernelOptimizer;
+        
+        this->clear();
+        this->numThreads = std::max(targetNumThreads, Index(1));
+        
+        Optimizer::Program program = Optimizer::decode(commands, indices);
+        Optimizer::setChunkSizes(program, chunkSizes);
+        
+        Index numChunks = 0;
+        Index numVariables = 0;
+        
+        for (const auto &instruction : program)
+        {
+            numChunks = std::max(numChunks, instruction.chunk + 1);
+            
+            for (const auto &operand : instruction.operands)
+            {
+                numVariables = std::max(numVariables, operand + 1);
+            }
+        }
+        
+        // The level of the last chunk that has written each variable, and the latest level that has read it,
+        // so that each chunk goes after everything it depends on, and everything that depends on what it overwrites;
+        // levels are counted from 1 here, so that 0 means none
+        std::vector<Index> writeLevels(numVariables, 0);
+        std::vector<Index> readLevels(numVariables, 0);
+        
+        std::vector<Index> chunkLevels(numChunks, 0);
+        std::vector<Index> chunkCosts(numChunks, 0);
+        std::vector<size_t> writes, reads;
+        
+        Index numLevels = 0;
+        size_t i = 0;
+        
+        while (i < program.size())
+        {
+            const Index chunk = program[i].chunk;
+            size_t end = i;
+            Index level = 1;
+            
+            // the level is found before updating the tables, so that a chunk doesn't depend on itself
+            for (; end < program.size() && program[end].chunk == chunk; ++end)
+            {
+                const auto &instruction = program[end];
+                Optimizer::getOperandRoles(instruction, writes, reads);
+                
+                for (const auto &position : reads)
+                {
+                    level = std::max(level, writeLevels[instruction.operands[position]] + 1);
+                }
+                
+                for (const auto &position : writes)
+                {
+                    const Index variable = instruction.operands[position];
+                    level = std::max(level, std::max(writeLevels[variable], readLevels[variable]) + 1);
+                }
+                
+                chunkCosts[chunk] += Index(instruction.operands.size() + 1);
+            }
+            
+            for (size_t j = i; j < end; ++j)
+            {
+                const auto &instruction = program[j];
+                Optimizer::getOperandRoles(instruction, writes, reads);
+                
+                for (const auto &position : reads)
+                {
+                    Index &readLevel = readLevels[instruction.operands[position]];
+                    readLevel = std::max(readLevel, level);
+                }
+                
+                for (const auto &position : writes)
+                {
+                    writeLevels[instruction.operands[position]] = level;
+                }
+            }
+            
+            chunkLevels[chunk] = level - 1;
+            numLevels = std::max(numLevels, level);
+            i = end;
+        }
+        
+        // Each level is cut into contiguous slices of roughly the same cost, never splitting a chunk
+        std::vector<uint64_t> levelCosts(numLevels, 0);
+        std::vector<uint64_t> levelProgress(numLevels, 0);
+        std::vector<std::vector<Optimizer::Program>> slices(numLevels, std::vector<Optimizer::Program>(this->numThreads));
+        
+        for (Index chunk = 0; chunk < numChunks; ++chunk)
+        {
+            levelCosts[chunkLevels[chunk]] += chunkCosts[chunk];
+        }
+        
+        for (size_t start = 0, end = 0; start < program.size(); start = end)
+        {
+            const Index chunk = program[start].chunk;
+            const Index level = chunkLevels[chunk];
+            const uint64_t thread = (levelProgress[level] * this->numThreads) / std::max(levelCosts[level], uint64_t(1));
+            auto &slice = slices[level][std::min(thread, uint64_t(this->numThreads - 1))];
+            
+            for (end = start; end < program.size() && program[end].chunk == chunk; ++end)
+            {
+                slice.push_back(program[end]);
+            }
+            
+            levelProgress[level] += chunkCosts[chunk];
+        }
+        
+        this->levels.resize(numLevels);
+        
+        for (Index level = 0; level < numLevels; ++level)
+        {
+            for (Index thread = 0; thread < this->numThreads; ++thread)
+            {
+                std::vector<char> sliceCommands;
+                std::vector<Index> sliceIndices;
+                Optimizer::encode(slices[level][thread], sliceCommands, sliceIndices);
+                
+                Slice slice(new UnrolledThreadedKernel());
+                slice->decode(sliceCommands, sliceIndices);
+                this->levels[level].push_back(slice);
+            }
+        }
+        
+        this->barrier.reset(this->numThreads);
+        
+        for (Index thread = 1; thread < this->numThreads; ++thread)
+        {
+            this->workers.push_back(std::thread(&UnrolledParallelKernel::runWorker, this, thread));
+        }
+    }
+    
+    inline void UnrolledParallelKernel::run(Value *targetMemory, Value targetDropout)
+    {
+        this->memory = targetMemory;
+        this->dropout = targetDropout;
+        
+        if (! this->workers.empty())
+        {
+            this->barrier.wait();
+        }
+        
+        this->runLevels(0);
+    }
+    
+    inline void UnrolledParallelKernel::runLevels(Index threadIndex)
+    {
+        for (const auto &level : this->levels)
+        {
+            level[threadIndex]->run(this->memory, this->dropout);
+            this->barrier.wait();
+        }
+    }
+    
+    inline void UnrolledParallelKernel::runWorker(Index threadIndex)
+    {
+        while (true)
+        {
+            // the start of a run, or the signal to stop
+            this->barrier.wait();
+            
+            if (this->shouldStop)
+            {
+                return;
+            }
+            
+            this->runLevels(threadIndex);
+        }
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDPARALLELKERNEL_H_INCLUDED
@@ -0,0 +1,183 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDSTATESNAPSHOT_H_INCLUDED
+#define TINYRNN_UNROLLEDSTATESNAPSHOT_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledTrainingContext.h"
+
+#include <mutex>
+
+namespace TinyRNN
+{
+    class UnrolledStatePool;
+    
+    // A copy of the per-sequence variables of an unrolled network, i.e. everything but the weights and biases,
+    // taken by UnrolledNetwork::saveState() and put back by UnrolledNetwork::restoreState().
+    //
+    // A snapshot never changes once taken, so forking a state into many branches is just
+    // sharing the pointer to it; a branch only gets a copy of its own when it is fed and saved again.
+    class UnrolledStateSnapshot final
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<const UnrolledStateSnapshot>;
+        using RawData = UnrolledTrainingContext::RawData;
+        
+        // Gives the buffer back to the pool it was taken from, if the pool is still there
+        ~UnrolledStateSnapshot();
+        
+        size_t getSize() const noexcept;
+    
+    private:
+        
+        UnrolledStateSnapshot(RawData &&values, std::weak_ptr<UnrolledStatePool> pool);
+        
+        RawData values;
+        std::weak_ptr<UnrolledStatePool> pool;
+        
+        friend class UnrolledStatePool;
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledStateSnapshot);
+    };
+    
+    // Keeps the buffers of the discarded snapshots for the new ones, so that after a few steps
+    // of e.g. a beam search, saving a state doesn't allocate any memory for the values.
+    // Snapshots may be discarded on any thread, so the free list is guarded with a mutex.
+    class UnrolledStatePool final : public std::enable_shared_from_this<UnrolledStatePool>
+    {
+    public:
+        
+        using Ptr = std::shared_ptr<UnrolledStatePool>;
+        using RawData = UnrolledTrainingContext::RawData;
+        using Ranges = std::vector<std::pair<Index, Index>>; // [begin, end) runs of the variables
+        
+        UnrolledStatePool() = default;
+        
+        // Copies the given runs of the memory into a snapshot, one after another
+        UnrolledStateSnapshot::Ptr save(const Value *memory, const Ranges &ranges, size_t size);
+        
+        // Returns false, if the snapshot was taken from some other pool, or with some other runs
+        bool restore(const UnrolledStateSnapshot &snapshot, Value *memory, const Ranges &ranges, size_t size) const;
+        
+        size_t getNumFreeBuffers() const;
+    
+    private:
+        
+        mutable std::mutex mutex;
+        std::vector<RawData> freeBuffers;
+        
+        void release(RawData &&buffer);
+        
+        friend class UnrolledStateSnapshot;
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledStatePool);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledStateSnapshot implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledStateSnapshot::UnrolledStateSnapshot(RawData &&targetValues, std::weak_ptr<UnrolledStatePool> targetPool) :
+    values(std::move(targetValues)),
+    pool(targetPool)
+    {
+    }
+    
+    inline UnrolledStateSnapshot::~UnrolledStateSnapshot()
+    {
+        if (auto targetPool = this->pool.lock())
+        {
+            targetPool->release(std::move(this->values));
+        }
+    }
+    
+    inline size_t UnrolledStateSnapshot::getSize() const noexcept
+    {
+        return this->values.size();
+    }
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledStatePool implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledStateSnapshot::Ptr UnrolledStatePool::save(const Value *memory, const Ranges &ranges, size_t size)
+    {
+        RawData buffer;
+        
+        {
+            const std::lock_guard<std::mutex> lock(this->mutex);
+            if (! this->freeBuffers.empty())
+            {
+                buffer = std::move(this->freeBuffers.back());
+                this->freeBuffers.pop_back();
+            }
+        }
+        
+        // the free buffers are all of the same size, unless the network has been renumbered since
+        buffer.resize(size);
+        Value *target = buffer.data();
+        
+        for (const auto &range : ranges)
+        {
+            target = std::copy(memory + range.first, memory + range.second, target);
+        }
+        
+        return UnrolledStateSnapshot::Ptr(new UnrolledStateSnapshot(std::move(buffer), this->shared_from_this()));
+    }
+    
+    inline bool UnrolledStatePool::restore(const UnrolledStateSnapshot &snapshot, Value *memory, const Ranges &ranges, size_t size) const
+    {
+        // the pool stands for the layout of the memory: the network gets a new one whenever the layout changes,
+        // which keeps the snapshots of the same size but with the variables in other places out
+        if (snapshot.pool.lock().get() != this || snapshot.values.size() != size)
+        {
+            return false;
+        }
+        
+        const Value *source = snapshot.values.data();
+        
+        for (const auto &range : ranges)
+        {
+            const Index length = range.second - range.first;
+            std::copy(source, source + length, memory + range.first);
+            source += length;
+        }
+        
+        return true;
+    }
+    
+    inline size_t UnrolledStatePool::getNumFreeBuffers() const
+    {
+        const std::lock_guard<std::mutex> lock(this->mutex);
+        return this->freeBuffers.size();
+    }
+    
+    inline void UnrolledStatePool::release(RawData &&buffer)
+    {
+        const std::lock_guard<std::mutex> lock(this->mutex);
+        this->freeBuffers.push_back(std::move(buffer));
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDSTATESNAPSHOT_H_INCLUDED
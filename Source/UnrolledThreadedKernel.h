@@ -0,0 +1,514 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDTHREADEDKERNEL_H_INCLUDED
+#define TINYRNN_UNROLLEDTHREADEDKERNEL_H_INCLUDED
+
+#include "Common.h"
+#include "UnrolledNeuron.h"
+
+// Labels as values are a GNU extension, supported by gcc and clang;
+// other compilers get the same pre-decoded code run through a switch.
+#if defined(__GNUC__) && ! defined(TINYRNN_NO_COMPUTED_GOTO)
+#define TINYRNN_USES_COMPUTED_GOTO 1
+#else
+#define TINYRNN_USES_COMPUTED_GOTO 0
+#endif
+
+namespace TinyRNN
+{
+    // The kernel bytecode, decoded once into a direct-threaded code:
+    // every instruction is a handler offset followed by its operands inline,
+    // so the hot loop never walks a separate indices array and never goes through a switch.
+    // All cells are 32-bit, as the kernels of mid-sized networks are already memory-bound,
+    // and full-width pointers would double the amount of code to stream through.
+    class UnrolledThreadedKernel final
+    {
+    public:
+        
+        UnrolledThreadedKernel() = default;
+        
+        void decode(const std::vector<char> &commands,
+                    const std::vector<Index> &indices);
+        
+        bool isDecoded() const noexcept;
+        
+        // Drops the decoded code, so that the next run decodes the kernel again
+        void clear();
+        
+        void run(Value *memory, Value dropout) const;
+    
+    private:
+        
+        union Cell
+        {
+            int32_t handler;
+            Index operation;
+            Index count;
+            Index operand;
+        };
+        
+        std::vector<Cell> cells;
+        
+        // The whole-layer operations read their operands straight from the cells
+        static_assert(sizeof(Cell) == sizeof(Index), "Cells must be laid out as the indices");
+        
+        static const int32_t *execute(const Cell *code, Value *memory, Value dropout);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledThreadedKernel);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledThreadedKernel implementation
+    //===------------------------------------------------------------------===//
+    
+    inline bool UnrolledThreadedKernel::isDecoded() const noexcept
+    {
+        return !this->cells.empty();
+    }
+    
+    inline void UnrolledThreadedKernel::clear()
+    {
+        this->cells.clear();
+    }
+    
+    inline void UnrolledThreadedKernel::decode(const std::vector<char> &commands,
+                                               const std::vector<Index> &indices)
+    {
+        const int32_t *handlers = UnrolledThreadedKernel::execute(nullptr, nullptr, 0);
+        
+        this->cells.clear();
+        this->cells.reserve(commands.size() + indices.size());
+        
+        Index i = 0;
+        
+        for (const char command : commands)
+        {
+            // Unknown commands take no operands, and vmProcess just skips them
+            const bool isKnown = (command >= VMProgram::Zero && command <= VMProgram::TrainSparseClipped);
+            
+            if (! isKnown && command != VMProgram::End)
+            {
+                continue;
+            }
+            
+            Cell handler;
+#if TINYRNN_USES_COMPUTED_GOTO
+            handler.handler = handlers[isKnown ? command : (VMProgram::TrainSparseClipped + 1)];
+#else
+            (void)handlers;
+            handler.operation = command;
+#endif
+            this->cells.push_back(handler);
+            
+            Index numOperands = 0;
+            
+            switch (command)
+            {
+                case VMProgram::Zero:
+                case VMProgram::Clip:
+                    numOperands = 1;
+                    break;
+                case VMProgram::ActivationSigmoid:
+                case VMProgram::DerivativeSigmoid:
+                case VMProgram::DropoutActivationSigmoid:
+                case VMProgram::ActivationTanh:
+                case VMProgram::DerivativeTanh:
+                case VMProgram::DropoutActivationTanh:
+                case VMProgram::ActivationLeakyReLU:
+                case VMProgram::DerivativeLeakyReLU:
+                case VMProgram::DropoutActivationLeakyReLU:
+                case VMProgram::A:
+                    numOperands = 2;
+                    break;
+                case VMProgram::AAP:
+                case VMProgram::AS:
+                case VMProgram::AD:
+                case VMProgram::AP:
+                case VMProgram::ActivationDerivativeSigmoid:
+                case VMProgram::DropoutActivationDerivativeSigmoid:
+                case VMProgram::ActivationDerivativeTanh:
+                case VMProgram::DropoutActivationDerivativeTanh:
+                case VMProgram::ActivationDerivativeLeakyReLU:
+                case VMProgram::DropoutActivationDerivativeLeakyReLU:
+                case VMProgram::ClipAAP:
+                    numOperands = 3;
+                    break;
+                case VMProgram::AAPP:
+                case VMProgram::APP:
+                case VMProgram::APS:
+                    numOperands = 4;
+                    break;
+                case VMProgram::APSP:
+                case VMProgram::APPS:
+                    numOperands = 5;
+                    break;
+                case VMProgram::APPSP:
+                    numOperands = 6;
+                    break;
+                case VMProgram::APPSPP:
+                    numOperands = 7;
+                    break;
+                case VMProgram::FeedState:
+                {
+                    Cell loopCount;
+                    loopCount.count = indices[i];
+                    this->cells.push_back(loopCount);
+                    
+                    Cell state;
+                    state.operand = indices[i + 1];
+                    this->cells.push_back(state);
+                    
+                    numOperands = loopCount.count * 3;
+                    i += 2;
+                    break;
+                }
+                case VMProgram::Softmax:
+                case VMProgram::SoftmaxCrossEntropy:
+                case VMProgram::GatherActiveInputs:
+                case VMProgram::FeedStateSparse:
+                case VMProgram::TraceSparse:
+                case VMProgram::TrainSparse:
+                case VMProgram::TrainSparseClipped:
+                    // the operands, counts included, are passed to VMProgram as they are
+                    numOperands = VMProgram::getNumOperands(command, indices.data() + i);
+                    break;
+                default:
+                    break;
+            }
+            
+            for (Index operand = 0; operand < numOperands; ++operand)
+            {
+                Cell variable;
+                variable.operand = indices[i + operand];
+                this->cells.push_back(variable);
+            }
+            
+            i += numOperands;
+        }
+    }
+    
+    inline void UnrolledThreadedKernel::run(Value *memory, Value dropout) const
+    {
+        UnrolledThreadedKernel::execute(this->cells.data(), memory, dropout);
+    }
+    
+    inline const int32_t *UnrolledThreadedKernel::execute(const Cell *code, Value *memory, Value dropout)
+    {
+#if TINYRNN_USES_COMPUTED_GOTO
+
+#define VM_LABEL(OPERATION) static_cast<const char *>(&&OPERATION##_)
+#define VM_HANDLER(OPERATION) int32_t(VM_LABEL(OPERATION) - VM_LABEL(Zero))
+        
+        // Indexed by VMProgram::Operation, with the End handler in the very last slot
+        static const int32_t handlers[] =
+        {
+            VM_HANDLER(Zero), VM_HANDLER(Clip),
+            VM_HANDLER(ActivationSigmoid), VM_HANDLER(DerivativeSigmoid), VM_HANDLER(DropoutActivationSigmoid),
+            VM_HANDLER(ActivationTanh), VM_HANDLER(DerivativeTanh), VM_HANDLER(DropoutActivationTanh),
+            VM_HANDLER(ActivationLeakyReLU), VM_HANDLER(DerivativeLeakyReLU), VM_HANDLER(DropoutActivationLeakyReLU),
+            VM_HANDLER(AAP), VM_HANDLER(AAPP), VM_HANDLER(A), VM_HANDLER(AS), VM_HANDLER(AD),
+            VM_HANDLER(AP), VM_HANDLER(APP), VM_HANDLER(APS), VM_HANDLER(APSP),
+            VM_HANDLER(APPS), VM_HANDLER(APPSP), VM_HANDLER(APPSPP),
+            VM_HANDLER(FeedState),
+            VM_HANDLER(ActivationDerivativeSigmoid), VM_HANDLER(DropoutActivationDerivativeSigmoid),
+            VM_HANDLER(ActivationDerivativeTanh), VM_HANDLER(DropoutActivationDerivativeTanh),
+            VM_HANDLER(ActivationDerivativeLeakyReLU), VM_HANDLER(DropoutActivationDerivativeLeakyReLU),
+            VM_HANDLER(ClipAAP),
+            VM_HANDLER(Softmax), VM_HANDLER(SoftmaxCrossEntropy),
+            VM_HANDLER(GatherActiveInputs), VM_HANDLER(FeedStateSparse), VM_HANDLER(TraceSparse),
+            VM_HANDLER(TrainSparse), VM_HANDLER(TrainSparseClipped),
+            VM_HANDLER(End)
+        };
+
+#undef VM_HANDLER
+        
+        static_assert(sizeof(handlers) / sizeof(handlers[0]) == VMProgram::TrainSparseClipped + 2,
+                      "Every operation must have a handler");
+        
+        if (code == nullptr)
+        {
+            return handlers;
+        }
+
+#define VM_BEGIN goto *(VM_LABEL(Zero) + (ip++)->handler);
+#define VM_CASE(OPERATION) OPERATION##_
+#define VM_NEXT goto *(VM_LABEL(Zero) + (ip++)->handler)
+#define VM_END
+
+#else
+        
+        if (code == nullptr)
+        {
+            return nullptr;
+        }
+
+#define VM_BEGIN for (;;) { switch ((ip++)->operation) {
+#define VM_CASE(OPERATION) case VMProgram::OPERATION
+#define VM_NEXT continue
+#define VM_END default: break; } }
+
+#endif
+
+#define X(INDEX) (memory[ip[INDEX].operand])
+        
+        const Cell *ip = code;
+        
+        VM_BEGIN
+        
+        VM_CASE(Zero):
+            X(0) = 0;
+            ip += 1;
+            VM_NEXT;
+        VM_CASE(Clip):
+            X(0) = std::max(Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD),
+                            std::min(X(0), Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD)));
+            ip += 1;
+            VM_NEXT;
+        
+        VM_CASE(ActivationSigmoid):
+            X(0) = (1.0 / (1.0 + exp(-X(1))));
+            ip += 2;
+            VM_NEXT;
+        VM_CASE(DropoutActivationSigmoid):
+            X(0) = Value(dropout) * (1.0 / (1.0 + exp(-X(1))));
+            ip += 2;
+            VM_NEXT;
+        VM_CASE(DerivativeSigmoid):
+            X(0) = X(1) * (1.0 - X(1));
+            ip += 2;
+            VM_NEXT;
+        
+        VM_CASE(ActivationTanh):
+        {
+            const Value eP = exp(X(1));
+            const Value eN = 1.0 / eP;
+            X(0) = (eP - eN) / (eP + eN);
+            ip += 2;
+            VM_NEXT;
+        }
+        VM_CASE(DropoutActivationTanh):
+        {
+            const Value eP = exp(X(1));
+            const Value eN = 1.0 / eP;
+            X(0) = Value(dropout) * ((eP - eN) / (eP + eN));
+            ip += 2;
+            VM_NEXT;
+        }
+        VM_CASE(DerivativeTanh):
+            X(0) = 1.0 - (X(1) * X(1));
+            ip += 2;
+            VM_NEXT;
+        
+        VM_CASE(ActivationLeakyReLU):
+            X(0) = X(1) > 0.0 ? X(1) : (0.01 * X(1));
+            ip += 2;
+            VM_NEXT;
+        VM_CASE(DropoutActivationLeakyReLU):
+            X(0) = Value(dropout) * (X(1) > 0.0 ? X(1) : (0.01 * X(1)));
+            ip += 2;
+            VM_NEXT;
+        VM_CASE(DerivativeLeakyReLU):
+            X(0) = X(1) > 0.0 ? 1.0 : 0.01;
+            ip += 2;
+            VM_NEXT;
+        
+        VM_CASE(AAP):
+            X(0) = X(0) + X(1) * X(2);
+            ip += 3;
+            VM_NEXT;
+        VM_CASE(AAPP):
+            X(0) = X(0) + X(1) * X(2) * X(3);
+            ip += 4;
+            VM_NEXT;
+        VM_CASE(A):
+            X(0) = X(1);
+            ip += 2;
+            VM_NEXT;
+        VM_CASE(AS):
+            X(0) = X(1) + X(2);
+            ip += 3;
+            VM_NEXT;
+        VM_CASE(AD):
+            X(0) = X(1) - X(2);
+            ip += 3;
+            VM_NEXT;
+        VM_CASE(AP):
+            X(0) = X(1) * X(2);
+            ip += 3;
+            VM_NEXT;
+        VM_CASE(APP):
+            X(0) = X(1) * X(2) * X(3);
+            ip += 4;
+            VM_NEXT;
+        VM_CASE(APS):
+            X(0) = X(1) * X(2) + X(3);
+            ip += 4;
+            VM_NEXT;
+        VM_CASE(APSP):
+            X(0) = X(1) * X(2) + X(3) * X(4);
+            ip += 5;
+            VM_NEXT;
+        VM_CASE(APPS):
+            X(0) = X(1) * X(2) * X(3) + X(4);
+            ip += 5;
+            VM_NEXT;
+        VM_CASE(APPSP):
+            X(0) = X(1) * X(2) * X(3) + X(4) * X(5);
+            ip += 6;
+            VM_NEXT;
+        VM_CASE(APPSPP):
+            X(0) = X(1) * X(2) * X(3) + X(4) * X(5) * X(6);
+            ip += 7;
+            VM_NEXT;
+        
+        VM_CASE(FeedState):
+        {
+            const Index loopCount = ip[0].count;
+            Value &state = memory[ip[1].operand];
+            ip += 2;
+            
+            Value accumulator = state;
+            
+            for (Index loop = 0; loop < loopCount; ++loop)
+            {
+                accumulator = accumulator + X(0) * X(1) * X(2);
+                ip += 3;
+            }
+            
+            state = accumulator;
+            VM_NEXT;
+        }
+        
+        VM_CASE(ActivationDerivativeSigmoid):
+            X(0) = (1.0 / (1.0 + exp(-X(2))));
+            X(1) = X(0) * (1.0 - X(0));
+            ip += 3;
+            VM_NEXT;
+        VM_CASE(DropoutActivationDerivativeSigmoid):
+            X(0) = Value(dropout) * (1.0 / (1.0 + exp(-X(2))));
+            X(1) = X(0) * (1.0 - X(0));
+            ip += 3;
+            VM_NEXT;
+        VM_CASE(ActivationDerivativeTanh):
+        {
+            const Value eP = exp(X(2));
+            const Value eN = 1.0 / eP;
+            X(0) = (eP - eN) / (eP + eN);
+            X(1) = 1.0 - (X(0) * X(0));
+            ip += 3;
+            VM_NEXT;
+        }
+        VM_CASE(DropoutActivationDerivativeTanh):
+        {
+            const Value eP = exp(X(2));
+            const Value eN = 1.0 / eP;
+            X(0) = Value(dropout) * ((eP - eN) / (eP + eN));
+            X(1) = 1.0 - (X(0) * X(0));
+            ip += 3;
+            VM_NEXT;
+        }
+        VM_CASE(ActivationDerivativeLeakyReLU):
+            X(0) = X(2) > 0.0 ? X(2) : (0.01 * X(2));
+            X(1) = X(2) > 0.0 ? 1.0 : 0.01;
+            ip += 3;
+            VM_NEXT;
+        VM_CASE(DropoutActivationDerivativeLeakyReLU):
+            X(0) = Value(dropout) * (X(2) > 0.0 ? X(2) : (0.01 * X(2)));
+            X(1) = X(2) > 0.0 ? 1.0 : 0.01;
+            ip += 3;
+            VM_NEXT;
+        VM_CASE(ClipAAP):
+            X(2) = std::max(Value(-TINYRNN_GRADIENT_CLIPPING_THRESHOLD),
+                            std::min(X(2), Value(TINYRNN_GRADIENT_CLIPPING_THRESHOLD)));
+            X(0) = X(0) + X(1) * X(2);
+            ip += 3;
+            VM_NEXT;
+        
+        VM_CASE(Softmax):
+        {
+            const Index *operands = reinterpret_cast<const Index *>(ip);
+            VMProgram::softmax(memory, operands);
+            ip += VMProgram::getNumOperands(VMProgram::Softmax, operands);
+            VM_NEXT;
+        }
+        VM_CASE(SoftmaxCrossEntropy):
+        {
+            const Index *operands = reinterpret_cast<const Index *>(ip);
+            VMProgram::softmaxCrossEntropy(memory, operands);
+            ip += VMProgram::getNumOperands(VMProgram::SoftmaxCrossEntropy, operands);
+            VM_NEXT;
+        }
+        
+        VM_CASE(GatherActiveInputs):
+        {
+            const Index *operands = reinterpret_cast<const Index *>(ip);
+            VMProgram::gatherActiveInputs(memory, operands);
+            ip += VMProgram::getNumOperands(VMProgram::GatherActiveInputs, operands);
+            VM_NEXT;
+        }
+        VM_CASE(FeedStateSparse):
+        {
+            const Index *operands = reinterpret_cast<const Index *>(ip);
+            VMProgram::feedStateSparse(memory, operands);
+            ip += VMProgram::getNumOperands(VMProgram::FeedStateSparse, operands);
+            VM_NEXT;
+        }
+        VM_CASE(TraceSparse):
+        {
+            const Index *operands = reinterpret_cast<const Index *>(ip);
+            VMProgram::traceSparse(memory, operands);
+            ip += VMProgram::getNumOperands(VMProgram::TraceSparse, operands);
+            VM_NEXT;
+        }
+        VM_CASE(TrainSparse):
+        {
+            const Index *operands = reinterpret_cast<const Index *>(ip);
+            VMProgram::trainSparse(memory, operands, false);
+            ip += VMProgram::getNumOperands(VMProgram::TrainSparse, operands);
+            VM_NEXT;
+        }
+        VM_CASE(TrainSparseClipped):
+        {
+            const Index *operands = reinterpret_cast<const Index *>(ip);
+            VMProgram::trainSparse(memory, operands, true);
+            ip += VMProgram::getNumOperands(VMProgram::TrainSparseClipped, operands);
+            VM_NEXT;
+        }
+        
+        VM_CASE(End):
+            return nullptr;
+        
+        VM_END
+
+#undef X
+#undef VM_LABEL
+#undef VM_BEGIN
+#undef VM_CASE
+#undef VM_NEXT
+#undef VM_END
+        
+        return nullptr;
+    }
+} // namespace TinyRNN
+
+#endif // TINYRNN_UNROLLEDTHREADEDKERNEL_H_INCLUDED
@@ -27,12 +27,12 @@
 #include "Id.h"
 #include "Neuron.h"
 #include "SerializedObject.h"
+#include "UnrolledVariableMapping.h"
 
 #include <random>
 #include <iostream>
-#include <sstream>
-#include <iterator>
 #include <numeric>
+#include <algorithm>
 
 namespace TinyRNN
 {   
@@ -43,15 +43,32 @@ namespace TinyRNN
         using Ptr = std::shared_ptr<UnrolledTrainingContext>;
         using RawData = std::vector<Value>;
         using Indices = std::vector<Index>;
-        using Mapping = std::map<std::string, Index>;
-        using VariableKey = std::vector<Id>;
+        using Mapping = UnrolledVariableMapping;
+        using VariableKey = UnrolledVariableMapping::Key;
         
+        // A read-only view of some of the variables, straight into the memory, with no copying:
+        // it only points to the memory and to the list of the variables, which has to outlive it
+        class View final
+        {
+        public:
+            
+            View(const RawData &targetMemory, const Indices &targetVariables);
+            
+            size_t size() const noexcept;
+            Value operator[](size_t index) const noexcept;
+        
+        private:
+            
+            const RawData *memory;
+            const Indices *variables;
+        };
+    
     public:
         
         UnrolledTrainingContext();
         
         void restoreNeuronState(Neuron::Ptr targetNeuron);
-
+        
         Value evaluateVariable(const VariableKey &variableKey, Value defaultValue);
         Index allocateOrReuseVariable(Value value, const VariableKey &variableKey);
         
@@ -60,40 +77,53 @@ namespace TinyRNN
         void registerTargetVariable(Index variableIndex);
         void registerRateVariable(Index variableIndex);
         
-        Indices getInputVariables() const;
-        Indices getOutputVariables() const;
-        Indices getTargetVariables() const;
+        const Indices &getInputVariables() const noexcept;
+        const Indices &getOutputVariables() const noexcept;
+        const Indices &getTargetVariables() const noexcept;
         Index getRateVariable() const;
         
+        // Finds all variables whose key has a given tag, e.g. Keys::Mapping::Weight
+        Indices getVariablesWithTag(Id tag) const;
+        
+        // Weights and biases, sorted: the only variables that the copies of a network share,
+        // all the rest being the activations, states and traces of a single sequence
+        Indices getTrainableVariables() const;
+        const Mapping &getMapping() const;
+        
+        // The list is not copied, e.g. the context's own lists of the input and output variables will do
+        View getView(const Indices &variables) const;
+        
         RawData &getMemory();
         RawData &getOutputs();
         
         void clear();
         void clearMappings();
         
+        // Moves every variable to a new place in memory, newIndices[oldIndex] being the new index;
+        // must be a permutation, and all the kernels using this context are to be renumbered as well
+        void renumberVariables(const Indices &newIndices);
+    
     public:
         
         virtual void deserialize(SerializationContext::Ptr context) override;
         virtual void serialize(SerializationContext::Ptr context) const override;
-        
+    
     private:
         
         RawData memory;                         // the actual data passed to the kernel
-        Mapping mapping;                        // variable name connected to its index in memory
+        Mapping mapping;                        // variable key connected to its index in memory
         
         Indices inputVariables;                 // indices of input variables
         Indices outputVariables;                // indices of output variables
         Indices targetVariables;                // indices of target variables
         Index rateVariable;
-        
+    
     private: // temporary stuff, never serialized:
         
         RawData outputs;                        // holds the most recent output
-        
+    
     private:
         
-        std::string getKeyForVariable(const VariableKey &variableKey) const;
-        
         TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledTrainingContext);
     };
     
@@ -106,56 +136,29 @@ namespace TinyRNN
     
     inline Index UnrolledTrainingContext::allocateOrReuseVariable(Value value, const VariableKey &variableKey)
     {
-        const std::string &key = this->getKeyForVariable(variableKey);
-        const bool variableExists = (this->mapping.find(key) != this->mapping.end());
-        
-        if (variableExists)
+        if (const Index *existingIndex = this->mapping.find(variableKey))
         {
-            const Index variableIndex = this->mapping[key];
+            const Index variableIndex = *existingIndex;
             this->memory[variableIndex] = value;
             return variableIndex;
         }
-        else
-        {
-            //std::cout << this->memory.size() << " is " << key << std::endl;
-            this->memory.push_back(value);
-            const Index variableIndex = (this->memory.size() - 1);
-            this->mapping[key] = variableIndex;
-            return variableIndex;
-        }
         
-        return 0;
+        this->memory.push_back(value);
+        const Index variableIndex = (this->memory.size() - 1);
+        this->mapping.insert(variableKey, variableIndex);
+        return variableIndex;
     }
     
     inline Value UnrolledTrainingContext::evaluateVariable(const VariableKey &variableKey, Value defaultValue)
     {
-        const std::string &key = this->getKeyForVariable(variableKey);
-        const bool variableExists = (this->mapping.find(key) != this->mapping.end());
-        
-        if (variableExists)
+        if (const Index *variableIndex = this->mapping.find(variableKey))
         {
-            const Index variableIndex = this->mapping[key];
-            //std::cout << "Variable: " << key << " = " << std::to_string(this->memory[variableIndex]) << std::endl;
-            return this->memory[variableIndex];
+            return this->memory[*variableIndex];
         }
         
-        //std::cout << "Variable missing: " << key << ", default to " << std::to_string(defaultValue) << std::endl;
         return defaultValue;
     }
     
-    inline std::string UnrolledTrainingContext::getKeyForVariable(const VariableKey &variableKey) const
-    {
-        std::ostringstream key;
-        
-        std::copy(variableKey.begin(),
-                  variableKey.end() - 1,
-                  std::ostream_iterator<Id>(key, "::"));
-        
-        key << variableKey.back();
-        
-        return key.str();
-    }
-    
     inline void UnrolledTrainingContext::registerInputVariable(Index variableIndex)
     {
         this->inputVariables.push_back(variableIndex);
@@ -177,20 +180,20 @@ namespace TinyRNN
         this->rateVariable = variableIndex;
     }
     
-    inline UnrolledTrainingContext::Indices 
-    UnrolledTrainingContext::getInputVariables() const
+    inline const UnrolledTrainingContext::Indices &
+    UnrolledTrainingContext::getInputVariables() const noexcept
     {
         return this->inputVariables;
     }
     
-    inline UnrolledTrainingContext::Indices
-    UnrolledTrainingContext::getOutputVariables() const
+    inline const UnrolledTrainingContext::Indices &
+    UnrolledTrainingContext::getOutputVariables() const noexcept
     {
         return this->outputVariables;
     }
     
-    inline UnrolledTrainingContext::Indices
-    UnrolledTrainingContext::getTargetVariables() const
+    inline const UnrolledTrainingContext::Indices &
+    UnrolledTrainingContext::getTargetVariables() const noexcept
     {
         return this->targetVariables;
     }
@@ -200,6 +203,50 @@ namespace TinyRNN
         return this->rateVariable;
     }
     
+    inline UnrolledTrainingContext::Indices
+    UnrolledTrainingContext::getVariablesWithTag(Id tag) const
+    {
+        Indices result;
+        
+        for (const auto &i : this->mapping)
+        {
+            if (i.first.tag == tag)
+            {
+                result.push_back(i.second);
+            }
+        }
+        
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+    
+    inline UnrolledTrainingContext::Indices UnrolledTrainingContext::getTrainableVariables() const
+    {
+        Indices result;
+        
+        for (const auto &i : this->mapping)
+        {
+            if (i.first.tag == Keys::Mapping::Weight ||
+                i.first.tag == Keys::Mapping::Bias)
+            {
+                result.push_back(i.second);
+            }
+        }
+        
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+    
+    inline const UnrolledTrainingContext::Mapping &UnrolledTrainingContext::getMapping() const
+    {
+        return this->mapping;
+    }
+    
+    inline UnrolledTrainingContext::View UnrolledTrainingContext::getView(const Indices &variables) const
+    {
+        return View(this->memory, variables);
+    }
+    
     inline UnrolledTrainingContext::RawData &UnrolledTrainingContext::getMemory()
     {
         return this->memory;
@@ -226,6 +273,57 @@ namespace TinyRNN
         this->mapping.clear();
     }
     
+    inline void UnrolledTrainingContext::renumberVariables(const Indices &newIndices)
+    {
+        RawData renumberedMemory(this->memory.size());
+        
+        for (size_t i = 0; i < this->memory.size(); ++i)
+        {
+            renumberedMemory[newIndices[i]] = this->memory[i];
+        }
+        
+        this->memory.swap(renumberedMemory);
+        
+        this->mapping.remapIndices(newIndices);
+        
+        for (auto &i : this->inputVariables)
+        {
+            i = newIndices[i];
+        }
+        
+        for (auto &i : this->outputVariables)
+        {
+            i = newIndices[i];
+        }
+        
+        for (auto &i : this->targetVariables)
+        {
+            i = newIndices[i];
+        }
+        
+        this->rateVariable = newIndices[this->rateVariable];
+    }
+    
+    //===------------------------------------------------------------------===//
+    // View implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledTrainingContext::View::View(const RawData &targetMemory, const Indices &targetVariables) :
+    memory(&targetMemory),
+    variables(&targetVariables)
+    {
+    }
+    
+    inline size_t UnrolledTrainingContext::View::size() const noexcept
+    {
+        return this->variables->size();
+    }
+    
+    inline Value UnrolledTrainingContext::View::operator[](size_t index) const noexcept
+    {
+        return (*this->memory)[(*this->variables)[index]];
+    }
+    
     //===------------------------------------------------------------------===//
     // Restore neuron state
     //===------------------------------------------------------------------===//
@@ -242,28 +340,19 @@ namespace TinyRNN
         target->oldState = oldState;
         target->activation = activation;
         
-        for (auto &i : target->eligibility)
+        for (size_t slot = 0; slot < target->incomingLinks.size(); ++slot)
         {
-            const Id &inputConnectionUuid = i.first;
-            target->eligibility[inputConnectionUuid] =
+            const Id inputConnectionUuid = target->incomingLinks[slot].connection->getUuid();
+            target->eligibility[slot] =
             this->evaluateVariable({target->getUuid(), inputConnectionUuid, Keys::Mapping::Eligibility},
-                                   target->eligibility[inputConnectionUuid]);
-        }
-        
-        for (auto &i : target->extended)
-        {
-            const Id &neighbourNeuronUuid = i.first;
-            Neuron::EligibilityMap &map = i.second;
+                                   target->eligibility[slot]);
             
-            for (auto &j : map)
+            for (auto &gatedNeighbour : target->gatedNeighbours)
             {
-                const Id &inputConnectionUuid = j.first;
-                
-                const Value extendedTrace =
+                const Id neighbourNeuronUuid = gatedNeighbour.neuron->getUuid();
+                gatedNeighbour.extended[slot] =
                 this->evaluateVariable({target->getUuid(), neighbourNeuronUuid, inputConnectionUuid, Keys::Mapping::ExtendedTrace},
-                                       target->extended[neighbourNeuronUuid][inputConnectionUuid]);
-                
-                target->extended[neighbourNeuronUuid][inputConnectionUuid] = extendedTrace;
+                                       gatedNeighbour.extended[slot]);
             }
         }
         
@@ -308,12 +397,29 @@ namespace TinyRNN
         
         if (auto mappingNode = context->getChildContext(Keys::Unrolled::VariablesMapping))
         {
+            // the older format has one node per variable with a key string like "12::345::7"
             for (size_t i = 0; i < mappingNode->getNumChildrenContexts(); ++i)
             {
                 SerializationContext::Ptr variableNode(mappingNode->getChildContext(i));
                 const std::string &key = variableNode->getStringProperty(Keys::Unrolled::Key);
                 const size_t index = variableNode->getNumberProperty(Keys::Unrolled::Index);
-                this->mapping[key] = index;
+                this->mapping.insert(VariableKey::fromString(key), index);
+            }
+            
+            const size_t mappingSize = mappingNode->getNumberProperty(Keys::Unrolled::MappingSize);
+            
+            if (mappingSize > 0)
+            {
+                const std::string &mappingEncoded = mappingNode->getStringProperty(Keys::Unrolled::RawMapping);
+                const std::vector<unsigned char> &mappingDecoded = context->decodeBase64(mappingEncoded);
+                
+                // a truncated or corrupt mapping is skipped, instead of being read past its end
+                if (mappingDecoded.size() >= sizeof(Id) * mappingSize)
+                {
+                    std::vector<Id> mappingData(mappingSize);
+                    std::memcpy(mappingData.data(), mappingDecoded.data(), sizeof(Id) * mappingSize);
+                    this->mapping.fromBinary(mappingData);
+                }
             }
         }
         
@@ -365,12 +471,14 @@ namespace TinyRNN
         context->setNumberProperty(this->memory.size(), Keys::Unrolled::MemorySize);
         
         SerializationContext::Ptr mappingNode(context->addChildContext(Keys::Unrolled::VariablesMapping));
-        for (const auto &i : this->mapping)
-        {
-            SerializationContext::Ptr variableNode(mappingNode->addChildContextUnordered(Keys::Unrolled::Variable));
-            variableNode->setStringProperty(i.first, Keys::Unrolled::Key);
-            variableNode->setNumberProperty(i.second, Keys::Unrolled::Index);
-        }
+        const std::vector<Id> &mappingData = this->mapping.toBinary();
+        
+        const std::string mappingEncoded =
+        context->encodeBase64((const unsigned char *)mappingData.data(),
+                              sizeof(Id) * mappingData.size());
+        
+        mappingNode->setStringProperty(mappingEncoded, Keys::Unrolled::RawMapping);
+        mappingNode->setNumberProperty(mappingData.size(), Keys::Unrolled::MappingSize);
         
         SerializationContext::Ptr inputsNode(context->addChildContext(Keys::Unrolled::InputsMapping));
         for (const auto &i : this->inputVariables)
@@ -0,0 +1,310 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TINYRNN_UNROLLEDVARIABLEMAPPING_H_INCLUDED
+#define TINYRNN_UNROLLEDVARIABLEMAPPING_H_INCLUDED
+
+#include "Common.h"
+
+#include <initializer_list>
+#include <algorithm>
+
+namespace TinyRNN
+{
+    // Maps the variables of an unrolled network to their indices in memory.
+    // Entries are kept in insertion order in a dense array,
+    // and a flat open-addressing table with linear probing indexes them.
+    class UnrolledVariableMapping final
+    {
+    public:
+        
+        static const size_t MaxIds = 4;
+        
+        // A fixed-width key: up to four uuids and a tag from Keys::Mapping,
+        // e.g. {connectionUuid, Keys::Mapping::Weight}
+        struct Key final
+        {
+            Id ids[MaxIds];
+            Id numIds;
+            Id tag;
+            
+            Key();
+            Key(std::initializer_list<Id> idsAndTag);
+            
+            bool operator==(const Key &other) const;
+            size_t hash() const;
+            
+            // A legacy string form, like "12::345::7"
+            static Key fromString(const std::string &key);
+        };
+        
+        using Entry = std::pair<Key, Index>;
+        using Entries = std::vector<Entry>;
+    
+    public:
+        
+        UnrolledVariableMapping();
+        
+        const Index *find(const Key &key) const;
+        Index *find(const Key &key);
+        
+        // Returns false if the key is already there, and leaves its index untouched
+        bool insert(const Key &key, Index index);
+        
+        size_t size() const;
+        void clear();
+        
+        Entries::const_iterator begin() const;
+        Entries::const_iterator end() const;
+        
+        // Indices are the only thing allowed to change in place, so that the table stays valid
+        void remapIndices(const std::vector<Index> &newIndices);
+        
+        // The binary form is a sequence of Ids: numIds, ids..., tag, index
+        std::vector<Id> toBinary() const;
+        void fromBinary(const std::vector<Id> &data);
+    
+    private:
+        
+        Entries entries;
+        std::vector<Index> slots; // entry index + 1, or 0 for empty slots
+        
+        size_t findSlot(const Key &key) const;
+        void rehash(size_t numSlots);
+        
+        TINYRNN_DISALLOW_COPY_AND_ASSIGN(UnrolledVariableMapping);
+    };
+    
+    //===------------------------------------------------------------------===//
+    // Key implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledVariableMapping::Key::Key() : ids(), numIds(0), tag(0)
+    {}
+    
+    inline UnrolledVariableMapping::Key::Key(std::initializer_list<Id> idsAndTag) :
+        ids(), numIds(0), tag(0)
+    {
+        if (idsAndTag.size() == 0)
+        {
+            return;
+        }
+        
+        this->numIds = Id(std::min(idsAndTag.size() - 1, size_t(MaxIds)));
+        std::copy(idsAndTag.begin(), idsAndTag.begin() + this->numIds, this->ids);
+        this->tag = *(idsAndTag.end() - 1);
+    }
+    
+    inline bool UnrolledVariableMapping::Key::operator==(const Key &other) const
+    {
+        return (this->tag == other.tag &&
+                this->numIds == other.numIds &&
+                std::memcmp(this->ids, other.ids, sizeof(this->ids)) == 0);
+    }
+    
+    inline size_t UnrolledVariableMapping::Key::hash() const
+    {
+        uint64_t h = (uint64_t(this->numIds) << 32) | this->tag;
+        
+        for (Id id : this->ids)
+        {
+            h = (h ^ id) * 0x9E3779B97F4A7C15ULL;
+            h ^= (h >> 29);
+        }
+        
+        return size_t(h);
+    }
+    
+    inline UnrolledVariableMapping::Key UnrolledVariableMapping::Key::fromString(const std::string &key)
+    {
+        std::vector<Id> parts;
+        size_t start = 0;
+        
+        while (true)
+        {
+            const size_t separator = key.find("::", start);
+            parts.push_back(Id(std::stoul(key.substr(start, separator - start))));
+            
+            if (separator == std::string::npos)
+            {
+                break;
+            }
+            
+            start = separator + 2;
+        }
+        
+        Key result;
+        result.numIds = Id(std::min(parts.size() - 1, size_t(MaxIds)));
+        std::copy(parts.begin(), parts.begin() + result.numIds, result.ids);
+        result.tag = parts.back();
+        return result;
+    }
+    
+    //===------------------------------------------------------------------===//
+    // UnrolledVariableMapping implementation
+    //===------------------------------------------------------------------===//
+    
+    inline UnrolledVariableMapping::UnrolledVariableMapping()
+    {
+        this->rehash(64);
+    }
+    
+    inline size_t UnrolledVariableMapping::findSlot(const Key &key) const
+    {
+        const size_t mask = this->slots.size() - 1;
+        size_t slot = key.hash() & mask;
+        
+        while (this->slots[slot] != 0 &&
+               !(this->entries[this->slots[slot] - 1].first == key))
+        {
+            slot = (slot + 1) & mask;
+        }
+        
+        return slot;
+    }
+    
+    inline const Index *UnrolledVariableMapping::find(const Key &key) const
+    {
+        const Index entry = this->slots[this->findSlot(key)];
+        return (entry == 0) ? nullptr : &this->entries[entry - 1].second;
+    }
+    
+    inline Index *UnrolledVariableMapping::find(const Key &key)
+    {
+        const Index entry = this->slots[this->findSlot(key)];
+        return (entry == 0) ? nullptr : &this->entries[entry - 1].second;
+    }
+    
+    inline bool UnrolledVariableMapping::insert(const Key &key, Index index)
+    {
+        const size_t slot = this->findSlot(key);
+        
+        if (this->slots[slot] != 0)
+        {
+            return false;
+        }
+        
+        this->entries.push_back(Entry(key, index));
+        this->slots[slot] = Index(this->entries.size());
+        
+        // keep the load factor under 1/2, so that probe sequences stay short
+        if (this->entries.size() * 2 > this->slots.size())
+        {
+            this->rehash(this->slots.size() * 2);
+        }
+        
+        return true;
+    }
+    
+    inline void UnrolledVariableMapping::rehash(size_t numSlots)
+    {
+        this->slots.assign(numSlots, 0);
+        const size_t mask = numSlots - 1;
+        
+        for (size_t i = 0; i < this->entries.size(); ++i)
+        {
+            size_t slot = this->entries[i].first.hash() & mask;
+            
+            while (this->slots[slot] != 0)
+            {
+                slot = (slot + 1) & mask;
+            }
+            
+            this->slots[slot] = Index(i + 1);
+        }
+    }
+    
+    inline size_t UnrolledVariableMapping::size() const
+    {
+        return this->entries.size();
+    }
+    
+    inline void UnrolledVariableMapping::clear()
+    {
+        this->entries.clear();
+        this->rehash(64);
+    }
+    
+    inline UnrolledVariableMapping::Entries::const_iterator UnrolledVariableMapping::begin() const
+    {
+        return this->entries.begin();
+    }
+    
+    inline UnrolledVariableMapping::Entries::const_iterator UnrolledVariableMapping::end() const
+    {
+        return this->entries.end();
+    }
+    
+    inline void UnrolledVariableMapping::remapIndices(const std::vector<Index> &newIndices)
+    {
+        for (auto &i : this->entries)
+        {
+            i.second = newIndices[i.second];
+        }
+    }
+    
+    //===------------------------------------------------------------------===//
+    // Binary form
+    //===------------------------------------------------------------------===//
+    
+    inline std::vector<Id> UnrolledVariableMapping::toBinary() const
+    {
+        std::vector<Id> result;
+        result.reserve(this->entries.size() * 4);
+        
+        for (const auto &i : this->entries)
+        {
+            const Key &key = i.first;
+            result.push_back(key.numIds);
+            result.insert(result.end(), key.ids, key.ids + key.numIds);
+            result.push_back(key.tag);
+            result.push_back(i.second);
+        }
+        
+        return result;
+    }
+    
+    inline void UnrolledVariableMapping::fromBinary(const std::vector<Id> &data)
+    {
+        this->clear();
+        size_t position = 0;
+        
+        while (position < data.size())
+        {
+            Key key;
+            key.numIds = data[position++];
+            
+            if (key.numIds > MaxIds || (position + key.numIds + 2) > data.size())
+            {
+                break;
+            }
+            
+            std::copy(data.begin() + position, data.begin() + position + key.numIds, key.ids);
+            position += key.numIds;
+            key.tag = data[position++];
+            
+            this->insert(key, data[position++]);
+        }
+    }
+}  // namespace TinyRNN
+
+#endif  // TINYRNN_UNROLLEDVARIABLEMAPPING_H_INCLUDED
@@ -0,0 +1,352 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+#include "ThirdParty/Catch/include/catch.hpp"
+#include "Helpers.h"
+#include "Network.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace TinyRNN;
+
+static const Value kTrainingRate = 0.25f;
+
+// Counts all the heap allocations of the test binary, only checked within the scopes below;
+// kept out of line, so that the compiler doesn't pair the inlined malloc with some other delete
+static std::atomic<size_t> numAllocations(0);
+
+__attribute__((noinline)) static void *countedAllocation(std::size_t size)
+{
+    ++numAllocations;
+    
+    if (void *pointer = std::malloc((size > 0) ? size : 1))
+    {
+        return pointer;
+    }
+    
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) static void countedDeallocation(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+__attribute__((noinline)) void *operator new(std::size_t size)
+{
+    return countedAllocation(size);
+}
+
+__attribute__((noinline)) void *operator new[](std::size_t size)
+{
+    return countedAllocation(size);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept
+{
+    countedDeallocation(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void *pointer) noexcept
+{
+    countedDeallocation(pointer);
+}
+
+__attribute__((noinline)) void operator delete(void *pointer, std::size_t) noexcept
+{
+    countedDeallocation(pointer);
+}
+
+__attribute__((noinline)) void operator delete[](void *pointer, std::size_t) noexcept
+{
+    countedDeallocation(pointer);
+}
+
+SCENARIO("Steady-state feeding and training of an unrolled network never allocates", "[allocation]")
+{
+    GIVEN("An unrolled lstm network, and the buffers for its inputs, outputs and targets")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(50, 100);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        std::vector<Value> inputs(numInputs * numSteps);
+        std::vector<Value> targets(numOutputs * numSteps);
+        std::vector<Value> outputs(numOutputs * numSteps);
+        for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+        for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+        
+        const auto outputsView = vmNetwork->getOutputsView();
+        REQUIRE(outputsView.size() == size_t(numOutputs));
+        
+        WHEN("It is fed and trained after a warm-up step, in each of the execution modes")
+        {
+            const UnrolledNetwork::ExecutionMode modes[] = { UnrolledNetwork::Interpreted, UnrolledNetwork::Threaded };
+            std::vector<size_t> numAllocationsPerMode;
+            
+            for (const auto mode : modes)
+            {
+                vmNetwork->setExecutionMode(mode);
+                
+                // the first step decodes the kernels, and the first reset finds the state variables
+                vmNetwork->feed(inputs.data(), outputs.data());
+                vmNetwork->train(kTrainingRate, targets.data());
+                vmNetwork->resetState();
+                
+                const size_t allocationsBefore = numAllocations;
+                
+                for (int t = 0; t < numSteps; ++t)
+                {
+                    vmNetwork->feed(inputs.data() + t * numInputs, outputs.data() + t * numOutputs);
+                    vmNetwork->train(kTrainingRate, targets.data() + t * numOutputs);
+                }
+                
+                vmNetwork->trainSequence(kTrainingRate, inputs.data(), targets.data(), numSteps, outputs.data());
+                vmNetwork->resetState();
+                vmNetwork->feedSequence(inputs.data(), numSteps, outputs.data());
+                
+                numAllocationsPerMode.push_back(numAllocations - allocationsBefore);
+            }
+            
+            THEN("There are no heap allocations at all, and the view shows the latest outputs")
+            {
+                for (const auto &n : numAllocationsPerMode)
+                {
+                    REQUIRE(n == 0);
+                }
+                
+                for (int i = 0; i < numOutputs; ++i)
+                {
+                    REQUIRE(outputsView[i] == outputs[(numSteps - 1) * numOutputs + i]);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Steady-state feeding and training of a network never allocates", "[allocation]")
+{
+    GIVEN("A multilayer perceptron, its unrolled copy, and the buffers for its inputs, outputs and targets")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(50, 100);
+        
+        Layer::Ptr inputLayer(new Layer(numInputs));
+        Layer::Ptr hiddenLayer(new Layer(RANDOM(5, 10)));
+        Layer::Ptr outputLayer(new Layer(numOutputs));
+        
+        inputLayer->connectAllToAll(hiddenLayer);
+        hiddenLayer->connectAllToAll(outputLayer);
+        
+        Network::Ptr network(new Network(RANDOMNAME(), inputLayer, {hiddenLayer}, outputLayer));
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        std::vector<Value> inputs(numInputs * numSteps);
+        std::vector<Value> targets(numOutputs * numSteps);
+        std::vector<Value> outputs(numOutputs * numSteps);
+        for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+        for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+        
+        WHEN("It is fed and trained after a warm-up step")
+        {
+            network->feed(inputs.data(), outputs.data());
+            network->train(kTrainingRate, targets.data());
+            
+            const size_t allocationsBefore = numAllocations;
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                network->feed(inputs.data() + t * numInputs, outputs.data() + t * numOutputs);
+                network->train(kTrainingRate, targets.data() + t * numOutputs);
+            }
+            
+            network->trainSequence(kTrainingRate, inputs.data(), targets.data(), numSteps, outputs.data());
+            
+            const size_t allocationsAfter = numAllocations;
+            
+            THEN("There are no heap allocations at all")
+            {
+                REQUIRE(allocationsAfter == allocationsBefore);
+            }
+        }
+        
+        WHEN("Its unrolled copy is fed")
+        {
+            vmNetwork->feed(inputs.data(), outputs.data());
+            
+            std::vector<Id> outputUuids;
+            for (const auto &neuron : outputLayer->getNeurons())
+            {
+                outputUuids.push_back(neuron->getUuid());
+            }
+            
+            const auto activationsView = vmNetwork->getActivationsView(outputUuids);
+            
+            // only the first call for these neurons looks their variables up
+            const size_t allocationsBefore = numAllocations;
+            const auto sameActivationsView = vmNetwork->getActivationsView(outputUuids);
+            const size_t allocationsAfter = numAllocations;
+            
+            THEN("The view of the output neurons' activations shows the outputs, and the same view again is free")
+            {
+                REQUIRE(allocationsAfter == allocationsBefore);
+                REQUIRE(activationsView.size() == size_t(numOutputs));
+                REQUIRE(sameActivationsView.size() == size_t(numOutputs));
+                
+                for (int i = 0; i < numOutputs; ++i)
+                {
+                    REQUIRE(activationsView[i] == outputs[i]);
+                    REQUIRE(sameActivationsView[i] == outputs[i]);
+                }
+            }
+            
+            THEN("The view keeps showing the outputs after the variables are renumbered")
+            {
+                vmNetwork->renumberVariables();
+                vmNetwork->feed(inputs.data() + numInputs, outputs.data());
+                
+                for (int i = 0; i < numOutputs; ++i)
+                {
+                    REQUIRE(activationsView[i] == outputs[i]);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Steady-state feeding and training of a gated network never allocates", "[allocation]")
+{
+    GIVEN("An lstm network, and the buffers for its inputs, outputs and targets")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(50, 100);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        
+        std::vector<Value> inputs(numInputs * numSteps);
+        std::vector<Value> targets(numOutputs * numSteps);
+        std::vector<Value> outputs(numOutputs * numSteps);
+        for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+        for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+        
+        WHEN("It is fed and trained after a warm-up step")
+        {
+            network->feed(inputs.data(), outputs.data());
+            network->train(kTrainingRate, targets.data());
+            
+            const size_t allocationsBefore = numAllocations;
+            
+            network->trainSequence(kTrainingRate, inputs.data(), targets.data(), numSteps, outputs.data());
+            
+            const size_t allocationsAfter = numAllocations;
+            
+            THEN("The traces are updated without any heap allocations")
+            {
+                REQUIRE(allocationsAfter == allocationsBefore);
+            }
+        }
+    }
+}
+
+SCENARIO("Steady-state feeding of an inference session never allocates", "[allocation]")
+{
+    GIVEN("A session of an unrolled lstm network's model, and the buffers for its inputs and outputs")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(50, 100);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        const auto model = network->toVM()->createModel();
+        const auto session1 = model->createSession();
+        const auto session2 = model->createSession();
+        
+        std::vector<Value> inputs(numInputs * numSteps);
+        std::vector<Value> outputs(numOutputs * numSteps);
+        for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+        
+        WHEN("The sessions are fed after a warm-up step")
+        {
+            // the first step copies the model into this thread's workspace
+            session1->feed(inputs.data(), outputs.data());
+            
+            const size_t allocationsBefore = numAllocations;
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                session1->feed(inputs.data() + t * numInputs, outputs.data() + t * numOutputs);
+                session2->feed(inputs.data() + t * numInputs, outputs.data() + t * numOutputs);
+            }
+            
+            const size_t allocationsAfter = numAllocations;
+            
+            THEN("There are no heap allocations at all")
+            {
+                REQUIRE(allocationsAfter == allocationsBefore);
+            }
+        }
+    }
+}
+
+SCENARIO("Closed-loop generation never allocates", "[allocation]")
+{
+    GIVEN("An unrolled lstm network with as many inputs as outputs, and the buffers for its outputs and symbols")
+    {
+        const int numSymbols = RANDOM(2, 8);
+        const int numSteps = RANDOM(50, 100);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numSymbols, {RANDOM(5, 10)}, numSymbols);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        std::vector<Value> inputs(numSymbols, 0.0);
+        std::vector<Value> outputs(numSymbols * numSteps);
+        std::vector<Index> symbols(numSteps);
+        inputs.front() = 1.0;
+        
+        WHEN("It generates in each of the feedback modes, after a warm-up step")
+        {
+            // the first step decodes the kernels
+            vmNetwork->feed(inputs.data(), outputs.data());
+            
+            const size_t allocationsBefore = numAllocations;
+            
+            vmNetwork->generate(inputs.data(), numSteps, outputs.data());
+            vmNetwork->generate(inputs.data(), numSteps, outputs.data(), UnrolledNetwork::Argmax, symbols.data());
+            vmNetwork->generate(inputs.data(), numSteps, outputs.data(), UnrolledNetwork::Sample, symbols.data());
+            
+            const size_t allocationsAfter = numAllocations;
+            
+            THEN("There are no heap allocations at all")
+            {
+                REQUIRE(allocationsAfter == allocationsBefore);
+            }
+        }
+    }
+}
@@ -0,0 +1,784 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ThirdParty/Catch/include/catch.hpp"
+#include "Helpers.h"
+#include "Network.h"
+#include "ScopedTimer.h"
+
+#include <iterator>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace TinyRNN;
+
+// Benchmarks are hidden from the default test run,
+// use `CatchTests [benchmark]` to run them explicitly
+
+static const Value kTrainingRate = 0.25f;
+
+// Counts the last level cache misses of this thread, where the hardware counters are available
+class CacheMissCounter final
+{
+public:
+    
+    CacheMissCounter() : descriptor(-1)
+    {
+#if defined(__linux__)
+        perf_event_attr attributes;
+        std::memset(&attributes, 0, sizeof(attributes));
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.size = sizeof(attributes);
+        attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+        attributes.disabled = 1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        this->descriptor = int(syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+    }
+    
+    ~CacheMissCounter()
+    {
+#if defined(__linux__)
+        if (this->isAvailable()) { close(this->descriptor); }
+#endif
+    }
+    
+    bool isAvailable() const { return this->descriptor >= 0; }
+    
+    void start()
+    {
+#if defined(__linux__)
+        if (! this->isAvailable()) { return; }
+        ioctl(this->descriptor, PERF_EVENT_IOC_RESET, 0);
+        ioctl(this->descriptor, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    
+    long long stop()
+    {
+        long long count = -1;
+#if defined(__linux__)
+        if (! this->isAvailable()) { return count; }
+        ioctl(this->descriptor, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(this->descriptor, &count, sizeof(count)) != sizeof(count)) { count = -1; }
+#endif
+        return count;
+    }
+    
+private:
+    
+    int descriptor;
+};
+
+static double benchmarkUnrolledNetwork(UnrolledNetwork::Ptr network,
+                                       int numInputs, int numOutputs, int numIterations)
+{
+    UnrolledTrainingContext::RawData inputs(numInputs);
+    UnrolledTrainingContext::RawData targets(numOutputs);
+    
+    const auto startTime = std::chrono::high_resolution_clock::now();
+    
+    for (int i = 0; i < numIterations; ++i)
+    {
+        for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+        for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+        
+        network->feed(inputs);
+        network->train(kTrainingRate, targets);
+    }
+    
+    const auto endTime = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(endTime - startTime).count();
+}
+
+SCENARIO("Threaded execution of an unrolled lstm network is faster than the interpreted one", "[.][benchmark]")
+{
+    GIVEN("Two unrolled copies of a mid-sized lstm network")
+    {
+        const int numInputs = 16;
+        const int numOutputs = 16;
+        const int numIterations = 2000;
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {64}, numOutputs);
+        
+        UnrolledNetwork::Ptr interpretedNetwork = network->toVM();
+        interpretedNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        
+        UnrolledNetwork::Ptr threadedNetwork = network->toVM();
+        threadedNetwork->setExecutionMode(UnrolledNetwork::Threaded);
+        
+        WHEN("Both are fed and trained for the same number of steps")
+        {
+            const double interpretedTime = benchmarkUnrolledNetwork(interpretedNetwork, numInputs, numOutputs, numIterations);
+            const double threadedTime = benchmarkUnrolledNetwork(threadedNetwork, numInputs, numOutputs, numIterations);
+            
+            std::cout << "Interpreted: " << interpretedTime << " ms, "
+                      << "threaded: " << threadedTime << " ms, "
+                      << "speedup: " << (interpretedTime / threadedTime) << "x" << std::endl;
+            
+            for (const auto &pass : threadedNetwork->getOptimizationReport())
+            {
+                std::cout << "Kernel optimizer: " << pass.first << " removed " << pass.second << " instructions" << std::endl;
+            }
+            
+            THEN("The threaded mode wins")
+            {
+                REQUIRE(threadedTime < interpretedTime);
+            }
+        }
+    }
+}
+
+SCENARIO("Jit-compiled small unrolled lstm network is faster than the interpreted one", "[.][benchmark]")
+{
+    GIVEN("Two unrolled copies of a small lstm network")
+    {
+        const int numInputs = 4;
+        const int numOutputs = 4;
+        const int numIterations = 50000;
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {8}, numOutputs);
+        
+        UnrolledNetwork::Ptr interpretedNetwork = network->toVM();
+        interpretedNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        
+        UnrolledNetwork::Ptr jitNetwork = network->toVM();
+        jitNetwork->setExecutionMode(UnrolledNetwork::Jit);
+        
+        WHEN("Both are fed and trained for the same number of steps")
+        {
+            const double interpretedTime = benchmarkUnrolledNetwork(interpretedNetwork, numInputs, numOutputs, numIterations);
+            const double jitTime = benchmarkUnrolledNetwork(jitNetwork, numInputs, numOutputs, numIterations);
+            
+            std::cout << "Interpreted: " << interpretedTime << " ms, "
+                      << "jit: " << jitTime << " ms, "
+                      << "speedup: " << (interpretedTime / jitTime) << "x" << std::endl;
+            
+            THEN("The jit mode wins")
+            {
+                REQUIRE(jitTime < interpretedTime);
+            }
+        }
+    }
+}
+
+SCENARIO("Batched unrolled lstm network has a higher throughput than the scalar one", "[.][benchmark]")
+{
+    GIVEN("A scalar and a batched copies of a mid-sized lstm network")
+    {
+        const int numInputs = 16;
+        const int numOutputs = 16;
+        const int numLanes = 8;
+        const int numIterations = 500;
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {64}, numOutputs);
+        
+        UnrolledNetwork::Ptr scalarNetwork = network->toVM();
+        
+        UnrolledNetwork::Ptr batchedNetwork = network->toVM();
+        batchedNetwork->setBatchSize(numLanes);
+        
+        WHEN("Both process the same number of sequence steps")
+        {
+            const double scalarTime =
+            benchmarkUnrolledNetwork(scalarNetwork, numInputs, numOutputs, numIterations * numLanes);
+            
+            UnrolledTrainingContext::RawData inputs(numInputs * numLanes);
+            UnrolledTrainingContext::RawData targets(numOutputs * numLanes);
+            
+            const auto startTime = std::chrono::high_resolution_clock::now();
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+                for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+                
+                batchedNetwork->feedBatch(inputs);
+                batchedNetwork->trainBatch(kTrainingRate, targets);
+            }
+            
+            const auto endTime = std::chrono::high_resolution_clock::now();
+            const double batchedTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+            
+            std::cout << "Scalar: " << scalarTime << " ms, "
+                      << "batched (" << numLanes << " lanes): " << batchedTime << " ms, "
+                      << "speedup: " << (scalarTime / batchedTime) << "x" << std::endl;
+            
+            THEN("The batched mode wins")
+            {
+                REQUIRE(batchedTime < scalarTime);
+            }
+        }
+    }
+}
+
+SCENARIO("Renumbered unrolled network has fewer cache misses per step", "[.][benchmark]")
+{
+    GIVEN("Two unrolled copies of an lstm network with a context larger than L2 cache, one of them renumbered")
+    {
+        const int numInputs = 32;
+        const int numOutputs = 32;
+        const int numIterations = 50;
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {128}, numOutputs);
+        
+        // No other optimizations, so that only the memory layout differs
+        UnrolledNetwork::Ptr plainNetwork = network->toVM(false);
+        UnrolledNetwork::Ptr renumberedNetwork = network->toVM(false);
+        renumberedNetwork->renumberVariables();
+        
+        WHEN("Both are fed and trained for the same number of steps")
+        {
+            CacheMissCounter counter;
+            
+            counter.start();
+            const double plainTime = benchmarkUnrolledNetwork(plainNetwork, numInputs, numOutputs, numIterations);
+            const long long plainMisses = counter.stop();
+            
+            counter.start();
+            const double renumberedTime = benchmarkUnrolledNetwork(renumberedNetwork, numInputs, numOutputs, numIterations);
+            const long long renumberedMisses = counter.stop();
+            
+            std::cout << "Context size: " << plainNetwork->getContext()->getMemory().size() * sizeof(Value) / 1024 << " kb" << std::endl;
+            std::cout << "Plain: " << plainTime << " ms, "
+                      << "renumbered: " << renumberedTime << " ms, "
+                      << "speedup: " << (plainTime / renumberedTime) << "x" << std::endl;
+            
+            if (counter.isAvailable())
+            {
+                std::cout << "Cache misses per step, plain: " << (plainMisses / numIterations) << ", "
+                          << "renumbered: " << (renumberedMisses / numIterations) << std::endl;
+            }
+            else
+            {
+                std::cout << "Cache misses per step: hardware counters are not available" << std::endl;
+            }
+            
+            THEN("The renumbered network wins")
+            {
+                if (counter.isAvailable())
+                {
+                    REQUIRE(renumberedMisses < plainMisses);
+                }
+                else
+                {
+                    REQUIRE(renumberedTime < plainTime);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Compiling an lstm network with hashed variable keys is faster than with string keys", "[.][benchmark]")
+{
+    GIVEN("A mid-sized lstm network")
+    {
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), 32, {64}, 32);
+        
+        WHEN("It is compiled, and its variable keys are replayed into a string-keyed map and a hashed one")
+        {
+            auto startTime = std::chrono::high_resolution_clock::now();
+            UnrolledNetwork::Ptr vmNetwork = network->toVM(false);
+            auto endTime = std::chrono::high_resolution_clock::now();
+            const double compileTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+            
+            const auto &mapping = vmNetwork->getContext()->getMapping();
+            const int numPasses = 4; // toVM looks up every variable a few times
+            
+            startTime = std::chrono::high_resolution_clock::now();
+            std::map<std::string, Index> stringMapping;
+            
+            for (int pass = 0; pass < numPasses; ++pass)
+            {
+                for (const auto &i : mapping)
+                {
+                    std::ostringstream key;
+                    std::copy(i.first.ids, i.first.ids + i.first.numIds, std::ostream_iterator<Id>(key, "::"));
+                    key << i.first.tag;
+                    
+                    const std::string &keyString = key.str();
+                    if (stringMapping.find(keyString) == stringMapping.end())
+                    {
+                        stringMapping[keyString] = i.second;
+                    }
+                }
+            }
+            
+            endTime = std::chrono::high_resolution_clock::now();
+            const double stringTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+            
+            startTime = std::chrono::high_resolution_clock::now();
+            UnrolledVariableMapping hashedMapping;
+            
+            for (int pass = 0; pass < numPasses; ++pass)
+            {
+                for (const auto &i : mapping)
+                {
+                    UnrolledVariableMapping::Key key;
+                    std::copy(i.first.ids, i.first.ids + i.first.numIds, key.ids);
+                    key.numIds = i.first.numIds;
+                    key.tag = i.first.tag;
+                    
+                    if (hashedMapping.find(key) == nullptr)
+                    {
+                        hashedMapping.insert(key, i.second);
+                    }
+                }
+            }
+            
+            endTime = std::chrono::high_resolution_clock::now();
+            const double hashedTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+            
+            std::cout << "Compiled " << mapping.size() << " variables in " << compileTime << " ms" << std::endl;
+            std::cout << "String keys: " << stringTime << " ms, "
+                      << "hashed keys: " << hashedTime << " ms, "
+                      << "speedup: " << (stringTime / hashedTime) << "x" << std::endl;
+            
+            THEN("The hashed keys win")
+            {
+                REQUIRE(stringMapping.size() == hashedMapping.size());
+                REQUIRE(hashedTime < stringTime);
+            }
+        }
+    }
+}
+
+SCENARIO("Dense feed-forward network is faster than the unrolled one", "[.][benchmark]")
+{
+    GIVEN("An unrolled and a dense copies of a wide multilayer perceptron")
+    {
+        const int layerSize = 256;
+        const int numIterations = 50;
+        const int numLanes = 16;
+        
+        const auto network = Network::Prefabs::feedForward(RANDOMNAME(), layerSize, {layerSize, layerSize}, layerSize);
+        
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        DenseNetwork::Ptr denseNetwork = network->toDense();
+        REQUIRE(denseNetwork != nullptr);
+        
+        WHEN("Both are fed and trained for the same number of steps")
+        {
+            const double vmTime = benchmarkUnrolledNetwork(vmNetwork, layerSize, layerSize, numIterations);
+            
+            Neuron::Values inputs(layerSize);
+            Neuron::Values targets(layerSize);
+            
+            auto startTime = std::chrono::high_resolution_clock::now();
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+                for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+                
+                denseNetwork->feed(inputs);
+                denseNetwork->train(kTrainingRate, targets);
+            }
+            
+            auto endTime = std::chrono::high_resolution_clock::now();
+            const double denseTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+            
+            Neuron::Values batchInputs(layerSize * numLanes);
+            for (auto &input : batchInputs) { input = RANDOM(0.0, 1.0); }
+            
+            startTime = std::chrono::high_resolution_clock::now();
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                denseNetwork->feedBatch(batchInputs);
+            }
+            
+            endTime = std::chrono::high_resolution_clock::now();
+            const double batchTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+            
+            std::cout << "Unrolled: " << vmTime << " ms, "
+                      << "dense: " << denseTime << " ms, "
+                      << "speedup: " << (vmTime / denseTime) << "x" << std::endl;
+            
+            std::cout << "Dense inference of " << (numIterations * numLanes) << " samples in batches of "
+                      << numLanes << ": " << batchTime << " ms" << std::endl;
+            
+            THEN("The dense network wins")
+            {
+                REQUIRE(denseTime < vmTime);
+            }
+        }
+    }
+}
+
+SCENARIO("Fused lstm network is faster than the unrolled one", "[.][benchmark]")
+{
+    GIVEN("An unrolled and a fused copies of an lstm network")
+    {
+        const int numInputs = 32;
+        const int numOutputs = 32;
+        const int numIterations = 500;
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {64}, numOutputs);
+        
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        FusedLSTMNetwork::Ptr fusedNetwork = network->toFusedLSTM();
+        REQUIRE(fusedNetwork != nullptr);
+        
+        WHEN("Both are fed and trained for the same number of steps")
+        {
+            const double vmTime = benchmarkUnrolledNetwork(vmNetwork, numInputs, numOutputs, numIterations);
+            
+            Neuron::Values inputs(numInputs);
+            Neuron::Values targets(numOutputs);
+            
+            const auto startTime = std::chrono::high_resolution_clock::now();
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+                for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+                
+                fusedNetwork->feed(inputs);
+                fusedNetwork->train(kTrainingRate, targets);
+            }
+            
+            const auto endTime = std::chrono::high_resolution_clock::now();
+            const double fusedTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+            
+            std::cout << "Unrolled: " << vmTime << " ms, "
+                      << "fused: " << fusedTime << " ms, "
+                      << "speedup: " << (vmTime / fusedTime) << "x" << std::endl;
+            
+            THEN("The fused network wins")
+            {
+                REQUIRE(fusedTime < vmTime);
+            }
+        }
+    }
+}
+
+SCENARIO("Parallel execution of a wide unrolled network scales with the number of cores", "[.][benchmark]")
+{
+    GIVEN("An unrolled copy of a wide multilayer perceptron")
+    {
+        const int layerSize = 384;
+        const int numIterations = 20;
+        const Index numCores = std::max(std::thread::hardware_concurrency(), 1u);
+        
+        const auto network = Network::Prefabs::feedForward(RANDOMNAME(), layerSize, {layerSize, layerSize}, layerSize);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        WHEN("It is fed and trained in the threaded mode, and then in parallel with more and more threads")
+        {
+            vmNetwork->setExecutionMode(UnrolledNetwork::Threaded);
+            benchmarkUnrolledNetwork(vmNetwork, layerSize, layerSize, 1);
+            const double threadedTime = benchmarkUnrolledNetwork(vmNetwork, layerSize, layerSize, numIterations);
+            std::cout << "Threaded: " << threadedTime << " ms" << std::endl;
+            
+            vmNetwork->setExecutionMode(UnrolledNetwork::Parallel);
+            double parallelTime = threadedTime;
+            
+            for (Index numThreads = 1; numThreads <= numCores; numThreads *= 2)
+            {
+                vmNetwork->setNumThreads(numThreads);
+                
+                // the first step schedules the kernels
+                benchmarkUnrolledNetwork(vmNetwork, layerSize, layerSize, 1);
+                parallelTime = benchmarkUnrolledNetwork(vmNetwork, layerSize, layerSize, numIterations);
+                
+                std::cout << "Parallel, " << numThreads << " threads: " << parallelTime << " ms, "
+                          << "speedup: " << (threadedTime / parallelTime) << "x" << std::endl;
+            }
+            
+            THEN("Running on several threads wins, if there are several cores")
+            {
+                REQUIRE((numCores == 1 || parallelTime < threadedTime));
+            }
+        }
+    }
+}
+
+SCENARIO("Hogwild training throughput grows with the number of threads", "[.][benchmark]")
+{
+    GIVEN("An unrolled lstm network and a set of random training sequences")
+    {
+        const int numInputs = 16;
+        const int numOutputs = 16;
+        const int numSequences = 64;
+        const int sequenceLength = 32;
+        const Index numCores = std::max(std::thread::hardware_concurrency(), 1u);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {32, 32}, numOutputs);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        std::vector<UnrolledHogwildTrainer::Sequence> sequences(numSequences);
+        
+        for (auto &sequence : sequences)
+        {
+            for (int i = 0; i < sequenceLength; ++i)
+            {
+                UnrolledTrainingContext::RawData inputs(numInputs);
+                UnrolledTrainingContext::RawData targets(numOutputs);
+                for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+                for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+                sequence.push_back(UnrolledHogwildTrainer::Step(inputs, targets));
+            }
+        }
+        
+        WHEN("It is trained by the Hogwild trainer with more and more threads")
+        {
+            const double numSamples = double(numSequences * sequenceLength);
+            double singleThreadedRate = 0.0;
+            double samplesPerSecond = 0.0;
+            
+            for (Index numThreads = 1; numThreads <= numCores; numThreads *= 2)
+            {
+                UnrolledHogwildTrainer trainer(vmNetwork, numThreads);
+                
+                const auto startTime = std::chrono::high_resolution_clock::now();
+                trainer.train(kTrainingRate, sequences);
+                const auto endTime = std::chrono::high_resolution_clock::now();
+                
+                samplesPerSecond = numSamples / std::chrono::duration<double>(endTime - startTime).count();
+                singleThreadedRate = (numThreads == 1) ? samplesPerSecond : singleThreadedRate;
+                
+                std::cout << "Hogwild, " << numThreads << " threads: " << samplesPerSecond << " samples/s, "
+                          << "speedup: " << (samplesPerSecond / singleThreadedRate) << "x" << std::endl;
+            }
+            
+            THEN("Training on several threads wins, if there are several cores")
+            {
+                REQUIRE((numCores == 1 || samplesPerSecond > singleThreadedRate));
+            }
+        }
+    }
+}
+
+SCENARIO("Object graph network stays within a small factor of the unrolled one", "[.][benchmark]")
+{
+    GIVEN("A multilayer perceptron and its unrolled copy")
+    {
+        const int numInputs = 16;
+        const int numOutputs = 16;
+        const int numIterations = 2000;
+        
+        const auto network = Network::Prefabs::feedForward(RANDOMNAME(), numInputs, {64, 64}, numOutputs);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        WHEN("Both are fed and trained for the same number of steps")
+        {
+            std::vector<Value> inputs(numInputs);
+            std::vector<Value> targets(numOutputs);
+            
+            const auto graphStartTime = std::chrono::high_resolution_clock::now();
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+                for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+                
+                network->feed(inputs);
+                network->train(kTrainingRate, targets);
+            }
+            
+            const auto graphEndTime = std::chrono::high_resolution_clock::now();
+            const double graphTime = std::chrono::duration<double, std::milli>(graphEndTime - graphStartTime).count();
+            const double vmTime = benchmarkUnrolledNetwork(vmNetwork, numInputs, numOutputs, numIterations);
+            
+            std::cout << "Object graph: " << graphTime << " ms, "
+                      << "unrolled: " << vmTime << " ms, "
+                      << "slowdown: " << (graphTime / vmTime) << "x" << std::endl;
+            
+            THEN("The object graph is not more than an order of magnitude slower")
+            {
+                REQUIRE(graphTime < vmTime * 10.0);
+            }
+        }
+    }
+}
+
+SCENARIO("Sequence calls of a small unrolled network are faster than the step-by-step ones", "[.][benchmark]")
+{
+    GIVEN("Two unrolled copies of a tiny perceptron and a long random sequence")
+    {
+        const int numInputs = 2;
+        const int numOutputs = 2;
+        const int numSteps = 100000;
+        
+        const auto network = Network::Prefabs::feedForward(RANDOMNAME(), numInputs, {4}, numOutputs);
+        UnrolledNetwork::Ptr stepNetwork = network->toVM();
+        UnrolledNetwork::Ptr sequenceNetwork = network->toVM();
+        
+        UnrolledTrainingContext::RawData inputs(numInputs * numSteps);
+        UnrolledTrainingContext::RawData targets(numOutputs * numSteps);
+        UnrolledTrainingContext::RawData outputs(numOutputs * numSteps);
+        for (auto &input : inputs) { input = RANDOM(0.0, 1.0); }
+        for (auto &target : targets) { target = RANDOM(0.0, 1.0); }
+        
+        WHEN("One of them is fed and trained step by step, and the other one with a single call")
+        {
+            // the first steps decode the kernels
+            stepNetwork->feed(UnrolledTrainingContext::RawData(numInputs));
+            stepNetwork->train(kTrainingRate, UnrolledTrainingContext::RawData(numOutputs));
+            sequenceNetwork->trainSequence(kTrainingRate, inputs.data(), targets.data(), 1, outputs.data());
+            
+            const auto stepStartTime = std::chrono::high_resolution_clock::now();
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                const UnrolledTrainingContext::RawData input(inputs.begin() + t * numInputs, inputs.begin() + (t + 1) * numInputs);
+                const UnrolledTrainingContext::RawData target(targets.begin() + t * numOutputs, targets.begin() + (t + 1) * numOutputs);
+                stepNetwork->feed(input);
+                stepNetwork->train(kTrainingRate, target);
+            }
+            
+            const auto stepEndTime = std::chrono::high_resolution_clock::now();
+            const double stepTime = std::chrono::duration<double, std::milli>(stepEndTime - stepStartTime).count();
+            
+            const auto sequenceStartTime = std::chrono::high_resolution_clock::now();
+            sequenceNetwork->trainSequence(kTrainingRate, inputs.data(), targets.data(), numSteps, outputs.data());
+            const auto sequenceEndTime = std::chrono::high_resolution_clock::now();
+            const double sequenceTime = std::chrono::duration<double, std::milli>(sequenceEndTime - sequenceStartTime).count();
+            
+            std::cout << "Step by step: " << stepTime << " ms, sequence: " << sequenceTime << " ms, "
+                      << "speedup: " << (stepTime / sequenceTime) << "x" << std::endl;
+            
+            THEN("The sequence call is faster")
+            {
+                REQUIRE(sequenceTime < stepTime);
+            }
+        }
+    }
+}
+
+SCENARIO("Wide layers are built in milliseconds", "[.][benchmark]")
+{
+    GIVEN("A number of wide layers")
+    {
+        const int numNeurons = 4096;
+        const int numLayers = 16;
+        
+        WHEN("They are built and chained one-to-one")
+        {
+            const auto startTime = std::chrono::high_resolution_clock::now();
+            
+            Layer::Vector layers;
+            for (int i = 0; i < numLayers; ++i)
+            {
+                layers.push_back(Layer::Ptr(new Layer(numNeurons)));
+            }
+            
+            for (int i = 1; i < numLayers; ++i)
+            {
+                layers[i - 1]->connectOneToOne(layers[i]);
+            }
+            
+            const auto endTime = std::chrono::high_resolution_clock::now();
+            const double buildTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+            
+            std::cout << "Building " << numLayers << " layers of " << numNeurons << " neurons: " << buildTime << " ms" << std::endl;
+            
+            THEN("Drawing the initial weights and biases takes no noticeable time")
+            {
+                REQUIRE(buildTime < 250.0);
+            }
+        }
+    }
+}
+
+SCENARIO("Building an lstm network scales with the number of connections", "[.][benchmark]")
+{
+    GIVEN("A range of hidden layer widths")
+    {
+        const int numInputs = 16;
+        const int numOutputs = 16;
+        const std::vector<int> widths = { 64, 128, 256, 512 };
+        
+        WHEN("A prefab lstm network is built for each of them")
+        {
+            std::vector<double> timesPerCellPair;
+            
+            for (const int width : widths)
+            {
+                const auto startTime = std::chrono::high_resolution_clock::now();
+                const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {width}, numOutputs);
+                const auto endTime = std::chrono::high_resolution_clock::now();
+                const double buildTime = std::chrono::duration<double, std::milli>(endTime - startTime).count();
+                
+                // most of the connections are the all-to-all ones between the cells and the gates
+                timesPerCellPair.push_back(buildTime / (double(width) * double(width)));
+                std::cout << "Width " << width << ": " << buildTime << " ms" << std::endl;
+            }
+            
+            THEN("The time per connection stays roughly the same as the layers grow")
+            {
+                REQUIRE(timesPerCellPair.back() < timesPerCellPair.front() * 2.0);
+            }
+        }
+    }
+}
+
+SCENARIO("Resetting the state of an unrolled network is much faster than compiling it again", "[.][benchmark]")
+{
+    GIVEN("An unrolled lstm network, fed for a while")
+    {
+        const int numInputs = 16;
+        const int numOutputs = 16;
+        const int numResets = 1000;
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {128}, numOutputs);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        std::vector<Value> inputs(numInputs, 0.5f);
+        std::vector<Value> outputs(numOutputs);
+        vmNetwork->feed(inputs.data(), outputs.data());
+        vmNetwork->resetState();
+        
+        WHEN("It is reset many times, and compiled once")
+        {
+            const auto resetStartTime = std::chrono::high_resolution_clock::now();
+            
+            for (int i = 0; i < numResets; ++i)
+            {
+                vmNetwork->resetState();
+            }
+            
+            const auto resetEndTime = std::chrono::high_resolution_clock::now();
+            const double resetTime = std::chrono::duration<double, std::micro>(resetEndTime - resetStartTime).count() / numResets;
+            
+            const auto compileStartTime = std::chrono::high_resolution_clock::now();
+            const auto compiledNetwork = network->toVM();
+            const auto compileEndTime = std::chrono::high_resolution_clock::now();
+            const double compileTime = std::chrono::duration<double, std::micro>(compileEndTime - compileStartTime).count();
+            
+            std::cout << "Context size: " << vmNetwork->getContext()->getMemory().size() * sizeof(Value) / 1024 << " kb" << std::endl;
+            std::cout << "Reset: " << resetTime << " us, compilation: " << compileTime << " us" << std::endl;
+            
+            THEN("A reset takes microseconds, and is orders of magnitude faster")
+            {
+                REQUIRE(resetTime * 100.0 < compileTime);
+            }
+        }
+    }
+}
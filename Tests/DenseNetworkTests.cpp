@@ -0,0 +1,148 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "ThirdParty/Catch/include/catch.hpp"
+#include "Helpers.h"
+#include "Network.h"
+
+using namespace TinyRNN;
+
+static const Value kTrainingRate = 0.25f;
+
+// Dense layers sum up the connections in another order than the neurons do
+static const Value kTolerance = 0.001f;
+
+static Neuron::Values randomValues(int size)
+{
+    Neuron::Values values;
+    
+    for (int i = 0; i < size; ++i)
+    {
+        values.push_back(RANDOM(0.0, 1.0));
+    }
+    
+    return values;
+}
+
+SCENARIO("Dense network gives the same results as the original one", "[dense]")
+{
+    GIVEN("A feed-forward network and its dense copy")
+    {
+        const int numInputs = RANDOM(5, 10);
+        const int numOutputs = RANDOM(2, 5);
+        
+        const auto network = Network::Prefabs::feedForward(RANDOMNAME(), numInputs,
+                                                           {RANDOM(10, 20), RANDOM(5, 15)}, numOutputs);
+        
+        DenseNetwork::Ptr denseNetwork = network->toDense();
+        REQUIRE(denseNetwork != nullptr);
+        REQUIRE(denseNetwork->getNumInputs() == Index(numInputs));
+        REQUIRE(denseNetwork->getNumOutputs() == Index(numOutputs));
+        REQUIRE(denseNetwork->getLayers().size() == 3);
+        
+        WHEN("Both networks are fed and trained with the same data")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            THEN("They produce the same outputs on each step")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    const auto result1 = network->feed(inputs);
+                    network->train(kTrainingRate, targets);
+                    
+                    const auto result2 = denseNetwork->feed(inputs);
+                    denseNetwork->train(kTrainingRate, targets);
+                    
+                    REQUIRE(result1.size() == result2.size());
+                    
+                    for (size_t j = 0; j < result1.size(); ++j)
+                    {
+                        REQUIRE(fabs(result1[j] - result2[j]) < kTolerance);
+                    }
+                }
+            }
+        }
+        
+        WHEN("Only the dense network is trained, and then restored into the original one")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                denseNetwork->feed(randomValues(numInputs));
+                denseNetwork->train(kTrainingRate, randomValues(numOutputs));
+            }
+            
+            network->restore(denseNetwork);
+            
+            THEN("Both networks produce the same outputs")
+            {
+                const auto inputs = randomValues(numInputs);
+                const auto result1 = network->feed(inputs);
+                const auto result2 = denseNetwork->feed(inputs);
+                
+                for (size_t j = 0; j < result1.size(); ++j)
+                {
+                    REQUIRE(fabs(result1[j] - result2[j]) < kTolerance);
+                }
+            }
+        }
+        
+        WHEN("A batch of inputs is fed at once")
+        {
+            const int numLanes = RANDOM(2, 10);
+            const auto inputs = randomValues(numInputs * numLanes);
+            const auto results = denseNetwork->feedBatch(inputs);
+            
+            THEN("Each lane gets exactly the same output as if it was fed alone")
+            {
+                REQUIRE(results.size() == size_t(numOutputs * numLanes));
+                
+                for (int lane = 0; lane < numLanes; ++lane)
+                {
+                    const Neuron::Values laneInputs(inputs.begin() + lane * numInputs,
+                                                    inputs.begin() + (lane + 1) * numInputs);
+                    
+                    const auto result = denseNetwork->feed(laneInputs);
+                    
+                    for (int j = 0; j < numOutputs; ++j)
+                    {
+                        REQUIRE(result[j] == results[lane * numOutputs + j]);
+                    }
+                }
+            }
+        }
+    }
+    
+    GIVEN("A recurrent network")
+    {
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), 2, {4}, 1);
+        
+        THEN("It cannot be compiled into dense layers")
+        {
+            REQUIRE(network->toDense() == nullptr);
+        }
+    }
+}
@@ -0,0 +1,130 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "ThirdParty/Catch/include/catch.hpp"
+#include "Helpers.h"
+#include "Network.h"
+
+using namespace TinyRNN;
+
+static const Value kTrainingRate = 0.25f;
+
+// Fused blocks sum up the connections in another order than the neurons do
+static const Value kTolerance = 0.001f;
+
+static Neuron::Values randomValues(int size)
+{
+    Neuron::Values values;
+    
+    for (int i = 0; i < size; ++i)
+    {
+        values.push_back(RANDOM(0.0, 1.0));
+    }
+    
+    return values;
+}
+
+SCENARIO("Fused LSTM network gives the same results as the original one", "[fused]")
+{
+    GIVEN("An LSTM network with several blocks and its fused copy")
+    {
+        const int numInputs = RANDOM(3, 8);
+        const int numOutputs = RANDOM(2, 5);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs,
+                                                                   {RANDOM(3, 8), RANDOM(2, 6)}, numOutputs);
+        
+        FusedLSTMNetwork::Ptr fusedNetwork = network->toFusedLSTM();
+        REQUIRE(fusedNetwork != nullptr);
+        REQUIRE(fusedNetwork->getNumInputs() == Index(numInputs));
+        REQUIRE(fusedNetwork->getNumOutputs() == Index(numOutputs));
+        
+        WHEN("Both networks are fed and trained with the same sequence")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            THEN("They produce the same outputs on each step")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    const auto result1 = network->feed(inputs);
+                    network->train(kTrainingRate, targets);
+                    
+                    const auto result2 = fusedNetwork->feed(inputs);
+                    fusedNetwork->train(kTrainingRate, targets);
+                    
+                    REQUIRE(result1.size() == result2.size());
+                    
+                    for (size_t j = 0; j < result1.size(); ++j)
+                    {
+                        REQUIRE(fabs(result1[j] - result2[j]) < kTolerance);
+                    }
+                }
+            }
+        }
+        
+        WHEN("Only the fused network is trained, and then restored into the original one")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                fusedNetwork->feed(randomValues(numInputs));
+                fusedNetwork->train(kTrainingRate, randomValues(numOutputs));
+            }
+            
+            network->restore(fusedNetwork);
+            
+            THEN("Both networks keep producing the same outputs, and keep learning the same way")
+            {
+                for (int i = 0; i < 10; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    const auto result1 = network->feed(inputs);
+                    network->train(kTrainingRate, targets);
+                    
+                    const auto result2 = fusedNetwork->feed(inputs);
+                    fusedNetwork->train(kTrainingRate, targets);
+                    
+                    for (size_t j = 0; j < result1.size(); ++j)
+                    {
+                        REQUIRE(fabs(result1[j] - result2[j]) < kTolerance);
+                    }
+                }
+            }
+        }
+    }
+    
+    GIVEN("A feed-forward network")
+    {
+        const auto network = Network::Prefabs::feedForward(RANDOMNAME(), 2, {4}, 1);
+        
+        THEN("It cannot be compiled into fused blocks")
+        {
+            REQUIRE(network->toFusedLSTM() == nullptr);
+        }
+    }
+}
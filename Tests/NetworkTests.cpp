@@ -51,6 +51,36 @@ SCENARIO("Neurons can be connected with each other", "[neuron]")
     }
 }
 
+SCENARIO("Neuron picks up the connections added after it was processed", "[neuron]")
+{
+    GIVEN("An output neuron processed with a single input neuron")
+    {
+        Neuron::Ptr input1(new Neuron());
+        Neuron::Ptr input2(new Neuron());
+        Neuron::Ptr output(new Neuron(0.0, Neuron::Tanh));
+        
+        input1->connectWith(output);
+        input1->feed(1.0);
+        const Value singleInputActivation = output->process();
+        
+        WHEN("another input neuron is connected to it")
+        {
+            input2->connectWith(output);
+            
+            THEN("the new connection is taken into account on the next step")
+            {
+                input1->feed(1.0);
+                input2->feed(0.0);
+                REQUIRE(output->process() == singleInputActivation);
+                
+                input1->feed(1.0);
+                input2->feed(1.0);
+                REQUIRE(output->process() != singleInputActivation);
+            }
+        }
+    }
+}
+
 SCENARIO("Layers can be connected all-to-all", "[layer]")
 {
     GIVEN("Two layers with some neurons")
@@ -80,6 +110,40 @@ SCENARIO("Layers can be connected all-to-all", "[layer]")
     }
 }
 
+SCENARIO("Layers connected all-to-all twice keep a single connection per pair of neurons", "[layer]")
+{
+    GIVEN("Two layers, where some neurons of the first one are connected to the second one already")
+    {
+        const int numNeurons1 = RANDOM(10, 100);
+        const int numNeurons2 = RANDOM(10, 100);
+        
+        Layer::Ptr layer1(new Layer(numNeurons1));
+        Layer::Ptr layer2(new Layer(numNeurons2));
+        Layer::Ptr layer3(new Layer(numNeurons2));
+        
+        const auto existingConnection = layer1->getNeurons().front()->connectWith(layer2->getNeurons().back());
+        layer1->getNeurons().back()->connectWith(layer3->getNeurons().front());
+        
+        WHEN("The first layer is all-to-all connected with the second one twice")
+        {
+            const auto connections1 = layer1->connectAllToAll(layer2);
+            const auto connections2 = layer1->connectAllToAll(layer2);
+            
+            THEN("The existing connections are reused, and no new ones are made the second time")
+            {
+                REQUIRE(connections1.size() == layer1->getSize() * layer2->getSize());
+                REQUIRE(connections1 == connections2);
+                REQUIRE(connections1.find(existingConnection->getUuid()) != connections1.end());
+                
+                for (const auto &neuron : layer1->getNeurons())
+                {
+                    REQUIRE(neuron->getOutgoingConnections().size() == layer2->getSize() + (neuron == layer1->getNeurons().back() ? 1 : 0));
+                }
+            }
+        }
+    }
+}
+
 SCENARIO("Layers can be connected one to one", "[layer]")
 {
     GIVEN("Two layers with different sizes")
@@ -218,3 +282,154 @@ SCENARIO("Layer can gate a connection between two other layers", "[layer]")
         }
     }
 }
+
+SCENARIO("Networks built with the same default seed are identical", "[network]")
+{
+    GIVEN("Two lstm networks of the same shape, built with the same default seed")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numHidden = RANDOM(5, 10);
+        const int numOutputs = RANDOM(1, 3);
+        const uint64_t seed = RANDOM(1, 1000);
+        
+        Random::getDefault().setSeed(seed);
+        const auto network1 = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {numHidden}, numOutputs);
+        
+        Random::getDefault().setSeed(seed);
+        const auto network2 = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {numHidden}, numOutputs);
+        
+        WHEN("They are fed with the same inputs")
+        {
+            const int numSteps = RANDOM(10, 20);
+            std::vector<Neuron::Values> results1, results2;
+            
+            for (int i = 0; i < numSteps; ++i)
+            {
+                Neuron::Values inputs;
+                for (int j = 0; j < numInputs; ++j)
+                {
+                    inputs.push_back(RANDOM(0.0, 1.0));
+                }
+                
+                results1.push_back(network1->feed(inputs));
+                results2.push_back(network2->feed(inputs));
+            }
+            
+            THEN("They give exactly the same outputs")
+            {
+                REQUIRE(results1 == results2);
+            }
+        }
+    }
+}
+
+SCENARIO("Network weights can be redrawn from a seed", "[network]")
+{
+    GIVEN("Two multilayer perceptrons of the same shape, with zero biases and random weights")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numHidden = RANDOM(5, 10);
+        const int numOutputs = RANDOM(1, 3);
+        const uint64_t seed = RANDOM(1, 1000);
+        
+        const auto buildNetwork = [&]()
+        {
+            Layer::Ptr inputLayer(new Layer(numInputs, 0.0, Neuron::Tanh));
+            Layer::Ptr hiddenLayer(new Layer(numHidden, 0.0, Neuron::Tanh));
+            Layer::Ptr outputLayer(new Layer(numOutputs, 0.0, Neuron::Tanh));
+            inputLayer->connectAllToAll(hiddenLayer);
+            hiddenLayer->connectAllToAll(outputLayer);
+            return Network::Ptr(new Network(RANDOMNAME(), inputLayer, {hiddenLayer}, outputLayer));
+        };
+        
+        const auto network1 = buildNetwork();
+        const auto network2 = buildNetwork();
+        
+        WHEN("Both are initialized with the same seed")
+        {
+            network1->initializeWeights(seed, Layer::Glorot);
+            network2->initializeWeights(seed, Layer::Glorot);
+            
+            THEN("They give exactly the same outputs")
+            {
+                for (int i = 0; i < 10; ++i)
+                {
+                    Neuron::Values inputs;
+                    for (int j = 0; j < numInputs; ++j)
+                    {
+                        inputs.push_back(RANDOM(0.0, 1.0));
+                    }
+                    
+                    REQUIRE(network1->feed(inputs) == network2->feed(inputs));
+                }
+            }
+        }
+    }
+    
+    GIVEN("A random stream")
+    {
+        Random random(RANDOM(1, 1000));
+        const Index fanIn = RANDOM(10, 100);
+        const Index fanOut = RANDOM(10, 100);
+        
+        WHEN("It fills a buffer with the Glorot-scaled values")
+        {
+            std::vector<Value> values(fanIn * fanOut);
+            random.fillGlorot(values.data(), values.size(), fanIn, fanOut);
+            
+            THEN("They fill the whole range within the limit")
+            {
+                const Value limit = std::sqrt(Value(6.0) / Value(fanIn + fanOut));
+                const auto range = std::minmax_element(values.begin(), values.end());
+                
+                REQUIRE(*range.first >= -limit);
+                REQUIRE(*range.second <= limit);
+                REQUIRE(*range.first < -limit * 0.9f);
+                REQUIRE(*range.second > limit * 0.9f);
+            }
+        }
+    }
+}
+
+SCENARIO("Neurons and connections built within an arena scope live in that arena", "[layer]")
+{
+    GIVEN("Two layers built and connected within an arena scope")
+    {
+        const int numNeurons1 = RANDOM(10, 100);
+        const int numNeurons2 = RANDOM(10, 100);
+        
+        Arena::Ptr arena(new Arena(4096));
+        std::weak_ptr<Arena> weakArena(arena);
+        
+        Layer::Ptr layer1;
+        Layer::Ptr layer2;
+        
+        {
+            const Arena::Scope arenaScope(arena);
+            layer1 = Layer::Ptr(new Layer(numNeurons1));
+            layer2 = Layer::Ptr(new Layer(numNeurons2));
+            layer1->connectAllToAll(layer2);
+        }
+        
+        REQUIRE(Arena::getCurrent() == nullptr);
+        REQUIRE(arena->getNumBlocks() > 1);
+        
+        WHEN("The arena is released by its owner")
+        {
+            arena.reset();
+            
+            THEN("It is kept alive by the neurons, until the last of them is gone")
+            {
+                REQUIRE(!weakArena.expired());
+                
+                Neuron::Ptr neuron = layer2->getNeurons().front();
+                layer1.reset();
+                layer2.reset();
+                REQUIRE(!weakArena.expired());
+                
+                neuron.reset();
+                REQUIRE(weakArena.expired());
+            }
+        }
+    }
+}
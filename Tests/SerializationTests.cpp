@@ -37,7 +37,7 @@ class XMLSerializationContext final : public SerializationContext
 public:
     
     using Ptr = std::shared_ptr<XMLSerializationContext>;
-    
+
 public:
     
     explicit XMLSerializationContext(pugi::xml_node rootNode) : node(rootNode) {}
@@ -90,11 +90,11 @@ public:
         XMLSerializationContext::Ptr childContext(new XMLSerializationContext(newChild));
         return childContext;
     }
-    
+
 private:
     
     pugi::xml_node node;
-    
+
 };
 
 class XMLSerializer final : public Serializer
@@ -134,7 +134,7 @@ public:
             target->deserialize(mainContext);
         }
     }
-    
+
 private:
     
     struct XMLStringWriter: pugi::xml_writer
@@ -146,7 +146,7 @@ private:
             result.append(static_cast<const char*>(data), size);
         }
     };
-    
+
 };
 
 SCENARIO("Networks can be serialized and deserialized correctly", "[serialization]")
@@ -297,3 +297,78 @@ SCENARIO("Unrolled network can be serialized and deserialized correctly", "[seri
         }
     }
 }
+
+SCENARIO("Unrolled training context reads the older variables mapping format", "[serialization]")
+{
+    GIVEN("A context written with one node per variable, and a key string for each")
+    {
+        const std::vector<Value> memory = { 0.5, -0.25, 1.0, 2.0 };
+        
+        pugi::xml_document document;
+        XMLSerializationContext::Ptr root(new XMLSerializationContext(document.root()));
+        SerializationContext::Ptr context(root->addChildContext(Keys::Unrolled::TrainingContext));
+        
+        context->setStringProperty(context->encodeBase64((const unsigned char *)memory.data(), sizeof(Value) * memory.size()),
+                                   Keys::Unrolled::RawMemory);
+        context->setNumberProperty(memory.size(), Keys::Unrolled::MemorySize);
+        
+        SerializationContext::Ptr mappingNode(context->addChildContext(Keys::Unrolled::VariablesMapping));
+        const std::string keys[] =
+        {
+            std::to_string(Keys::Mapping::Rate),
+            "12::" + std::to_string(Keys::Mapping::Bias),
+            "12::345::" + std::to_string(Keys::Mapping::Eligibility),
+            "12::345::678::" + std::to_string(Keys::Mapping::ExtendedTrace)
+        };
+        
+        for (size_t i = 0; i < 4; ++i)
+        {
+            SerializationContext::Ptr variableNode(mappingNode->addChildContext(Keys::Unrolled::Variable));
+            variableNode->setStringProperty(keys[i], Keys::Unrolled::Key);
+            variableNode->setNumberProperty(3 - i, Keys::Unrolled::Index);
+        }
+        
+        WHEN("It is deserialized")
+        {
+            UnrolledTrainingContext::Ptr trainingContext(new UnrolledTrainingContext());
+            trainingContext->deserialize(context);
+            const auto &mapping = trainingContext->getMapping();
+            
+            THEN("The memory is restored, and every key is found at its index")
+            {
+                REQUIRE(trainingContext->getMemory() == memory);
+                REQUIRE(mapping.size() == 4);
+                
+                REQUIRE(mapping.find({Keys::Mapping::Rate}) != nullptr);
+                REQUIRE(*mapping.find({Keys::Mapping::Rate}) == 3);
+                REQUIRE(mapping.find({12, Keys::Mapping::Bias}) != nullptr);
+                REQUIRE(*mapping.find({12, Keys::Mapping::Bias}) == 2);
+                REQUIRE(mapping.find({12, 345, Keys::Mapping::Eligibility}) != nullptr);
+                REQUIRE(*mapping.find({12, 345, Keys::Mapping::Eligibility}) == 1);
+                REQUIRE(mapping.find({12, 345, 678, Keys::Mapping::ExtendedTrace}) != nullptr);
+                REQUIRE(*mapping.find({12, 345, 678, Keys::Mapping::ExtendedTrace}) == 0);
+                
+                REQUIRE(mapping.find({345, Keys::Mapping::Bias}) == nullptr);
+                REQUIRE(mapping.find({12, Keys::Mapping::Weight}) == nullptr);
+            }
+        }
+        
+        WHEN("It also claims a binary mapping longer than the data it has")
+        {
+            const std::vector<Id> truncatedMapping = { 1, 12, Keys::Mapping::Bias };
+            mappingNode->setStringProperty(context->encodeBase64((const unsigned char *)truncatedMapping.data(),
+                                                                 sizeof(Id) * truncatedMapping.size()),
+                                           Keys::Unrolled::RawMapping);
+            mappingNode->setNumberProperty(1000, Keys::Unrolled::MappingSize);
+            
+            UnrolledTrainingContext::Ptr trainingContext(new UnrolledTrainingContext());
+            trainingContext->deserialize(context);
+            
+            THEN("The binary mapping is skipped, and the per-variable one is kept")
+            {
+                REQUIRE(trainingContext->getMapping().size() == 4);
+                REQUIRE(*trainingContext->getMapping().find({12, Keys::Mapping::Bias}) == 2);
+            }
+        }
+    }
+}
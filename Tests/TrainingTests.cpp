@@ -98,6 +98,119 @@ SCENARIO("A perceptron can be trained with a xor function", "[training]")
     }
 }
 
+// With the tiny initial weights, a full-batch xor never leaves the saddle point at zero,
+// only the noise of the online updates breaks the symmetry, so a separable function is used here
+SCENARIO("A perceptron can be trained with an or function in mini-batches", "[training][minibatch]")
+{
+    GIVEN("A single-layer perceptron and its unrolled copy, both training in mini-batches of the whole truth table")
+    {
+        const int numIterations = RANDOM(2500, 3000);
+        
+        Layer::Ptr inputLayer(new Layer(2));
+        Layer::Ptr hiddenLayer(new Layer(20));
+        Layer::Ptr outputLayer(new Layer(1));
+        
+        inputLayer->connectAllToAll(hiddenLayer);
+        hiddenLayer->connectAllToAll(outputLayer);
+        
+        Network::Ptr network(new Network(RANDOMNAME(), inputLayer, {hiddenLayer}, outputLayer));
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        network->setMiniBatchSize(4);
+        REQUIRE(network->getMiniBatchSize() == 4);
+        REQUIRE(vmNetwork->setMiniBatchSize(4));
+        
+        WHEN("Both networks are trained with some random number of iterations")
+        {
+            const Neuron::Values inputs[] = { {0.0, 1.0}, {0.0, 0.0}, {1.0, 0.0}, {1.0, 1.0} };
+            const Neuron::Values targets[] = { {1.0}, {0.0}, {1.0}, {1.0} };
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                for (int j = 0; j < 4; ++j)
+                {
+                    network->feed(inputs[j]);
+                    network->train(kTrainingRate, targets[j]);
+                    
+                    vmNetwork->feed(inputs[j]);
+                    vmNetwork->train(kTrainingRate, targets[j]);
+                }
+            }
+            
+            THEN("Both give a reasonable output")
+            {
+                // the first feed after training still uses the dropout
+                vmNetwork->feed(inputs[0]);
+                
+                for (int j = 0; j < 4; ++j)
+                {
+                    const auto result = network->feed(inputs[j]);
+                    const auto vmResult = vmNetwork->feed(inputs[j]);
+                    INFO(result.front());
+                    INFO(vmResult.front());
+                    REQUIRE(std::fabs(result.front() - targets[j].front()) < 0.1);
+                    
+                    // the dropout makes the unrolled network converge slower
+                    REQUIRE(std::fabs(vmResult.front() - targets[j].front()) < 0.25);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Sequence calls of a network give the same results as the step-by-step ones", "[training][sequence]")
+{
+    GIVEN("An lstm network, its snapshot, and a random sequence")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(20, 50);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        const auto snapshot = network->toVM();
+        
+        Neuron::Values inputs, targets;
+        for (int i = 0; i < numInputs * numSteps; ++i) { inputs.push_back(RANDOM(0.0, 1.0)); }
+        for (int i = 0; i < numOutputs * numSteps; ++i) { targets.push_back(RANDOM(0.0, 1.0)); }
+        
+        WHEN("It is trained and fed step by step, and then restored and run with the whole sequence at once")
+        {
+            Neuron::Values stepOutputs;
+            Neuron::Values sequenceOutputs(numOutputs * numSteps * 2);
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                const Neuron::Values input(inputs.begin() + t * numInputs, inputs.begin() + (t + 1) * numInputs);
+                const Neuron::Values target(targets.begin() + t * numOutputs, targets.begin() + (t + 1) * numOutputs);
+                const auto output = network->feed(input);
+                stepOutputs.insert(stepOutputs.end(), output.begin(), output.end());
+                network->train(kTrainingRate, target);
+            }
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                const Neuron::Values input(inputs.begin() + t * numInputs, inputs.begin() + (t + 1) * numInputs);
+                const auto output = network->feed(input);
+                stepOutputs.insert(stepOutputs.end(), output.begin(), output.end());
+            }
+            
+            network->restore(snapshot->getContext());
+            network->trainSequence(kTrainingRate, inputs.data(), targets.data(), numSteps, sequenceOutputs.data());
+            network->feedSequence(inputs.data(), numSteps, sequenceOutputs.data() + numOutputs * numSteps);
+            
+            THEN("The outputs are exactly the same")
+            {
+                REQUIRE(stepOutputs.size() == sequenceOutputs.size());
+                
+                for (size_t i = 0; i < stepOutputs.size(); ++i)
+                {
+                    REQUIRE(stepOutputs[i] == sequenceOutputs[i]);
+                }
+            }
+        }
+    }
+}
+
 static Value crossEntropyErrorCost(const Neuron::Values &targets, const Neuron::Values &outputs)
 {
     Value cost = 0.0;
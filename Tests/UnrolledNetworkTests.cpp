@@ -0,0 +1,1744 @@
+/*
+    Copyright (c) 2016 Peter Rudenko
+
+    Permission is hereby granted, free of charge, to any person obtaining
+    a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation
+    the rights to use, copy, modify, merge, publish, distribute, sublicense,
+    and/or sell copies of the Software, and to permit persons to whom the Software
+    is furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in
+    all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+    OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+    TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#include "ThirdParty/Catch/include/catch.hpp"
+#include "Helpers.h"
+#include "Network.h"
+
+using namespace TinyRNN;
+
+static const Value kTrainingRate = 0.25f;
+
+static UnrolledTrainingContext::RawData randomValues(int size)
+{
+    UnrolledTrainingContext::RawData values;
+    
+    for (int i = 0; i < size; ++i)
+    {
+        values.push_back(RANDOM(0.0, 1.0));
+    }
+    
+    return values;
+}
+
+// Dropout is only enabled after the first train() call, and then takes one value per feed() from the network's stream,
+// so all the networks being compared are switched into training mode first, and get the same seed on each step
+static void startTraining(UnrolledNetwork::Ptr network, int numOutputs)
+{
+    network->train(0.0, UnrolledTrainingContext::RawData(numOutputs, 0.0));
+}
+
+SCENARIO("Unrolled network gives the same results in all execution modes", "[unrolled]")
+{
+    GIVEN("Two unrolled copies of the same lstm network")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int layerSize = RANDOM(5, 10);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {layerSize}, numOutputs);
+        
+        UnrolledNetwork::Ptr interpretedNetwork = network->toVM();
+        UnrolledNetwork::Ptr threadedNetwork = network->toVM();
+        
+        REQUIRE(threadedNetwork->getExecutionMode() == UnrolledNetwork::Threaded);
+        interpretedNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        
+        startTraining(interpretedNetwork, numOutputs);
+        startTraining(threadedNetwork, numOutputs);
+        
+        WHEN("Both networks are fed and trained with the same data")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            THEN("They produce the same outputs on each step")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    interpretedNetwork->setRandomSeed(i);
+                    const auto result1 = interpretedNetwork->feed(inputs);
+                    interpretedNetwork->train(kTrainingRate, targets);
+                    
+                    threadedNetwork->setRandomSeed(i);
+                    const auto result2 = threadedNetwork->feed(inputs);
+                    threadedNetwork->train(kTrainingRate, targets);
+                    
+                    REQUIRE(result1.size() == result2.size());
+                    
+                    for (size_t j = 0; j < result1.size(); ++j)
+                    {
+                        REQUIRE(result1[j] == result2[j]);
+                    }
+                }
+            }
+        }
+        
+        WHEN("The execution mode is switched in the middle of training")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            THEN("The network keeps producing the same outputs as the interpreted one")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    // Cycles through Interpreted, Threaded and Jit, which are all bit-exact
+                    threadedNetwork->setExecutionMode(UnrolledNetwork::ExecutionMode(i % 3));
+                    
+                    interpretedNetwork->setRandomSeed(i);
+                    const auto result1 = interpretedNetwork->feed(inputs);
+                    interpretedNetwork->train(kTrainingRate, targets);
+                    
+                    threadedNetwork->setRandomSeed(i);
+                    const auto result2 = threadedNetwork->feed(inputs);
+                    threadedNetwork->train(kTrainingRate, targets);
+                    
+                    for (size_t j = 0; j < result1.size(); ++j)
+                    {
+                        REQUIRE(result1[j] == result2[j]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Jit-compiled unrolled network is bit-exact with the interpreter", "[unrolled]")
+{
+    GIVEN("An interpreted and a jit-compiled copies of the same lstm network")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int layerSize = RANDOM(5, 10);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {layerSize}, numOutputs);
+        
+        UnrolledNetwork::Ptr interpretedNetwork = network->toVM();
+        interpretedNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        
+        UnrolledNetwork::Ptr jitNetwork = network->toVM();
+        jitNetwork->setExecutionMode(UnrolledNetwork::Jit);
+        
+        startTraining(interpretedNetwork, numOutputs);
+        startTraining(jitNetwork, numOutputs);
+        
+        WHEN("Both networks are fed and trained with the same data")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                const auto inputs = randomValues(numInputs);
+                const auto targets = randomValues(numOutputs);
+                
+                interpretedNetwork->setRandomSeed(i);
+                interpretedNetwork->feed(inputs);
+                interpretedNetwork->train(kTrainingRate, targets);
+                
+                jitNetwork->setRandomSeed(i);
+                jitNetwork->feed(inputs);
+                jitNetwork->train(kTrainingRate, targets);
+            }
+            
+            THEN("Their memory is exactly the same")
+            {
+                const auto &memory1 = interpretedNetwork->getContext()->getMemory();
+                const auto &memory2 = jitNetwork->getContext()->getMemory();
+                REQUIRE(memory1.size() == memory2.size());
+                
+                for (size_t j = 0; j < memory1.size(); ++j)
+                {
+                    REQUIRE(memory1[j] == memory2[j]);
+                }
+            }
+        }
+        
+        WHEN("The jit network is allowed to use fused multiply-add")
+        {
+            jitNetwork->setExecutionMode(UnrolledNetwork::JitFused);
+            const int numIterations = RANDOM(100, 200);
+            
+            THEN("The outputs stay within a tolerance")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    interpretedNetwork->setRandomSeed(i);
+                    const auto result1 = interpretedNetwork->feed(inputs);
+                    interpretedNetwork->train(kTrainingRate, targets);
+                    
+                    jitNetwork->setRandomSeed(i);
+                    const auto result2 = jitNetwork->feed(inputs);
+                    jitNetwork->train(kTrainingRate, targets);
+                    
+                    for (size_t j = 0; j < result1.size(); ++j)
+                    {
+                        const Value error = fabs(result1[j] - result2[j]);
+                        REQUIRE(error < 0.001);
+                    }
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Parallel unrolled network is bit-exact with the interpreter", "[unrolled][parallel]")
+{
+    GIVEN("An interpreted and a parallel copies of the same multilayer lstm network")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs,
+                                                                   {RANDOM(5, 10), RANDOM(5, 10)}, numOutputs);
+        
+        UnrolledNetwork::Ptr interpretedNetwork = network->toVM();
+        interpretedNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        
+        UnrolledNetwork::Ptr parallelNetwork = network->toVM();
+        parallelNetwork->setExecutionMode(UnrolledNetwork::Parallel);
+        REQUIRE(parallelNetwork->getNumThreads() > 0);
+        
+        startTraining(interpretedNetwork, numOutputs);
+        startTraining(parallelNetwork, numOutputs);
+        
+        WHEN("Both networks are fed and trained with the same data, with any number of threads")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                const auto inputs = randomValues(numInputs);
+                const auto targets = randomValues(numOutputs);
+                
+                // Also checks that the kernels are rescheduled when the number of threads changes
+                parallelNetwork->setNumThreads(Index(1 + (i / 10) % 4));
+                
+                interpretedNetwork->setRandomSeed(i);
+                interpretedNetwork->feed(inputs);
+                interpretedNetwork->train(kTrainingRate, targets);
+                
+                parallelNetwork->setRandomSeed(i);
+                parallelNetwork->feed(inputs);
+                parallelNetwork->train(kTrainingRate, targets);
+            }
+            
+            THEN("Their memory is exactly the same")
+            {
+                const auto &memory1 = interpretedNetwork->getContext()->getMemory();
+                const auto &memory2 = parallelNetwork->getContext()->getMemory();
+                REQUIRE(memory1.size() == memory2.size());
+                
+                for (size_t j = 0; j < memory1.size(); ++j)
+                {
+                    REQUIRE(memory1[j] == memory2[j]);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Hogwild trainer with a single thread is bit-exact with the network itself", "[unrolled][hogwild]")
+{
+    GIVEN("Two copies of a network without hidden layers, so that there is no dropout, and a trainer for one of them")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        
+        Layer::Ptr inputLayer(new Layer(numInputs));
+        Layer::Ptr outputLayer(new Layer(numOutputs));
+        inputLayer->connectAllToAll(outputLayer);
+        
+        const Network::Ptr network(new Network(RANDOMNAME(), inputLayer, Layer::Vector(), outputLayer));
+        
+        UnrolledNetwork::Ptr plainNetwork = network->toVM();
+        UnrolledNetwork::Ptr trainedNetwork = network->toVM();
+        UnrolledHogwildTrainer trainer(trainedNetwork, 1);
+        REQUIRE(trainer.getNumThreads() == 1);
+        
+        WHEN("The network and the trainer are given the same sequences")
+        {
+            std::vector<UnrolledHogwildTrainer::Sequence> sequences(RANDOM(5, 10));
+            
+            for (auto &sequence : sequences)
+            {
+                for (int i = RANDOM(5, 10); i --> 0 ;)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    sequence.push_back(UnrolledHogwildTrainer::Step(inputs, targets));
+                    
+                    plainNetwork->feed(inputs);
+                    plainNetwork->train(kTrainingRate, targets);
+                }
+            }
+            
+            trainer.train(kTrainingRate, sequences);
+            
+            THEN("The weights written back to the network are exactly the same")
+            {
+                const auto &memory1 = plainNetwork->getContext()->getMemory();
+                const auto &memory2 = trainedNetwork->getContext()->getMemory();
+                const auto weights = plainNetwork->getContext()->getTrainableVariables();
+                REQUIRE(! weights.empty());
+                
+                for (const auto &w : weights)
+                {
+                    REQUIRE(memory1[w] == memory2[w]);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Hogwild trainer with many threads trains the shared weights", "[unrolled][hogwild]")
+{
+    GIVEN("An unrolled lstm network and a trainer with several threads")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        UnrolledNetwork::Ptr vm = network->toVM();
+        UnrolledHogwildTrainer trainer(vm, 4);
+        
+        const auto inputs = randomValues(numInputs);
+        const auto targets = randomValues(numOutputs);
+        
+        // the network's own state is not touched by the trainer, so it is warmed up before each measure
+        const auto getError = [&]()
+        {
+            for (int i = 0; i < 10; ++i)
+            {
+                vm->feed(inputs);
+            }
+            
+            const auto outputs = vm->feed(inputs);
+            Value error = 0.0;
+            
+            for (int i = 0; i < numOutputs; ++i)
+            {
+                error += (outputs[i] - targets[i]) * (outputs[i] - targets[i]);
+            }
+            
+            return error;
+        };
+        
+        WHEN("It is trained on the same sample over and over")
+        {
+            const Value errorBefore = getError();
+            
+            std::vector<UnrolledHogwildTrainer::Sequence> sequences(16);
+            
+            for (auto &sequence : sequences)
+            {
+                sequence.assign(25, UnrolledHogwildTrainer::Step(inputs, targets));
+            }
+            
+            trainer.train(kTrainingRate, sequences);
+            
+            THEN("The network, using the updated weights, gets closer to the target")
+            {
+                REQUIRE(getError() < errorBefore);
+            }
+        }
+    }
+}
+
+SCENARIO("Mini-batch training updates the weights once per batch", "[unrolled][minibatch]")
+{
+    GIVEN("Two unrolled copies of the same lstm network")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        
+        UnrolledNetwork::Ptr onlineNetwork = network->toVM();
+        UnrolledNetwork::Ptr batchNetwork = network->toVM();
+        
+        startTraining(onlineNetwork, numOutputs);
+        startTraining(batchNetwork, numOutputs);
+        
+        WHEN("One of them is switched to mini-batches and back to the batch size of one")
+        {
+            REQUIRE(batchNetwork->setMiniBatchSize(RANDOM(2, 5)));
+            REQUIRE(batchNetwork->setMiniBatchSize(1));
+            REQUIRE(batchNetwork->getMiniBatchSize() == 1);
+            
+            for (int i = 0; i < 50; ++i)
+            {
+                const auto inputs = randomValues(numInputs);
+                const auto targets = randomValues(numOutputs);
+                
+                onlineNetwork->setRandomSeed(i);
+                onlineNetwork->feed(inputs);
+                onlineNetwork->train(kTrainingRate, targets);
+                
+                batchNetwork->setRandomSeed(i);
+                batchNetwork->feed(inputs);
+                batchNetwork->train(kTrainingRate, targets);
+            }
+            
+            THEN("It trains exactly the same as the online one")
+            {
+                const auto &memory1 = onlineNetwork->getContext()->getMemory();
+                const auto &memory2 = batchNetwork->getContext()->getMemory();
+                
+                for (const auto &v : onlineNetwork->getContext()->getTrainableVariables())
+                {
+                    REQUIRE(memory1[v] == memory2[v]);
+                }
+            }
+        }
+        
+        WHEN("One of them is trained in mini-batches of several samples")
+        {
+            const Index miniBatchSize = RANDOM(2, 5);
+            REQUIRE(batchNetwork->setMiniBatchSize(miniBatchSize));
+            REQUIRE(batchNetwork->getMiniBatchSize() == miniBatchSize);
+            
+            const auto &memory = batchNetwork->getContext()->getMemory();
+            const auto weights = batchNetwork->getContext()->getTrainableVariables();
+            const auto gradients = batchNetwork->getContext()->getVariablesWithTag(Keys::Mapping::BatchGradient);
+            REQUIRE(gradients.size() == weights.size());
+            
+            std::vector<Value> initialWeights;
+            
+            for (const auto &v : weights)
+            {
+                initialWeights.push_back(memory[v]);
+            }
+            
+            THEN("The weights stay the same until the batch is complete, and then all the sums are applied")
+            {
+                for (Index i = 0; i < miniBatchSize; ++i)
+                {
+                    for (size_t j = 0; j < weights.size(); ++j)
+                    {
+                        REQUIRE(memory[weights[j]] == initialWeights[j]);
+                    }
+                    
+                    batchNetwork->feed(randomValues(numInputs));
+                    batchNetwork->train(kTrainingRate, randomValues(numOutputs));
+                }
+                
+                bool anyWeightChanged = false;
+                
+                for (size_t j = 0; j < weights.size(); ++j)
+                {
+                    anyWeightChanged = anyWeightChanged || (memory[weights[j]] != initialWeights[j]);
+                }
+                
+                REQUIRE(anyWeightChanged);
+                
+                for (const auto &g : gradients)
+                {
+                    REQUIRE(memory[g] == 0.0);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Sequence calls of an unrolled network are bit-exact with the step-by-step ones", "[unrolled][sequence]")
+{
+    GIVEN("Two unrolled copies of the same lstm network and a random sequence")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(20, 50);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        
+        UnrolledNetwork::Ptr stepNetwork = network->toVM();
+        UnrolledNetwork::Ptr sequenceNetwork = network->toVM();
+        
+        const auto inputs = randomValues(numInputs * numSteps);
+        const auto targets = randomValues(numOutputs * numSteps);
+        
+        WHEN("One of them is trained and fed step by step, and the other one with the whole sequence at once")
+        {
+            UnrolledTrainingContext::RawData stepOutputs;
+            UnrolledTrainingContext::RawData sequenceOutputs(numOutputs * numSteps * 2);
+            
+            startTraining(stepNetwork, numOutputs);
+            stepNetwork->setRandomSeed(numSteps);
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                const UnrolledTrainingContext::RawData input(inputs.begin() + t * numInputs, inputs.begin() + (t + 1) * numInputs);
+                const UnrolledTrainingContext::RawData target(targets.begin() + t * numOutputs, targets.begin() + (t + 1) * numOutputs);
+                const auto output = stepNetwork->feed(input);
+                stepOutputs.insert(stepOutputs.end(), output.begin(), output.end());
+                stepNetwork->train(kTrainingRate, target);
+            }
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                const UnrolledTrainingContext::RawData input(inputs.begin() + t * numInputs, inputs.begin() + (t + 1) * numInputs);
+                const auto output = stepNetwork->feed(input);
+                stepOutputs.insert(stepOutputs.end(), output.begin(), output.end());
+            }
+            
+            startTraining(sequenceNetwork, numOutputs);
+            sequenceNetwork->setRandomSeed(numSteps);
+            sequenceNetwork->trainSequence(kTrainingRate, inputs.data(), targets.data(), numSteps, sequenceOutputs.data());
+            sequenceNetwork->feedSequence(inputs.data(), numSteps, sequenceOutputs.data() + numOutputs * numSteps);
+            
+            THEN("Their outputs and their memory are exactly the same")
+            {
+                REQUIRE(stepOutputs.size() == sequenceOutputs.size());
+                
+                for (size_t i = 0; i < stepOutputs.size(); ++i)
+                {
+                    REQUIRE(stepOutputs[i] == sequenceOutputs[i]);
+                }
+                
+                const auto &memory1 = stepNetwork->getContext()->getMemory();
+                const auto &memory2 = sequenceNetwork->getContext()->getMemory();
+                REQUIRE(memory1.size() == memory2.size());
+                
+                for (size_t i = 0; i < memory1.size(); ++i)
+                {
+                    REQUIRE(memory1[i] == memory2[i]);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Optimized kernels give the same results as the unoptimized ones", "[unrolled][optimizer]")
+{
+    GIVEN("An unrolled lstm network with optimized kernels, and another one without optimizations")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int layerSize = RANDOM(5, 10);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {layerSize}, numOutputs);
+        
+        UnrolledNetwork::Ptr plainNetwork = network->toVM(false);
+        UnrolledNetwork::Ptr optimizedNetwork = network->toVM(true);
+        
+        REQUIRE(plainNetwork->getOptimizationReport().empty());
+        REQUIRE(! optimizedNetwork->getOptimizationReport().empty());
+        
+        startTraining(plainNetwork, numOutputs);
+        startTraining(optimizedNetwork, numOutputs);
+        
+        WHEN("The optimizer is done")
+        {
+            THEN("Some instructions are removed")
+            {
+                Index numRemoved = 0;
+                
+                for (const auto &pass : optimizedNetwork->getOptimizationReport())
+                {
+                    numRemoved += pass.second;
+                }
+                
+                REQUIRE(numRemoved > 0);
+            }
+        }
+        
+        WHEN("Both networks are fed and trained with the same data")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            THEN("They produce the same outputs on each step")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    plainNetwork->setRandomSeed(i);
+                    const auto result1 = plainNetwork->feed(inputs);
+                    plainNetwork->train(kTrainingRate, targets);
+                    
+                    optimizedNetwork->setRandomSeed(i);
+                    const auto result2 = optimizedNetwork->feed(inputs);
+                    optimizedNetwork->train(kTrainingRate, targets);
+                    
+                    for (size_t j = 0; j < result1.size(); ++j)
+                    {
+                        REQUIRE(result1[j] == result2[j]);
+                    }
+                }
+                
+                // The optimized context is renumbered, so only compare the sets of trained weights
+                std::vector<Value> weights1, weights2;
+                
+                for (const auto &w : plainNetwork->getContext()->getVariablesWithTag(Keys::Mapping::Weight))
+                {
+                    weights1.push_back(plainNetwork->getContext()->getMemory()[w]);
+                }
+                
+                for (const auto &w : optimizedNetwork->getContext()->getVariablesWithTag(Keys::Mapping::Weight))
+                {
+                    weights2.push_back(optimizedNetwork->getContext()->getMemory()[w]);
+                }
+                
+                std::sort(weights1.begin(), weights1.end());
+                std::sort(weights2.begin(), weights2.end());
+                REQUIRE(weights1 == weights2);
+            }
+        }
+    }
+}
+
+SCENARIO("Renumbering the variables of a network that has already run keeps its results", "[unrolled][optimizer]")
+{
+    GIVEN("Unrolled copies of an lstm network without optimizations, and an interpreted one to compare with")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int layerSize = RANDOM(5, 10);
+        const int numLanes = RANDOM(2, 4);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {layerSize}, numOutputs);
+        
+        UnrolledNetwork::Ptr interpretedNetwork = network->toVM(false);
+        interpretedNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        startTraining(interpretedNetwork, numOutputs);
+        
+        const UnrolledNetwork::ExecutionMode modes[] =
+        {
+            UnrolledNetwork::Threaded,
+            UnrolledNetwork::Jit,
+            UnrolledNetwork::Parallel
+        };
+        
+        std::vector<UnrolledNetwork::Ptr> networks;
+        
+        for (const auto mode : modes)
+        {
+            networks.push_back(network->toVM(false));
+            networks.back()->setExecutionMode(mode);
+            startTraining(networks.back(), numOutputs);
+        }
+        
+        UnrolledNetwork::Ptr batchedNetwork = network->toVM(false);
+        UnrolledNetwork::Ptr renumberedBatchedNetwork = network->toVM(false);
+        batchedNetwork->setBatchSize(numLanes);
+        renumberedBatchedNetwork->setBatchSize(numLanes);
+        
+        WHEN("They are fed and trained, renumbered halfway through, and fed and trained again")
+        {
+            const int numIterations = RANDOM(20, 40);
+            
+            THEN("The kernels they have decoded before are not reused, and they stay bit-exact")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    if (i == numIterations / 2)
+                    {
+                        for (auto &vmNetwork : networks)
+                        {
+                            vmNetwork->renumberVariables();
+                        }
+                        
+                        renumberedBatchedNetwork->renumberVariables();
+                    }
+                    
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    interpretedNetwork->setRandomSeed(i);
+                    const auto result = interpretedNetwork->feed(inputs);
+                    interpretedNetwork->train(kTrainingRate, targets);
+                    
+                    for (auto &vmNetwork : networks)
+                    {
+                        vmNetwork->setRandomSeed(i);
+                        REQUIRE(vmNetwork->feed(inputs) == result);
+                        vmNetwork->train(kTrainingRate, targets);
+                    }
+                    
+                    const auto batchInputs = randomValues(numInputs * numLanes);
+                    const auto batchTargets = randomValues(numOutputs * numLanes);
+                    
+                    batchedNetwork->setRandomSeed(i);
+                    const auto batchResult = batchedNetwork->feedBatch(batchInputs);
+                    batchedNetwork->trainBatch(kTrainingRate, batchTargets);
+                    
+                    renumberedBatchedNetwork->setRandomSeed(i);
+                    REQUIRE(renumberedBatchedNetwork->feedBatch(batchInputs) == batchResult);
+                    renumberedBatchedNetwork->trainBatch(kTrainingRate, batchTargets);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Batched unrolled network gives the same results as separate copies", "[unrolled][batch]")
+{
+    GIVEN("An unrolled lstm network in a batched mode, and a separate copy for each lane")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int layerSize = RANDOM(5, 10);
+        const int numLanes = RANDOM(1, 3) * 4 + RANDOM(0, 1);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {layerSize}, numOutputs);
+        
+        UnrolledNetwork::Ptr batchedNetwork = network->toVM();
+        REQUIRE(batchedNetwork->setBatchSize(numLanes));
+        REQUIRE(batchedNetwork->getBatchSize() == Index(numLanes));
+        
+        std::vector<UnrolledNetwork::Ptr> laneNetworks;
+        for (int l = 0; l < numLanes; ++l)
+        {
+            laneNetworks.push_back(network->toVM());
+            startTraining(laneNetworks.back(), numOutputs);
+        }
+        
+        batchedNetwork->trainBatch(0.0, UnrolledTrainingContext::RawData(numOutputs * numLanes, 0.0));
+        
+        WHEN("Each lane is fed with its own sequence, and the weights are kept fixed")
+        {
+            const int numIterations = RANDOM(50, 100);
+            
+            THEN("Every lane produces exactly the same outputs as its own copy")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs * numLanes);
+                    const auto targets = randomValues(numOutputs * numLanes);
+                    
+                    batchedNetwork->setRandomSeed(i);
+                    const auto batchResult = batchedNetwork->feedBatch(inputs);
+                    batchedNetwork->trainBatch(0.0, targets);
+                    REQUIRE(batchResult.size() == size_t(numOutputs * numLanes));
+                    
+                    for (int l = 0; l < numLanes; ++l)
+                    {
+                        const UnrolledTrainingContext::RawData laneInputs(inputs.begin() + l * numInputs,
+                                                                          inputs.begin() + (l + 1) * numInputs);
+                        
+                        const UnrolledTrainingContext::RawData laneTargets(targets.begin() + l * numOutputs,
+                                                                           targets.begin() + (l + 1) * numOutputs);
+                        
+                        laneNetworks[l]->setRandomSeed(i);
+                        const auto laneResult = laneNetworks[l]->feed(laneInputs);
+                        laneNetworks[l]->train(0.0, laneTargets);
+                        
+                        for (int j = 0; j < numOutputs; ++j)
+                        {
+                            REQUIRE(batchResult[l * numOutputs + j] == laneResult[j]);
+                        }
+                    }
+                }
+            }
+        }
+        
+        WHEN("All lanes are fed and trained with the same data")
+        {
+            UnrolledNetwork::Ptr scalarNetwork = laneNetworks.front();
+            const int numIterations = RANDOM(50, 100);
+            
+            for (int i = 0; i < numIterations; ++i)
+            {
+                const auto inputs = randomValues(numInputs);
+                const auto targets = randomValues(numOutputs);
+                
+                UnrolledTrainingContext::RawData batchInputs;
+                UnrolledTrainingContext::RawData batchTargets;
+                for (int l = 0; l < numLanes; ++l)
+                {
+                    batchInputs.insert(batchInputs.end(), inputs.begin(), inputs.end());
+                    batchTargets.insert(batchTargets.end(), targets.begin(), targets.end());
+                }
+                
+                batchedNetwork->setRandomSeed(i);
+                batchedNetwork->feedBatch(batchInputs);
+                batchedNetwork->trainBatch(kTrainingRate, batchTargets);
+                
+                scalarNetwork->setRandomSeed(i);
+                scalarNetwork->feed(inputs);
+                scalarNetwork->train(kTrainingRate, targets);
+            }
+            
+            THEN("The shared weights end up the same as in a single trained network")
+            {
+                const auto &memory1 = batchedNetwork->getContext()->getMemory();
+                const auto &memory2 = scalarNetwork->getContext()->getMemory();
+                const auto &weights = batchedNetwork->getContext()->getVariablesWithTag(Keys::Mapping::Weight);
+                REQUIRE(! weights.empty());
+                
+                for (const auto &w : weights)
+                {
+                    const Value error = fabs(memory1[w] - memory2[w]);
+                    REQUIRE(error < 0.001);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Inference sessions give the same results as the network they are taken from", "[unrolled][session]")
+{
+    GIVEN("An unrolled lstm network, and a model taken from it")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(50, 100);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        // the very first feed of a new network uses dropout, all the following ones just scale the activations
+        vmNetwork->feed(randomValues(numInputs));
+        const UnrolledModel::Ptr model = vmNetwork->createModel();
+        
+        UnrolledTrainingContext::RawData inputs;
+        for (int t = 0; t < numSteps; ++t)
+        {
+            const auto input = randomValues(numInputs);
+            inputs.insert(inputs.end(), input.begin(), input.end());
+        }
+        
+        UnrolledTrainingContext::RawData networkOutputs(numOutputs * numSteps);
+        vmNetwork->feedSequence(inputs.data(), numSteps, networkOutputs.data());
+        
+        THEN("Each session keeps only a small part of the memory")
+        {
+            REQUIRE(model->getNumInputs() == size_t(numInputs));
+            REQUIRE(model->getNumOutputs() == size_t(numOutputs));
+            REQUIRE(model->getStateSize() < model->getNumSharedVariables());
+            REQUIRE(model->getStateSize() + model->getNumSharedVariables() < vmNetwork->getContext()->getMemory().size());
+        }
+        
+        WHEN("Several sessions are fed with the same inputs, one after another")
+        {
+            auto session1 = model->createSession();
+            auto session2 = model->createSession();
+            UnrolledTrainingContext::RawData outputs1(numOutputs * numSteps);
+            UnrolledTrainingContext::RawData outputs2(numOutputs * numSteps);
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                session1->feed(inputs.data() + t * numInputs, outputs1.data() + t * numOutputs);
+                session2->feed(inputs.data() + t * numInputs, outputs2.data() + t * numOutputs);
+            }
+            
+            THEN("They don't affect each other, and produce exactly the same outputs as the network")
+            {
+                REQUIRE(outputs1 == networkOutputs);
+                REQUIRE(outputs2 == networkOutputs);
+            }
+        }
+        
+        WHEN("Many sessions are fed from many threads at once")
+        {
+            const int numThreads = 4;
+            const int numSessionsPerThread = 3;
+            std::vector<UnrolledTrainingContext::RawData> outputs(numThreads * numSessionsPerThread,
+                                                                  UnrolledTrainingContext::RawData(numOutputs * numSteps));
+            
+            std::vector<std::thread> threads;
+            
+            for (int i = 0; i < numThreads; ++i)
+            {
+                threads.push_back(std::thread([&, i]()
+                {
+                    std::vector<UnrolledModel::Session::Ptr> sessions;
+                    for (int s = 0; s < numSessionsPerThread; ++s)
+                    {
+                        sessions.push_back(model->createSession());
+                    }
+                    
+                    for (int t = 0; t < numSteps; ++t)
+                    {
+                        for (int s = 0; s < numSessionsPerThread; ++s)
+                        {
+                            auto &sessionOutputs = outputs[i * numSessionsPerThread + s];
+                            sessions[s]->feed(inputs.data() + t * numInputs, sessionOutputs.data() + t * numOutputs);
+                        }
+                    }
+                }));
+            }
+            
+            for (auto &thread : threads)
+            {
+                thread.join();
+            }
+            
+            THEN("Every session produces exactly the same outputs as the network")
+            {
+                for (const auto &sessionOutputs : outputs)
+                {
+                    REQUIRE(sessionOutputs == networkOutputs);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Resetting the state of an unrolled network is the same as starting over", "[unrolled][reset]")
+{
+    GIVEN("Two unrolled copies of the same lstm network, one of them already fed and trained")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(50, 100);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        UnrolledNetwork::Ptr usedNetwork = network->toVM();
+        UnrolledNetwork::Ptr freshNetwork = network->toVM();
+        startTraining(usedNetwork, numOutputs);
+        startTraining(freshNetwork, numOutputs);
+        
+        for (int t = 0; t < numSteps; ++t)
+        {
+            usedNetwork->feed(randomValues(numInputs));
+            usedNetwork->train(kTrainingRate, randomValues(numOutputs));
+        }
+        
+        const auto &memory = usedNetwork->getContext()->getMemory();
+        const auto trainableVariables = usedNetwork->getContext()->getTrainableVariables();
+        
+        UnrolledTrainingContext::RawData trainedValues;
+        for (const auto &v : trainableVariables)
+        {
+            trainedValues.push_back(memory[v]);
+        }
+        
+        WHEN("Its state is reset")
+        {
+            usedNetwork->resetState();
+            
+            THEN("The weights and biases are kept, and the states and traces are the same as in a new copy")
+            {
+                const auto &freshMemory = freshNetwork->getContext()->getMemory();
+                REQUIRE(memory.size() == freshMemory.size());
+                
+                for (size_t i = 0; i < trainableVariables.size(); ++i)
+                {
+                    REQUIRE(memory[trainableVariables[i]] == trainedValues[i]);
+                }
+                
+                const Id stateTags[] = { Keys::Mapping::Activation, Keys::Mapping::State, Keys::Mapping::OldState,
+                                         Keys::Mapping::Gain, Keys::Mapping::Eligibility, Keys::Mapping::ExtendedTrace };
+                
+                for (const auto &tag : stateTags)
+                {
+                    for (const auto &v : usedNetwork->getContext()->getVariablesWithTag(tag))
+                    {
+                        REQUIRE(memory[v] == freshMemory[v]);
+                    }
+                }
+            }
+        }
+        
+        WHEN("Its state is reset, and the trained weights are given to the new copy")
+        {
+            usedNetwork->resetState();
+            
+            auto &freshMemory = freshNetwork->getContext()->getMemory();
+            for (size_t i = 0; i < trainableVariables.size(); ++i)
+            {
+                freshMemory[trainableVariables[i]] = trainedValues[i];
+            }
+            
+            THEN("Both produce exactly the same outputs for the next sequence")
+            {
+                for (int t = 0; t < numSteps; ++t)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    usedNetwork->setRandomSeed(t);
+                    const auto usedResult = usedNetwork->feed(inputs);
+                    usedNetwork->train(kTrainingRate, targets);
+                    
+                    freshNetwork->setRandomSeed(t);
+                    const auto freshResult = freshNetwork->feed(inputs);
+                    freshNetwork->train(kTrainingRate, targets);
+                    
+                    REQUIRE(usedResult == freshResult);
+                }
+            }
+        }
+        
+        WHEN("Both are switched into a batched mode, fed with different sequences, and reset")
+        {
+            const int numLanes = RANDOM(2, 5);
+            usedNetwork->resetState();
+            usedNetwork->setBatchSize(numLanes);
+            
+            auto &freshMemory = freshNetwork->getContext()->getMemory();
+            for (size_t i = 0; i < trainableVariables.size(); ++i)
+            {
+                freshMemory[trainableVariables[i]] = trainedValues[i];
+            }
+            
+            freshNetwork->setBatchSize(numLanes);
+            
+            for (int t = 0; t < numSteps; ++t)
+            {
+                usedNetwork->feedBatch(randomValues(numInputs * numLanes));
+            }
+            
+            // the same number of feeds for both is what matters for dropout
+            freshNetwork->feedBatch(randomValues(numInputs * numLanes));
+            
+            usedNetwork->resetState();
+            freshNetwork->resetState();
+            
+            THEN("Every lane starts over, and they produce the same outputs")
+            {
+                for (int t = 0; t < numSteps; ++t)
+                {
+                    const auto inputs = randomValues(numInputs * numLanes);
+                    
+                    usedNetwork->setRandomSeed(t);
+                    freshNetwork->setRandomSeed(t);
+                    REQUIRE(usedNetwork->feedBatch(inputs) == freshNetwork->feedBatch(inputs));
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Restoring a saved state of an unrolled network continues the sequence from there", "[unrolled][snapshot]")
+{
+    GIVEN("An unrolled lstm network, fed for a while, and a snapshot of its state")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int numSteps = RANDOM(50, 100);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {RANDOM(5, 10)}, numOutputs);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        for (int t = 0; t < numSteps; ++t)
+        {
+            vmNetwork->feed(randomValues(numInputs));
+        }
+        
+        const auto snapshot = vmNetwork->saveState();
+        const auto trainableVariables = vmNetwork->getContext()->getTrainableVariables();
+        REQUIRE(snapshot->getSize() + trainableVariables.size() < vmNetwork->getContext()->getMemory().size());
+        
+        std::vector<UnrolledTrainingContext::RawData> inputs;
+        for (int t = 0; t < numSteps; ++t)
+        {
+            inputs.push_back(randomValues(numInputs));
+        }
+        
+        WHEN("It is fed, restored and fed with the same inputs again, many times")
+        {
+            std::vector<UnrolledTrainingContext::RawData> branchOutputs(3);
+            
+            for (auto &outputs : branchOutputs)
+            {
+                REQUIRE(vmNetwork->restoreState(*snapshot));
+                
+                for (const auto &input : inputs)
+                {
+                    const auto result = vmNetwork->feed(input);
+                    outputs.insert(outputs.end(), result.begin(), result.end());
+                }
+            }
+            
+            THEN("Each branch produces exactly the same outputs")
+            {
+                REQUIRE(branchOutputs[0] == branchOutputs[1]);
+                REQUIRE(branchOutputs[0] == branchOutputs[2]);
+            }
+        }
+        
+        WHEN("It is trained, and then restored")
+        {
+            for (int t = 0; t < numSteps; ++t)
+            {
+                vmNetwork->feed(inputs[t]);
+                vmNetwork->train(kTrainingRate, randomValues(numOutputs));
+            }
+            
+            const auto &memory = vmNetwork->getContext()->getMemory();
+            UnrolledTrainingContext::RawData trainedValues;
+            for (const auto &v : trainableVariables)
+            {
+                trainedValues.push_back(memory[v]);
+            }
+            
+            REQUIRE(vmNetwork->restoreState(*snapshot));
+            
+            THEN("The weights and biases stay trained")
+            {
+                for (size_t i = 0; i < trainableVariables.size(); ++i)
+                {
+                    REQUIRE(memory[trainableVariables[i]] == trainedValues[i]);
+                }
+            }
+        }
+        
+        WHEN("A snapshot of some other network is restored")
+        {
+            const auto otherNetwork = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {20}, numOutputs);
+            const auto otherSnapshot = otherNetwork->toVM()->saveState();
+            
+            THEN("It doesn't fit")
+            {
+                REQUIRE_FALSE(vmNetwork->restoreState(*otherSnapshot));
+            }
+        }
+        
+        WHEN("The variables are renumbered after the snapshot was taken")
+        {
+            vmNetwork->renumberVariables();
+            
+            THEN("The old snapshot doesn't fit any more, though it has the same size, and a new one does")
+            {
+                REQUIRE(vmNetwork->saveState()->getSize() == snapshot->getSize());
+                REQUIRE_FALSE(vmNetwork->restoreState(*snapshot));
+                REQUIRE(vmNetwork->restoreState(*vmNetwork->saveState()));
+            }
+        }
+    }
+}
+
+SCENARIO("Beam search finds the most likely continuations of a sequence", "[unrolled][snapshot]")
+{
+    GIVEN("An unrolled lstm network with as many inputs as outputs, and a beam search over it")
+    {
+        const int numSymbols = RANDOM(3, 4);
+        const int numSteps = 3;
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numSymbols, {RANDOM(5, 10)}, numSymbols);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        
+        // the very first feed of a new network uses dropout, all the following ones just scale the activations
+        vmNetwork->feed(randomValues(numSymbols));
+        
+        const auto initialState = vmNetwork->saveState();
+        const auto getLogProbability = [&](const std::vector<Index> &symbols)
+        {
+            vmNetwork->restoreState(*initialState);
+            
+            double logProbability = 0.0;
+            UnrolledTrainingContext::RawData inputs(numSymbols, 0.0);
+            UnrolledTrainingContext::RawData outputs;
+            
+            for (size_t i = 0; i < symbols.size(); ++i)
+            {
+                if (i > 0)
+                {
+                    double sum = 0.0;
+                    for (const auto &score : outputs) { sum += std::max(score, Value(1e-6)); }
+                    logProbability += std::log(std::max(outputs[symbols[i]], Value(1e-6)) / sum);
+                }
+                
+                std::fill(inputs.begin(), inputs.end(), Value(0.0));
+                inputs[symbols[i]] = 1.0;
+                outputs = vmNetwork->feed(inputs);
+            }
+            
+            vmNetwork->restoreState(*initialState);
+            return logProbability;
+        };
+        
+        WHEN("The beam is wide enough to keep every sequence")
+        {
+            Index numSequences = 1;
+            for (int i = 0; i < numSteps; ++i) { numSequences *= numSymbols; }
+            
+            UnrolledBeamSearch beamSearch(vmNetwork, numSequences);
+            const auto memoryBefore = vmNetwork->getContext()->getMemory();
+            const auto hypotheses = beamSearch.search(0, numSteps);
+            
+            THEN("It finds all of them, sorted by their probabilities, and leaves the network as it was")
+            {
+                REQUIRE(vmNetwork->getContext()->getMemory() == memoryBefore);
+                REQUIRE(hypotheses.size() == numSequences);
+                
+                double bestLogProbability = -std::numeric_limits<double>::max();
+                for (Index s = 0; s < numSequences; ++s)
+                {
+                    std::vector<Index> symbols = { 0 };
+                    for (Index i = 0, rest = s; i < Index(numSteps); ++i, rest /= numSymbols)
+                    {
+                        symbols.push_back(rest % numSymbols);
+                    }
+                    
+                    bestLogProbability = std::max(bestLogProbability, getLogProbability(symbols));
+                }
+                
+                REQUIRE(fabs(hypotheses.front().logProbability - bestLogProbability) < 0.0001);
+                
+                for (size_t i = 0; i < hypotheses.size(); ++i)
+                {
+                    REQUIRE(hypotheses[i].symbols.size() == size_t(numSteps + 1));
+                    REQUIRE(fabs(hypotheses[i].logProbability - getLogProbability(hypotheses[i].symbols)) < 0.0001);
+                    
+                    if (i > 0)
+                    {
+                        REQUIRE(hypotheses[i].logProbability <= hypotheses[i - 1].logProbability);
+                    }
+                }
+            }
+        }
+        
+        WHEN("The beam is one hypothesis wide")
+        {
+            UnrolledBeamSearch beamSearch(vmNetwork, 1);
+            const auto hypotheses = beamSearch.search(0, numSteps);
+            
+            THEN("It is the greedy search, picking the highest score on each step")
+            {
+                REQUIRE(hypotheses.size() == 1);
+                
+                const auto &symbols = hypotheses.front().symbols;
+                UnrolledTrainingContext::RawData inputs(numSymbols, 0.0);
+                
+                for (size_t i = 0; i + 1 < symbols.size(); ++i)
+                {
+                    std::fill(inputs.begin(), inputs.end(), Value(0.0));
+                    inputs[symbols[i]] = 1.0;
+                    
+                    // the scores below the clamping threshold all tie
+                    auto outputs = vmNetwork->feed(inputs);
+                    for (auto &score : outputs) { score = std::max(score, Value(1e-6)); }
+                    REQUIRE(outputs[symbols[i + 1]] == *std::max_element(outputs.begin(), outputs.end()));
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Closed-loop generation gives the same results as feeding the outputs back by hand", "[unrolled][generation]")
+{
+    GIVEN("Two unrolled copies of an lstm network with as many inputs as outputs")
+    {
+        const int numSymbols = RANDOM(2, 8);
+        const int numSteps = RANDOM(50, 100);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numSymbols, {RANDOM(5, 10)}, numSymbols);
+        UnrolledNetwork::Ptr generatingNetwork = network->toVM();
+        UnrolledNetwork::Ptr handFedNetwork = network->toVM();
+        generatingNetwork->setRandomSeed(0);
+        handFedNetwork->setRandomSeed(0);
+        
+        const auto firstInputs = randomValues(numSymbols);
+        UnrolledTrainingContext::RawData outputs(numSymbols * numSteps);
+        std::vector<Index> symbols(numSteps);
+        
+        WHEN("The outputs are fed back as they are")
+        {
+            REQUIRE(generatingNetwork->generate(firstInputs.data(), numSteps, outputs.data()));
+            
+            THEN("Each step is the same as feeding the previous outputs")
+            {
+                auto inputs = firstInputs;
+                
+                for (int t = 0; t < numSteps; ++t)
+                {
+                    inputs = handFedNetwork->feed(inputs);
+                    
+                    for (int i = 0; i < numSymbols; ++i)
+                    {
+                        REQUIRE(outputs[t * numSymbols + i] == inputs[i]);
+                    }
+                }
+                
+                REQUIRE(generatingNetwork->getContext()->getMemory() == handFedNetwork->getContext()->getMemory());
+            }
+        }
+        
+        WHEN("The highest scores are fed back as one-hot inputs")
+        {
+            REQUIRE(generatingNetwork->generate(firstInputs.data(), numSteps, outputs.data(),
+                                                UnrolledNetwork::Argmax, symbols.data()));
+            
+            THEN("Each step picks the symbol with the highest score, and feeds it next")
+            {
+                auto inputs = firstInputs;
+                
+                for (int t = 0; t < numSteps; ++t)
+                {
+                    const auto result = handFedNetwork->feed(inputs);
+                    const auto best = std::max_element(result.begin(), result.end()) - result.begin();
+                    REQUIRE(symbols[t] == Index(best));
+                    
+                    for (int i = 0; i < numSymbols; ++i)
+                    {
+                        REQUIRE(outputs[t * numSymbols + i] == result[i]);
+                        inputs[i] = Value(i == best);
+                    }
+                }
+            }
+        }
+        
+        WHEN("The symbols are sampled by both copies, with the same seeds")
+        {
+            std::vector<Index> otherSymbols(numSteps);
+            REQUIRE(generatingNetwork->generate(firstInputs.data(), numSteps, nullptr,
+                                                UnrolledNetwork::Sample, symbols.data()));
+            REQUIRE(handFedNetwork->generate(firstInputs.data(), numSteps, outputs.data(),
+                                             UnrolledNetwork::Sample, otherSymbols.data()));
+            
+            THEN("They draw the same symbols, each one with a positive score, or the highest one if none is")
+            {
+                REQUIRE(symbols == otherSymbols);
+                
+                for (int t = 0; t < numSteps; ++t)
+                {
+                    REQUIRE(symbols[t] < Index(numSymbols));
+                    
+                    const auto stepOutputs = outputs.begin() + t * numSymbols;
+                    const Value highestScore = *std::max_element(stepOutputs, stepOutputs + numSymbols);
+                    REQUIRE((stepOutputs[symbols[t]] > 0.0 || stepOutputs[symbols[t]] == highestScore));
+                }
+            }
+        }
+    }
+    
+    GIVEN("An unrolled network with fewer outputs than inputs")
+    {
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), 3, {RANDOM(5, 10)}, 2);
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        UnrolledTrainingContext::RawData inputs(3, 0.5);
+        
+        THEN("It can't generate anything")
+        {
+            REQUIRE_FALSE(vmNetwork->generate(inputs.data(), 10, nullptr));
+        }
+    }
+}
+
+SCENARIO("Softmax output layer is trained on the cross-entropy in all execution modes", "[unrolled][softmax]")
+{
+    GIVEN("A network with a softmax output layer, and its unrolled copies")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(2, 5);
+        const int numLanes = RANDOM(1, 4);
+        
+        // no hidden layers, as the dropout would make the unrolled copies differ from the network
+        Layer::Ptr inputLayer(new Layer(numInputs));
+        Layer::Ptr outputLayer(new Layer(numOutputs));
+        inputLayer->connectAllToAll(outputLayer);
+        outputLayer->setUsesSoftmax(true);
+        REQUIRE(outputLayer->usesSoftmax());
+        
+        Network::Ptr network(new Network(RANDOMNAME(), inputLayer, {}, outputLayer));
+        REQUIRE(network->toDense() == nullptr);
+        
+        UnrolledNetwork::Ptr interpretedNetwork = network->toVM();
+        UnrolledNetwork::Ptr switchingNetwork = network->toVM();
+        UnrolledNetwork::Ptr batchedNetwork = network->toVM();
+        interpretedNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        batchedNetwork->setBatchSize(numLanes);
+        
+        REQUIRE(interpretedNetwork->getLoss() == 0.0);
+        
+        WHEN("They are all fed and trained with the same random inputs and one-hot targets")
+        {
+            const int numIterations = RANDOM(100, 200);
+            Value expectedLoss = 0.0;
+            
+            // the fused jit mode is left out, as it rounds differently
+            const UnrolledNetwork::ExecutionMode bitExactModes[] =
+            {
+                UnrolledNetwork::Interpreted,
+                UnrolledNetwork::Threaded,
+                UnrolledNetwork::Jit,
+                UnrolledNetwork::Parallel
+            };
+            
+            THEN("The outputs are the same probabilities, and the loss is summed up as the network gives it")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    UnrolledTrainingContext::RawData targets(numOutputs, 0.0);
+                    const int symbol = RANDOM(0, numOutputs - 1);
+                    targets[symbol] = 1.0;
+                    
+                    switchingNetwork->setExecutionMode(bitExactModes[i % 4]);
+                    
+                    const auto result = network->feed(inputs);
+                    network->train(kTrainingRate, targets);
+                    
+                    const auto result1 = interpretedNetwork->feed(inputs);
+                    interpretedNetwork->train(kTrainingRate, targets);
+                    
+                    const auto result2 = switchingNetwork->feed(inputs);
+                    switchingNetwork->train(kTrainingRate, targets);
+                    
+                    UnrolledTrainingContext::RawData batchInputs;
+                    UnrolledTrainingContext::RawData batchTargets;
+                    for (int l = 0; l < numLanes; ++l)
+                    {
+                        batchInputs.insert(batchInputs.end(), inputs.begin(), inputs.end());
+                        batchTargets.insert(batchTargets.end(), targets.begin(), targets.end());
+                    }
+                    
+                    const auto batchResult = batchedNetwork->feedBatch(batchInputs);
+                    batchedNetwork->trainBatch(kTrainingRate, batchTargets);
+                    
+                    Value sum = 0.0;
+                    
+                    for (int j = 0; j < numOutputs; ++j)
+                    {
+                        REQUIRE(result1[j] > 0.0);
+                        REQUIRE(result1[j] == result2[j]);
+                        REQUIRE(fabs(result1[j] - result[j]) < 0.0001);
+                        
+                        for (int l = 0; l < numLanes; ++l)
+                        {
+                            REQUIRE(fabs(batchResult[l * numOutputs + j] - result1[j]) < 0.0001);
+                        }
+                        
+                        sum += result1[j];
+                    }
+                    
+                    REQUIRE(fabs(sum - 1.0) < 0.0001);
+                    
+                    expectedLoss -= log(result1[symbol]);
+                    REQUIRE(interpretedNetwork->getLoss() == switchingNetwork->getLoss());
+                    REQUIRE(fabs(interpretedNetwork->getLoss() - expectedLoss) < 0.001 * numIterations);
+                    REQUIRE(fabs(batchedNetwork->getLoss() - expectedLoss * numLanes) < 0.001 * numIterations * numLanes);
+                }
+                
+                interpretedNetwork->resetLoss();
+                batchedNetwork->resetLoss();
+                REQUIRE(interpretedNetwork->getLoss() == 0.0);
+                REQUIRE(batchedNetwork->getLoss() == 0.0);
+            }
+        }
+        
+        WHEN("An unrolled copy is trained on a fixed mapping from inputs to symbols for a while")
+        {
+            std::vector<UnrolledTrainingContext::RawData> inputs;
+            std::vector<UnrolledTrainingContext::RawData> targets;
+            
+            for (int j = 0; j < numOutputs; ++j)
+            {
+                inputs.push_back(randomValues(numInputs));
+                targets.push_back(UnrolledTrainingContext::RawData(numOutputs, 0.0));
+                targets.back()[j] = 1.0;
+            }
+            
+            std::vector<Value> epochLosses;
+            
+            for (int epoch = 0; epoch < 100; ++epoch)
+            {
+                for (int j = 0; j < numOutputs; ++j)
+                {
+                    interpretedNetwork->feed(inputs[j]);
+                    interpretedNetwork->train(kTrainingRate, targets[j]);
+                }
+                
+                epochLosses.push_back(interpretedNetwork->getLoss());
+                interpretedNetwork->resetLoss();
+            }
+            
+            THEN("The loss goes down")
+            {
+                REQUIRE(epochLosses.back() < epochLosses.front());
+            }
+        }
+    }
+}
+
+SCENARIO("Softmax is ignored anywhere but in the output layer", "[unrolled][softmax]")
+{
+    GIVEN("A multilayer perceptron unrolled as is, and unrolled again with softmax set in its hidden layer")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        
+        Layer::Ptr inputLayer(new Layer(numInputs));
+        Layer::Ptr hiddenLayer(new Layer(RANDOM(5, 10)));
+        Layer::Ptr outputLayer(new Layer(numOutputs));
+        inputLayer->connectAllToAll(hiddenLayer);
+        hiddenLayer->connectAllToAll(outputLayer);
+        
+        Network::Ptr network(new Network(RANDOMNAME(), inputLayer, {hiddenLayer}, outputLayer));
+        UnrolledNetwork::Ptr plainNetwork = network->toVM();
+        
+        const auto inputs = randomValues(numInputs);
+        const auto plainResult = network->feed(inputs);
+        
+        hiddenLayer->setUsesSoftmax(true);
+        UnrolledNetwork::Ptr softmaxNetwork = network->toVM();
+        
+        plainNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        softmaxNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        startTraining(plainNetwork, numOutputs);
+        startTraining(softmaxNetwork, numOutputs);
+        
+        WHEN("Both are fed and trained with the same data, and so is the network itself")
+        {
+            const auto softmaxResult = network->feed(inputs);
+            const int numIterations = RANDOM(100, 200);
+            
+            THEN("The network and its unrolled copies give the same outputs as without softmax")
+            {
+                REQUIRE(plainResult == softmaxResult);
+                REQUIRE(network->toDense() != nullptr);
+                
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    plainNetwork->setRandomSeed(i);
+                    const auto result1 = plainNetwork->feed(inputs);
+                    plainNetwork->train(kTrainingRate, targets);
+                    
+                    softmaxNetwork->setRandomSeed(i);
+                    const auto result2 = softmaxNetwork->feed(inputs);
+                    softmaxNetwork->train(kTrainingRate, targets);
+                    
+                    REQUIRE(result1 == result2);
+                }
+            }
+        }
+    }
+}
+
+SCENARIO("Sparse inputs give the same results as the dense ones in all execution modes", "[unrolled][sparse]")
+{
+    GIVEN("A multilayer perceptron and an lstm network, each unrolled both with the dense and with the sparse inputs")
+    {
+        const int numInputs = RANDOM(5, 20);
+        const int numOutputs = RANDOM(1, 3);
+        const int layerSize = RANDOM(5, 10);
+        
+        const Network::Ptr networks[] =
+        {
+            Network::Prefabs::feedForward(RANDOMNAME(), numInputs, {layerSize}, numOutputs),
+            Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {layerSize}, numOutputs)
+        };
+        
+        std::vector<UnrolledNetwork::Ptr> denseNetworks;
+        std::vector<UnrolledNetwork::Ptr> sparseNetworks;
+        
+        for (const auto &network : networks)
+        {
+            REQUIRE(! network->getInputLayer()->usesSparseInputs());
+            denseNetworks.push_back(network->toVM());
+            denseNetworks.back()->setExecutionMode(UnrolledNetwork::Interpreted);
+            
+            network->getInputLayer()->setUsesSparseInputs(true);
+            REQUIRE(network->getInputLayer()->usesSparseInputs());
+            sparseNetworks.push_back(network->toVM());
+            
+            startTraining(denseNetworks.back(), numOutputs);
+            startTraining(sparseNetworks.back(), numOutputs);
+        }
+        
+        WHEN("They are trained on the same few-hot inputs, given by their positions to the sparse copies every other step")
+        {
+            const int numIterations = RANDOM(100, 200);
+            
+            // the fused jit mode is left out, as it rounds differently
+            const UnrolledNetwork::ExecutionMode bitExactModes[] =
+            {
+                UnrolledNetwork::Interpreted,
+                UnrolledNetwork::Threaded,
+                UnrolledNetwork::Jit,
+                UnrolledNetwork::Parallel
+            };
+            
+            THEN("They produce the same outputs on each step")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    UnrolledTrainingContext::RawData inputs(numInputs, 0.0);
+                    std::vector<Index> activeInputs;
+                    UnrolledTrainingContext::RawData activeValues;
+                    
+                    // one-hot most of the time, and sometimes none or a few at once
+                    const int numActive = (i % 5 == 0) ? RANDOM(0, 3) : 1;
+                    
+                    for (int k = 0; k < numActive; ++k)
+                    {
+                        const Index position = Index(RANDOM(0, numInputs - 1));
+                        
+                        if (inputs[position] == 0.0)
+                        {
+                            inputs[position] = (i % 2 == 0) ? Value(1.0) : Value(RANDOM(0.1, 1.0));
+                            activeInputs.push_back(position);
+                            activeValues.push_back(inputs[position]);
+                        }
+                    }
+                    
+                    const auto targets = randomValues(numOutputs);
+                    
+                    for (size_t n = 0; n < denseNetworks.size(); ++n)
+                    {
+                        sparseNetworks[n]->setExecutionMode(bitExactModes[i % 4]);
+                        
+                        denseNetworks[n]->setRandomSeed(i);
+                        const auto result1 = denseNetworks[n]->feed(inputs);
+                        denseNetworks[n]->train(kTrainingRate, targets);
+                        
+                        sparseNetworks[n]->setRandomSeed(i);
+                        UnrolledTrainingContext::RawData result2(numOutputs);
+                        
+                        if (i % 2 == 0)
+                        {
+                            REQUIRE(sparseNetworks[n]->feedSparse(activeInputs.data(), nullptr,
+                                                                  activeInputs.size(), result2.data()));
+                        }
+                        else
+                        {
+                            result2 = sparseNetworks[n]->feed(inputs);
+                        }
+                        
+                        sparseNetworks[n]->train(kTrainingRate, targets);
+                        
+                        REQUIRE(result1 == result2);
+                    }
+                }
+            }
+        }
+        
+        WHEN("A sparse copy is given a position out of range")
+        {
+            const Index activeInputs[] = { 0, Index(numInputs) };
+            UnrolledTrainingContext::RawData outputs(numOutputs, -1.0);
+            
+            THEN("It refuses to feed")
+            {
+                REQUIRE(! sparseNetworks.front()->feedSparse(activeInputs, nullptr, 2, outputs.data()));
+                REQUIRE(outputs == UnrolledTrainingContext::RawData(numOutputs, -1.0));
+            }
+        }
+    }
+}
+
+#if defined(TINYRNN_TEST_CXX_COMPILER)
+
+#include <dlfcn.h>
+#include <fstream>
+
+SCENARIO("Generated code gives the same results as the interpreter", "[unrolled][codegen]")
+{
+    GIVEN("An unrolled lstm network exported as a compiled library")
+    {
+        const int numInputs = RANDOM(2, 5);
+        const int numOutputs = RANDOM(1, 3);
+        const int layerSize = RANDOM(5, 10);
+        
+        const auto network = Network::Prefabs::longShortTermMemory(RANDOMNAME(), numInputs, {layerSize}, numOutputs);
+        
+        UnrolledNetwork::Ptr vmNetwork = network->toVM();
+        vmNetwork->setExecutionMode(UnrolledNetwork::Interpreted);
+        startTraining(vmNetwork, numOutputs);
+        
+        char directoryTemplate[] = "/tmp/TinyRNNXXXXXX";
+        const std::string directory(mkdtemp(directoryTemplate));
+        const std::string headerPath = directory + "/GeneratedNetwork.h";
+        const std::string sourcePath = directory + "/GeneratedNetwork.cpp";
+        const std::string libraryPath = directory + "/GeneratedNetwork.so";
+        
+        {
+            std::ofstream header(headerPath);
+            header << vmNetwork->generateCode("GeneratedNetwork");
+            
+            std::ofstream source(sourcePath);
+            source << "#include \"GeneratedNetwork.h\"" << std::endl;
+            source << "using namespace GeneratedNetwork;" << std::endl;
+            source << "extern \"C\" size_t getMemorySize() { return kMemorySize; }" << std::endl;
+            source << "extern \"C\" void initializeMemory(Value *x) { initialize(x); }" << std::endl;
+            source << "extern \"C\" void feedNetwork(Value *x, const Value *i, Value *o, Value d) { feed(x, i, o, d); }" << std::endl;
+            source << "extern \"C\" void trainNetwork(Value *x, Value r, const Value *t) { train(x, r, t); }" << std::endl;
+        }
+        
+        // No fp contraction, so that the generated code is bit-exact with vmProcess
+        const std::string command = std::string(TINYRNN_TEST_CXX_COMPILER) +
+            " -std=c++11 -O2 -ffp-contract=off -shared -fPIC -o " + libraryPath + " " + sourcePath;
+        
+        REQUIRE(std::system(command.c_str()) == 0);
+        
+        void *library = dlopen(libraryPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+        REQUIRE(library != nullptr);
+        
+        using GetMemorySize = size_t (*)();
+        using InitializeMemory = void (*)(Value *);
+        using FeedNetwork = void (*)(Value *, const Value *, Value *, Value);
+        using TrainNetwork = void (*)(Value *, Value, const Value *);
+        
+        const auto getMemorySize = reinterpret_cast<GetMemorySize>(dlsym(library, "getMemorySize"));
+        const auto initializeMemory = reinterpret_cast<InitializeMemory>(dlsym(library, "initializeMemory"));
+        const auto feedNetwork = reinterpret_cast<FeedNetwork>(dlsym(library, "feedNetwork"));
+        const auto trainNetwork = reinterpret_cast<TrainNetwork>(dlsym(library, "trainNetwork"));
+        
+        REQUIRE(getMemorySize != nullptr);
+        REQUIRE(initializeMemory != nullptr);
+        REQUIRE(feedNetwork != nullptr);
+        REQUIRE(trainNetwork != nullptr);
+        
+        WHEN("Both are fed and trained with the same random data")
+        {
+            UnrolledTrainingContext::RawData memory(getMemorySize());
+            UnrolledTrainingContext::RawData outputs(numOutputs);
+            initializeMemory(memory.data());
+            
+            REQUIRE(memory == vmNetwork->getContext()->getMemory());
+            
+            const int numIterations = RANDOM(100, 200);
+            
+            THEN("They produce the same outputs on each step, and end up in the same state")
+            {
+                for (int i = 0; i < numIterations; ++i)
+                {
+                    const auto inputs = randomValues(numInputs);
+                    const auto targets = randomValues(numOutputs);
+                    
+                    vmNetwork->setRandomSeed(i);
+                    const auto result = vmNetwork->feed(inputs);
+                    vmNetwork->train(kTrainingRate, targets);
+                    
+                    feedNetwork(memory.data(), inputs.data(), outputs.data(), Value(Random(i).nextBool()));
+                    trainNetwork(memory.data(), kTrainingRate, targets.data());
+                    
+                    REQUIRE(result == outputs);
+                }
+                
+                REQUIRE(memory == vmNetwork->getContext()->getMemory());
+            }
+        }
+        
+        dlclose(library);
+        std::remove(headerPath.c_str());
+        std::remove(sourcePath.c_str());
+        std::remove(libraryPath.c_str());
+        std::remove(directory.c_str());
+    }
+}
+
+#endif